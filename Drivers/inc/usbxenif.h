@@ -84,6 +84,13 @@
 #define ISO_FRAME_ASAP      0x04 // if set start this ISO request on next available frame
 #define INDIRECT_GREF       0x08 // if set this request uses indirect gref pages (see comments below).
 #define CYCLE_PORT          0x10 // force re-enumeration of this device
+#define CANCEL_REQUEST      0x20 // cancel the request whose id is in setup, all other fields are ignored.
+//
+// CANCEL_REQUEST is only sent if both ends publish feature-cancel-request.
+// The cancelled request still gets its own response, USBIF_RSP_USB_CANCELED
+// or its real status if it finished first. The cancel response only reports
+// whether the id was found.
+//
 
 
 typedef uint32_t usbif_request_len_t;
@@ -114,6 +121,9 @@ typedef struct usbif_indirect_page usbif_indirect_page_t;
 // the first page dual purposed as the nr_segments for the entire set of indirect pages.
 //
 // For ISO requests the first gref is the array of nr_packets iso_packet_info requests.
+// If both ends publish feature-max-iso-packets the array may span more than one page,
+// such requests are always indirect and the first BYTES_TO_PAGES(nr_packets * 8)
+// grefs of the first indirect page are the array.
 //
 
 struct usbif_request {
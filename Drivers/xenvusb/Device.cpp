@@ -28,6 +28,7 @@
 #include <devguid.h>
 #include <initguid.h>
 #include "RootHubPdo.h"
+#include "UsbRequest.h"
 
 struct USB_FDO_INTERRUPT_CONTEXT
 {
@@ -74,6 +75,22 @@ VOID
 DeleteScratchpad(
     IN PUSB_FDO_CONTEXT fdoContext);
 
+VOID
+InitIsoFastPath(
+    IN PUSB_FDO_CONTEXT fdoContext);
+
+VOID
+DeleteIsoFastPath(
+    IN PUSB_FDO_CONTEXT fdoContext);
+
+VOID
+InitFlightRecorder(
+    IN PUSB_FDO_CONTEXT fdoContext);
+
+VOID
+DeleteFlightRecorder(
+    IN PUSB_FDO_CONTEXT fdoContext);
+
 NTSTATUS
 SetPdoDescriptors(
     IN PWDFDEVICE_INIT DeviceInit,
@@ -314,6 +331,8 @@ FdoEvtDeviceAdd(
     {
         return status;
     }
+    InitIsoFastPath(fdoContext);
+    InitFlightRecorder(fdoContext);
     //
     // Initialize the I/O Package and any Queues
     //
@@ -430,6 +449,7 @@ FdoEvtDeviceContextCleanup (
     // scratchpad cleanup.
     //
     DeleteScratchpad(fdoContext);
+    DeleteIsoFastPath(fdoContext);
     //
     // xen interface cleanup
     //
@@ -437,6 +457,7 @@ FdoEvtDeviceContextCleanup (
     {
         DeallocateXenInterface(fdoContext->Xen);
     }
+    DeleteFlightRecorder(fdoContext);
     if (fdoContext->CompatIds)
     {
         ExFreePool(fdoContext->CompatIds);
@@ -768,7 +789,10 @@ FdoUnplugDevice(
             AcquireFdoLock(fdoContext);
         }
     }
-    DrainRequestQueue(fdoContext, TRUE);
+    DrainIsoFastPath(fdoContext);
+    ReleaseInterfaceSwitchRequests(fdoContext);
+    ReleaseThrottledRequests(fdoContext);
+    DrainRequestQueue(fdoContext);
 }
 
 VOID
@@ -909,6 +933,59 @@ FdoEvtDeviceD0Exit(
         fdoContext->maxRequestsProcessed,
         fdoContext->maxRequeuedRequestsProcessed);
 
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE,
+        __FUNCTION__": %s\n"
+        "    Descriptor cache hits %I64d misses %I64d\n"
+        "    Standard requests processed locally %I64d\n",
+        fdoContext->FrontEndPath,
+        fdoContext->DescriptorCache.Hits,
+        fdoContext->DescriptorCache.Misses,
+        fdoContext->totalLocalStandardRequests);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE,
+        __FUNCTION__": %s\n"
+        "    Endpoint throttles %I64d Poll mode hits %I64d\n",
+        fdoContext->FrontEndPath,
+        fdoContext->totalEndpointThrottles,
+        fdoContext->totalPollHits);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE,
+        __FUNCTION__": %s\n"
+        "    Frame clock syncs %I64d errors %I64d corrections %I64d iso corrections %I64d\n"
+        "    Frame clock drift last %d max %d total %I64d\n",
+        fdoContext->FrontEndPath,
+        fdoContext->FrameClock.Syncs,
+        fdoContext->FrameClock.SyncErrors,
+        fdoContext->FrameClock.Corrections,
+        fdoContext->FrameClock.IsoCorrections,
+        fdoContext->FrameClock.LastDrift,
+        fdoContext->FrameClock.MaxDrift,
+        fdoContext->FrameClock.TotalDrift);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE,
+        __FUNCTION__": %s\n"
+        "    Iso ASAP scheduled %I64d underruns %I64d late starts %I64d\n",
+        fdoContext->FrontEndPath,
+        fdoContext->totalIsoAsapScheduled,
+        fdoContext->totalIsoUnderruns,
+        fdoContext->totalIsoLateStarts);
+
+    if (fdoContext->IsoFastPath)
+    {
+        PISO_FAST_PATH fastPath = fdoContext->IsoFastPath;
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE,
+            __FUNCTION__": %s\n"
+            "    Iso fast path submitted %I64d busy %I64d completed %I64d errors %I64d\n"
+            "    Iso fast path latency to ring average %I64d max %I64d (100ns)\n",
+            fdoContext->FrontEndPath,
+            fastPath->Submitted,
+            fastPath->Busy,
+            fastPath->Completed,
+            fastPath->Errors,
+            fastPath->Submitted ? fastPath->TotalLatency / fastPath->Submitted : 0,
+            fastPath->MaxLatency);
+    }
+
     // @todo anything else that needs undoing?
     return STATUS_SUCCESS;
 }
@@ -929,6 +1006,10 @@ VOID FdoEvtDeviceSurpriseRemoval(
         __FUNCTION__": %s Device %p\n",
         fdoContext->FrontEndPath, 
         fdoContext->WdfDevice);
+    //
+    // the history leading up to the removal.
+    //
+    FlightRecorderDump(fdoContext, 64);
 
     CleanupDisconnectedDevice(fdoContext);
 }
@@ -996,11 +1077,14 @@ FdoEvtDeviceDpcFunc(
         return;
     }
     fdoContext->InDpc = TRUE;
+    fdoContext->totalDpcCount++;
 
     BOOLEAN moreWork;
     do
     {
+        LONGLONG timingStart = PathTimingStart(fdoContext);
         moreWork = XenDpc(fdoContext, fdoContext->RequestCollection);
+        PathTimingStop(fdoContext, XenvusbPathXenDpc, timingStart);
         passes++;
         if (fdoContext->DpcOverLapCount)
         {
@@ -1050,13 +1134,16 @@ FdoEvtDeviceDpcFunc(
             Request,
             WdfRequestWdmGetIrp(Request)->IoStatus.Status);
         
+        LONGLONG timingStart = PathTimingStart(fdoContext);
         ReleaseFdoLock(fdoContext);
 
         WdfRequestCompleteWithPriorityBoost(Request,
             WdfRequestWdmGetIrp(Request)->IoStatus.Status,
             IO_SOUND_INCREMENT);
+        LONGLONG timingEnd = PathTimingEnd(timingStart);
         
         AcquireFdoLock(fdoContext);
+        PathTimingRecord(fdoContext, XenvusbPathComplete, timingStart, timingEnd);
 
         responseCount++;
     }
@@ -1066,9 +1153,18 @@ FdoEvtDeviceDpcFunc(
         fdoContext->maxRequestsProcessed = responseCount;
     }
     //
+    // realtime isoch submissions go ahead of the request queue.
+    //
+    DrainIsoFastPath(fdoContext);
+    //
+    // held endpoints first, they were waiting for these responses.
+    //
+    ReleaseInterfaceSwitchRequests(fdoContext);
+    ReleaseThrottledRequests(fdoContext);
+    //
     // fire up any queued requests
     //    
-    DrainRequestQueue(fdoContext, FALSE);
+    DrainRequestQueue(fdoContext);
 
     ReleaseFdoLock(fdoContext);
 
@@ -1108,6 +1204,14 @@ FdoEvtTimerFunc(
         {
             // restart the timer.
             WdfTimerStart(Timer, WDF_REL_TIMEOUT_IN_SEC(1));
+            //
+            // abort the pipes of requests the backend did not cancel.
+            //
+            AbortTimedOutCancels(fdoContext);
+            //
+            // a cancelled SELECT_INTERFACE does not go through the DPC.
+            //
+            ReleaseInterfaceSwitchRequests(fdoContext);
         }
         else
         {
@@ -1123,6 +1227,10 @@ FdoEvtTimerFunc(
     }
     ReleaseFdoLock(fdoContext);
     //
+    // keep the frame clock in step with the backend.
+    //
+    (VOID) SyncFrameClock(fdoContext);
+    //
     // @todo run the dpc - if this fixes anything fix the bug!
     //
     if (!fdoContext->DeviceUnplugged)
@@ -1357,6 +1465,7 @@ InitScratchpad(
 {
     NTSTATUS status;
     KeInitializeEvent(&fdoContext->ScratchPad.CompletionEvent, NotificationEvent, FALSE);
+    FrameClockInitialize(fdoContext);
     
     fdoContext->ScratchPad.Buffer = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, XVU1);
     if (!fdoContext->ScratchPad.Buffer)
@@ -1404,6 +1513,298 @@ DeleteScratchpad(
     }
 }
 
+//
+// FdoSubmitIsoOutUrb() is optional, it fails if these allocations fail.
+//
+VOID
+InitIsoFastPath(
+    IN PUSB_FDO_CONTEXT fdoContext)
+{
+    PISO_FAST_PATH fastPath = (PISO_FAST_PATH) ExAllocatePoolWithTag(NonPagedPool,
+        sizeof(ISO_FAST_PATH), XVU6);
+    if (!fastPath)
+    {
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
+            __FUNCTION__": Device %p ExAllocatePoolWithTag failed\n",
+            fdoContext->WdfDevice);
+        return;
+    }
+    RtlZeroMemory(fastPath, sizeof(ISO_FAST_PATH));
+    InitializeSListHead(&fastPath->FreeList);
+    InitializeSListHead(&fastPath->PendingList);
+    fdoContext->IsoFastPath = fastPath;
+
+    for (ULONG index = 0; index < ISO_FAST_SLOTS; index++)
+    {
+        PISO_FAST_SLOT slot = &fastPath->Slots[index];
+
+        slot->PacketBuffer = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, XVUK);
+        if (slot->PacketBuffer)
+        {
+            slot->PacketMdl = IoAllocateMdl(slot->PacketBuffer,
+                PAGE_SIZE,
+                FALSE,
+                FALSE,
+                NULL);
+        }
+        if (!slot->PacketMdl)
+        {
+            TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
+                __FUNCTION__": Device %p slot %d allocation failed\n",
+                fdoContext->WdfDevice,
+                index);
+            DeleteIsoFastPath(fdoContext);
+            return;
+        }
+        MmBuildMdlForNonPagedPool(slot->PacketMdl);
+        InterlockedPushEntrySList(&fastPath->FreeList, &slot->Link);
+    }
+}
+
+VOID
+DeleteIsoFastPath(
+    IN PUSB_FDO_CONTEXT fdoContext)
+{
+    PISO_FAST_PATH fastPath = fdoContext->IsoFastPath;
+    if (!fastPath)
+    {
+        return;
+    }
+    fdoContext->IsoFastPath = NULL;
+
+    for (ULONG index = 0; index < ISO_FAST_SLOTS; index++)
+    {
+        if (fastPath->Slots[index].PacketMdl)
+        {
+            IoFreeMdl(fastPath->Slots[index].PacketMdl);
+        }
+        if (fastPath->Slots[index].PacketBuffer)
+        {
+            ExFreePool(fastPath->Slots[index].PacketBuffer);
+        }
+    }
+    ExFreePool(fastPath);
+}
+
+//
+// The flight recorder is optional, FlightRecord() does nothing if this fails.
+//
+VOID
+InitFlightRecorder(
+    IN PUSB_FDO_CONTEXT fdoContext)
+{
+    PXENVUSB_FLIGHT_RECORDER recorder = (PXENVUSB_FLIGHT_RECORDER) ExAllocatePoolWithTag(NonPagedPool,
+        sizeof(XENVUSB_FLIGHT_RECORDER), XVUL);
+    if (!recorder)
+    {
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
+            __FUNCTION__": Device %p ExAllocatePoolWithTag failed\n",
+            fdoContext->WdfDevice);
+        return;
+    }
+    RtlZeroMemory(recorder, sizeof(XENVUSB_FLIGHT_RECORDER));
+    LARGE_INTEGER frequency;
+    KeQueryPerformanceCounter(&frequency);
+    recorder->Version = XENVUSB_FLIGHT_RECORDER_VERSION;
+    recorder->Size = sizeof(XENVUSB_FLIGHT_RECORDER);
+    recorder->Frequency = frequency.QuadPart;
+    fdoContext->FlightRecorder = recorder;
+}
+
+//
+// IOCTL_XENVUSB_GET_FLIGHT_RECORDER copies the recorder under the FDO lock.
+//
+VOID
+DeleteFlightRecorder(
+    IN PUSB_FDO_CONTEXT fdoContext)
+{
+    AcquireFdoLock(fdoContext);
+    PXENVUSB_FLIGHT_RECORDER recorder = fdoContext->FlightRecorder;
+    fdoContext->FlightRecorder = NULL;
+    ReleaseFdoLock(fdoContext);
+    if (recorder)
+    {
+        ExFreePool(recorder);
+    }
+}
+
+/**
+ * @brief add a record to the flight recorder.
+ * Lock free, any IRQL <= DISPATCH_LEVEL. Writers claim a record with an
+ * interlocked increment and write Sequence last, a reader racing a writer
+ * may see a record with a stale Sequence.
+ */
+VOID
+FlightRecord(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN XENVUSB_FLIGHT_EVENT Event,
+    IN USHORT ShadowId,
+    IN UCHAR Endpoint,
+    IN UCHAR Type,
+    IN USHORT Function,
+    IN ULONG Length,
+    IN LONG Status,
+    IN ULONG StartFrame)
+{
+    PXENVUSB_FLIGHT_RECORDER recorder = fdoContext->FlightRecorder;
+    if (!recorder)
+    {
+        return;
+    }
+    ULONG sequence = (ULONG) InterlockedIncrement((volatile LONG *) &recorder->Next);
+    PXENVUSB_FLIGHT_RECORD record = &recorder->Records[(sequence - 1) & (XENVUSB_FLIGHT_RECORDS - 1)];
+
+    record->Sequence = 0;
+    record->Timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+    record->Event = (UCHAR) Event;
+    record->Endpoint = Endpoint;
+    record->Type = Type;
+    record->ShadowId = ShadowId;
+    record->Function = Function;
+    record->Length = Length;
+    record->Status = Status;
+    record->StartFrame = StartFrame;
+    KeMemoryBarrier();
+    record->Sequence = sequence;
+}
+
+/**
+ * @brief trace the most recent flight recorder records.
+ *
+ * @param[in] fdoContext. The context object for the device.
+ * @param[in] Count. The number of records to trace, oldest first.
+ */
+VOID
+FlightRecorderDump(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN ULONG Count)
+{
+    PXENVUSB_FLIGHT_RECORDER recorder = fdoContext->FlightRecorder;
+    if (!recorder)
+    {
+        return;
+    }
+    ULONG next = recorder->Next;
+    if (Count > next)
+    {
+        Count = next;
+    }
+    if (Count > XENVUSB_FLIGHT_RECORDS)
+    {
+        Count = XENVUSB_FLIGHT_RECORDS;
+    }
+    TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
+        __FUNCTION__": %s last %d of %d records, frequency %I64d\n",
+        fdoContext->FrontEndPath,
+        Count,
+        next,
+        recorder->Frequency);
+
+    for (ULONG sequence = next - Count + 1; sequence <= next; sequence++)
+    {
+        PXENVUSB_FLIGHT_RECORD record = &recorder->Records[(sequence - 1) & (XENVUSB_FLIGHT_RECORDS - 1)];
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
+            "    %d: %I64d event %d id %x ep %x type %d function %x length %d status %x frame %x\n",
+            record->Sequence,
+            record->Timestamp,
+            record->Event,
+            record->ShadowId,
+            record->Endpoint,
+            record->Type,
+            record->Function,
+            record->Length,
+            record->Status,
+            record->StartFrame);
+    }
+}
+
+/**
+ * @brief start timing a per URB path.
+ * Timing is off by default, IOCTL_XENVUSB_PATH_TIMING_CONTROL turns it on.
+ *
+ * @param[in] fdoContext. The context object for the device.
+ *
+ * @returns the start time for PathTimingStop(), zero if timing is off.
+ */
+_Requires_lock_held_(fdoContext->WdfDevice)
+LONGLONG
+PathTimingStart(
+    IN PUSB_FDO_CONTEXT fdoContext)
+{
+    if (!fdoContext->PathTimingEnabled)
+    {
+        return 0;
+    }
+    return KeQueryPerformanceCounter(NULL).QuadPart;
+}
+
+/**
+ * @brief account the time since PathTimingStart() to a path.
+ *
+ * @param[in] fdoContext. The context object for the device.
+ * @param[in] Path. The path being timed.
+ * @param[in] Start. The value returned by PathTimingStart().
+ */
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+PathTimingStop(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN XENVUSB_PATH Path,
+    IN LONGLONG Start)
+{
+    PathTimingRecord(fdoContext, Path, Start, PathTimingEnd(Start));
+}
+
+/**
+ * @brief the end time of a path timed without the lock held, for
+ * PathTimingRecord(). Taken before the lock is reacquired so that waiting
+ * for the lock is not counted.
+ *
+ * @param[in] Start. The value returned by PathTimingStart().
+ *
+ * @returns the end time, zero if timing is off.
+ */
+LONGLONG
+PathTimingEnd(
+    IN LONGLONG Start)
+{
+    if (!Start)
+    {
+        return 0;
+    }
+    return KeQueryPerformanceCounter(NULL).QuadPart;
+}
+
+/**
+ * @brief account the time from Start to End to a path.
+ *
+ * @param[in] fdoContext. The context object for the device.
+ * @param[in] Path. The path being timed.
+ * @param[in] Start. The value returned by PathTimingStart().
+ * @param[in] End. The value returned by PathTimingEnd().
+ */
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+PathTimingRecord(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN XENVUSB_PATH Path,
+    IN LONGLONG Start,
+    IN LONGLONG End)
+{
+    if (!Start)
+    {
+        return;
+    }
+    ULONGLONG ticks = (ULONGLONG) (End - Start);
+    PXENVUSB_PATH_TIMING timing = &fdoContext->PathTimings[Path];
+    timing->Count++;
+    timing->TotalTicks += ticks;
+    if (ticks > timing->MaxTicks)
+    {
+        timing->MaxTicks = ticks;
+    }
+}
+
 PCHAR
 DbgDevicePowerString(
     IN WDF_POWER_DEVICE_STATE Type)
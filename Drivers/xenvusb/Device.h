@@ -25,6 +25,7 @@
 #pragma once
 #include "Trace.h"
 #include "xenusb.h"
+#include "Public.h"
 #include "xenif.h"
 #include <usbioctl.h>
 #include "DevicePdo.h"
@@ -47,6 +48,123 @@ struct SCRATCHPAD
     ULONG                        Data; //!< response from scratch request
 };
 
+//
+/// Model of the backend's USB frame counter.
+/// Synchronized from the watchdog timer with an XenUsbdGetCurrentFrame ring
+/// request and interpolated in between using KeQueryInterruptTime at one frame per
+/// millisecond. Isoch completions can only move the clock forward.
+/// Protected by its own spinlock as FdoQueryBusTime can be called at DISPATCH_LEVEL.
+//
+#define FRAME_CLOCK_MAX_FAILURES 5 //!< consecutive sync failures before giving up.
+
+struct FRAME_CLOCK
+{
+    KSPIN_LOCK                   Lock;
+    BOOLEAN                      Synchronized;  //!< at least one sync succeeded.
+    BOOLEAN                      Unsupported;   //!< the backend does not answer, free run.
+    ULONG                        BaseFrame;     //!< backend frame at BaseTime.
+    ULONGLONG                    BaseTime;      //!< KeQueryInterruptTime, 100ns units.
+    ULONG                        LastFrame;     //!< last frame reported, the clock never runs backwards.
+    ULONG                        Failures;      //!< consecutive sync failures.
+    //
+    // protected by the device lock.
+    //
+    BOOLEAN                      SyncOnRing;    //!< a SyncFrameClock() request is outstanding.
+    ULONGLONG                    SyncSent;      //!< KeQueryInterruptTime when it was put on the ring.
+    //
+    // stats.
+    //
+    ULONGLONG                    Syncs;
+    ULONGLONG                    SyncErrors;
+    ULONGLONG                    Corrections;   //!< syncs that moved the clock by one frame or more.
+    ULONGLONG                    IsoCorrections;//!< isoch completions ahead of the clock.
+    LONG                         LastDrift;     //!< model - backend at the last sync, in frames.
+    ULONG                        MaxDrift;      //!< largest absolute drift seen.
+    ULONGLONG                    TotalDrift;    //!< sum of absolute drift.
+};
+
+//
+/// Realtime isoch OUT submission, see FdoSubmitIsoOutUrb().
+/// Callers at any IRQL pop a free slot and push it on the pending list without
+/// taking the FDO lock, the DPC moves pending slots onto the ringbuffer using
+/// shadows that the Xen interface reserves for this path, one per slot.
+/// The caller owns the URB again when its status is no longer USBD_STATUS_PENDING.
+//
+#define ISO_FAST_SLOTS 8
+#define ISO_FAST_MAX_PACKETS (PAGE_SIZE / 8) //!< one page of 8 byte iso_packet_info per slot.
+
+struct ISO_FAST_SLOT
+{
+    SLIST_ENTRY                  Link;         //!< free or pending list, must be first.
+    PURB                         Urb;          //!< NULL while on the free list.
+    PVOID                        PacketBuffer; //!< iso packet descriptor page.
+    PMDL                         PacketMdl;
+    ULONGLONG                    SubmitTime;   //!< KeQueryInterruptTime at submission.
+};
+
+struct ISO_FAST_PATH
+{
+    SLIST_HEADER                 FreeList;
+    SLIST_HEADER                 PendingList;
+    ISO_FAST_SLOT                Slots[ISO_FAST_SLOTS];
+    //
+    // stats. Submitted and Busy are interlocked, the rest need the FDO lock.
+    //
+    LONG64                       Submitted;
+    LONG64                       Busy;         //!< rejected, no free slot.
+    ULONGLONG                    Completed;
+    ULONGLONG                    Errors;
+    ULONGLONG                    TotalLatency; //!< submission to ringbuffer, 100ns units.
+    ULONGLONG                    MaxLatency;
+};
+typedef ISO_FAST_PATH *PISO_FAST_PATH;
+
+//
+/// Per-endpoint histograms, recorded by the DPC as responses arrive.
+/// The counters are updated with interlocked increments and are read by
+/// IOCTL_XENVUSB_GET_ENDPOINT_HISTOGRAMS without the FDO lock, the isoch
+/// interval state is only touched by the DPC.
+//
+struct ENDPOINT_HISTOGRAM
+{
+    XENVUSB_ENDPOINT_HISTOGRAM   Histogram;
+    LONGLONG                     LastIsoCompletion; //!< performance counter.
+    LONGLONG                     LastIsoInterval;   //!< 0 if the stream (re)started.
+};
+
+//
+/// Descriptors that are not part of the device or configuration descriptors
+/// (strings, class descriptors fetched via the interface or endpoint) are
+/// retained here once fetched in full so that repeated GET_DESCRIPTOR requests
+/// do not cross the ringbuffer. Entries are keyed by (recipient, type, index, langid)
+/// and are replaced round-robin. The cache is flushed on device reset or port cycle.
+//
+#define DESCRIPTOR_CACHE_ENTRIES 16
+
+struct DESCRIPTOR_CACHE_ENTRY
+{
+    PUCHAR                       Descriptor; //!< NULL if the slot is empty.
+    USHORT                       Length;
+    USHORT                       LanguageId; //!< wIndex of the request.
+    UCHAR                        Recipient;
+    UCHAR                        DescriptorType;
+    UCHAR                        Index;
+};
+
+struct DESCRIPTOR_CACHE
+{
+    DESCRIPTOR_CACHE_ENTRY       Entries[DESCRIPTOR_CACHE_ENTRIES];
+    ULONG                        NextEntry; //!< round-robin replacement index.
+    ULONGLONG                    Hits;
+    ULONGLONG                    Misses;
+};
+
+//
+/// interfaces numbered at or above this have their alternate setting
+/// queried from the device.
+//
+#define MAX_TRACKED_INTERFACES 32
+
 //
 /// The device context performs the same job as
 /// a WDM device extension in the driver frameworks
@@ -84,6 +202,13 @@ struct USB_FDO_CONTEXT
     //
     BOOLEAN                   ConfigBusy;
     //
+    /// a SELECT_INTERFACE is on the ring. Only URBs for SwitchingInterface and
+    /// the pipe table are held, see WaitsForInterfaceSwitch().
+    //
+    BOOLEAN                   InterfaceSwitching;
+    BOOLEAN                   InterfaceSwitchHeld; //!< the InterfaceSwitchQueue may hold requests.
+    UCHAR                     SwitchingInterface;
+    //
     // idle notification support
     //
     WDFREQUEST                IdleRequest;
@@ -99,6 +224,13 @@ struct USB_FDO_CONTEXT
     BOOLEAN                   BlacklistDevice;   //!< this device should be disabled for this OS release.
     BOOLEAN                   FetchOsDescriptor; //!< this device supports os descriptor strings.
     BOOLEAN                   ResetDevice;       //!< this device supports reset without malfunctions.
+    BOOLEAN                   LocalStandardRequests; //!< stable standard requests may be answered locally.
+    BOOLEAN                   ForceShortPacketOk; //!< all IN bulk/interrupt transfers may be short.
+    BOOLEAN                   PollMode;          //!< spin briefly in the DPC for more responses.
+    BOOLEAN                   DescriptorCacheDisabled; //!< descriptor requests always go to the backend.
+    ULONG                     MaxInFlightPerEndpoint; //!< bulk/interrupt requests on the ring per endpoint, 0 is unlimited.
+    ULONG                     IsoLeadFrames;     //!< isoch scheduling lead, 0 is the driver default.
+    LONG                      QuirksGeneration;  //!< gQuirksGeneration the settings above were applied from.
     KEVENT                    resetCompleteEvent;
     
     USB_DEVICE_DESCRIPTOR     DeviceDescriptor;
@@ -141,6 +273,7 @@ struct USB_FDO_CONTEXT
     /// one for each interface, alternate and concurrent.
     //
     PUSB_INTERFACE_DESCRIPTOR * InterfaceDescriptors;
+    INTERFACE_PIPES *         InterfacePipes; //!< pipe index for each InterfaceDescriptors entry.
     //
     /// A configuration supports up to 32 unique endpoints,
     /// 16 in endpoints and 16 out endpoints. Alternate interfaces
@@ -149,7 +282,17 @@ struct USB_FDO_CONTEXT
     /// one for each possible endpoint in each interface and interface alternate.
     //
     PIPE_DESCRIPTOR *         PipeDescriptors;
-    
+    //
+    /// Standard request state tracked for the current configuration.
+    /// Used to answer GET_CONFIGURATION, GET_INTERFACE and device or interface
+    /// GET_STATUS without a round trip when LocalStandardRequests is set.
+    /// StandardStateValid is cleared by a device reset or port cycle and set again
+    /// once the configuration is known.
+    //
+    BOOLEAN                   StandardStateValid;
+    BOOLEAN                   RemoteWakeupEnabled;
+    UCHAR                     AlternateSettings[MAX_TRACKED_INTERFACES]; //!< by bInterfaceNumber.
+
     PUSB_STRING               Manufacturer;
     PUSB_STRING               Product;
     PUSB_STRING               SerialNumber;
@@ -157,9 +300,28 @@ struct USB_FDO_CONTEXT
     POS_COMPAT_ID             CompatIds; 
     USHORT                    LangId;
     //
+    /// descriptors answered locally. Protected by the FDO lock.
+    //
+    DESCRIPTOR_CACHE          DescriptorCache;
+    //
     /// scratch buffer. For internal URB requests.
     //
     SCRATCHPAD                ScratchPad;
+    FRAME_CLOCK               FrameClock;
+    //
+    /// FdoSubmitIsoOutUrb() slots. NULL if the allocation failed.
+    //
+    PISO_FAST_PATH            IsoFastPath;
+    ENDPOINT_HISTOGRAM        EndpointHistograms[XENVUSB_HISTOGRAM_ENDPOINTS];
+    //
+    /// URB event history. NULL if the allocation failed.
+    //
+    PXENVUSB_FLIGHT_RECORDER  FlightRecorder;
+    //
+    /// per URB path cost, see PathTimingStart().
+    //
+    BOOLEAN                   PathTimingEnabled;
+    XENVUSB_PATH_TIMING       PathTimings[XenvusbPathCount];
     //
     /// a parallel queue for URBs from the child PDO.
     //
@@ -170,6 +332,16 @@ struct USB_FDO_CONTEXT
     WDFQUEUE                  RequestQueue;
     ULONG                     RequeuedCount;
     //
+    /// a manual IO queue for requests held by usbflags MaxInFlightPerEndpoint.
+    /// Unlike the RequestQueue the UrbQueue keeps running while it is not empty.
+    //
+    WDFQUEUE                  ThrottleQueue;
+    //
+    /// a manual IO queue for requests held while a SELECT_INTERFACE is on the
+    /// ring. The UrbQueue keeps running while it is not empty.
+    //
+    WDFQUEUE                  InterfaceSwitchQueue;
+    //
     // a watchdog timer for detecting Xen state changes.
     //
     WDFTIMER                  WatchdogTimer;
@@ -215,6 +387,27 @@ struct USB_FDO_CONTEXT
     ULONG                    maxDpcPasses;
     ULONG                    maxRequestsProcessed;
     ULONG                    maxRequeuedRequestsProcessed;
+    //
+    // Standard requests answered locally (round trips saved).
+    //
+    ULONGLONG                totalLocalStandardRequests;
+    //
+    // usbflags quirk stats.
+    //
+    ULONGLONG                totalEndpointThrottles; // held by MaxInFlightPerEndpoint
+    ULONGLONG                totalPollHits;          // responses found by PollMode
+    //
+    // isoch scheduling stats.
+    //
+    ULONGLONG                totalIsoAsapScheduled;  // ASAP transfers given a start frame
+    ULONGLONG                totalIsoUnderruns;      // streams that fell behind the bus
+    ULONGLONG                totalIsoLateStarts;     // explicit start frames already past
+    //
+    // bus statistics, completed data transfers by USBD_PIPE_TYPE.
+    //
+    ULONGLONG                totalPipeBytes[UsbdPipeTypeInterrupt + 1];
+    ULONGLONG                totalCompletedTransfers;
+    ULONGLONG                totalDpcCount;
 }; 
 //
 // This macro will generate an inline function called DeviceGetContext
@@ -230,6 +423,13 @@ struct FDO_REQUEST_CONTEXT
 {
     LONG CancelSet;
     LONG RequestCompleted;
+    ULONG ShadowIndex; //!< the request's shadow if that shadow's Request is this request.
+    LONG CancelOnRing;     //!< cancelled with CANCEL_REQUEST, the DPC completes it.
+    LONG CancelTimedOut;   //!< no answer to the CANCEL_REQUEST, the pipe abort completes it.
+    ULONGLONG CancelOnRingTime; //!< interrupt time the CANCEL_REQUEST went on the ring.
+    LONG ResponseReceived; //!< the DPC left the response to the cancel routine.
+    LONG Throttled;        //!< held in the ThrottleQueue, see ReleaseThrottledRequests().
+    UCHAR ThrottledEndpoint;
 };
 typedef FDO_REQUEST_CONTEXT *PFDO_REQUEST_CONTEXT;
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FDO_REQUEST_CONTEXT, RequestGetRequestContext)
@@ -317,6 +517,47 @@ VOID
 ReleaseFdoLock(
     IN PUSB_FDO_CONTEXT fdoContext);
 
+VOID
+FlightRecord(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN XENVUSB_FLIGHT_EVENT Event,
+    IN USHORT ShadowId,
+    IN UCHAR Endpoint,
+    IN UCHAR Type,
+    IN USHORT Function,
+    IN ULONG Length,
+    IN LONG Status,
+    IN ULONG StartFrame);
+
+VOID
+FlightRecorderDump(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN ULONG Count);
+
+_Requires_lock_held_(fdoContext->WdfDevice)
+LONGLONG
+PathTimingStart(
+    IN PUSB_FDO_CONTEXT fdoContext);
+
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+PathTimingStop(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN XENVUSB_PATH Path,
+    IN LONGLONG Start);
+
+LONGLONG
+PathTimingEnd(
+    IN LONGLONG Start);
+
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+PathTimingRecord(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN XENVUSB_PATH Path,
+    IN LONGLONG Start,
+    IN LONGLONG End);
+
 
 PCHAR UsbIoctlToString(
     ULONG IoControlCode);
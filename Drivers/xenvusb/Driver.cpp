@@ -25,6 +25,7 @@
 #include "driver.h"
 #include "resource.h"
 #include "Device.h"
+#include "UsbQuirks.h"
 #include <initguid.h> 
 #include <ndisguid.h>
 #include <wdmguid.h>
@@ -71,6 +72,10 @@ Device architecture:
 
 BOOLEAN gVistaOrLater = FALSE; //!< XP is different.
 BOOLEAN gFakeNxprep = FALSE;   //!< for debugging nxprep 
+BOOLEAN gLocalStandardRequests = FALSE; //!< answer stable standard requests from tracked state.
+#if DBG
+FAULT_INJECTION gFaultInjection; //!< all off.
+#endif
 
 //
 /// driver entry is an "init" segment so the strings local to it get discarded so we need a local string
@@ -83,6 +88,76 @@ PCHAR name="XenVusb";
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (INIT, DriverEntry)
 #endif
+
+/**
+ * @brief read optional driver wide settings from the service key.
+ *
+ *   LocalStandardRequests REG_DWORD  non-zero: answer GET_STATUS (device and interface),
+ *                                    GET_CONFIGURATION and GET_INTERFACE from the state
+ *                                    tracked by the frontend rather than the device.
+ *                                    Individual devices can opt out via the usbflags
+ *                                    NoLocalStandardRequests value. Default is off.
+ *
+ * Checked builds only, see FAULT_INJECTION:
+ *
+ *   FaultGrantFailEvery, FaultStallEvery, FaultDeviceRemovedEvery,
+ *   FaultResponseDelayUs  REG_DWORD  Default is 0, off.
+ *
+ * @param[in] RegistryPath registry path to services key for driver.
+ */
+static VOID
+GetDriverSettings(
+    _In_ PUNICODE_STRING RegistryPath)
+{
+    ULONG localStandardRequests = 0;
+    RTL_QUERY_REGISTRY_TABLE QueryTable[6];
+    RtlZeroMemory(QueryTable, sizeof(QueryTable));
+    QueryTable[0].QueryRoutine = NULL;
+    QueryTable[0].Flags = RTL_QUERY_REGISTRY_DIRECT;
+    QueryTable[0].Name = L"LocalStandardRequests";
+    QueryTable[0].EntryContext = &localStandardRequests;
+    QueryTable[0].DefaultType = REG_DWORD;
+    QueryTable[0].DefaultData = &localStandardRequests;
+    QueryTable[0].DefaultLength = sizeof(localStandardRequests);
+#if DBG
+    FAULT_INJECTION faults = { 0 };
+    struct
+    {
+        PWSTR Name;
+        PULONG Value;
+    } faultValues[] =
+    {
+        { L"FaultGrantFailEvery", &faults.GrantFailEvery },
+        { L"FaultStallEvery", &faults.StallEvery },
+        { L"FaultDeviceRemovedEvery", &faults.DeviceRemovedEvery },
+        { L"FaultResponseDelayUs", &faults.ResponseDelayUs },
+    };
+    for (ULONG index = 0; index < ARRAYSIZE(faultValues); index++)
+    {
+        QueryTable[index + 1].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        QueryTable[index + 1].Name = faultValues[index].Name;
+        QueryTable[index + 1].EntryContext = faultValues[index].Value;
+        QueryTable[index + 1].DefaultType = REG_DWORD;
+        QueryTable[index + 1].DefaultData = faultValues[index].Value;
+        QueryTable[index + 1].DefaultLength = sizeof(ULONG);
+    }
+#endif
+
+    NTSTATUS Status = RtlQueryRegistryValues(
+        RTL_REGISTRY_ABSOLUTE,
+        RegistryPath->Buffer,
+        QueryTable,
+        NULL,
+        NULL);
+    if (NT_SUCCESS(Status))
+    {
+        gLocalStandardRequests = localStandardRequests ? TRUE : FALSE;
+#if DBG
+        faults.ResponseDelayUs = min(faults.ResponseDelayUs, 100000);
+        gFaultInjection = faults;
+#endif
+    }
+}
 /** 
  * @brief Entry point for the driver.
  * Set up global variables and connect to the framework.
@@ -110,13 +185,23 @@ DriverEntry(
     gVistaOrLater = RtlIsNtDdiVersionAvailable(NTDDI_VISTA);
 
 #ifdef ALPHA_DBG
-    gDebugLevel = TRACE_LEVEL_INFORMATION;
+    gDebugLevel = TRACE_LEVEL_VERBOSE;
     gDebugFlag = TRACE_DRIVER|TRACE_DEVICE|TRACE_QUEUE|TRACE_URB|TRACE_ISR|TRACE_DPC;
 #else
-    gDebugLevel = TRACE_LEVEL_WARNING;
-    gDebugFlag = TRACE_DRIVER|TRACE_DEVICE|TRACE_QUEUE|TRACE_URB;
+    //
+    // gDebugFlag filters traces below warning level, all flags are on by
+    // default so that information traces from the DPC are still seen.
+    //
+    gDebugLevel = TRACE_LEVEL_INFORMATION;
+    gDebugFlag = TRACE_DRIVER|TRACE_DEVICE|TRACE_QUEUE|TRACE_URB|TRACE_ISR|TRACE_DPC;
 #endif
     GetDebugSettings(RegistryPath);
+    GetDriverSettings(RegistryPath);
+    //
+    // Failing to read usbflags is not fatal, devices get the default quirks.
+    //
+    (VOID) UsbQuirksInitialize();
+    IrpWorkItemInitialize();
 
 #if DBG
     CHAR * buildType = "Debug";
@@ -134,6 +219,23 @@ DriverEntry(
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER,
         "DebugLevel %x DebugFlag %x\n", 
         gDebugLevel, gDebugFlag);
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER,
+        "Local standard requests %s\n",
+        gLocalStandardRequests ? "enabled" : "disabled");
+#if DBG
+    if (gFaultInjection.GrantFailEvery ||
+        gFaultInjection.StallEvery ||
+        gFaultInjection.DeviceRemovedEvery ||
+        gFaultInjection.ResponseDelayUs)
+    {
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_DRIVER,
+            "Fault injection: grant fail every %d stall every %d device removed every %d response delay %dus\n",
+            gFaultInjection.GrantFailEvery,
+            gFaultInjection.StallEvery,
+            gFaultInjection.DeviceRemovedEvery,
+            gFaultInjection.ResponseDelayUs);
+    }
+#endif
 
     //
     // Setup a cleanup callback for the WDFDRIVER object we are creating. 
@@ -161,6 +263,8 @@ DriverEntry(
     {
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER, "WdfDriverCreate failed %x\n", 
             status);
+        UsbQuirksCleanup();
+        IrpWorkItemCleanup();
         return status;
     }
     return status;
@@ -180,6 +284,8 @@ EvtDriverContextCleanup(
     UNREFERENCED_PARAMETER(DriverObject);
 
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER, __FUNCTION__": Driver unload\n");
+    UsbQuirksCleanup();
+    IrpWorkItemCleanup();
 }
 
 /*
@@ -60,23 +60,52 @@ LONGLONG Uptime();
 #define XVU2 '2UVX' // AllocAndQueryPropertyString buffer.
 #define XVU3 '3UVX' // USB_FDO_CONTEXT.ConfigData. (USB_CONFIG_INFO)
 #define XVU4 '4UVX' // USB_CONFIG_INFO.m_configurationDescriptor
-#define XVU5 '5UVX' // USB_CONFIG_INFO.m_interfaceDescriptors
-#define XVU6 '6UVX' // USB_CONFIG_INFO.m_pipeDescriptors
+#define XVU5 '5UVX' // USB_CONFIG_INFO.m_arena
+#define XVU6 '6UVX' // ISO_FAST_PATH.
 #define XVU7 '7UVX' // GetOsDescriptorString compatids.
 #define XVU8 '8UVX' // GetString USB_STRING.
 #define XVU9 '9UVX' // XEN_INTERFACE.
 #define XVUA 'AUVX' // usbif_shadow_ex_t array.
 #define XVUB 'BUVX' // USHORT shadow free list array.
-#define XVUC 'CUVX' // PutUrbOnRing indirectPageMemory.
-#define XVUD 'DUVX' // PutIsoUrbOnRing iso packet buffer.
-#define XVUE 'EUVX' // PutIsoUrbOnRing indirectPageMemory.
+#define XVUC 'CUVX' // PutUrbOnRing indirectPageMemory larger than the page classes.
+#define XVUD 'DUVX' // PutIsoUrbOnRing iso packet buffer larger than the page classes.
+#define XVUE 'EUVX' // PutIsoUrbOnRing indirectPageMemory larger than the page classes.
 #define XVUF 'FUVX' // RootHubIfGetLocationString
 #define XVUG 'GUVX' // RootHubIfFpAllocateWorkItem.
-#define XVUH 'HUVX' // AllocateIrpWorkItem.
-#define XVUI 'IUVX' // unused.
-#define XVUJ 'JUVX' // unused.
-#define XVUK 'KUVX' // unused.
+#define XVUH 'HUVX' // AllocateIrpWorkItem lookaside list.
+#define XVUI 'IUVX' // DESCRIPTOR_CACHE_ENTRY.Descriptor.
+#define XVUJ 'JUVX' // USB_QUIRKS_TABLE and USB_QUIRKS_ENTRY.
+#define XVUK 'KUVX' // ISO_FAST_SLOT.PacketBuffer.
+#define XVUL 'LUVX' // XENVUSB_FLIGHT_RECORDER.
+#define XVUM 'MUVX' // XEN_CAPTURE.Buffer.
+#define XVUN 'NUVX' // XEN_INTERFACE.PageLookaside transient pages.
+#define XVUO 'OUVX' // XEN_INTERFACE.TransferMdl.
 
 
 extern BOOLEAN gVistaOrLater;
-extern BOOLEAN gFakeNxprep;
\ No newline at end of file
+extern BOOLEAN gFakeNxprep;
+extern BOOLEAN gLocalStandardRequests;
+
+#if DBG
+//
+/// Checked builds only. Makes the backend look slow or hostile, each
+/// setting is off when 0. See GetDriverSettings().
+//
+struct FAULT_INJECTION
+{
+    ULONG GrantFailEvery;     //!< fail every Nth grant ref allocation.
+    ULONG StallEvery;         //!< report every Nth response as stalled.
+    ULONG DeviceRemovedEvery; //!< report every Nth response as device removed.
+    ULONG ResponseDelayUs;    //!< hold each response until its request is this old, at most 100000.
+};
+extern FAULT_INJECTION gFaultInjection;
+#endif
+
+//
+// UsbInterface.cpp, driver wide IRP_WORK_ITEM lookaside list.
+//
+VOID
+IrpWorkItemInitialize();
+
+VOID
+IrpWorkItemCleanup();
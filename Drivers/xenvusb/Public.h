@@ -1 +1,280 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file Public.h Definitions shared with applications.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#pragma once
 
+//
+/// Sent to the virtual usb controller device. Re-reads
+/// HKLM\\CCS\\Control\\usbflags into the driver's in-memory quirks table.
+/// Every controller applies the runtime quirks to its device at its next URB.
+/// No input or output buffer.
+//
+#define IOCTL_XENVUSB_RELOAD_QUIRKS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+//
+/// Sent to the virtual usb controller device. Returns a
+/// XENVUSB_ENDPOINT_HISTOGRAMS snapshot in the output buffer.
+/// No input buffer.
+//
+#define IOCTL_XENVUSB_GET_ENDPOINT_HISTOGRAMS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define XENVUSB_HISTOGRAM_VERSION 1
+//
+/// log2 buckets. Bucket 0 counts zero, bucket n counts [2^(n-1), 2^n)
+/// and the last bucket counts everything from 2^30 up.
+//
+#define XENVUSB_HISTOGRAM_BUCKETS 32
+//
+/// indexed by endpoint number, plus 16 for IN endpoints.
+//
+#define XENVUSB_HISTOGRAM_ENDPOINTS 32
+
+typedef struct _XENVUSB_ENDPOINT_HISTOGRAM
+{
+    UCHAR  EndpointAddress; //!< valid if Completions is not zero.
+    UCHAR  Type;            //!< USBD_PIPE_TYPE.
+    USHORT Reserved;
+    ULONG  Completions;
+    ULONG  RingLatency[XENVUSB_HISTOGRAM_BUCKETS]; //!< microseconds from the ringbuffer to the response.
+    ULONG  Bytes[XENVUSB_HISTOGRAM_BUCKETS];       //!< per URB. The requested length for isoch URBs.
+    ULONG  IsoJitter[XENVUSB_HISTOGRAM_BUCKETS];   //!< microseconds, change in the isoch completion interval.
+} XENVUSB_ENDPOINT_HISTOGRAM, *PXENVUSB_ENDPOINT_HISTOGRAM;
+
+typedef struct _XENVUSB_ENDPOINT_HISTOGRAMS
+{
+    ULONG  Version; //!< XENVUSB_HISTOGRAM_VERSION
+    ULONG  Size;    //!< sizeof(XENVUSB_ENDPOINT_HISTOGRAMS)
+    XENVUSB_ENDPOINT_HISTOGRAM Endpoints[XENVUSB_HISTOGRAM_ENDPOINTS];
+} XENVUSB_ENDPOINT_HISTOGRAMS, *PXENVUSB_ENDPOINT_HISTOGRAMS;
+
+//
+/// Sent to the virtual usb controller device. Returns a
+/// XENVUSB_FLIGHT_RECORDER snapshot in the output buffer.
+/// No input buffer.
+//
+#define IOCTL_XENVUSB_GET_FLIGHT_RECORDER \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define XENVUSB_FLIGHT_RECORDER_VERSION 1
+//
+/// must be a power of 2.
+//
+#define XENVUSB_FLIGHT_RECORDS 1024
+//
+/// ShadowId for events before the URB is on the ringbuffer.
+//
+#define XENVUSB_FLIGHT_NO_SHADOW 0xFFFF
+
+//
+/// XENVUSB_FLIGHT_RECORD.Event. Status is 0 for XenvusbFlightSubmitUrb and
+/// XenvusbFlightPutOnRing, the usbif response status for XenvusbFlightResponse
+/// and the final USBD_STATUS for XenvusbFlightComplete. Length is the usbif
+/// error packet count for isoch XenvusbFlightResponse records.
+//
+typedef enum _XENVUSB_FLIGHT_EVENT
+{
+    XenvusbFlightNone,
+    XenvusbFlightSubmitUrb,
+    XenvusbFlightPutOnRing,
+    XenvusbFlightResponse,
+    XenvusbFlightComplete
+} XENVUSB_FLIGHT_EVENT;
+
+typedef struct _XENVUSB_FLIGHT_RECORD
+{
+    LONGLONG Timestamp;  //!< KeQueryPerformanceCounter.
+    ULONG    Sequence;   //!< 1 based, 0 if the record was never written.
+    UCHAR    Event;      //!< XENVUSB_FLIGHT_EVENT.
+    UCHAR    Endpoint;   //!< usbif endpoint address.
+    UCHAR    Type;       //!< USBD_PIPE_TYPE.
+    UCHAR    Reserved;
+    USHORT   ShadowId;   //!< ringbuffer request id or XENVUSB_FLIGHT_NO_SHADOW.
+    USHORT   Function;   //!< URB function.
+    ULONG    Length;     //!< bytes requested or transferred.
+    LONG     Status;
+    ULONG    StartFrame; //!< isoch only.
+} XENVUSB_FLIGHT_RECORD, *PXENVUSB_FLIGHT_RECORD;
+
+typedef struct _XENVUSB_FLIGHT_RECORDER
+{
+    ULONG    Version;   //!< XENVUSB_FLIGHT_RECORDER_VERSION
+    ULONG    Size;      //!< sizeof(XENVUSB_FLIGHT_RECORDER)
+    LONGLONG Frequency; //!< of the Timestamp counter.
+    ULONG    Next;      //!< records written. Record n is at (n - 1) % XENVUSB_FLIGHT_RECORDS.
+    ULONG    Reserved;
+    XENVUSB_FLIGHT_RECORD Records[XENVUSB_FLIGHT_RECORDS];
+} XENVUSB_FLIGHT_RECORDER, *PXENVUSB_FLIGHT_RECORDER;
+
+//
+/// Sent to the virtual usb controller device. Starts or stops capturing the
+/// usbif request and response stream. The input buffer is a
+/// XENVUSB_CAPTURE_CONTROL. Starting a capture discards unread records,
+/// stopping one keeps them for IOCTL_XENVUSB_READ_CAPTURE. Free builds do not
+/// capture data and fail a non-zero PayloadLimit with STATUS_NOT_SUPPORTED.
+//
+#define IOCTL_XENVUSB_CAPTURE_CONTROL \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x803, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+//
+/// Sent to the virtual usb controller device. Returns a XENVUSB_CAPTURE_HEADER
+/// followed by as many whole XENVUSB_CAPTURE_RECORDs as fit in the output
+/// buffer. Returned records are removed from the capture buffer.
+/// No input buffer.
+//
+#define IOCTL_XENVUSB_READ_CAPTURE \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x804, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define XENVUSB_CAPTURE_VERSION 1
+#define XENVUSB_CAPTURE_MAX_PAYLOAD 0x10000
+
+typedef struct _XENVUSB_CAPTURE_CONTROL
+{
+    ULONG Enable;       //!< zero stops the capture.
+    ULONG PayloadLimit; //!< data bytes kept per message, at most XENVUSB_CAPTURE_MAX_PAYLOAD.
+} XENVUSB_CAPTURE_CONTROL, *PXENVUSB_CAPTURE_CONTROL;
+
+typedef enum _XENVUSB_CAPTURE_KIND
+{
+    XenvusbCaptureNone,     //!< never returned.
+    XenvusbCaptureRequest,  //!< struct usbif_request, OUT data.
+    XenvusbCaptureResponse  //!< struct usbif_response, IN data.
+} XENVUSB_CAPTURE_KIND;
+
+//
+/// The usbif message, as put on or taken off the shared ring, follows the
+/// record header and the payload follows the message. Records are 8 byte
+/// aligned.
+//
+typedef struct _XENVUSB_CAPTURE_RECORD
+{
+    ULONG    RecordLength;   //!< header, message, payload and padding.
+    UCHAR    Kind;           //!< XENVUSB_CAPTURE_KIND.
+    UCHAR    Reserved;
+    USHORT   MessageLength;
+    LONGLONG Timestamp;      //!< KeQueryPerformanceCounter.
+    ULONG    PayloadLength;  //!< data bytes captured.
+    ULONG    OriginalLength; //!< data bytes in the transfer.
+} XENVUSB_CAPTURE_RECORD, *PXENVUSB_CAPTURE_RECORD;
+
+typedef struct _XENVUSB_CAPTURE_HEADER
+{
+    ULONG    Version;   //!< XENVUSB_CAPTURE_VERSION
+    ULONG    Length;    //!< of the records following the header.
+    LONGLONG Frequency; //!< of the Timestamp counter.
+    ULONG    Dropped;   //!< records lost to a full capture buffer since the capture started.
+    ULONG    Active;    //!< non-zero if the capture is running.
+} XENVUSB_CAPTURE_HEADER, *PXENVUSB_CAPTURE_HEADER;
+
+//
+/// Sent to the virtual usb controller device. Starts or stops timing the
+/// per URB paths. The input buffer is a XENVUSB_PATH_TIMING_CONTROL.
+/// Starting discards the accumulated timings.
+//
+#define IOCTL_XENVUSB_PATH_TIMING_CONTROL \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x805, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+//
+/// Sent to the virtual usb controller device. Returns a XENVUSB_PATH_TIMINGS
+/// snapshot in the output buffer. No input buffer.
+//
+#define IOCTL_XENVUSB_GET_PATH_TIMINGS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x806, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define XENVUSB_PATH_TIMING_VERSION 1
+
+typedef struct _XENVUSB_PATH_TIMING_CONTROL
+{
+    ULONG Enable; //!< zero stops timing.
+} XENVUSB_PATH_TIMING_CONTROL, *PXENVUSB_PATH_TIMING_CONTROL;
+
+typedef enum _XENVUSB_PATH
+{
+    XenvusbPathSubmitUrb,       //!< SubmitUrb() dispatch, including the ring put.
+    XenvusbPathPutUrbOnRing,    //!< MDL to PFN to grant translation.
+    XenvusbPathPutIsoUrbOnRing, //!< the same for isoch transfers.
+    XenvusbPathXenDpc,          //!< one pass over the response ring.
+    XenvusbPathPostProcessUrb,  //!< one response translated back to its URB.
+    XenvusbPathComplete,        //!< WdfRequestCompleteWithPriorityBoost() from the DPC.
+    XenvusbPathCount
+} XENVUSB_PATH;
+
+typedef struct _XENVUSB_PATH_TIMING
+{
+    ULONGLONG Count;
+    ULONGLONG TotalTicks;
+    ULONGLONG MaxTicks;
+} XENVUSB_PATH_TIMING, *PXENVUSB_PATH_TIMING;
+
+typedef struct _XENVUSB_PATH_TIMINGS
+{
+    ULONG               Version;   //!< XENVUSB_PATH_TIMING_VERSION
+    ULONG               Size;      //!< sizeof(XENVUSB_PATH_TIMINGS)
+    LONGLONG            Frequency; //!< of the tick counter.
+    ULONG               Enabled;
+    ULONG               Reserved;
+    XENVUSB_PATH_TIMING Paths[XenvusbPathCount]; //!< indexed by XENVUSB_PATH.
+} XENVUSB_PATH_TIMINGS, *PXENVUSB_PATH_TIMINGS;
+
+//
+/// Sent to the virtual usb controller device. Returns a
+/// XENVUSB_TRANSFER_STATISTICS in the output buffer. The optional input
+/// buffer is the XENVUSB_TRANSFER_STATISTICS returned by the caller's
+/// previous request, the rates are computed over the interval since then.
+/// The driver keeps no per caller state.
+//
+#define IOCTL_XENVUSB_GET_TRANSFER_STATISTICS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x807, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define XENVUSB_TRANSFER_STATISTICS_VERSION 1
+//
+/// indexed by USBD_PIPE_TYPE.
+//
+#define XENVUSB_PIPE_TYPES 4
+
+typedef struct _XENVUSB_TRANSFER_STATISTICS
+{
+    ULONG     Version;    //!< XENVUSB_TRANSFER_STATISTICS_VERSION
+    ULONG     Size;       //!< sizeof(XENVUSB_TRANSFER_STATISTICS)
+    //
+    // free running since the device started.
+    //
+    ULONGLONG Time;       //!< interrupt time, 100ns units.
+    ULONGLONG Transfers;  //!< completed data transfers.
+    ULONGLONG PipeBytes[XENVUSB_PIPE_TYPES]; //!< completed bytes.
+    //
+    // ring occupancy now.
+    //
+    ULONG     RequestsOnRing;
+    ULONG     MaxRequestsOnRing; //!< high water mark.
+    ULONG     RingSize;          //!< request slots on the ring.
+    ULONG     Reserved;
+    //
+    // since the sample passed in, zero if there was none.
+    //
+    ULONGLONG Interval;   //!< 100ns units.
+    ULONGLONG TransfersPerSecond;
+    ULONGLONG BytesPerSecond[XENVUSB_PIPE_TYPES];
+} XENVUSB_TRANSFER_STATISTICS, *PXENVUSB_TRANSFER_STATISTICS;
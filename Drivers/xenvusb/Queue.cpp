@@ -25,6 +25,9 @@
 #include "driver.h"
 #include "usbioctl.h"
 #include "UsbRequest.h"
+#include "UsbConfig.h"
+#include "UsbQuirks.h"
+#include "Public.h"
 
 
 //
@@ -45,7 +48,8 @@ WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(QUEUE_CONTEXT, QueueGetContext)
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL FdoEvtIoDeviceControl;
 EVT_WDF_IO_QUEUE_IO_INTERNAL_DEVICE_CONTROL UrbEvtIoInternalDeviceControl;
 EVT_WDF_IO_QUEUE_IO_STOP FdoEvtIoStop;
-EVT_WDF_WORKITEM  PassiveDrain;
+
+EVT_WDF_WORKITEM ReloadQuirksWorker;
 
 PCHAR UsbControlCodeToString(
     IN ULONG ControlCode);
@@ -55,8 +59,8 @@ PCHAR UsbControlCodeToString(
  * virtual usb controller.
  * The virtual usb controller does all of the URB and IOCTL processing for the
  * USB PDO.
- * Three queues are created: one for IOCTLs, one for URBs and one for URBs that 
- * could not be put on the ringbuffer.
+ * Four queues are created: one for IOCTLs, one for URBs, one for URBs that 
+ * could not be put on the ringbuffer and one for URBs held per endpoint.
  *
  * @param[in] Device handle to the WDFDEVICE object for the virtual usb host controller FDO.
  *
@@ -84,6 +88,12 @@ FdoQueueInitialize(
     // the RequestQueue will have either 0 or 1 requests queued, although it is possible to have
     // a depth > 1.
     //
+    // The ThrottleQueue holds bulk and interrupt requests for endpoints that are at their
+    // usbflags MaxInFlightPerEndpoint limit. The UrbQueue keeps running while it is non-empty.
+    //
+    // The InterfaceSwitchQueue holds the requests that have to wait for a SELECT_INTERFACE
+    // on the ring, the UrbQueue keeps running for everything else.
+    //
     WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(
          &queueConfig,
         WdfIoQueueDispatchParallel); // this could probably be serial.
@@ -147,6 +157,46 @@ FdoQueueInitialize(
             __FUNCTION__ ": %s Manual queue WdfIoQueueCreate failed %x", 
             fdoContext->FrontEndPath,
             status);
+        return status;
+    }
+    //
+    // and the throttle queue, also manual dispatch.
+    //
+    WDF_IO_QUEUE_CONFIG_INIT(
+        &queueConfig,
+        WdfIoQueueDispatchManual);
+
+    status = WdfIoQueueCreate(Device,
+        &queueConfig,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        &fdoContext->ThrottleQueue);
+
+    if( !NT_SUCCESS(status) ) 
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, 
+            __FUNCTION__ ": %s Throttle queue WdfIoQueueCreate failed %x", 
+            fdoContext->FrontEndPath,
+            status);
+        return status;
+    }
+    //
+    // and the interface switch queue, also manual dispatch.
+    //
+    WDF_IO_QUEUE_CONFIG_INIT(
+        &queueConfig,
+        WdfIoQueueDispatchManual);
+
+    status = WdfIoQueueCreate(Device,
+        &queueConfig,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        &fdoContext->InterfaceSwitchQueue);
+
+    if( !NT_SUCCESS(status) ) 
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, 
+            __FUNCTION__ ": %s Interface switch queue WdfIoQueueCreate failed %x", 
+            fdoContext->FrontEndPath,
+            status);
     }
     return status;
 }
@@ -717,6 +767,242 @@ ProcessUsbControllerInfo0(
 
 }
 
+/**
+ * @brief Process an USBUSER_GET_BUS_STATISTICS_0.
+ * ** Must complete the Request **
+ * ** Processed on dispatch side and does not use Request Context **
+ * There is no PCI controller behind this bus, the interrupt and worker counts
+ * are the event channel DPC counts. The common buffers are the pages shared
+ * with the backend for the life of the device: the ring, the scratchpad and
+ * the isoch fast path packet pages.
+ *
+ * @param[in] fdoContext. The context object for the device.
+ * @param[in] Request. The handle to the IO Request.
+ * @param[in] OutputBufferLength. The length in bytes of the output buffer.
+ *
+ */
+VOID
+ProcessUsbBusStatistics0(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN WDFREQUEST Request,
+    IN size_t OutputBufferLength)
+{
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    PUSBUSER_BUS_STATISTICS_0_REQUEST usbStatistics = NULL;
+    ULONG_PTR Information = 0;
+
+    NTSTATUS Status = WdfRequestRetrieveOutputBuffer(Request,
+            sizeof(USBUSER_BUS_STATISTICS_0_REQUEST),
+            (PVOID *) &usbStatistics,
+            NULL);
+
+    if (NT_SUCCESS(Status))
+    {
+        PUSB_BUS_STATISTICS_0 busStatistics = &usbStatistics->BusStatistics0;
+        RtlZeroMemory(busStatistics, sizeof(USB_BUS_STATISTICS_0));
+
+        KeQuerySystemTime(&busStatistics->CurrentSystemTime);
+        busStatistics->CurrentUsbFrame = FrameClockCurrentFrame(fdoContext);
+
+        AcquireFdoLock(fdoContext);
+        busStatistics->DeviceCount = fdoContext->PortConnected ? 1 : 0;
+        //
+        // USBPORT reports these as free running ULONG counters.
+        //
+        busStatistics->ControlDataBytes = (ULONG) fdoContext->totalPipeBytes[UsbdPipeTypeControl];
+        busStatistics->IsoBytes = (ULONG) fdoContext->totalPipeBytes[UsbdPipeTypeIsochronous];
+        busStatistics->BulkBytes = (ULONG) fdoContext->totalPipeBytes[UsbdPipeTypeBulk];
+        busStatistics->InterruptBytes = (ULONG) fdoContext->totalPipeBytes[UsbdPipeTypeInterrupt];
+        busStatistics->PciInterruptCount = (ULONG) fdoContext->totalDpcCount;
+        busStatistics->WorkerSignalCount = (ULONG) (fdoContext->totalDpcReQueueCount +
+            fdoContext->totalDpcOverLapCount);
+        busStatistics->CommonBufferBytes = fdoContext->Xen ? RingBufferBytes(fdoContext->Xen) : 0;
+        if (fdoContext->ScratchPad.Buffer)
+        {
+            busStatistics->CommonBufferBytes += PAGE_SIZE;
+        }
+        if (fdoContext->IsoFastPath)
+        {
+            busStatistics->CommonBufferBytes += ISO_FAST_SLOTS * PAGE_SIZE;
+        }
+        ReleaseFdoLock(fdoContext);
+
+        busStatistics->RootHubEnabled = TRUE;
+        busStatistics->RootHubDevicePowerState = 0; // D0
+
+        usbStatistics->Header.UsbUserStatusCode = UsbUserSuccess;
+        usbStatistics->Header.ActualBufferLength = sizeof(USBUSER_BUS_STATISTICS_0_REQUEST);
+        Information = usbStatistics->Header.ActualBufferLength;
+    }
+    
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE,
+        __FUNCTION__": request completed with status %x size %d\n",
+        Status,
+        Information); 
+
+    WdfRequestCompleteWithInformation(Request, Status, Information);
+
+}
+
+//
+// High speed bus bandwidth in bits per millisecond.
+//
+#define HIGH_SPEED_BITS_PER_MS 480000
+
+/**
+ * @brief Process an USBUSER_GET_BANDWIDTH_INFORMATION.
+ * ** Must complete the Request **
+ * ** Processed on dispatch side and does not use Request Context **
+ * Nothing is reserved on the bus, the backend owns the schedule, so every
+ * allocation is reported as 0. Measured throughput is returned by
+ * IOCTL_XENVUSB_GET_TRANSFER_STATISTICS.
+ *
+ * @param[in] fdoContext. The context object for the device.
+ * @param[in] Request. The handle to the IO Request.
+ * @param[in] OutputBufferLength. The length in bytes of the output buffer.
+ *
+ */
+VOID
+ProcessUsbBandwidthInformation(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN WDFREQUEST Request,
+    IN size_t OutputBufferLength)
+{
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    PUSBUSER_BANDWIDTH_INFO_REQUEST usbBandwidth = NULL;
+    ULONG_PTR Information = 0;
+
+    NTSTATUS Status = WdfRequestRetrieveOutputBuffer(Request,
+            sizeof(USBUSER_BANDWIDTH_INFO_REQUEST),
+            (PVOID *) &usbBandwidth,
+            NULL);
+
+    if (NT_SUCCESS(Status))
+    {
+        PUSB_BANDWIDTH_INFO bandwidthInfo = &usbBandwidth->BandwidthInformation;
+        RtlZeroMemory(bandwidthInfo, sizeof(USB_BANDWIDTH_INFO));
+
+        bandwidthInfo->DeviceCount = fdoContext->PortConnected ? 1 : 0;
+        bandwidthInfo->TotalBusBandwidth = HIGH_SPEED_BITS_PER_MS;
+        bandwidthInfo->Total32secBandwidth = HIGH_SPEED_BITS_PER_MS * 32;
+
+        usbBandwidth->Header.UsbUserStatusCode = UsbUserSuccess;
+        usbBandwidth->Header.ActualBufferLength = sizeof(USBUSER_BANDWIDTH_INFO_REQUEST);
+        Information = usbBandwidth->Header.ActualBufferLength;
+    }
+    
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE,
+        __FUNCTION__": request completed with status %x size %d\n",
+        Status,
+        Information); 
+
+    WdfRequestCompleteWithInformation(Request, Status, Information);
+
+}
+
+C_ASSERT(XENVUSB_PIPE_TYPES == (UsbdPipeTypeInterrupt + 1));
+
+/**
+ * @brief Process an IOCTL_XENVUSB_GET_TRANSFER_STATISTICS.
+ * ** Must complete the Request **
+ * ** Processed on dispatch side and does not use Request Context **
+ * The caller's previous sample, if any, is the input buffer. The rates are
+ * computed against it so any number of monitors can sample independently.
+ *
+ * @param[in] fdoContext. The context object for the device.
+ * @param[in] Request. The handle to the IO Request.
+ *
+ */
+VOID
+ProcessTransferStatistics(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN WDFREQUEST Request)
+{
+    PXENVUSB_TRANSFER_STATISTICS previous = NULL;
+    PXENVUSB_TRANSFER_STATISTICS statistics = NULL;
+    XENVUSB_TRANSFER_STATISTICS sample;
+    BOOLEAN haveSample = FALSE;
+    ULONG_PTR Information = 0;
+
+    //
+    // the input and output buffers are the same system buffer, take a copy
+    // of the caller's sample first.
+    //
+    if (NT_SUCCESS(WdfRequestRetrieveInputBuffer(Request,
+        sizeof(XENVUSB_TRANSFER_STATISTICS),
+        (PVOID *) &previous,
+        NULL)) &&
+        (previous->Version == XENVUSB_TRANSFER_STATISTICS_VERSION) &&
+        (previous->Size == sizeof(XENVUSB_TRANSFER_STATISTICS)))
+    {
+        sample = *previous;
+        haveSample = TRUE;
+    }
+
+    NTSTATUS Status = WdfRequestRetrieveOutputBuffer(Request,
+        sizeof(XENVUSB_TRANSFER_STATISTICS),
+        (PVOID *) &statistics,
+        NULL);
+
+    if (NT_SUCCESS(Status))
+    {
+        RtlZeroMemory(statistics, sizeof(XENVUSB_TRANSFER_STATISTICS));
+        statistics->Version = XENVUSB_TRANSFER_STATISTICS_VERSION;
+        statistics->Size = sizeof(XENVUSB_TRANSFER_STATISTICS);
+
+        AcquireFdoLock(fdoContext);
+        statistics->Time = KeQueryInterruptTime();
+        statistics->Transfers = fdoContext->totalCompletedTransfers;
+        RtlCopyMemory(statistics->PipeBytes, fdoContext->totalPipeBytes,
+            sizeof(statistics->PipeBytes));
+        if (fdoContext->Xen)
+        {
+            statistics->RequestsOnRing = OnRingBuffer(fdoContext->Xen);
+            statistics->MaxRequestsOnRing = MaxOnRingBuffer(fdoContext->Xen);
+            statistics->RingSize = RingBufferSize(fdoContext->Xen);
+        }
+        ReleaseFdoLock(fdoContext);
+
+        //
+        // a sample from before a restart of the counters is ignored.
+        //
+        if (haveSample &&
+            (statistics->Time > sample.Time) &&
+            (statistics->Transfers >= sample.Transfers))
+        {
+            statistics->Interval = statistics->Time - sample.Time;
+            statistics->TransfersPerSecond =
+                ((statistics->Transfers - sample.Transfers) * 10000000) / statistics->Interval;
+            for (ULONG pipeType = 0; pipeType < XENVUSB_PIPE_TYPES; pipeType++)
+            {
+                if (statistics->PipeBytes[pipeType] >= sample.PipeBytes[pipeType])
+                {
+                    statistics->BytesPerSecond[pipeType] =
+                        ((statistics->PipeBytes[pipeType] - sample.PipeBytes[pipeType]) * 10000000) /
+                        statistics->Interval;
+                }
+            }
+        }
+        Information = sizeof(XENVUSB_TRANSFER_STATISTICS);
+
+        TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_QUEUE,
+            __FUNCTION__": %s %I64d transfers/s on ring %d (max %d of %d)\n",
+            fdoContext->FrontEndPath,
+            statistics->TransfersPerSecond,
+            statistics->RequestsOnRing,
+            statistics->MaxRequestsOnRing,
+            statistics->RingSize);
+    }
+    else
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+            __FUNCTION__": WdfRequestRetrieveOutputBuffer error %x\n",
+            Status);
+    }
+
+    WdfRequestCompleteWithInformation(Request, Status, Information);
+}
+
 /**
  * @brief Process an IOCTL_USB_USER_REQUEST.
  * ** Must guarantee the Request is completed. **
@@ -779,9 +1065,13 @@ ProcessUsbUserRequest(
             break;
         case USBUSER_GET_BANDWIDTH_INFORMATION:
             userRequestString = "USBUSER_GET_BANDWIDTH_INFORMATION";
+            ProcessUsbBandwidthInformation(fdoContext, Request, OutputBufferLength);
+            Request = NULL;
             break;
         case USBUSER_GET_BUS_STATISTICS_0:
             userRequestString = "USBUSER_GET_BUS_STATISTICS_0";
+            ProcessUsbBusStatistics0(fdoContext, Request, OutputBufferLength);
+            Request = NULL;
             break;
         case USBUSER_GET_ROOTHUB_SYMBOLIC_NAME:
             userRequestString = "USBUSER_GET_ROOTHUB_SYMBOLIC_NAME";
@@ -848,6 +1138,28 @@ ProcessUsbUserRequest(
 }
 
 
+/**
+ * @brief IOCTL_XENVUSB_RELOAD_QUIRKS sent above PASSIVE_LEVEL. Reads the
+ * usbflags key and completes the request.
+ *
+ * @param[in] WorkItem a handle to a WDFWORKITEM object.
+ */
+VOID
+ReloadQuirksWorker(
+    IN WDFWORKITEM WorkItem)
+{
+    PUSB_FDO_WORK_ITEM_CONTEXT  context = WorkItemGetContext(WorkItem);
+    WDFREQUEST Request = (WDFREQUEST) context->Params[0];
+
+    NTSTATUS Status = UsbQuirksReload();
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE,
+        __FUNCTION__": %s Request %p status %x\n",
+        context->FdoContext->FrontEndPath,
+        Request,
+        Status);
+    WdfRequestComplete(Request, Status);
+}
+
 /**
  * @brief process IOCTL requests.
  * IOCTLs targeted at the usb controller are processed here.
@@ -913,6 +1225,216 @@ FdoEvtIoDeviceControl(
             Request = NULL;
             break;
 
+        case IOCTL_XENVUSB_RELOAD_QUIRKS:
+            //
+            // registry access, must be at passive level. Every FDO re-applies
+            // its entry at its next URB, see RefreshUsbInfo().
+            //
+            if (KeGetCurrentIrql() == PASSIVE_LEVEL)
+            {
+                Status = UsbQuirksReload();
+                break;
+            }
+            {
+                AcquireFdoLock(fdoContext);
+                WDFWORKITEM worker = NewWorkItem(fdoContext,
+                    ReloadQuirksWorker,
+                    (ULONG_PTR) Request,
+                    0,0,0);
+                ReleaseFdoLock(fdoContext);
+                if (!worker)
+                {
+                    Status = STATUS_INSUFFICIENT_RESOURCES;
+                    break;
+                }
+                WdfWorkItemEnqueue(worker);
+                Request = NULL; // completed by ReloadQuirksWorker.
+            }
+            break;
+
+        case IOCTL_XENVUSB_GET_ENDPOINT_HISTOGRAMS:
+            {
+                PXENVUSB_ENDPOINT_HISTOGRAMS histograms = NULL;
+                Status = WdfRequestRetrieveOutputBuffer(Request,
+                    sizeof(XENVUSB_ENDPOINT_HISTOGRAMS),
+                    (PVOID *) &histograms,
+                    NULL);
+                if (!NT_SUCCESS(Status))
+                {
+                    TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                        __FUNCTION__": WdfRequestRetrieveOutputBuffer error %x\n",
+                        Status);
+                    break;
+                }
+                //
+                // the counters are updated with interlocked operations from the
+                // DPC, a snapshot does not need the device lock.
+                //
+                histograms->Version = XENVUSB_HISTOGRAM_VERSION;
+                histograms->Size = sizeof(XENVUSB_ENDPOINT_HISTOGRAMS);
+                for (ULONG index = 0; index < XENVUSB_HISTOGRAM_ENDPOINTS; index++)
+                {
+                    histograms->Endpoints[index] =
+                        fdoContext->EndpointHistograms[index].Histogram;
+                }
+                WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS,
+                    sizeof(XENVUSB_ENDPOINT_HISTOGRAMS));
+                Request = NULL;
+            }
+            break;
+
+        case IOCTL_XENVUSB_GET_FLIGHT_RECORDER:
+            {
+                PXENVUSB_FLIGHT_RECORDER recorder = NULL;
+                Status = WdfRequestRetrieveOutputBuffer(Request,
+                    sizeof(XENVUSB_FLIGHT_RECORDER),
+                    (PVOID *) &recorder,
+                    NULL);
+                if (!NT_SUCCESS(Status))
+                {
+                    TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                        __FUNCTION__": WdfRequestRetrieveOutputBuffer error %x\n",
+                        Status);
+                    break;
+                }
+                //
+                // the FDO lock keeps DeleteFlightRecorder() and the writers
+                // that hold it (SubmitUrb(), PutOnRing(), XenDpc()) out of the
+                // copy. FdoSubmitIsoOutUrb() records without it, a record it
+                // is writing may be copied with a stale Sequence, see
+                // FlightRecord().
+                //
+                AcquireFdoLock(fdoContext);
+                if (!fdoContext->FlightRecorder)
+                {
+                    ReleaseFdoLock(fdoContext);
+                    Status = STATUS_NOT_SUPPORTED;
+                    break;
+                }
+                RtlCopyMemory(recorder, fdoContext->FlightRecorder,
+                    sizeof(XENVUSB_FLIGHT_RECORDER));
+                ReleaseFdoLock(fdoContext);
+                WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS,
+                    sizeof(XENVUSB_FLIGHT_RECORDER));
+                Request = NULL;
+            }
+            break;
+
+        case IOCTL_XENVUSB_CAPTURE_CONTROL:
+            {
+                PXENVUSB_CAPTURE_CONTROL control = NULL;
+                Status = WdfRequestRetrieveInputBuffer(Request,
+                    sizeof(XENVUSB_CAPTURE_CONTROL),
+                    (PVOID *) &control,
+                    NULL);
+                if (!NT_SUCCESS(Status))
+                {
+                    TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                        __FUNCTION__": WdfRequestRetrieveInputBuffer error %x\n",
+                        Status);
+                    break;
+                }
+                Status = fdoContext->Xen ?
+                    XenCaptureControl(fdoContext->Xen,
+                        control->Enable ? TRUE : FALSE,
+                        control->PayloadLimit) :
+                    STATUS_DEVICE_NOT_READY;
+            }
+            break;
+
+        case IOCTL_XENVUSB_READ_CAPTURE:
+            {
+                PXENVUSB_CAPTURE_HEADER header = NULL;
+                size_t length = 0;
+                if (!fdoContext->Xen)
+                {
+                    Status = STATUS_DEVICE_NOT_READY;
+                    break;
+                }
+                Status = WdfRequestRetrieveOutputBuffer(Request,
+                    sizeof(XENVUSB_CAPTURE_HEADER),
+                    (PVOID *) &header,
+                    &length);
+                if (!NT_SUCCESS(Status))
+                {
+                    TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                        __FUNCTION__": WdfRequestRetrieveOutputBuffer error %x\n",
+                        Status);
+                    break;
+                }
+                ULONG information = XenCaptureRead(fdoContext->Xen,
+                    header,
+                    (ULONG) min(length, MAXULONG));
+                WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS,
+                    information);
+                Request = NULL;
+            }
+            break;
+
+        case IOCTL_XENVUSB_PATH_TIMING_CONTROL:
+            {
+                PXENVUSB_PATH_TIMING_CONTROL control = NULL;
+                Status = WdfRequestRetrieveInputBuffer(Request,
+                    sizeof(XENVUSB_PATH_TIMING_CONTROL),
+                    (PVOID *) &control,
+                    NULL);
+                if (!NT_SUCCESS(Status))
+                {
+                    TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                        __FUNCTION__": WdfRequestRetrieveInputBuffer error %x\n",
+                        Status);
+                    break;
+                }
+                AcquireFdoLock(fdoContext);
+                if (control->Enable && !fdoContext->PathTimingEnabled)
+                {
+                    RtlZeroMemory(fdoContext->PathTimings, sizeof(fdoContext->PathTimings));
+                }
+                fdoContext->PathTimingEnabled = control->Enable ? TRUE : FALSE;
+                ReleaseFdoLock(fdoContext);
+                TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE,
+                    __FUNCTION__": %s path timing %s\n",
+                    fdoContext->FrontEndPath,
+                    control->Enable ? "enabled" : "disabled");
+            }
+            break;
+
+        case IOCTL_XENVUSB_GET_PATH_TIMINGS:
+            {
+                PXENVUSB_PATH_TIMINGS timings = NULL;
+                Status = WdfRequestRetrieveOutputBuffer(Request,
+                    sizeof(XENVUSB_PATH_TIMINGS),
+                    (PVOID *) &timings,
+                    NULL);
+                if (!NT_SUCCESS(Status))
+                {
+                    TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                        __FUNCTION__": WdfRequestRetrieveOutputBuffer error %x\n",
+                        Status);
+                    break;
+                }
+                LARGE_INTEGER frequency;
+                KeQueryPerformanceCounter(&frequency);
+                timings->Version = XENVUSB_PATH_TIMING_VERSION;
+                timings->Size = sizeof(XENVUSB_PATH_TIMINGS);
+                timings->Frequency = frequency.QuadPart;
+                timings->Reserved = 0;
+                AcquireFdoLock(fdoContext);
+                timings->Enabled = fdoContext->PathTimingEnabled;
+                RtlCopyMemory(timings->Paths, fdoContext->PathTimings,
+                    sizeof(timings->Paths));
+                ReleaseFdoLock(fdoContext);
+                WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS,
+                    sizeof(XENVUSB_PATH_TIMINGS));
+                Request = NULL;
+            }
+            break;
+
+        case IOCTL_XENVUSB_GET_TRANSFER_STATISTICS:
+            ProcessTransferStatistics(fdoContext, Request);
+            Request = NULL;
+            break;
+
         case IOCTL_USB_HCD_GET_STATS_1: //255
         case IOCTL_USB_HCD_GET_STATS_2: // 266
         case IOCTL_USB_HCD_DISABLE_PORT: //268
@@ -961,7 +1483,6 @@ UrbEvtIoInternalDeviceControl(
     _In_ size_t InputBufferLength,
     _In_ ULONG IoControlCode)
 {
-    KIRQL dispatchIrql = KeGetCurrentIrql();
     NTSTATUS Status = STATUS_UNSUCCESSFUL;
 
     UNREFERENCED_PARAMETER(OutputBufferLength);
@@ -1045,21 +1566,16 @@ UrbEvtIoInternalDeviceControl(
                     Request = NULL; // consumed!
                     LEAVE;
                 }
-
-                if ((Urb->UrbHeader.Function == URB_FUNCTION_SELECT_INTERFACE) &&
-                    (dispatchIrql >= DISPATCH_LEVEL))
+                if ((fdoContext->InterfaceSwitching || fdoContext->InterfaceSwitchHeld) &&
+                    WaitsForInterfaceSwitch(fdoContext, Urb))
                 {
-                    XXX_TODO("SELECT_INTERFACE at >= DISPATCH_LEVEL");
-                    //
-                    // This queue has to be stopped. This request
-                    // has to be requeued to a passive level queue.
-                    // That queue has to submit the select interface request
-                    // and then the completion of that request has to 
-                    // restart this queue.
-                    //
+                    HoldForInterfaceSwitch(fdoContext, Request);
+                    Request = NULL; // consumed!
                     LEAVE;
                 }
+                LONGLONG timingStart = PathTimingStart(fdoContext);
                 SubmitUrb(fdoContext, Request, Urb);
+                PathTimingStop(fdoContext, XenvusbPathSubmitUrb, timingStart);
                 Request = NULL; // consumed!
             }
             break;
@@ -1336,46 +1852,22 @@ RequeueRequest(
     return;
 }
 
-/**
- * @brief PASSIVE level worker routine to invoke DrainRequestQueue().
- * This is only used for the edge case where we had to requeue a URB_FUNCTION_SELECT_INTERFACE
- * operation.
- *
- * @param[in] WorkItem a handle to a WDFWORKITEM object for this worker routine.
- *
- */
-void
-PassiveDrain(
-    IN WDFWORKITEM WorkItem)
-{
-    PUSB_FDO_WORK_ITEM_CONTEXT  context = WorkItemGetContext(WorkItem);
-    
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE,
-        __FUNCTION__":Device %p\n",
-        context->FdoContext->WdfDevice);
-    //
-    // run the queue
-    //
-    AcquireFdoLock(context->FdoContext);
-    DrainRequestQueue(context->FdoContext, TRUE);
-    ReleaseFdoLock(context->FdoContext);
-}
-
 /**
  * @brief Drain the RequestQueue and restart the default queue iff drained.
  * *Must be called with the device lock held*
  * *Will release and re-acquire the device lock.*
  * @todo wouldn't it be cleaner to not call this with the lock held?
  *
+ * All URBs, including URB_FUNCTION_SELECT_INTERFACE, can be submitted at DISPATCH_LEVEL
+ * so the queue is drained in place from the DPC.
+ *
  * @param[in] fdoContext A pointer to the USB_FDO_CONTEXT for the virtual usb controller device.
- * @param[in] FromPassiveLevel TRUE if invoked from PASSIVE_LEVEL i.e. from PassiveDrain() else FALSE.
  *
  */
 _Requires_lock_held_(fdoContext->WdfDevice)
 VOID
 DrainRequestQueue(
-    IN PUSB_FDO_CONTEXT fdoContext,
-    IN BOOLEAN FromPassiveLevel)
+    IN PUSB_FDO_CONTEXT fdoContext)
 {
     BOOLEAN queueEmpty = FALSE;
     BOOLEAN moreToDo = TRUE;
@@ -1422,40 +1914,14 @@ DrainRequestQueue(
 
                     PURB Urb = (PURB) URB_FROM_REQUEST(Request);
 
-                    if (!FromPassiveLevel &&
-                        Urb->UrbHeader.Function == URB_FUNCTION_SELECT_INTERFACE)
-                    {
-                        TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_QUEUE,
-                            __FUNCTION__ ": Device %p Request %p URB_FUNCTION_SELECT_INTERFACE processing from DPC\n",
-                            fdoContext->WdfDevice,
-                            Request);
-
-                        WDFWORKITEM worker = NewWorkItem(fdoContext,
-                            PassiveDrain,
-                            0,0,0,0);
-                        if (worker)
-                        {
-                            RequeueThisRequest = TRUE;
-                            WdfWorkItemEnqueue(worker);
-                        }
-                        else
-                        {
-                            TraceEvents(TRACE_LEVEL_WARNING, TRACE_QUEUE,
-                                __FUNCTION__ ": Device %p Request %p URB_FUNCTION_SELECT_INTERFACE no workitem available\n",
-                                fdoContext->WdfDevice,
-                                Request);
-                            Status = STATUS_INSUFFICIENT_RESOURCES;
-                        }
-                    }
-                    else
+                    fdoContext->RequeuedCount = 0; // test if we requeued a request while processing it.
+                    LONGLONG timingStart = PathTimingStart(fdoContext);
+                    SubmitUrb(fdoContext, Request, Urb);
+                    PathTimingStop(fdoContext, XenvusbPathSubmitUrb, timingStart);
+                    Request = NULL; // Consumed.
+                    if (fdoContext->RequeuedCount)
                     {
-                        fdoContext->RequeuedCount = 0; // test if we requeued a request while processing it.
-                        SubmitUrb(fdoContext, Request, Urb);
-                        Request = NULL; // Consumed.
-                        if (fdoContext->RequeuedCount)
-                        {
-                            moreToDo = FALSE;
-                        }
+                        moreToDo = FALSE;
                     }
                 }
                 break;
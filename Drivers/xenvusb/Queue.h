@@ -31,8 +31,7 @@ FdoQueueInitialize(
 _Requires_lock_held_(fdoContext->WdfDevice)
 VOID
 DrainRequestQueue(
-    IN PUSB_FDO_CONTEXT fdoContext,
-    BOOLEAN FromPassiveLevel);
+    IN PUSB_FDO_CONTEXT fdoContext);
 
 _Requires_lock_held_(fdoContext->WdfDevice)
 VOID
@@ -376,6 +376,10 @@ CreateRootHubPdoWithDeviceInit(
         hubContext->HubConfig.InterfaceArray[0] = &hubContext->HubConfig.InterfaceDescriptor;
         hubContext->HubConfig.ConfigInfo.m_interfaceDescriptors = 
             hubContext->HubConfig.InterfaceArray;
+        hubContext->HubConfig.InterfacePipes[0].firstPipe = 0;
+        hubContext->HubConfig.InterfacePipes[0].numPipes = 1;
+        hubContext->HubConfig.ConfigInfo.m_interfacePipes =
+            hubContext->HubConfig.InterfacePipes;
         hubContext->HubConfig.ConfigInfo.m_pipeDescriptors = 
             &hubContext->HubConfig.PipeDescriptor;
         hubContext->HubConfig.ConfigInfo.m_numInterfaces = 1;
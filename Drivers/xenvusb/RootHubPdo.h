@@ -41,6 +41,7 @@ struct ROOT_HUB_CONFIG
     USB_CONFIGURATION_DESCRIPTOR ConfigurationDescriptor;
     USB_INTERFACE_DESCRIPTOR     InterfaceDescriptor;
     PUSB_INTERFACE_DESCRIPTOR    InterfaceArray[1];
+    INTERFACE_PIPES              InterfacePipes[1];
     USB_ENDPOINT_DESCRIPTOR      EndpointDescriptor;
     PIPE_DESCRIPTOR              PipeDescriptor;
     USB_HUB_DESCRIPTOR           HubDescriptor;
@@ -24,15 +24,51 @@
 #include "Trace.h"
 
 /* TODO the debug level and flag are not really controlling logging
- * behavior outside of the xenvusb device itself. And clearly the routine
- * for getting debug settings is a nop ATM.
+ * behavior outside of the xenvusb device itself.
  */
 ULONG gDebugLevel;
 ULONG gDebugFlag;
 PCHAR gDriverName = "xenvusb";
 
+/**
+ * @brief override the default debug level and flags from the service key.
+ *
+ *   DebugLevel REG_DWORD  lowest XEN_TRACE_LEVEL traced, e.g. 1 for verbose.
+ *   DebugFlag  REG_DWORD  TRACE_DRIVER, TRACE_DEVICE ... mask.
+ *
+ * Verbose messages are only present if compiled in, see XENVUSB_TRACE_VERBOSE.
+ *
+ * @param[in] RegistryPath registry path to services key for driver.
+ */
 void
 GetDebugSettings(IN PUNICODE_STRING RegistryPath)
 {
-	RegistryPath;
+	ULONG debugLevel = gDebugLevel;
+	ULONG debugFlag = gDebugFlag;
+	RTL_QUERY_REGISTRY_TABLE QueryTable[3];
+	RtlZeroMemory(QueryTable, sizeof(QueryTable));
+	QueryTable[0].Flags = RTL_QUERY_REGISTRY_DIRECT;
+	QueryTable[0].Name = L"DebugLevel";
+	QueryTable[0].EntryContext = &debugLevel;
+	QueryTable[0].DefaultType = REG_DWORD;
+	QueryTable[0].DefaultData = &debugLevel;
+	QueryTable[0].DefaultLength = sizeof(debugLevel);
+	QueryTable[1].Flags = RTL_QUERY_REGISTRY_DIRECT;
+	QueryTable[1].Name = L"DebugFlag";
+	QueryTable[1].EntryContext = &debugFlag;
+	QueryTable[1].DefaultType = REG_DWORD;
+	QueryTable[1].DefaultData = &debugFlag;
+	QueryTable[1].DefaultLength = sizeof(debugFlag);
+
+	NTSTATUS Status = RtlQueryRegistryValues(
+		RTL_REGISTRY_ABSOLUTE,
+		RegistryPath->Buffer,
+		QueryTable,
+		NULL,
+		NULL);
+	if (NT_SUCCESS(Status))
+	{
+		gDebugLevel = debugLevel;
+		gDebugFlag = debugFlag;
+	}
 }
\ No newline at end of file
@@ -63,7 +63,35 @@ static inline void __XenTrace(XEN_TRACE_LEVEL level, ULONG flags, PCSTR fmt, ...
 	va_end(args);
 }
 
+//
+// Verbose and debug messages are issued per ring request (PutRequest,
+// GetResponse, XenDpc, AllocateGrefs). Free builds compile them out, define
+// XENVUSB_TRACE_VERBOSE=1 to keep them.
+//
+#ifndef XENVUSB_TRACE_VERBOSE
+#if DBG
+#define XENVUSB_TRACE_VERBOSE 1
+#else
+#define XENVUSB_TRACE_VERBOSE 0
+#endif
+#endif
+
+EXTERN_C ULONG gDebugLevel;
+EXTERN_C ULONG gDebugFlag;
+
+//
+// Warnings and worse are always traced. Anything else must be at or above
+// gDebugLevel for a flag in gDebugFlag. Checked before the arguments are
+// evaluated or the va_list is built.
+//
+#define TraceEnabled(_lvl_, _flg_) \
+	(((XEN_TRACE_LEVEL)(_lvl_) > XenTraceLevelVerbose || XENVUSB_TRACE_VERBOSE) && \
+	 (((XEN_TRACE_LEVEL)(_lvl_) >= XenTraceLevelWarning) || \
+	  (((ULONG)(_lvl_) >= gDebugLevel) && (gDebugFlag & (_flg_)))))
+
 #define TraceEvents(_lvl_, _flg_, format, ...) \
+	__pragma(warning(suppress:4127)) \
+	if (!TraceEnabled(_lvl_, _flg_)) {} else \
 	__XenTrace((XEN_TRACE_LEVEL)_lvl_, _flg_, format, __VA_ARGS__)
 
 #define TRACE_DRIVER 0x01
@@ -79,8 +107,6 @@ static inline void __XenTrace(XEN_TRACE_LEVEL level, ULONG flags, PCSTR fmt, ...
 #define TRACE_LEVEL_INFORMATION XenTraceLevelInfo 
 #define TRACE_LEVEL_VERBOSE     XenTraceLevelVerbose 
 
-EXTERN_C ULONG gDebugLevel;
-EXTERN_C ULONG gDebugFlag;
 EXTERN_C PCHAR gDriverName;
 
 void
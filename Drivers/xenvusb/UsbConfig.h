@@ -67,6 +67,63 @@ NTSTATUS
 ResetDevice(
     IN PUSB_FDO_CONTEXT fdoContext);
 
+VOID
+FrameClockInitialize(
+    IN PUSB_FDO_CONTEXT fdoContext);
+
+ULONG
+FrameClockCurrentFrame(
+    IN PUSB_FDO_CONTEXT fdoContext);
+
+VOID
+FrameClockObserve(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN ULONG Frame);
+
+NTSTATUS
+SyncFrameClock(
+    IN PUSB_FDO_CONTEXT fdoContext);
+
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+FrameClockSyncComplete(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN BOOLEAN Success,
+    IN ULONG BackendFrame);
+
+_Requires_lock_held_(fdoContext->WdfDevice)
+BOOLEAN
+DescriptorCacheLookup(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN UCHAR Recipient,
+    IN PURB Urb);
+
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+DescriptorCacheInsert(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN UCHAR Recipient,
+    IN UCHAR DescriptorType,
+    IN UCHAR Index,
+    IN USHORT LanguageId,
+    IN PVOID Descriptor,
+    IN ULONG Length);
+
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+DescriptorCacheCapture(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN UCHAR Recipient,
+    IN PURB Urb,
+    IN PVOID Buffer,
+    IN ULONG RequestedLength,
+    IN ULONG BytesTransferred);
+
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+DescriptorCacheFlush(
+    IN PUSB_FDO_CONTEXT fdoContext);
+
 BOOLEAN
 GetUsbInfo(
     IN PUSB_FDO_CONTEXT FdoContext);
@@ -76,6 +133,11 @@ SetUsbInfo(
     IN PUSB_FDO_CONTEXT FdoContext,
     IN BOOLEAN enable);
 
+_Requires_lock_held_(FdoContext->WdfDevice)
+VOID
+RefreshUsbInfo(
+    IN PUSB_FDO_CONTEXT FdoContext);
+
 PUSB_ENDPOINT_DESCRIPTOR
 PipeHandleToEndpointAddressDescriptor(
     IN PUSB_FDO_CONTEXT fdoContext,
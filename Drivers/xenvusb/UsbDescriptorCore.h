@@ -0,0 +1,376 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file UsbDescriptorCore.h platform neutral checks for the descriptors a
+/// device returns: configuration descriptors and the Microsoft OS descriptors.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#pragma once
+
+//
+/// Nothing in this file calls WDF or the NT kernel. It depends only on the
+/// usbspec.h descriptor definitions, include it after usb.h.
+/// host/UsbifHost.h supplies them for a host build. Everything read from a
+/// descriptor is device controlled, nothing here reads past the length the
+/// caller says is valid.
+//
+
+//
+// Microsoft OS descriptors, see usb.h. OS_STRING is in usbspec.h.
+//
+struct OS_FEATURE_HEADER
+{
+    ULONG  dwLength;
+    USHORT bcdVersion; // 0x0100
+    USHORT wIndex;     // 0x04
+    UCHAR  bCount;
+    UCHAR  reserved[7];
+};
+
+struct OS_COMPATID_FUNCTION
+{
+    UCHAR bFirstInterfaceNumber;
+    UCHAR reserved;
+    UCHAR compatibleID[8];
+    UCHAR subCompatibleID[8];
+    UCHAR reserved2[6];
+};
+
+struct OS_COMPAT_ID
+{
+    OS_FEATURE_HEADER header;
+    OS_COMPATID_FUNCTION functions[1];
+};
+typedef OS_COMPAT_ID *POS_COMPAT_ID;
+
+enum USB_CONFIG_CHECK
+{
+    UsbConfigValid = 0,
+    UsbConfigNoInterfaces,
+    UsbConfigBadLength,        //!< a descriptor with bLength less than 2.
+    UsbConfigUnexpectedConfig, //!< a configuration descriptor after the first.
+    UsbConfigShortInterface,   //!< an interface descriptor shorter than its struct.
+    UsbConfigShortEndpoint,    //!< an endpoint descriptor shorter than its struct.
+    UsbConfigOrphanEndpoint,   //!< an endpoint descriptor before any interface.
+    UsbConfigTooMany           //!< more descriptors than the caller has room for.
+};
+
+//
+/// where UsbConfigCount() or UsbConfigWalk() stopped.
+//
+struct USB_CONFIG_WALK
+{
+    ULONG Interfaces; //!< interface descriptors found.
+    ULONG Endpoints;  //!< endpoint descriptors found.
+    ULONG EnumIndex;  //!< the descriptor the walk stopped at, 1 is the first after the config.
+    ULONG Remaining;  //!< bytes of a truncated trailing descriptor, 0 if none.
+    UCHAR Length;     //!< bLength of the descriptor the walk stopped at.
+};
+
+//
+/// the configuration descriptor itself. The caller must have trimmed
+/// wTotalLength to the bytes received, as GetCompleteConfigDescriptor() does.
+//
+inline bool
+UsbConfigCheckHeader(
+    const USB_CONFIGURATION_DESCRIPTOR * Config)
+{
+    return (Config->bLength == sizeof(USB_CONFIGURATION_DESCRIPTOR)) &&
+        (Config->bDescriptorType == USB_CONFIGURATION_DESCRIPTOR_TYPE) &&
+        (Config->wTotalLength > sizeof(USB_CONFIGURATION_DESCRIPTOR));
+}
+
+//
+/// the next descriptor header inside wTotalLength, NULL at the end or at
+/// a truncated descriptor, when Walk->Remaining is set.
+//
+inline USB_COMMON_DESCRIPTOR *
+UsbConfigNext(
+    UCHAR * Current,
+    UCHAR * End,
+    USB_CONFIG_WALK * Walk)
+{
+    if (Current >= End)
+    {
+        return NULL;
+    }
+    USB_COMMON_DESCRIPTOR * common = (USB_COMMON_DESCRIPTOR *) Current;
+    ULONG remaining = (ULONG) (End - Current);
+    if ((remaining < sizeof(USB_COMMON_DESCRIPTOR)) ||
+        (common->bLength > remaining))
+    {
+        Walk->Remaining = remaining;
+        return NULL;
+    }
+    Walk->Length = common->bLength;
+    return common;
+}
+
+inline void
+UsbConfigWalkInit(
+    USB_CONFIG_WALK * Walk)
+{
+    Walk->Interfaces = 0;
+    Walk->Endpoints = 0;
+    Walk->EnumIndex = 1;
+    Walk->Remaining = 0;
+    Walk->Length = 0;
+}
+
+//
+/// count the interface and endpoint descriptors, reading only the headers.
+/// Stops where UsbConfigWalk() would stop at the latest, so the counts are
+/// enough room for the walk.
+//
+inline void
+UsbConfigCount(
+    USB_CONFIGURATION_DESCRIPTOR * Config,
+    USB_CONFIG_WALK * Count)
+{
+    UCHAR * end = (UCHAR *) Config + Config->wTotalLength;
+    UCHAR * current = (UCHAR *) Config + Config->bLength;
+    USB_COMMON_DESCRIPTOR * common;
+
+    UsbConfigWalkInit(Count);
+    while ((common = UsbConfigNext(current, end, Count)) != NULL)
+    {
+        if (common->bLength < sizeof(USB_COMMON_DESCRIPTOR))
+        {
+            break;
+        }
+        Count->Interfaces += (common->bDescriptorType == USB_INTERFACE_DESCRIPTOR_TYPE);
+        Count->Endpoints += (common->bDescriptorType == USB_ENDPOINT_DESCRIPTOR_TYPE);
+        current += common->bLength;
+        Count->EnumIndex++;
+    }
+}
+
+//
+/// Descriptor as a T if it is long enough to be one, else NULL. For the
+/// class specific descriptors a visitor looks into.
+//
+template <class T>
+inline T *
+UsbDescriptorAs(
+    USB_COMMON_DESCRIPTOR * Descriptor)
+{
+    return (Descriptor->bLength >= sizeof(T)) ? (T *) Descriptor : NULL;
+}
+
+//
+/// Validate each descriptor header against wTotalLength and hand the
+/// descriptors to Visit:
+///
+///     void Interface(USB_INTERFACE_DESCRIPTOR *, ULONG InterfaceIndex, ULONG FirstEndpoint);
+///     void Endpoint(USB_ENDPOINT_DESCRIPTOR *, ULONG InterfaceIndex, ULONG EndpointIndex);
+///     void Other(USB_COMMON_DESCRIPTOR *);
+///
+/// Interface and endpoint descriptors are at least their struct size and
+/// every endpoint follows an interface. At most MaxInterfaces interfaces and
+/// MaxEndpoints endpoints are visited. A truncated trailing descriptor ends
+/// the walk without an error, Walk->Remaining says so.
+//
+template <class Visitor>
+inline USB_CONFIG_CHECK
+UsbConfigWalk(
+    USB_CONFIGURATION_DESCRIPTOR * Config,
+    ULONG MaxInterfaces,
+    ULONG MaxEndpoints,
+    Visitor & Visit,
+    USB_CONFIG_WALK * Walk)
+{
+    UCHAR * end = (UCHAR *) Config + Config->wTotalLength;
+    UCHAR * current = (UCHAR *) Config + Config->bLength;
+    USB_COMMON_DESCRIPTOR * common;
+
+    UsbConfigWalkInit(Walk);
+    while ((common = UsbConfigNext(current, end, Walk)) != NULL)
+    {
+        if (common->bLength < sizeof(USB_COMMON_DESCRIPTOR))
+        {
+            return UsbConfigBadLength;
+        }
+        switch (common->bDescriptorType)
+        {
+        case USB_CONFIGURATION_DESCRIPTOR_TYPE:
+            return UsbConfigUnexpectedConfig;
+
+        case USB_INTERFACE_DESCRIPTOR_TYPE:
+            if (common->bLength < sizeof(USB_INTERFACE_DESCRIPTOR))
+            {
+                return UsbConfigShortInterface;
+            }
+            if (Walk->Interfaces >= MaxInterfaces)
+            {
+                return UsbConfigTooMany;
+            }
+            Visit.Interface((USB_INTERFACE_DESCRIPTOR *) common,
+                Walk->Interfaces,
+                Walk->Endpoints);
+            Walk->Interfaces++;
+            break;
+
+        case USB_ENDPOINT_DESCRIPTOR_TYPE:
+            if (common->bLength < sizeof(USB_ENDPOINT_DESCRIPTOR))
+            {
+                return UsbConfigShortEndpoint;
+            }
+            if (Walk->Interfaces == 0)
+            {
+                return UsbConfigOrphanEndpoint;
+            }
+            if (Walk->Endpoints >= MaxEndpoints)
+            {
+                return UsbConfigTooMany;
+            }
+            Visit.Endpoint((USB_ENDPOINT_DESCRIPTOR *) common,
+                Walk->Interfaces - 1,
+                Walk->Endpoints);
+            Walk->Endpoints++;
+            break;
+
+        default:
+            Visit.Other(common);
+            break;
+        }
+        current += common->bLength;
+        Walk->EnumIndex++;
+    }
+    return Walk->Interfaces ? UsbConfigValid : UsbConfigNoInterfaces;
+}
+
+enum USB_OS_DESCRIPTOR_CHECK
+{
+    UsbOsDescriptorValid = 0,
+    UsbOsDescriptorBadLength,      //!< OS string bLength is not 0x12.
+    UsbOsDescriptorBadType,        //!< OS string is not a string descriptor.
+    UsbOsDescriptorBadSignature,   //!< OS string is not "MSFT100".
+    UsbOsDescriptorShort,          //!< fewer bytes received than needed.
+    UsbOsDescriptorTooBig,         //!< dwLength over the caller's limit.
+    UsbOsDescriptorBadVersion,
+    UsbOsDescriptorBadIndex,
+    UsbOsDescriptorNoFunctions,
+    UsbOsDescriptorLengthMismatch  //!< dwLength is not the header and bCount functions.
+};
+
+//
+/// the string at OS_STRING_DESCRIPTOR_INDEX. The caller's buffer is at
+/// least sizeof(OS_STRING).
+//
+inline USB_OS_DESCRIPTOR_CHECK
+UsbOsStringCheck(
+    const OS_STRING * String)
+{
+    //
+    // MS_OS_STRING_SIGNATURE, compared a WCHAR at a time so that it does not
+    // depend on the size of wchar_t.
+    //
+    static const USHORT signature[] = { 'M', 'S', 'F', 'T', '1', '0', '0' };
+
+    if (String->bLength != sizeof(OS_STRING))
+    {
+        return UsbOsDescriptorBadLength;
+    }
+    if (String->bDescriptorType != USB_STRING_DESCRIPTOR_TYPE)
+    {
+        return UsbOsDescriptorBadType;
+    }
+    for (ULONG index = 0; index < sizeof(signature) / sizeof(signature[0]); index++)
+    {
+        if ((USHORT) String->MicrosoftString[index] != signature[index])
+        {
+            return UsbOsDescriptorBadSignature;
+        }
+    }
+    return UsbOsDescriptorValid;
+}
+
+//
+/// the header of the extended compat ID descriptor, Received bytes of it
+/// were returned. Length is the size of the whole descriptor.
+//
+inline USB_OS_DESCRIPTOR_CHECK
+UsbOsFeatureHeaderCheck(
+    const OS_FEATURE_HEADER * Header,
+    ULONG Received,
+    ULONG MaxLength,
+    USHORT * Length)
+{
+    if (Received < sizeof(OS_FEATURE_HEADER))
+    {
+        return UsbOsDescriptorShort;
+    }
+    if (Header->dwLength > MaxLength)
+    {
+        return UsbOsDescriptorTooBig;
+    }
+    if (Header->bcdVersion != 0x100)
+    {
+        return UsbOsDescriptorBadVersion;
+    }
+    if (Header->wIndex != 4)
+    {
+        return UsbOsDescriptorBadIndex;
+    }
+    if (Header->bCount == 0)
+    {
+        return UsbOsDescriptorNoFunctions;
+    }
+    *Length = (Header->bCount * (USHORT) sizeof(OS_COMPATID_FUNCTION)) +
+        (USHORT) sizeof(OS_FEATURE_HEADER);
+    if (*Length != Header->dwLength)
+    {
+        return UsbOsDescriptorLengthMismatch;
+    }
+    return UsbOsDescriptorValid;
+}
+
+//
+/// the whole compat ID descriptor, Length from UsbOsFeatureHeaderCheck().
+/// The device may return a different header the second time, bCount
+/// is checked again so that every function it counts is inside Length.
+//
+inline USB_OS_DESCRIPTOR_CHECK
+UsbOsCompatIdCheck(
+    const OS_COMPAT_ID * CompatIds,
+    ULONG Received,
+    USHORT Length)
+{
+    if (Received != Length)
+    {
+        return UsbOsDescriptorShort;
+    }
+    if (CompatIds->header.bcdVersion != 0x100)
+    {
+        return UsbOsDescriptorBadVersion;
+    }
+    if (CompatIds->header.wIndex != 4)
+    {
+        return UsbOsDescriptorBadIndex;
+    }
+    if ((CompatIds->header.dwLength != Length) ||
+        ((CompatIds->header.bCount * sizeof(OS_COMPATID_FUNCTION)) +
+            sizeof(OS_FEATURE_HEADER) != Length))
+    {
+        return UsbOsDescriptorLengthMismatch;
+    }
+    return UsbOsDescriptorValid;
+}
@@ -24,6 +24,8 @@
 //
 #include "driver.h"
 #include "RootHubPdo.h"
+#include "UsbConfig.h"
+#include "UsbRequest.h"
 #include <hubbusif.h>
 #include <wdmguid.h>
 #include <HubFpIf.h>
@@ -125,7 +127,8 @@ Routine Description:
     
 Arguments:
 
-NOTE: unimplemented
+NOTE: the frame number comes from the frame clock model,
+see SyncFrameClock().
 
 */
 NTSTATUS
@@ -142,8 +145,7 @@ FdoQueryBusTime(
 
   NTSTATUS Status = STATUS_SUCCESS;
 
-  fdoContext->ScratchPad.FrameNumber++;
-  *CurrentUsbFrame = fdoContext->ScratchPad.FrameNumber;
+  *CurrentUsbFrame = FrameClockCurrentFrame(fdoContext);
 
   TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_DEVICE,
         __FUNCTION__": Context %p, CurrentUsbFrame %x\n",
@@ -159,29 +161,89 @@ Routine Description:
     to submit a request without going thru IoCallDriver or allocating 
     an Irp.  
 
-    Additionally the request is scheduled while at high IRQL. The driver
+    Additionally the request is scheduled while at raised IRQL. The driver
     forfeits any packet level error information when calling this function.
 
-    IRQL = ANY
-    
 Arguments:
 
     BusContext - Handle returned from get_bus_interface
 
-    Urb - 
+    Urb - an URB_FUNCTION_ISOCH_TRANSFER for an isoch OUT pipe with
+    at most ISO_FAST_MAX_PACKETS packets.
 
-    NOTE: unimplemented
+    NOTE: IRQL <= DISPATCH_LEVEL. The Urb is handed to the DPC on a
+    preallocated slot without taking the FDO lock, see DrainIsoFastPath().
+    Only a submission that races with an unplug takes the lock.
+    The caller owns the Urb again when Urb->UrbHeader.Status is no longer
+    USBD_STATUS_PENDING. STATUS_INSUFFICIENT_RESOURCES if all
+    ISO_FAST_SLOTS are in use.
 */
 NTSTATUS
 FdoSubmitIsoOutUrb(
     IN PVOID Context,
-    IN PURB )
+    IN PURB Urb)
 {
+    PUSB_FDO_CONTEXT fdoContext = (PUSB_FDO_CONTEXT) Context;
+    PISO_FAST_PATH fastPath = fdoContext->IsoFastPath;
+
     TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_DEVICE,
-        __FUNCTION__": Context %p\n",
-        Context);
+        __FUNCTION__": Context %p Urb %p\n",
+        Context,
+        Urb);
 
-    return STATUS_UNSUCCESSFUL;
+    if (!fastPath)
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if ((Urb->UrbHeader.Function != URB_FUNCTION_ISOCH_TRANSFER) ||
+        (Urb->UrbIsochronousTransfer.NumberOfPackets == 0) ||
+        (Urb->UrbIsochronousTransfer.NumberOfPackets > MaxIsoPackets(fdoContext->Xen)) ||
+        (Urb->UrbIsochronousTransfer.NumberOfPackets > ISO_FAST_MAX_PACKETS) ||
+        (Urb->UrbHeader.Length < GET_ISO_URB_SIZE(Urb->UrbIsochronousTransfer.NumberOfPackets)))
+    {
+        Urb->UrbHeader.Status = USBD_STATUS_INVALID_PARAMETER;
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (fdoContext->DeviceUnplugged)
+    {
+        Urb->UrbHeader.Status = USBD_STATUS_DEVICE_GONE;
+        return STATUS_DEVICE_DOES_NOT_EXIST;
+    }
+
+    PISO_FAST_SLOT slot = (PISO_FAST_SLOT) InterlockedPopEntrySList(&fastPath->FreeList);
+    if (!slot)
+    {
+        InterlockedIncrement64(&fastPath->Busy);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    slot->Urb = Urb;
+    slot->SubmitTime = KeQueryInterruptTime();
+    Urb->UrbHeader.Status = USBD_STATUS_PENDING;
+    FlightRecord(fdoContext, XenvusbFlightSubmitUrb, XENVUSB_FLIGHT_NO_SHADOW,
+        0, UsbdPipeTypeIsochronous, Urb->UrbHeader.Function,
+        Urb->UrbIsochronousTransfer.TransferBufferLength, 0,
+        Urb->UrbIsochronousTransfer.StartFrame);
+
+    InterlockedPushEntrySList(&fastPath->PendingList, &slot->Link);
+    InterlockedIncrement64(&fastPath->Submitted);
+    if (fdoContext->DeviceUnplugged)
+    {
+        //
+        // FdoUnplugDevice() sets DeviceUnplugged before it drains the
+        // PendingList. If it was set after the check above the drain may have
+        // missed this slot and the DPC is gone, so drain again. The slots
+        // left are completed with USBD_STATUS_DEVICE_GONE.
+        //
+        AcquireFdoLock(fdoContext);
+        DrainIsoFastPath(fdoContext);
+        ReleaseFdoLock(fdoContext);
+        return STATUS_SUCCESS;
+    }
+    XenScheduleDPC(fdoContext->Xen);
+
+    return STATUS_SUCCESS;
 }
 
 /* 
@@ -2065,6 +2127,44 @@ typedef struct _IRP_WORK_ITEM
     BOOLEAN Flag;
 } IRP_WORK_ITEM, *PIRP_WORK_ITEM;
 
+//
+/// IRP_WORK_ITEM and the IO_WORKITEM it points to are allocated together
+/// from a driver wide lookaside list. RootHubIfFpDeferIrpProcessing() has
+/// no context of ours to keep a per device list in.
+//
+#define IRP_WORK_ITEM_HEADER_SIZE ALIGN_UP_BY(sizeof(IRP_WORK_ITEM), MEMORY_ALLOCATION_ALIGNMENT)
+
+static NPAGED_LOOKASIDE_LIST IrpWorkItemLookaside;
+static BOOLEAN IrpWorkItemLookasideInitialized = FALSE;
+
+VOID
+IrpWorkItemInitialize()
+{
+    ExInitializeNPagedLookasideList(&IrpWorkItemLookaside,
+        NULL,
+        NULL,
+        0,
+        IRP_WORK_ITEM_HEADER_SIZE + IoSizeofWorkItem(),
+        XVUH,
+        0);
+    IrpWorkItemLookasideInitialized = TRUE;
+}
+
+VOID
+IrpWorkItemCleanup()
+{
+    if (IrpWorkItemLookasideInitialized)
+    {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER,
+            __FUNCTION__": irp work items: allocations %d from pool %d\n",
+            IrpWorkItemLookaside.L.TotalAllocates,
+            IrpWorkItemLookaside.L.AllocateMisses);
+
+        ExDeleteNPagedLookasideList(&IrpWorkItemLookaside);
+        IrpWorkItemLookasideInitialized = FALSE;
+    }
+}
+
 _Function_class_(IO_WORKITEM_ROUTINE)
 VOID
 ProcessIrpWorkItem(
@@ -2081,27 +2181,23 @@ ProcessIrpWorkItem(
     // usbport derefs the dev.
     item->Func(device, item->Irp);
     ObDereferenceObject(device);
-    RootHubIfFpFreeWorkItem(item->IoWorkItem);
-    ExFreePool(item);
+    IoUninitializeWorkItem(item->IoWorkItem);
+    ExFreeToNPagedLookasideList(&IrpWorkItemLookaside, item);
 }
 
 //
-// returns allocated IRP_WORK_ITEM with IRP_WORK_ITEM.IoWorkItem set to an allocated IO_WORK_ITEM.
+// returns allocated IRP_WORK_ITEM with IRP_WORK_ITEM.IoWorkItem set to the IO_WORK_ITEM
+// that follows it in the same allocation.
 //
 PIRP_WORK_ITEM
 AllocateIrpWorkItem()
 {
-    PIRP_WORK_ITEM irpItem =  (PIRP_WORK_ITEM) ExAllocatePoolWithTag(NonPagedPool, 
-        sizeof(IRP_WORK_ITEM), XVUH);
+    PIRP_WORK_ITEM irpItem =  (PIRP_WORK_ITEM) ExAllocateFromNPagedLookasideList(
+        &IrpWorkItemLookaside);
     if (irpItem)
     {
-        RtlZeroMemory(irpItem, sizeof(IRP_WORK_ITEM));
-        irpItem->IoWorkItem = RootHubIfFpAllocateWorkItem(NULL);
-        if (!irpItem->IoWorkItem)
-        {
-            ExFreePool(irpItem);
-            irpItem = NULL;
-        }
+        RtlZeroMemory(irpItem, IRP_WORK_ITEM_HEADER_SIZE + IoSizeofWorkItem());
+        irpItem->IoWorkItem = (PIO_WORKITEM) ((PUCHAR) irpItem + IRP_WORK_ITEM_HEADER_SIZE);
     }
     return irpItem;
 }
@@ -0,0 +1,470 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file UsbQuirks.cpp in-memory usbflags quirks table.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#include "Driver.h"
+#include "UsbQuirks.h"
+
+#define USBFLAGS_KEY_PATH L"\\Registry\\Machine\\System\\CurrentControlSet\\Control\\usbflags"
+#define QUIRKS_HASH_BUCKETS 64 // must be a power of 2
+#define QUIRKS_ENTRY_NAME_LENGTH 12 // vvvvpppprrrr
+
+struct USB_QUIRKS_ENTRY
+{
+    USB_QUIRKS_ENTRY * Next;
+    USHORT             VendorId;
+    USHORT             ProductId;
+    USHORT             BcdDevice;
+    USB_QUIRKS         Quirks;
+};
+
+struct USB_QUIRKS_TABLE
+{
+    ULONG              Entries;
+    USB_QUIRKS_ENTRY * Buckets[QUIRKS_HASH_BUCKETS];
+};
+
+static KSPIN_LOCK gQuirksLock;
+static USB_QUIRKS_TABLE * gQuirksTable = NULL;
+volatile LONG gQuirksGeneration = 0; //!< bumped by each reload.
+
+static ULONG
+QuirksHash(
+    IN USHORT VendorId,
+    IN USHORT ProductId,
+    IN USHORT BcdDevice)
+{
+    return ((VendorId * 31) ^ (ProductId * 7) ^ BcdDevice) & (QUIRKS_HASH_BUCKETS - 1);
+}
+
+static USB_QUIRKS_ENTRY *
+QuirksFind(
+    IN USB_QUIRKS_TABLE * Table,
+    IN USHORT VendorId,
+    IN USHORT ProductId,
+    IN USHORT BcdDevice)
+{
+    USB_QUIRKS_ENTRY * entry = Table->Buckets[QuirksHash(VendorId, ProductId, BcdDevice)];
+    for (; entry; entry = entry->Next)
+    {
+        if ((entry->VendorId == VendorId) &&
+            (entry->ProductId == ProductId) &&
+            (entry->BcdDevice == BcdDevice))
+        {
+            break;
+        }
+    }
+    return entry;
+}
+
+static VOID
+QuirksDefaults(
+    OUT PUSB_QUIRKS Quirks)
+{
+    RtlZeroMemory(Quirks, sizeof(USB_QUIRKS));
+    Quirks->OsDescriptor = 0x0100; // default is fetch it.
+}
+
+static VOID
+FreeQuirksTable(
+    IN USB_QUIRKS_TABLE * Table)
+{
+    for (ULONG bucket = 0; bucket < QUIRKS_HASH_BUCKETS; bucket++)
+    {
+        while (Table->Buckets[bucket])
+        {
+            USB_QUIRKS_ENTRY * entry = Table->Buckets[bucket];
+            Table->Buckets[bucket] = entry->Next;
+            ExFreePoolWithTag(entry, XVUJ);
+        }
+    }
+    ExFreePoolWithTag(Table, XVUJ);
+}
+
+static BOOLEAN
+HexToUshort(
+    IN PWCHAR Chars,
+    OUT PUSHORT Value)
+{
+    USHORT value = 0;
+    for (ULONG index = 0; index < 4; index++)
+    {
+        WCHAR c = Chars[index];
+        value <<= 4;
+        if ((c >= L'0') && (c <= L'9'))
+        {
+            value |= (c - L'0');
+        }
+        else if ((c >= L'a') && (c <= L'f'))
+        {
+            value |= (c - L'a' + 10);
+        }
+        else if ((c >= L'A') && (c <= L'F'))
+        {
+            value |= (c - L'A' + 10);
+        }
+        else
+        {
+            return FALSE;
+        }
+    }
+    *Value = value;
+    return TRUE;
+}
+
+//
+// read the values for one usbflags\vvvvpppprrrr subkey.
+//
+static NTSTATUS
+ReadQuirksEntry(
+    IN PWCHAR EntryName,
+    OUT PUSB_QUIRKS Quirks)
+{
+    WCHAR path[24];
+    NTSTATUS Status = RtlStringCbPrintfW(path,
+        sizeof(path),
+        L"usbflags\\%.12s",
+        EntryName);
+    if (!NT_SUCCESS(Status))
+    {
+        return Status;
+    }
+
+    USHORT osvc = 0x0100;
+    ULONG reset = 0;
+    ULONG noLocalRequests = 0;
+    ULONG blackList = 0;
+    ULONG maxInFlight = 0;
+    ULONG forceShortOk = 0;
+    ULONG pollMode = 0;
+    ULONG noDescriptorCache = 0;
+    ULONG isoLeadFrames = 0;
+
+    struct
+    {
+        PWSTR Name;
+        PVOID Value;
+        ULONG Type;
+        ULONG Length;
+    } values[] =
+    {
+        { L"osvc", &osvc, REG_BINARY, sizeof(osvc) },
+        { L"ResetOnStart", &reset, REG_DWORD, sizeof(reset) },
+        { L"NoLocalStandardRequests", &noLocalRequests, REG_DWORD, sizeof(noLocalRequests) },
+        { L"OsBlackList", &blackList, REG_DWORD, sizeof(blackList) },
+        { L"MaxInFlightPerEndpoint", &maxInFlight, REG_DWORD, sizeof(maxInFlight) },
+        { L"ForceShortPacketOk", &forceShortOk, REG_DWORD, sizeof(forceShortOk) },
+        { L"PollMode", &pollMode, REG_DWORD, sizeof(pollMode) },
+        { L"NoDescriptorCache", &noDescriptorCache, REG_DWORD, sizeof(noDescriptorCache) },
+        { L"IsoLeadFrames", &isoLeadFrames, REG_DWORD, sizeof(isoLeadFrames) },
+    };
+    RTL_QUERY_REGISTRY_TABLE QueryTable[RTL_NUMBER_OF(values) + 1];
+    RtlZeroMemory(QueryTable, sizeof(QueryTable));
+    for (ULONG index = 0; index < RTL_NUMBER_OF(values); index++)
+    {
+        QueryTable[index].QueryRoutine = NULL;
+        QueryTable[index].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        QueryTable[index].Name = values[index].Name;
+        QueryTable[index].EntryContext = values[index].Value;
+        QueryTable[index].DefaultType = values[index].Type;
+        QueryTable[index].DefaultData = values[index].Value;
+        QueryTable[index].DefaultLength = values[index].Length;
+    }
+
+    Status = RtlQueryRegistryValues(
+        RTL_REGISTRY_CONTROL,
+        path,
+        QueryTable,
+        NULL,
+        NULL);
+    if (!NT_SUCCESS(Status))
+    {
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_DRIVER,
+            __FUNCTION__": RtlQueryRegistryValues %S error %x\n",
+            path,
+            Status);
+        return Status;
+    }
+
+    Quirks->OsDescriptor = osvc;
+    Quirks->ResetOnStart = reset ? TRUE : FALSE;
+    Quirks->NoLocalStandardRequests = noLocalRequests ? TRUE : FALSE;
+    Quirks->OsBlackList = blackList;
+    Quirks->MaxInFlightPerEndpoint = maxInFlight;
+    Quirks->ForceShortPacketOk = forceShortOk ? TRUE : FALSE;
+    Quirks->PollMode = pollMode ? TRUE : FALSE;
+    Quirks->NoDescriptorCache = noDescriptorCache ? TRUE : FALSE;
+    Quirks->IsoLeadFrames = isoLeadFrames;
+    return STATUS_SUCCESS;
+}
+
+//
+// build a new table from the usbflags key. Subkeys that are not
+// of the form vvvvpppprrrr (e.g. the MSFT global settings) are ignored.
+//
+static NTSTATUS
+LoadQuirksTable(
+    OUT USB_QUIRKS_TABLE ** Table)
+{
+    *Table = NULL;
+    USB_QUIRKS_TABLE * table = (USB_QUIRKS_TABLE *) ExAllocatePoolWithTag(
+        NonPagedPool,
+        sizeof(USB_QUIRKS_TABLE),
+        XVUJ);
+    if (!table)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(table, sizeof(USB_QUIRKS_TABLE));
+
+    UNICODE_STRING keyName;
+    RtlInitUnicodeString(&keyName, USBFLAGS_KEY_PATH);
+    OBJECT_ATTRIBUTES attributes;
+    InitializeObjectAttributes(&attributes,
+        &keyName,
+        OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+        NULL,
+        NULL);
+
+    HANDLE key;
+    NTSTATUS Status = ZwOpenKey(&key, KEY_READ, &attributes);
+    if (!NT_SUCCESS(Status))
+    {
+        //
+        // no usbflags key, no quirks.
+        //
+        *Table = table;
+        return STATUS_SUCCESS;
+    }
+
+    DECLSPEC_ALIGN(8) UCHAR buffer[sizeof(KEY_BASIC_INFORMATION) + (64 * sizeof(WCHAR))];
+    PKEY_BASIC_INFORMATION info = (PKEY_BASIC_INFORMATION) buffer;
+
+    for (ULONG index = 0; ; index++)
+    {
+        ULONG resultLength;
+        Status = ZwEnumerateKey(key,
+            index,
+            KeyBasicInformation,
+            info,
+            sizeof(buffer),
+            &resultLength);
+
+        if (Status == STATUS_NO_MORE_ENTRIES)
+        {
+            Status = STATUS_SUCCESS;
+            break;
+        }
+        if ((Status == STATUS_BUFFER_OVERFLOW) ||
+            (Status == STATUS_BUFFER_TOO_SMALL))
+        {
+            continue; // not a vvvvpppprrrr name.
+        }
+        if (!NT_SUCCESS(Status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER,
+                __FUNCTION__": ZwEnumerateKey index %d error %x\n",
+                index,
+                Status);
+            break;
+        }
+        USHORT vid, pid, bcd;
+        if ((info->NameLength != (QUIRKS_ENTRY_NAME_LENGTH * sizeof(WCHAR))) ||
+            !HexToUshort(&info->Name[0], &vid) ||
+            !HexToUshort(&info->Name[4], &pid) ||
+            !HexToUshort(&info->Name[8], &bcd))
+        {
+            continue;
+        }
+
+        USB_QUIRKS_ENTRY * entry = (USB_QUIRKS_ENTRY *) ExAllocatePoolWithTag(
+            NonPagedPool,
+            sizeof(USB_QUIRKS_ENTRY),
+            XVUJ);
+        if (!entry)
+        {
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+        }
+        entry->VendorId = vid;
+        entry->ProductId = pid;
+        entry->BcdDevice = bcd;
+        QuirksDefaults(&entry->Quirks);
+        if (!NT_SUCCESS(ReadQuirksEntry(info->Name, &entry->Quirks)))
+        {
+            ExFreePoolWithTag(entry, XVUJ);
+            continue;
+        }
+        ULONG bucket = QuirksHash(vid, pid, bcd);
+        entry->Next = table->Buckets[bucket];
+        table->Buckets[bucket] = entry;
+        table->Entries++;
+    }
+    ZwClose(key);
+
+    if (!NT_SUCCESS(Status))
+    {
+        FreeQuirksTable(table);
+        return Status;
+    }
+    *Table = table;
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief load the usbflags quirks into memory. Called from DriverEntry.
+ */
+NTSTATUS
+UsbQuirksInitialize()
+{
+    KeInitializeSpinLock(&gQuirksLock);
+    return UsbQuirksReload();
+}
+
+/**
+ * @brief free the in-memory quirks. Called on driver unload.
+ */
+VOID
+UsbQuirksCleanup()
+{
+    KIRQL irql;
+    KeAcquireSpinLock(&gQuirksLock, &irql);
+    USB_QUIRKS_TABLE * table = gQuirksTable;
+    gQuirksTable = NULL;
+    KeReleaseSpinLock(&gQuirksLock, irql);
+    if (table)
+    {
+        FreeQuirksTable(table);
+    }
+}
+
+/**
+ * @brief re-read the usbflags key and replace the in-memory table.
+ * *Must be called at PASSIVE_LEVEL*
+ * On failure the current table is kept.
+ */
+NTSTATUS
+UsbQuirksReload()
+{
+    USB_QUIRKS_TABLE * table;
+    NTSTATUS Status = LoadQuirksTable(&table);
+    if (!NT_SUCCESS(Status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DRIVER,
+            __FUNCTION__": error %x loading usbflags\n",
+            Status);
+        return Status;
+    }
+
+    KIRQL irql;
+    KeAcquireSpinLock(&gQuirksLock, &irql);
+    USB_QUIRKS_TABLE * oldTable = gQuirksTable;
+    gQuirksTable = table;
+    KeReleaseSpinLock(&gQuirksLock, irql);
+    InterlockedIncrement(&gQuirksGeneration);
+
+    if (oldTable)
+    {
+        FreeQuirksTable(oldTable);
+    }
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DRIVER,
+        __FUNCTION__": %d usbflags entries loaded\n",
+        table->Entries);
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief copy the quirks for a device out of the table.
+ *
+ * @returns TRUE if the device has a usbflags entry. If not Quirks
+ * is set to the defaults.
+ */
+BOOLEAN
+UsbQuirksLookup(
+    IN USHORT VendorId,
+    IN USHORT ProductId,
+    IN USHORT BcdDevice,
+    OUT PUSB_QUIRKS Quirks)
+{
+    BOOLEAN found = FALSE;
+    KIRQL irql;
+
+    QuirksDefaults(Quirks);
+    KeAcquireSpinLock(&gQuirksLock, &irql);
+    if (gQuirksTable)
+    {
+        USB_QUIRKS_ENTRY * entry = QuirksFind(gQuirksTable, VendorId, ProductId, BcdDevice);
+        if (entry)
+        {
+            *Quirks = entry->Quirks;
+            found = TRUE;
+        }
+    }
+    KeReleaseSpinLock(&gQuirksLock, irql);
+    return found;
+}
+
+/**
+ * @brief keep the table consistent with a usbflags entry written by SetUsbInfo().
+ */
+VOID
+UsbQuirksUpdate(
+    IN USHORT VendorId,
+    IN USHORT ProductId,
+    IN USHORT BcdDevice,
+    IN PUSB_QUIRKS Quirks)
+{
+    USB_QUIRKS_ENTRY * newEntry = (USB_QUIRKS_ENTRY *) ExAllocatePoolWithTag(
+        NonPagedPool,
+        sizeof(USB_QUIRKS_ENTRY),
+        XVUJ);
+    KIRQL irql;
+
+    KeAcquireSpinLock(&gQuirksLock, &irql);
+    if (gQuirksTable)
+    {
+        USB_QUIRKS_ENTRY * entry = QuirksFind(gQuirksTable, VendorId, ProductId, BcdDevice);
+        if (entry)
+        {
+            entry->Quirks = *Quirks;
+        }
+        else if (newEntry)
+        {
+            ULONG bucket = QuirksHash(VendorId, ProductId, BcdDevice);
+            newEntry->VendorId = VendorId;
+            newEntry->ProductId = ProductId;
+            newEntry->BcdDevice = BcdDevice;
+            newEntry->Quirks = *Quirks;
+            newEntry->Next = gQuirksTable->Buckets[bucket];
+            gQuirksTable->Buckets[bucket] = newEntry;
+            gQuirksTable->Entries++;
+            newEntry = NULL;
+        }
+    }
+    KeReleaseSpinLock(&gQuirksLock, irql);
+
+    if (newEntry)
+    {
+        ExFreePoolWithTag(newEntry, XVUJ);
+    }
+}
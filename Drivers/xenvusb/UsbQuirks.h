@@ -0,0 +1,71 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file UsbQuirks.h in-memory copy of the usbflags quirks database.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#pragma once
+
+//
+/// Per device quirks from HKLM\\CCS\\Control\\usbflags\\vvvvpppprrrr.
+/// The usbflags key is read once at DriverEntry into a hash table keyed by
+/// vendor, product and revision and can be reloaded with IOCTL_XENVUSB_RELOAD_QUIRKS.
+/// Each reload bumps gQuirksGeneration, every FDO compares it in SubmitUrb()
+/// and re-applies its entry when it has moved on.
+//
+struct USB_QUIRKS
+{
+    USHORT  OsDescriptor;           //!< osvc, 0x01xx: fetch the MSFT OS string descriptor.
+    BOOLEAN ResetOnStart;           //!< ResetOnStart
+    BOOLEAN NoLocalStandardRequests;//!< NoLocalStandardRequests
+    ULONG   OsBlackList;            //!< OsBlackList
+    ULONG   MaxInFlightPerEndpoint; //!< MaxInFlightPerEndpoint, 0 is unlimited.
+    BOOLEAN ForceShortPacketOk;     //!< ForceShortPacketOk
+    BOOLEAN PollMode;               //!< PollMode
+    BOOLEAN NoDescriptorCache;      //!< NoDescriptorCache
+    ULONG   IsoLeadFrames;          //!< IsoLeadFrames, 0 is the driver default.
+};
+typedef USB_QUIRKS * PUSB_QUIRKS;
+
+extern volatile LONG gQuirksGeneration;
+
+NTSTATUS
+UsbQuirksInitialize();
+
+VOID
+UsbQuirksCleanup();
+
+NTSTATUS
+UsbQuirksReload();
+
+BOOLEAN
+UsbQuirksLookup(
+    IN USHORT VendorId,
+    IN USHORT ProductId,
+    IN USHORT BcdDevice,
+    OUT PUSB_QUIRKS Quirks);
+
+VOID
+UsbQuirksUpdate(
+    IN USHORT VendorId,
+    IN USHORT ProductId,
+    IN USHORT BcdDevice,
+    IN PUSB_QUIRKS Quirks);
@@ -25,6 +25,7 @@
 #include "Driver.h"
 #include "Device.h"
 #include "UsbConfig.h"
+#include "UsbQuirks.h"
 #include "usbioctl.h"
 #include "xenif.h"
 #include "UsbResponse.h"
@@ -112,6 +113,20 @@ ProcessGetStatus(
     IN PURB Urb,
     IN ULONG Recipient);
 
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+ProcessGetConfiguration(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN WDFREQUEST Request,
+    IN PURB Urb);
+
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+ProcessGetInterface(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN WDFREQUEST Request,
+    IN PURB Urb);
+
 _Requires_lock_held_(fdoContext->WdfDevice)
 VOID
 ProcessSyncResetClearStall(
@@ -184,12 +199,33 @@ SubmitUrb(
 
         return;
     }
+    if (fdoContext->QuirksGeneration != gQuirksGeneration)
+    {
+        //
+        // the usbflags were reloaded.
+        //
+        RefreshUsbInfo(fdoContext);
+    }
 
     //
     // preset usb status to success!
     //
     Urb->UrbHeader.Status = USBD_STATUS_SUCCESS;
 
+    ULONG transferLength = 0;
+    if (((Urb->UrbHeader.Function == URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER) ||
+        (Urb->UrbHeader.Function == URB_FUNCTION_ISOCH_TRANSFER) ||
+        (Urb->UrbHeader.Function == URB_FUNCTION_CONTROL_TRANSFER)) &&
+        (Urb->UrbHeader.Length >= sizeof(_URB_BULK_OR_INTERRUPT_TRANSFER)))
+    {
+        //
+        // same offset in all three.
+        //
+        transferLength = Urb->UrbBulkOrInterruptTransfer.TransferBufferLength;
+    }
+    FlightRecord(fdoContext, XenvusbFlightSubmitUrb, XENVUSB_FLIGHT_NO_SHADOW,
+        0, 0, Urb->UrbHeader.Function, transferLength, 0, 0);
+
     PCHAR UrbFuncString = UrbFunctionToString(Urb->UrbHeader.Function);
 
     /* --XT-- This might be the source of so much of the info tracing, taking it out...
@@ -218,7 +254,7 @@ SubmitUrb(
             }
             else
             {
-                Urb->UrbGetCurrentFrameNumber.FrameNumber = fdoContext->ScratchPad.FrameNumber;
+                Urb->UrbGetCurrentFrameNumber.FrameNumber = FrameClockCurrentFrame(fdoContext);
                 Status = STATUS_SUCCESS;
             }
             RequestGetRequestContext(Request)->RequestCompleted = 1;
@@ -335,6 +371,15 @@ SubmitUrb(
             Destination = BMREQUEST_TO_ENDPOINT;
         }
 
+        if (DescriptorCacheLookup(fdoContext, Destination, Urb))
+        {
+            RequestGetRequestContext(Request)->RequestCompleted = 1;
+            ReleaseFdoLock(fdoContext);
+            WdfRequestComplete(Request, STATUS_SUCCESS);
+            AcquireFdoLock(fdoContext);
+            return;
+        }
+
         ProcessGetDescriptor(Destination,
             fdoContext,
             Request,
@@ -342,6 +387,11 @@ SubmitUrb(
         break;
 
     case URB_FUNCTION_SELECT_CONFIGURATION:
+        if (fdoContext->InterfaceSwitching)
+        {
+            HoldForInterfaceSwitch(fdoContext, Request);
+            return;
+        }
         if (fdoContext->ConfigBusy)
         {
             TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_URB,
@@ -369,7 +419,16 @@ SubmitUrb(
             RequeueRequest(fdoContext, Request);
             return;
         }
-        fdoContext->ConfigBusy = TRUE;
+        if (fdoContext->InterfaceSwitching)
+        {
+            HoldForInterfaceSwitch(fdoContext, Request);
+            return;
+        }
+        //
+        // only this interface is held while the SET_INTERFACE is on the ring.
+        //
+        fdoContext->InterfaceSwitching = TRUE;
+        fdoContext->SwitchingInterface = Urb->UrbSelectInterface.Interface.InterfaceNumber;
         ProcessSelectInterface(
             fdoContext,
             Request,
@@ -610,6 +669,20 @@ SubmitUrb(
             BMREQUEST_TO_OTHER);
         break;
 
+    case URB_FUNCTION_GET_CONFIGURATION:
+        ProcessGetConfiguration(
+            fdoContext,
+            Request,
+            Urb);
+        break;
+
+    case URB_FUNCTION_GET_INTERFACE:
+        ProcessGetInterface(
+            fdoContext,
+            Request,
+            Urb);
+        break;
+
     case URB_FUNCTION_ISOCH_TRANSFER:
 
         RtlZeroMemory(&Urb->UrbIsochronousTransfer.hca, sizeof(_URB_HCD_AREA));
@@ -748,11 +821,169 @@ ProcessBulkOrInterruptTransfer(
             PipeType,
             endpoint->bEndpointAddress,
             TRUE,
-            Urb->UrbBulkOrInterruptTransfer.TransferFlags & USBD_SHORT_TRANSFER_OK ? TRUE : FALSE);
+            (Urb->UrbBulkOrInterruptTransfer.TransferFlags & USBD_SHORT_TRANSFER_OK) ||
+            (fdoContext->ForceShortPacketOk && USB_ENDPOINT_DIRECTION_IN(endpoint->bEndpointAddress)) ? TRUE : FALSE);
         break;
     }
 }
 
+//
+// frames scheduled ahead of the bus when an isoch stream (re)starts,
+// unless set by usbflags IsoLeadFrames.
+//
+#define ISO_DEFAULT_LEAD_FRAMES 8
+//
+// a stream that has been behind the bus for longer than this was stopped
+// by its client, not starved.
+//
+#define ISO_STREAM_IDLE_FRAMES 100
+
+/**
+ * @brief schedule an isoch transfer on its endpoint's stream.
+ * ASAP transfers are given the frame following the previous transfer on
+ * the endpoint so the backend sees a contiguous schedule. When the stream
+ * has fallen behind the bus the stream has underrun and restarts with
+ * IsoLeadFrames of lead.
+ *
+ * The stream itself is not changed, the caller passes the new state to
+ * IsoStreamCommit() once the transfer is on the ringbuffer.
+ *
+ * @param[in] fdoContext. The FDO context.
+ * @param[in] pipe. The (validated) pipe for the transfer.
+ * @param[in] Urb. The URB for the ISO transfer operation. StartFrame is set for ASAP transfers.
+ * @param[out] stream. The stream state after the transfer.
+ *
+ * @returns TRUE if the backend should still start the transfer ASAP,
+ * which is only the case until the frame clock has been synchronized.
+ */
+_Requires_lock_held_(fdoContext->WdfDevice)
+static BOOLEAN
+IsoStreamSchedule(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN PIPE_DESCRIPTOR * pipe,
+    IN PURB Urb,
+    OUT ISO_STREAM * stream)
+{
+    *stream = pipe->isoStream;
+    ULONG now = FrameClockCurrentFrame(fdoContext);
+    ULONG lead = fdoContext->IsoLeadFrames ? fdoContext->IsoLeadFrames : ISO_DEFAULT_LEAD_FRAMES;
+    ULONG frames = Urb->UrbIsochronousTransfer.NumberOfPackets;
+    ULONG startFrame;
+
+    if (fdoContext->DeviceSpeed == UsbHighSpeed)
+    {
+        frames = (frames + 7) / 8; // packets are microframes.
+    }
+
+    if (Urb->UrbIsochronousTransfer.TransferFlags & USBD_START_ISO_TRANSFER_ASAP)
+    {
+        if (!fdoContext->FrameClock.Synchronized)
+        {
+            //
+            // our frame numbers mean nothing to the backend yet.
+            //
+            stream->active = FALSE;
+            return TRUE;
+        }
+        if (stream->active)
+        {
+            LONG behind = (LONG) (now - stream->nextFrame);
+            if (behind > ISO_STREAM_IDLE_FRAMES)
+            {
+                stream->active = FALSE;
+            }
+            else if (behind >= 0)
+            {
+                stream->active = FALSE;
+                stream->underruns++;
+                TraceEvents(TRACE_LEVEL_WARNING, TRACE_URB,
+                    __FUNCTION__": %s ea %x underrun %d frames behind (%d underruns, min lead %d)\n",
+                    fdoContext->FrontEndPath,
+                    pipe->endpoint->bEndpointAddress,
+                    behind,
+                    stream->underruns,
+                    stream->minLead);
+            }
+        }
+        if (!stream->active)
+        {
+            startFrame = now + lead;
+            stream->minLead = lead;
+        }
+        else
+        {
+            startFrame = stream->nextFrame;
+        }
+        Urb->UrbIsochronousTransfer.StartFrame = startFrame;
+    }
+    else
+    {
+        startFrame = Urb->UrbIsochronousTransfer.StartFrame;
+        if ((LONG) (startFrame - now) < 0)
+        {
+            fdoContext->totalIsoLateStarts++;
+            TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_URB,
+                __FUNCTION__": %s ea %x start frame %x is before current frame %x\n",
+                fdoContext->FrontEndPath,
+                pipe->endpoint->bEndpointAddress,
+                startFrame,
+                now);
+        }
+    }
+
+    LONG currentLead = (LONG) (startFrame - now);
+    if (currentLead < 0)
+    {
+        currentLead = 0;
+    }
+    if (!stream->active || ((ULONG) currentLead < stream->minLead))
+    {
+        stream->minLead = (ULONG) currentLead;
+    }
+    stream->nextFrame = startFrame + frames;
+    stream->active = TRUE;
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_URB,
+        __FUNCTION__": %s ea %x start %x frames %d lead %d\n",
+        fdoContext->FrontEndPath,
+        pipe->endpoint->bEndpointAddress,
+        startFrame,
+        frames,
+        currentLead);
+
+    return FALSE;
+}
+
+/**
+ * @brief the transfer scheduled by IsoStreamSchedule() is on the ringbuffer,
+ * make its stream state current. A transfer that was requeued or failed
+ * leaves the stream as it was.
+ *
+ * @param[in] fdoContext. The FDO context.
+ * @param[in] pipe. The pipe for the transfer.
+ * @param[in] Urb. The URB for the ISO transfer operation.
+ * @param[in] stream. The stream state from IsoStreamSchedule().
+ */
+_Requires_lock_held_(fdoContext->WdfDevice)
+static VOID
+IsoStreamCommit(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN PIPE_DESCRIPTOR * pipe,
+    IN PURB Urb,
+    IN const ISO_STREAM * stream)
+{
+    if (stream->underruns != pipe->isoStream.underruns)
+    {
+        fdoContext->totalIsoUnderruns++;
+    }
+    if ((Urb->UrbIsochronousTransfer.TransferFlags & USBD_START_ISO_TRANSFER_ASAP) &&
+        stream->active)
+    {
+        fdoContext->totalIsoAsapScheduled++;
+    }
+    pipe->isoStream = *stream;
+}
+
 /**
  * @brief process ISO URB transfer requests.
  * __Requirements inherited from caller:__
@@ -765,6 +996,7 @@ ProcessBulkOrInterruptTransfer(
  *    In other words, IsoPacket[n+1].Offset must be equal to IsoPacket[n].Offset + IsoPacket[n].Length. (not enforced)
  *  In high-speed transmissions, the number of packets must be a multiple of eight. (not enforced)
  *  The only supported flag is USB_START_ISO_TRANSFER_ASAP?
+ *    ASAP transfers are converted to explicit start frames by IsoStreamSchedule().
  *
  * @param[in] fdoContext. The FDO context.
  * @param[in] Request. The WDFREQUEST handle.
@@ -837,7 +1069,7 @@ ProcessIsoRequest(
     if (Urb->UrbIsochronousTransfer.NumberOfPackets > MaxIsoPackets(fdoContext->Xen))
     {
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_URB,
-            __FUNCTION__": %s NumberOfPackets (%d) > MAX_ISO_PACKETS (%d)\n",
+            __FUNCTION__": %s NumberOfPackets (%d) > MaxIsoPackets (%d)\n",
             fdoContext->FrontEndPath,
             Urb->UrbIsochronousTransfer.NumberOfPackets,
             MaxIsoPackets(fdoContext->Xen));
@@ -888,19 +1120,160 @@ ProcessIsoRequest(
         // direction is implied by endpoint address
         //
         RtlZeroMemory(&packet, sizeof(WDF_USB_CONTROL_SETUP_PACKET));
-        BOOLEAN transferAsap = (Urb->UrbIsochronousTransfer.TransferFlags & USBD_START_ISO_TRANSFER_ASAP) ? TRUE : FALSE;
+        PIPE_DESCRIPTOR * pipe = (PIPE_DESCRIPTOR *) Urb->UrbIsochronousTransfer.PipeHandle;
+        ISO_STREAM stream;
+        BOOLEAN transferAsap = IsoStreamSchedule(fdoContext,
+            pipe,
+            Urb,
+            &stream);
 
-        PutIsoUrbOnRing(
+        if (NT_SUCCESS(PutIsoUrbOnRing(
             fdoContext,
             &packet,
             Request,
+            NULL,
             endpoint->bEndpointAddress,
             transferAsap,
-            1); 
+            1)))
+        {
+            IsoStreamCommit(fdoContext, pipe, Urb, &stream);
+        }
         break;    
     }
 }
 
+/**
+ * @brief return an FdoSubmitIsoOutUrb() URB to its owner.
+ * The slot goes back on the free list before the URB status is written, the
+ * owner may resubmit as soon as the status is no longer USBD_STATUS_PENDING.
+ *
+ * @param[in] fdoContext. The FDO context.
+ * @param[in] slot. The slot for the URB, no longer on the ringbuffer.
+ * @param[in] usbdStatus. The final URB status.
+ *
+ */
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+CompleteIsoFastSlot(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN PISO_FAST_SLOT slot,
+    IN USBD_STATUS usbdStatus)
+{
+    PISO_FAST_PATH fastPath = fdoContext->IsoFastPath;
+    PURB Urb = slot->Urb;
+
+    if (USBD_SUCCESS(usbdStatus))
+    {
+        fastPath->Completed++;
+    }
+    else
+    {
+        fastPath->Errors++;
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_URB,
+            __FUNCTION__": %s Urb %p usbd status %x\n",
+            fdoContext->FrontEndPath,
+            Urb,
+            usbdStatus);
+    }
+    slot->Urb = NULL;
+    InterlockedPushEntrySList(&fastPath->FreeList, &slot->Link);
+    Urb->UrbHeader.Status = usbdStatus;
+}
+
+/**
+ * @brief put FdoSubmitIsoOutUrb() transfers on the ringbuffer.
+ * Called from the DPC ahead of the request queue. Slots are taken in submission
+ * order and scheduled on their endpoint's isoch stream like ProcessIsoRequest().
+ * Each slot owns a reserved shadow so nothing waits for ringbuffer space, and
+ * as there is no request to requeue any failure completes the URB.
+ *
+ * @param[in] fdoContext. The FDO context.
+ *
+ */
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+DrainIsoFastPath(
+    IN PUSB_FDO_CONTEXT fdoContext)
+{
+    PISO_FAST_PATH fastPath = fdoContext->IsoFastPath;
+    if (!fastPath)
+    {
+        return;
+    }
+    //
+    // the pending list is LIFO.
+    //
+    PSLIST_ENTRY entry = InterlockedFlushSList(&fastPath->PendingList);
+    PSLIST_ENTRY ordered = NULL;
+    while (entry)
+    {
+        PSLIST_ENTRY next = entry->Next;
+        entry->Next = ordered;
+        ordered = entry;
+        entry = next;
+    }
+
+    while (ordered)
+    {
+        PISO_FAST_SLOT slot = CONTAINING_RECORD(ordered, ISO_FAST_SLOT, Link);
+        PURB Urb = slot->Urb;
+        ordered = ordered->Next;
+
+        if (fdoContext->DeviceUnplugged || !fdoContext->XenConfigured)
+        {
+            CompleteIsoFastSlot(fdoContext, slot, USBD_STATUS_DEVICE_GONE);
+            continue;
+        }
+
+        PUSB_ENDPOINT_DESCRIPTOR endpoint = 
+            PipeHandleToEndpointAddressDescriptor(fdoContext, Urb->UrbIsochronousTransfer.PipeHandle);
+
+        if (!endpoint ||
+            ((endpoint->bmAttributes & USB_ENDPOINT_TYPE_MASK) != USB_ENDPOINT_TYPE_ISOCHRONOUS) ||
+            USB_ENDPOINT_DIRECTION_IN(endpoint->bEndpointAddress))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_URB,
+                __FUNCTION__": %s Urb %p PipeHandle %p is not an isoch OUT pipe\n",
+                fdoContext->FrontEndPath,
+                Urb,
+                Urb->UrbIsochronousTransfer.PipeHandle);
+            CompleteIsoFastSlot(fdoContext, slot, USBD_STATUS_INVALID_PIPE_HANDLE);
+            continue;
+        }
+
+        WDF_USB_CONTROL_SETUP_PACKET packet;
+        RtlZeroMemory(&packet, sizeof(WDF_USB_CONTROL_SETUP_PACKET));
+        PIPE_DESCRIPTOR * pipe = (PIPE_DESCRIPTOR *) Urb->UrbIsochronousTransfer.PipeHandle;
+        ISO_STREAM stream;
+        BOOLEAN transferAsap = IsoStreamSchedule(fdoContext,
+            pipe,
+            Urb,
+            &stream);
+        ULONGLONG latency = KeQueryInterruptTime() - slot->SubmitTime;
+
+        NTSTATUS Status = PutIsoUrbOnRing(
+            fdoContext,
+            &packet,
+            NULL,
+            slot,
+            endpoint->bEndpointAddress,
+            transferAsap,
+            1);
+
+        if (!NT_SUCCESS(Status))
+        {
+            CompleteIsoFastSlot(fdoContext, slot, USBD_STATUS_INSUFFICIENT_RESOURCES);
+            continue;
+        }
+        IsoStreamCommit(fdoContext, pipe, Urb, &stream);
+        fastPath->TotalLatency += latency;
+        if (latency > fastPath->MaxLatency)
+        {
+            fastPath->MaxLatency = latency;
+        }
+    }
+}
+
 /**
  * @brief process Control pipe URB transfer requests.
  * __Requirements inherited from caller:__
@@ -1357,6 +1730,11 @@ ProcessSelectConfiguration(
         return;
     }
     //
+    // interface, endpoint and class descriptors belong to the configuration
+    // being replaced.
+    //
+    DescriptorCacheFlush(fdoContext);
+    //
     // @todo revisit smartcard config zero nonsense.
     // See http://www.usb.org/developers/devclass_docs/DWG_Smart-Card_USB-ICC_ICCD_rev10.pdf
     //
@@ -1682,7 +2060,7 @@ ProcessSelectInterface(
             Urb->UrbHeader.Length,
             minimumSize);
 
-        fdoContext->ConfigBusy = FALSE;     
+        fdoContext->InterfaceSwitching = FALSE;     
         RequestGetRequestContext(Request)->RequestCompleted = 1;   
         ReleaseFdoLock(fdoContext);
         WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
@@ -1698,7 +2076,7 @@ ProcessSelectInterface(
             Urb->UrbSelectInterface.ConfigurationHandle,
             fdoContext->ConfigurationDescriptor);
 
-        fdoContext->ConfigBusy = FALSE;       
+        fdoContext->InterfaceSwitching = FALSE;       
         RequestGetRequestContext(Request)->RequestCompleted = 1; 
         ReleaseFdoLock(fdoContext);
         WdfRequestComplete(Request, STATUS_UNSUCCESSFUL);
@@ -1723,7 +2101,7 @@ ProcessSelectInterface(
             Urb->UrbSelectInterface.Interface.InterfaceNumber,
             Urb->UrbSelectInterface.Interface.AlternateSetting);
 
-        fdoContext->ConfigBusy = FALSE;    
+        fdoContext->InterfaceSwitching = FALSE;    
         RequestGetRequestContext(Request)->RequestCompleted = 1;    
         ReleaseFdoLock(fdoContext);
         WdfRequestComplete(Request, STATUS_UNSUCCESSFUL);
@@ -1749,7 +2127,7 @@ ProcessSelectInterface(
             Urb->UrbSelectInterface.Hdr.Length,
             sizeNeeded);
 
-        fdoContext->ConfigBusy = FALSE;   
+        fdoContext->InterfaceSwitching = FALSE;   
         RequestGetRequestContext(Request)->RequestCompleted = 1;     
         ReleaseFdoLock(fdoContext);
         WdfRequestComplete(Request, STATUS_UNSUCCESSFUL);
@@ -1776,7 +2154,7 @@ ProcessSelectInterface(
 
             Urb->UrbHeader.Status = Status;
 
-            fdoContext->ConfigBusy = FALSE;    
+            fdoContext->InterfaceSwitching = FALSE;    
             RequestGetRequestContext(Request)->RequestCompleted = 1;    
             ReleaseFdoLock(fdoContext);
             WdfRequestComplete(Request, STATUS_UNSUCCESSFUL);
@@ -1789,7 +2167,12 @@ ProcessSelectInterface(
         //
         // don't select an interface on a device with one interface.
         //
-        fdoContext->ConfigBusy = FALSE;   
+        if (Urb->UrbSelectInterface.Interface.InterfaceNumber < MAX_TRACKED_INTERFACES)
+        {
+            fdoContext->AlternateSettings[Urb->UrbSelectInterface.Interface.InterfaceNumber] =
+                Urb->UrbSelectInterface.Interface.AlternateSetting;
+        }
+        fdoContext->InterfaceSwitching = FALSE;   
         RequestGetRequestContext(Request)->RequestCompleted = 1;     
         ReleaseFdoLock(fdoContext);
         WdfRequestComplete(Request, STATUS_SUCCESS);
@@ -1797,7 +2180,9 @@ ProcessSelectInterface(
         return;
     }
     //
-    // put this down to the backend via the sync scratchpad interface.
+    // put this down to the backend as an ordinary control transfer. Completion
+    // is handled in PostProcessUrb(), which clears InterfaceSwitching, so nothing
+    // here has to wait at PASSIVE_LEVEL.
     //
     WDF_USB_CONTROL_SETUP_PACKET packet;
     RtlZeroMemory(&packet, sizeof(WDF_USB_CONTROL_SETUP_PACKET));
@@ -1817,80 +2202,181 @@ ProcessSelectInterface(
         packet.Packet.wIndex.Value,
         packet.Packet.wValue.Value);
 
-    Status = PutScratchOnRing(
+    Status = PutUrbOnRing(
         fdoContext,
         &packet,
-        0,
+        Request,
         UsbdPipeTypeControl,
-        USB_ENDPOINT_TYPE_CONTROL,
+        USB_ENDPOINT_TYPE_CONTROL, // control OUT
+        FALSE,
         FALSE);
 
-    do
+    if (!NT_SUCCESS(Status))
     {
-        if (!NT_SUCCESS(Status))
-        {
-            TraceEvents(TRACE_LEVEL_ERROR, TRACE_URB,
-                __FUNCTION__ ": %s putScratchOnRing failed %x\n",
-                fdoContext->FrontEndPath,
-                Status);
-            break;
-        }
-
-        ReleaseFdoLock(fdoContext);
-        Status = WaitForScratchCompletion(fdoContext);
-        AcquireFdoLock(fdoContext);
-        fdoContext->ConfigBusy = FALSE;
-
-        if (Status != STATUS_SUCCESS)
-        {
-            TraceEvents(TRACE_LEVEL_ERROR, TRACE_URB,
-                __FUNCTION__ ": %s wait failed %x\n",
-                fdoContext->FrontEndPath,
-                Status);
-            Status = STATUS_UNSUCCESSFUL;
-            break;
-        }
-        if (fdoContext->ScratchPad.Status != 0) // XXX what is the correct constant?
-        {
-            TraceEvents(TRACE_LEVEL_ERROR, TRACE_URB,
-                __FUNCTION__ ": %s usb status %x returned\n",
-                fdoContext->FrontEndPath,
-                fdoContext->ScratchPad.Status);
-
-            Status = STATUS_UNSUCCESSFUL;
-        }
-        else
-        {
-            // @todo tone this down when MUTT is working!
-            TraceEvents(TRACE_LEVEL_WARNING, TRACE_URB,
-                __FUNCTION__ ": %s interface %d Alternate %d selected\n",
-                fdoContext->FrontEndPath,
-                Interface,
-                Alternate);
-        }
-        break;
-
-    } while(1);
-    
-    RequestGetRequestContext(Request)->RequestCompleted = 1;
-    ReleaseFdoLock(fdoContext);
-    WdfRequestComplete(Request, Status);
-    AcquireFdoLock(fdoContext);
-    return;
+        //
+        // The request was either completed or requeued. A requeued
+        // request sets InterfaceSwitching again when it is resubmitted.
+        //
+        fdoContext->InterfaceSwitching = FALSE;
+    }
 }
 
-NTSTATUS
-PostProcessSelectInterface(
+/**
+ * @brief does this URB have to wait for the SELECT_INTERFACE on the ring?
+ * Configuration changes and requests for pipes of the interface being
+ * switched do, everything else goes straight to the ring.
+ *
+ * @param[in] fdoContext. The context for the FDO device.
+ * @param[in] Urb. The URB being submitted.
+ *
+ * @returns TRUE if the URB has to be held.
+ */
+_Requires_lock_held_(fdoContext->WdfDevice)
+BOOLEAN
+WaitsForInterfaceSwitch(
     IN PUSB_FDO_CONTEXT fdoContext,
-    IN WDFREQUEST,
     IN PURB Urb)
 {
-    NTSTATUS Status = STATUS_SUCCESS;
+    USBD_PIPE_HANDLE PipeHandle;
 
-    ASSERT(fdoContext->ConfigBusy);
-    fdoContext->ConfigBusy = FALSE;
+    switch (Urb->UrbHeader.Function)
+    {
+    case URB_FUNCTION_SELECT_CONFIGURATION:
+    case URB_FUNCTION_SELECT_INTERFACE:
+        return TRUE;
 
-    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_URB,
+    case URB_FUNCTION_GET_INTERFACE:
+        return (Urb->UrbControlGetInterfaceRequest.Interface == fdoContext->SwitchingInterface);
+
+    case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER:
+    case URB_FUNCTION_ISOCH_TRANSFER:
+    case URB_FUNCTION_ABORT_PIPE:
+    case URB_FUNCTION_SYNC_RESET_PIPE_AND_CLEAR_STALL:
+    case URB_FUNCTION_SYNC_RESET_PIPE:
+    case URB_FUNCTION_SYNC_CLEAR_STALL:
+    case URB_FUNCTION_CONTROL_TRANSFER:
+    case URB_FUNCTION_CONTROL_TRANSFER_EX:
+        PipeHandle = Urb->UrbPipeRequest.PipeHandle;
+        break;
+
+    default:
+        return FALSE;
+    }
+    //
+    // the default pipe and invalid handles are not held, SubmitUrb()
+    // deals with them.
+    //
+    if (!PipeHandleToEndpointAddressDescriptor(fdoContext, PipeHandle))
+    {
+        return FALSE;
+    }
+    PIPE_DESCRIPTOR * pipe = (PIPE_DESCRIPTOR *) PipeHandle;
+    return (pipe->interfaceDescriptor &&
+        (pipe->interfaceDescriptor->bInterfaceNumber == fdoContext->SwitchingInterface));
+}
+
+/**
+ * @brief park a request in the InterfaceSwitchQueue until the
+ * SELECT_INTERFACE on the ring completes. Unlike RequeueRequest() the
+ * UrbQueue keeps running.
+ * *Will release and re-acquire the device lock.*
+ *
+ * @param[in] fdoContext. The context for the FDO device.
+ * @param[in] Request. The request to hold.
+ */
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+HoldForInterfaceSwitch(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN WDFREQUEST Request)
+{
+    fdoContext->InterfaceSwitchHeld = TRUE;
+
+    ReleaseFdoLock(fdoContext);
+    NTSTATUS Status;
+    if (WdfRequestGetIoQueue(Request) != fdoContext->InterfaceSwitchQueue)
+    {
+        Status = WdfRequestForwardToIoQueue(Request, fdoContext->InterfaceSwitchQueue);
+    }
+    else
+    {
+        Status = WdfRequestRequeue(Request);
+    }
+    AcquireFdoLock(fdoContext);
+
+    if (!NT_SUCCESS(Status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_URB,
+            __FUNCTION__": %s Device %p Error %x holding Request %p for interface %d\n",
+            fdoContext->FrontEndPath,
+            fdoContext->WdfDevice,
+            Status,
+            Request,
+            fdoContext->SwitchingInterface);
+        RequestGetRequestContext(Request)->RequestCompleted = 1;
+        ReleaseFdoLock(fdoContext);
+        WdfRequestComplete(Request, Status);
+        AcquireFdoLock(fdoContext);
+        return;
+    }
+    //
+    // the queue may have been emptied while the lock was dropped.
+    //
+    fdoContext->InterfaceSwitchHeld = TRUE;
+    if (!fdoContext->InterfaceSwitching)
+    {
+        ReleaseInterfaceSwitchRequests(fdoContext);
+    }
+}
+
+/**
+ * @brief submit the requests held in the InterfaceSwitchQueue, oldest
+ * first, until the queue is empty or another SELECT_INTERFACE goes on the
+ * ring. If the device is gone the requests are completed.
+ * *Will release and re-acquire the device lock.*
+ *
+ * @param[in] fdoContext. The context for the FDO device.
+ */
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+ReleaseInterfaceSwitchRequests(
+    IN PUSB_FDO_CONTEXT fdoContext)
+{
+    while (fdoContext->InterfaceSwitchHeld &&
+        (!fdoContext->InterfaceSwitching || fdoContext->DeviceUnplugged))
+    {
+        WDFREQUEST Request;
+        NTSTATUS Status = WdfIoQueueRetrieveNextRequest(fdoContext->InterfaceSwitchQueue,
+            &Request);
+        if (!NT_SUCCESS(Status))
+        {
+            fdoContext->InterfaceSwitchHeld = FALSE;
+            break;
+        }
+        if (fdoContext->DeviceUnplugged)
+        {
+            RequestGetRequestContext(Request)->RequestCompleted = 1;
+            ReleaseFdoLock(fdoContext);
+            WdfRequestComplete(Request, STATUS_DEVICE_DOES_NOT_EXIST);
+            AcquireFdoLock(fdoContext);
+            continue;
+        }
+        SubmitUrb(fdoContext, Request, URB_FROM_REQUEST(Request));
+    }
+}
+
+NTSTATUS
+PostProcessSelectInterface(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN WDFREQUEST,
+    IN PURB Urb)
+{
+    NTSTATUS Status = STATUS_SUCCESS;
+
+    ASSERT(fdoContext->InterfaceSwitching);
+    fdoContext->InterfaceSwitching = FALSE;
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_URB,
         __FUNCTION__ ": %s interface %d %d complete\n",
         fdoContext->FrontEndPath,
         Urb->UrbSelectInterface.Interface.InterfaceNumber,
@@ -1925,6 +2411,14 @@ ProcessAbortPipe(
             USB_ENDPOINT_DIRECTION_IN(endpoint->bEndpointAddress) ? "In" : "Out");
 
         Status = STATUS_SUCCESS;
+        //
+        // the next isoch transfer starts a new schedule.
+        //
+        ((PIPE_DESCRIPTOR *) Urb->UrbPipeRequest.PipeHandle)->isoStream.active = FALSE;
+        //
+        // requests held by MaxInFlightPerEndpoint never reached the backend.
+        //
+        AbortThrottledRequests(fdoContext, endpoint->bEndpointAddress);
     }
     else
     {        
@@ -2036,6 +2530,7 @@ ProcessSyncResetClearStall(
         return;
     }
     EndpointAddress = endpoint->bEndpointAddress;
+    ((PIPE_DESCRIPTOR *) Urb->UrbPipeRequest.PipeHandle)->isoStream.active = FALSE;
 
     RtlZeroMemory(&packet, sizeof(WDF_USB_CONTROL_SETUP_PACKET));
     packet.Packet.bm.Request.Dir = BMREQUEST_HOST_TO_DEVICE;
@@ -2254,6 +2749,174 @@ ProcessGetDescriptor(
         TRUE);
 }
 
+//
+// Get the system address of an URB transfer buffer described by either
+// a buffer or an MDL.
+//
+static PVOID
+UrbTransferBuffer(
+    IN PVOID TransferBuffer,
+    IN PMDL TransferBufferMDL)
+{
+    if (TransferBuffer)
+    {
+        return TransferBuffer;
+    }
+    if (TransferBufferMDL)
+    {
+        return MmGetSystemAddressForMdlSafe(TransferBufferMDL, NormalPagePriority);
+    }
+    return NULL;
+}
+
+/**
+ * @brief can a standard request be answered from the state tracked by the frontend?
+ * Only if enabled for the driver and not disabled for this device by the
+ * NoLocalStandardRequests quirk, and only while that state is known to
+ * match the device. Devices with the zero bConfigurationValue quirk
+ * always go to the device.
+ */
+_Requires_lock_held_(fdoContext->WdfDevice)
+static BOOLEAN
+StandardRequestLocal(
+    IN PUSB_FDO_CONTEXT fdoContext)
+{
+    return (fdoContext->LocalStandardRequests &&
+        fdoContext->StandardStateValid &&
+        !fdoContext->ResetInProgress &&
+        !fdoContext->CurrentConfigOffset);
+}
+
+_Requires_lock_held_(fdoContext->WdfDevice)
+static VOID
+CompleteStandardRequestLocally(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN WDFREQUEST Request,
+    IN PURB Urb)
+{
+    fdoContext->totalLocalStandardRequests++;
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_URB,
+        __FUNCTION__": %s processed locally\n",
+        UrbFunctionToString(Urb->UrbHeader.Function));
+
+    RequestGetRequestContext(Request)->RequestCompleted = 1;
+    ReleaseFdoLock(fdoContext);
+    WdfRequestComplete(Request, STATUS_SUCCESS);
+    AcquireFdoLock(fdoContext);
+}
+
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+ProcessGetConfiguration(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN WDFREQUEST Request,
+    IN PURB Urb)
+{
+    if (Urb->UrbControlGetConfigurationRequest.TransferBufferLength < 1)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_URB,
+            __FUNCTION__": %s invalid length %d\n",
+            fdoContext->FrontEndPath,
+            Urb->UrbControlGetConfigurationRequest.TransferBufferLength);
+
+        RequestGetRequestContext(Request)->RequestCompleted = 1;
+        ReleaseFdoLock(fdoContext);
+        WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
+        AcquireFdoLock(fdoContext);
+        return;
+    }
+
+    if (StandardRequestLocal(fdoContext))
+    {
+        PUCHAR buffer = (PUCHAR) UrbTransferBuffer(
+            Urb->UrbControlGetConfigurationRequest.TransferBuffer,
+            Urb->UrbControlGetConfigurationRequest.TransferBufferMDL);
+        if (buffer)
+        {
+            buffer[0] = fdoContext->CurrentConfigValue;
+            Urb->UrbControlGetConfigurationRequest.TransferBufferLength = 1;
+            CompleteStandardRequestLocally(fdoContext, Request, Urb);
+            return;
+        }
+    }
+
+    WDF_USB_CONTROL_SETUP_PACKET packet;
+    RtlZeroMemory(&packet, sizeof(WDF_USB_CONTROL_SETUP_PACKET));
+    packet.Packet.bm.Request.Dir = BMREQUEST_DEVICE_TO_HOST;
+    packet.Packet.bm.Request.Type = BMREQUEST_STANDARD;
+    packet.Packet.bm.Request.Recipient = BMREQUEST_TO_DEVICE;
+    packet.Packet.bRequest = USB_REQUEST_GET_CONFIGURATION;
+    packet.Packet.wLength = 1;
+
+    PutUrbOnRing(
+        fdoContext,
+        &packet,
+        Request,
+        UsbdPipeTypeControl,
+        USB_ENDPOINT_TYPE_CONTROL | USB_ENDPOINT_DIRECTION_MASK, // control IN
+        TRUE,
+        FALSE);
+}
+
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+ProcessGetInterface(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN WDFREQUEST Request,
+    IN PURB Urb)
+{
+    USHORT Interface = Urb->UrbControlGetInterfaceRequest.Interface;
+
+    if (Urb->UrbControlGetInterfaceRequest.TransferBufferLength < 1)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_URB,
+            __FUNCTION__": %s invalid length %d\n",
+            fdoContext->FrontEndPath,
+            Urb->UrbControlGetInterfaceRequest.TransferBufferLength);
+
+        RequestGetRequestContext(Request)->RequestCompleted = 1;
+        ReleaseFdoLock(fdoContext);
+        WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
+        AcquireFdoLock(fdoContext);
+        return;
+    }
+
+    if (StandardRequestLocal(fdoContext) &&
+        (Interface < MAX_TRACKED_INTERFACES) &&
+        FindInterface(fdoContext, NULL, (UCHAR) Interface, 0))
+    {
+        PUCHAR buffer = (PUCHAR) UrbTransferBuffer(
+            Urb->UrbControlGetInterfaceRequest.TransferBuffer,
+            Urb->UrbControlGetInterfaceRequest.TransferBufferMDL);
+        if (buffer)
+        {
+            buffer[0] = fdoContext->AlternateSettings[Interface];
+            Urb->UrbControlGetInterfaceRequest.TransferBufferLength = 1;
+            CompleteStandardRequestLocally(fdoContext, Request, Urb);
+            return;
+        }
+    }
+
+    WDF_USB_CONTROL_SETUP_PACKET packet;
+    RtlZeroMemory(&packet, sizeof(WDF_USB_CONTROL_SETUP_PACKET));
+    packet.Packet.bm.Request.Dir = BMREQUEST_DEVICE_TO_HOST;
+    packet.Packet.bm.Request.Type = BMREQUEST_STANDARD;
+    packet.Packet.bm.Request.Recipient = BMREQUEST_TO_INTERFACE;
+    packet.Packet.bRequest = USB_REQUEST_GET_INTERFACE;
+    packet.Packet.wIndex.Value = Interface;
+    packet.Packet.wLength = 1;
+
+    PutUrbOnRing(
+        fdoContext,
+        &packet,
+        Request,
+        UsbdPipeTypeControl,
+        USB_ENDPOINT_TYPE_CONTROL | USB_ENDPOINT_DIRECTION_MASK, // control IN
+        TRUE,
+        FALSE);
+}
+
 _Requires_lock_held_(fdoContext->WdfDevice)
 VOID
 ProcessGetStatus(
@@ -2298,6 +2961,42 @@ ProcessGetStatus(
         AcquireFdoLock(fdoContext);;
         return;
     }
+    //
+    // Device and interface status are stable for USB 2.0 devices: self powered
+    // comes from the configuration and remote wakeup is tracked from
+    // SET/CLEAR_FEATURE. SuperSpeed adds link power and function suspend
+    // state, and endpoint status reflects halt conditions, so those go to
+    // the device.
+    //
+    if (StandardRequestLocal(fdoContext) &&
+        (fdoContext->DeviceSpeed < UsbSuperSpeed) &&
+        (fdoContext->ConfigurationDescriptor) &&
+        (((Recipient == BMREQUEST_TO_DEVICE) && (Urb->UrbControlGetStatusRequest.Index == 0)) ||
+         ((Recipient == BMREQUEST_TO_INTERFACE) && 
+          FindInterface(fdoContext, NULL, (UCHAR) Urb->UrbControlGetStatusRequest.Index, 0))))
+    {
+        PUSHORT status = (PUSHORT) UrbTransferBuffer(
+            Urb->UrbControlGetStatusRequest.TransferBuffer,
+            Urb->UrbControlGetStatusRequest.TransferBufferMDL);
+        if (status)
+        {
+            *status = 0;
+            if (Recipient == BMREQUEST_TO_DEVICE)
+            {
+                if (fdoContext->ConfigurationDescriptor->bmAttributes & USB_CONFIG_SELF_POWERED)
+                {
+                    *status |= USB_GETSTATUS_SELF_POWERED;
+                }
+                if (fdoContext->RemoteWakeupEnabled)
+                {
+                    *status |= USB_GETSTATUS_REMOTE_WAKEUP_ENABLED;
+                }
+            }
+            Urb->UrbControlGetStatusRequest.TransferBufferLength = 2;
+            CompleteStandardRequestLocally(fdoContext, Request, Urb);
+            return;
+        }
+    }
 
     UCHAR control = USB_ENDPOINT_TYPE_CONTROL | USB_ENDPOINT_DIRECTION_MASK; // IN
 
@@ -2350,13 +3049,203 @@ ProcessResetRequest(
         TRUE);
 }
 
+/**
+* @brief Queues an AbortEndpointWorker, or an AbortEndpointWaitWorker if an
+* abort is already in progress, for the pipe of a cancelled request that is
+* on the ring. If there are no work items left the request is completed.
+* *Must be called with lock held*
+*
+* @param[in] fdoContext the FDO context.
+* @param[in] Request the cancelled URB request.
+*
+* @returns TRUE if the request is taken care of, the lock has been released.
+* FALSE if the request has no endpoint to abort, the lock is still held.
+*/
+_Requires_lock_held_(fdoContext->WdfDevice)
+static BOOLEAN
+AbortPipeForCancelledRequest(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN WDFREQUEST Request)
+{
+    //
+    // find the endpoint and do an abort endpoint,
+    //
+    PURB Urb = (PURB) URB_FROM_REQUEST(Request);
+    switch (Urb->UrbHeader.Function)
+    {
+    case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER:
+    case URB_FUNCTION_ISOCH_TRANSFER:
+    case URB_FUNCTION_CONTROL_TRANSFER:
+    case URB_FUNCTION_CONTROL_TRANSFER_EX:
+        break;
+
+    case URB_FUNCTION_SELECT_INTERFACE:
+        //
+        // PostProcessUrb() will not see this request so release the
+        // held requests here. UrbPipeRequest.PipeHandle overlays the
+        // ConfigurationHandle, there is no pipe to abort.
+        //
+        fdoContext->InterfaceSwitching = FALSE;
+        return FALSE;
+
+    default:
+        //
+        // no PipeHandle in this URB.
+        //
+        return FALSE;
+    }
+    PIPE_DESCRIPTOR * pipe = (PIPE_DESCRIPTOR *) Urb->UrbPipeRequest.PipeHandle;
+    PUSB_ENDPOINT_DESCRIPTOR endpoint = 
+        PipeHandleToEndpointAddressDescriptor(fdoContext, Urb->UrbPipeRequest.PipeHandle);
+    PCHAR UrbFuncString = UrbFunctionToString(Urb->UrbHeader.Function);
+    //
+    // if there is no valid endpoint we can't abort it.
+    //
+    if (!endpoint)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
+            __FUNCTION__": %s Device %p no endpoint for Request %p %s\n",
+            fdoContext->FrontEndPath,
+            fdoContext->WdfDevice,
+            Request,
+            UrbFuncString);
+        return FALSE;
+    }
+
+    ULONG doAbort = TRUE;
+
+    if (pipe->abortInProgress)
+    {
+        // let the current abort handle things.
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
+            __FUNCTION__ ": %s Device %p Request %p EA %x abort in progress wait for abort completion.\n",
+            fdoContext->FrontEndPath,
+            fdoContext->WdfDevice,
+            Request,
+            endpoint->bEndpointAddress);
+        doAbort = FALSE;
+    }
+
+    WDFWORKITEM worker = NewWorkItem(fdoContext,
+        doAbort ? AbortEndpointWorker : AbortEndpointWaitWorker,
+        (ULONG_PTR) endpoint->bEndpointAddress,
+        (ULONG_PTR) Request,
+        (ULONG_PTR) pipe, 
+        0);
+
+    if (worker)
+    {
+        pipe->abortInProgress = TRUE;
+        if (doAbort)
+        {
+            KeClearEvent(&pipe->abortCompleteEvent);
+            pipe->abortWaiters = 0;
+        }
+        else
+        {
+            pipe->abortWaiters++;
+        }
+
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
+            __FUNCTION__ ": %s Device %p queue %s for Request %p EA %x %s waiters %d\n",
+            fdoContext->FrontEndPath,
+            fdoContext->WdfDevice,
+            doAbort ? "AbortEndpointWorker" : "AbortEndpointWaitWorker",
+            Request,
+            endpoint->bEndpointAddress,
+            UrbFuncString,
+            pipe->abortWaiters);
+
+        WdfWorkItemEnqueue(worker);
+        ReleaseFdoLock(fdoContext);
+        return TRUE;
+    }
+    //
+    // oh great no memory.
+    // reserve more work items!
+    //
+    RequestGetRequestContext(Request)->RequestCompleted = 1;   
+    RequestGetRequestContext(Request)->CancelSet = 0;
+    ReleaseFdoLock(fdoContext);
+
+    TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
+        __FUNCTION__ ": %s Device %p no work items for abort pipe of cancelled Request %p\n",
+        fdoContext->FrontEndPath,
+        fdoContext->WdfDevice,
+        Request);
+    WdfRequestComplete(Request, STATUS_CANCELLED);
+    return TRUE;
+}
+
+/**
+* @brief Queues a ResetDeviceWorker for a cancelled request that could not
+* be cancelled any other way, or completes the request.
+* *Must be called with lock held*, releases it.
+*
+* @param[in] fdoContext the FDO context.
+* @param[in] Request the cancelled request.
+*/
+_Requires_lock_held_(fdoContext->WdfDevice)
+_Releases_lock_(fdoContext->WdfDevice)
+static VOID
+ResetDeviceForCancelledRequest(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN WDFREQUEST Request)
+{
+    if (fdoContext->ResetInProgress)
+    {
+        XXX_TODO("like aborts, this needs to have a waitforresetworker for each request.");        
+        RequestGetRequestContext(Request)->RequestCompleted = 1;  
+        RequestGetRequestContext(Request)->CancelSet = 0;
+        FreeShadowForRequest(fdoContext->Xen, Request);
+        ReleaseFdoLock(fdoContext);
+        WdfRequestComplete(Request, STATUS_CANCELLED);
+        return;
+    }
+    //
+    // this request has to be processed at passive level
+    //
+    WDFWORKITEM worker = NewWorkItem(fdoContext,
+        ResetDeviceWorker,
+        (ULONG_PTR) Request,
+        0,0,0);
+
+    if (worker)
+    {
+        fdoContext->ResetInProgress = TRUE;
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
+            __FUNCTION__ ": %s Device %p queue ResetDeviceWorker for Request %p \n",
+            fdoContext->FrontEndPath,
+            fdoContext->WdfDevice,
+            Request);
+        WdfWorkItemEnqueue(worker);
+        ReleaseFdoLock(fdoContext);
+        return;
+    }
+
+
+    TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
+        __FUNCTION__ ": %s Device %p no work items for reset device for cancelled Request %p\n",
+        fdoContext->FrontEndPath,
+        fdoContext->WdfDevice,
+        Request);
+
+    FreeShadowForRequest(fdoContext->Xen, Request);
+    RequestGetRequestContext(Request)->RequestCompleted = 1;     
+    RequestGetRequestContext(Request)->CancelSet = 0;
+    ReleaseFdoLock(fdoContext);
+    WdfRequestComplete(Request, STATUS_CANCELLED);
+    return;
+}
+
 /**
 * @brief Called by the framework when a request has been cancelled and
 * that request is currently in progress ("on the hardware" i.e. owned by DOM0.)
 * This function is responsible for initiating an abort of the request.
-* It does this by either queuing an AbortEndpointWorker request if there is
-* an endpoint, or a ResetDeviceWorker if there isn't, or failing that completing
-* the request itself.
+* If the backend supports it only this request is cancelled on the ring and
+* the DPC completes it. Otherwise it queues an AbortEndpointWorker request if
+* there is an endpoint, or a ResetDeviceWorker if there isn't, or failing that
+* completes the request itself.
 *
 * @param[in] Request the handle to the WdfRequest object to cancel.
 *
@@ -2424,140 +3313,67 @@ EvtFdoOnHardwareRequestCancelled(
                 IOCTL_INTERNAL_USB_SUBMIT_URB);
             break;
         }
-        //
-        // we have a urb so find an endpoint and do an abort endpoint,
-        //
-        PURB Urb = (PURB) URB_FROM_REQUEST(Request);
-        PIPE_DESCRIPTOR * pipe = (PIPE_DESCRIPTOR *) Urb->UrbPipeRequest.PipeHandle;
-        PUSB_ENDPOINT_DESCRIPTOR endpoint = 
-            PipeHandleToEndpointAddressDescriptor(fdoContext, Urb->UrbPipeRequest.PipeHandle);
-        PCHAR UrbFuncString = UrbFunctionToString(Urb->UrbHeader.Function);
-        //
-        // if there is no valid endpoint we can't abort it.
-        //
-        if (!endpoint)
+        PFDO_REQUEST_CONTEXT requestContext = RequestGetRequestContext(Request);
+        if (requestContext->ResponseReceived)
         {
-            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
-                __FUNCTION__": %s Device %p no endpoint for Request %p %s\n",
-                fdoContext->FrontEndPath,
-                fdoContext->WdfDevice,
-                Request,
-                UrbFuncString);
-            break;
+            //
+            // the response raced the cancel, nothing left to cancel.
+            //
+            FreeShadowForRequest(fdoContext->Xen, Request);
+            requestContext->RequestCompleted = 1;
+            requestContext->CancelSet = 0;
+            ReleaseFdoLock(fdoContext);
+            WdfRequestComplete(Request, STATUS_CANCELLED);
+            return;
         }
-
-        ULONG doAbort = TRUE;
-
-        if (pipe->abortInProgress)
+        if (PutCancelRequestOnRing(fdoContext, Request))
         {
-            // let the current abort handle things.
-            TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
-                __FUNCTION__ ": %s Device %p Request %p EA %x abort in progress wait for abort completion.\n",
-                fdoContext->FrontEndPath,
-                fdoContext->WdfDevice,
-                Request,
-                endpoint->bEndpointAddress);
-            doAbort = FALSE;
+            //
+            // the request stays on the ring and the DPC completes it
+            // as it would any other response. AbortTimedOutCancels()
+            // aborts the pipe if the backend does not answer.
+            //
+            requestContext->CancelSet = 0;
+            requestContext->CancelOnRing = 1;
+            requestContext->CancelOnRingTime = KeQueryInterruptTime();
+            ReleaseFdoLock(fdoContext);
+            return;
         }
-
-        WDFWORKITEM worker = NewWorkItem(fdoContext,
-            doAbort ? AbortEndpointWorker : AbortEndpointWaitWorker,
-            (ULONG_PTR) endpoint->bEndpointAddress,
-            (ULONG_PTR) Request,
-            (ULONG_PTR) pipe, 
-            0);
-
-        if (worker)
+        if (AbortPipeForCancelledRequest(fdoContext, Request))
         {
-            pipe->abortInProgress = TRUE;
-            if (doAbort)
-            {
-                KeClearEvent(&pipe->abortCompleteEvent);
-                pipe->abortWaiters = 0;
-            }
-            else
-            {
-                pipe->abortWaiters++;
-            }
-
-            TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
-                __FUNCTION__ ": %s Device %p queue %s for Request %p EA %x %s waiters %d\n",
-                fdoContext->FrontEndPath,
-                fdoContext->WdfDevice,
-                doAbort ? "AbortEndpointWorker" : "AbortEndpointWaitWorker",
-                Request,
-                endpoint->bEndpointAddress,
-                UrbFuncString,
-                pipe->abortWaiters);
-
-            WdfWorkItemEnqueue(worker);
-            ReleaseFdoLock(fdoContext);
             return;
         }
-        //
-        // oh great no memory.
-        // reserve more work items!
-        //
-        RequestGetRequestContext(Request)->RequestCompleted = 1;   
-        RequestGetRequestContext(Request)->CancelSet = 0;
-        ReleaseFdoLock(fdoContext);
-
-        TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
-            __FUNCTION__ ": %s Device %p no work items for abort pipe of cancelled Request %p\n",
-            fdoContext->FrontEndPath,
-            fdoContext->WdfDevice,
-            Request);
-        WdfRequestComplete(Request, STATUS_CANCELLED);
-        return;
-
     } while (0);
-
-    // just reset the entire device, but this should not happen.
-
-    if (fdoContext->ResetInProgress)
-    {
-        XXX_TODO("like aborts, this needs to have a waitforresetworker for each request.");        
-        RequestGetRequestContext(Request)->RequestCompleted = 1;  
-        RequestGetRequestContext(Request)->CancelSet = 0;
-        FreeShadowForRequest(fdoContext->Xen, Request);
-        ReleaseFdoLock(fdoContext);
-        WdfRequestComplete(Request, STATUS_CANCELLED);
-        return;
-    }
     //
-    // this request has to be processed at passive level
+    // just reset the entire device, but this should not happen.
     //
-    WDFWORKITEM worker = NewWorkItem(fdoContext,
-        ResetDeviceWorker,
-        (ULONG_PTR) Request,
-        0,0,0);
+    ResetDeviceForCancelledRequest(fdoContext, Request);
+}
 
-    if (worker)
+/**
+* @brief Called from the watchdog. A request cancelled on the ring is
+* completed by its own response, if the backend has not sent that within
+* CANCEL_ON_RING_TIMEOUT abort the pipe as EvtFdoOnHardwareRequestCancelled()
+* does when the backend cannot cancel a single request.
+* *Must be called with lock held*
+*
+* @param[in] fdoContext the FDO context.
+*/
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+AbortTimedOutCancels(
+    IN PUSB_FDO_CONTEXT fdoContext)
+{
+    WDFREQUEST Request;
+    while (!fdoContext->DeviceUnplugged &&
+        ((Request = GetTimedOutCancelRequest(fdoContext)) != NULL))
     {
-        fdoContext->ResetInProgress = TRUE;
-        TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
-            __FUNCTION__ ": %s Device %p queue ResetDeviceWorker for Request %p \n",
-            fdoContext->FrontEndPath,
-            fdoContext->WdfDevice,
-            Request);
-        WdfWorkItemEnqueue(worker);
-        ReleaseFdoLock(fdoContext);
-        return;
+        if (!AbortPipeForCancelledRequest(fdoContext, Request))
+        {
+            ResetDeviceForCancelledRequest(fdoContext, Request);
+        }
+        AcquireFdoLock(fdoContext);
     }
-
-
-    TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
-        __FUNCTION__ ": %s Device %p no work items for reset device for cancelled Request %p\n",
-        fdoContext->FrontEndPath,
-        fdoContext->WdfDevice,
-        Request);
-
-    FreeShadowForRequest(fdoContext->Xen, Request);
-    RequestGetRequestContext(Request)->RequestCompleted = 1;     
-    RequestGetRequestContext(Request)->CancelSet = 0;
-    ReleaseFdoLock(fdoContext);
-    WdfRequestComplete(Request, STATUS_CANCELLED);
-    return;
 }
 
 
@@ -42,4 +42,38 @@ ProcessResetRequest(
     IN PUSB_FDO_CONTEXT fdoContext,
     IN WDFREQUEST Request);
 
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+DrainIsoFastPath(
+    IN PUSB_FDO_CONTEXT fdoContext);
+
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+CompleteIsoFastSlot(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN PISO_FAST_SLOT slot,
+    IN USBD_STATUS usbdStatus);
+
 EVT_WDF_REQUEST_CANCEL  EvtFdoOnHardwareRequestCancelled;
+
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+AbortTimedOutCancels(
+    IN PUSB_FDO_CONTEXT fdoContext);
+
+_Requires_lock_held_(fdoContext->WdfDevice)
+BOOLEAN
+WaitsForInterfaceSwitch(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN PURB Urb);
+
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+HoldForInterfaceSwitch(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN WDFREQUEST Request);
+
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+ReleaseInterfaceSwitchRequests(
+    IN PUSB_FDO_CONTEXT fdoContext);
@@ -41,8 +41,7 @@ VOID
 PostProcessScratch(
     IN PUSB_FDO_CONTEXT fdoContext, 
     IN NTSTATUS usbdStatus,
-    IN PCHAR usbifStatusString,
-    IN PCHAR usbdStatusString,
+    IN LONG usbifStatus,
     IN ULONG BytesTransferred, 
     IN ULONG Data)
 {
@@ -71,12 +70,46 @@ PostProcessScratch(
             __FUNCTION__": %s Scratch request error %x usbif %s usbd %s\n",
             fdoContext->FrontEndPath,
             usbdStatus,
-            usbifStatusString,
-            usbdStatusString);
+            UsbifStatusToString(usbifStatus),
+            UsbdStatusToString(usbdStatus));
     }
     KeSetEvent(&fdoContext->ScratchPad.CompletionEvent, IO_NO_INCREMENT, FALSE);
 }
 
+//
+// A standard request sent as a raw control transfer can change the device
+// state tracked for local standard request processing. Stop answering
+// locally until the configuration is selected again.
+//
+static VOID
+CheckStandardControlTransfer(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN PUCHAR SetupPacket)
+{
+    PWDF_USB_CONTROL_SETUP_PACKET packet = (PWDF_USB_CONTROL_SETUP_PACKET) SetupPacket;
+
+    if ((packet->Packet.bm.Request.Type != BMREQUEST_STANDARD) ||
+        (packet->Packet.bm.Request.Dir != BMREQUEST_HOST_TO_DEVICE) ||
+        (packet->Packet.bm.Request.Recipient == BMREQUEST_TO_ENDPOINT))
+    {
+        return;
+    }
+    switch (packet->Packet.bRequest)
+    {
+    case USB_REQUEST_SET_CONFIGURATION:
+        DescriptorCacheFlush(fdoContext);
+        fdoContext->StandardStateValid = FALSE;
+        break;
+    case USB_REQUEST_SET_FEATURE:
+    case USB_REQUEST_CLEAR_FEATURE:
+    case USB_REQUEST_SET_INTERFACE:
+        fdoContext->StandardStateValid = FALSE;
+        break;
+    default:
+        break;
+    }
+}
+
 //
 // handle descriptor and interface operations here
 // in order to provide enough of a usbport emulation
@@ -125,7 +158,19 @@ PostProcessUrb(
         // UsbBuildGetDescriptorRequest
         //
     case URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE:
+    case URB_FUNCTION_GET_DESCRIPTOR_FROM_INTERFACE:
+    case URB_FUNCTION_GET_DESCRIPTOR_FROM_ENDPOINT:
         {
+            ULONG requestedLength = Urb->UrbControlDescriptorRequest.TransferBufferLength;
+            UCHAR recipient = BMREQUEST_TO_DEVICE;
+            if (Urb->UrbHeader.Function == URB_FUNCTION_GET_DESCRIPTOR_FROM_INTERFACE)
+            {
+                recipient = BMREQUEST_TO_INTERFACE;
+            }
+            else if (Urb->UrbHeader.Function == URB_FUNCTION_GET_DESCRIPTOR_FROM_ENDPOINT)
+            {
+                recipient = BMREQUEST_TO_ENDPOINT;
+            }
             Urb->UrbControlDescriptorRequest.TransferBufferLength = bytesTransferred;
             if (NT_SUCCESS(Status))
             {
@@ -154,6 +199,17 @@ PostProcessUrb(
                         break;
                     }
                 }
+                DescriptorCacheCapture(fdoContext,
+                    recipient,
+                    Urb,
+                    buffer,
+                    requestedLength,
+                    bytesTransferred);
+
+                if (recipient != BMREQUEST_TO_DEVICE)
+                {
+                    break;
+                }
                 switch (Urb->UrbControlDescriptorRequest.DescriptorType)
                 {
                 case USB_DEVICE_DESCRIPTOR_TYPE:
@@ -265,21 +321,45 @@ PostProcessUrb(
         }
         if (!NT_SUCCESS(Status))
         {
-            if (fdoContext->ConfigBusy)
-            {
-                fdoContext->ConfigBusy = FALSE;
-            }
             //
-            // zero out the data?
+            // the client still owns the pipe information, only report the
+            // failure.
             //
-            RtlZeroMemory(Urb, Urb->UrbHeader.Length);
+            fdoContext->InterfaceSwitching = FALSE;
+            Urb->UrbHeader.Status = *usbdStatus;
         }
         break;
 
     case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER:
+        Urb->UrbControlTransfer.TransferBufferLength = bytesTransferred;
+        break;
+
     case URB_FUNCTION_CONTROL_TRANSFER:
+        Urb->UrbControlTransfer.TransferBufferLength = bytesTransferred;
+        CheckStandardControlTransfer(fdoContext, Urb->UrbControlTransfer.SetupPacket);
+        break;
+
     case URB_FUNCTION_CONTROL_TRANSFER_EX:
         Urb->UrbControlTransfer.TransferBufferLength = bytesTransferred;
+        CheckStandardControlTransfer(fdoContext, Urb->UrbControlTransferEx.SetupPacket);
+        break;
+
+    case URB_FUNCTION_GET_CONFIGURATION:
+    case URB_FUNCTION_GET_INTERFACE:
+        Urb->UrbControlGetConfigurationRequest.TransferBufferLength = bytesTransferred;
+        break;
+
+    case URB_FUNCTION_SET_FEATURE_TO_DEVICE:
+    case URB_FUNCTION_CLEAR_FEATURE_TO_DEVICE:
+        //
+        // track remote wakeup for local GET_STATUS processing.
+        //
+        if (NT_SUCCESS(Status) &&
+            (Urb->UrbControlFeatureRequest.FeatureSelector == USB_FEATURE_REMOTE_WAKEUP))
+        {
+            fdoContext->RemoteWakeupEnabled =
+                (Urb->UrbHeader.Function == URB_FUNCTION_SET_FEATURE_TO_DEVICE);
+        }
         break;
 
     case URB_FUNCTION_ISOCH_TRANSFER:
@@ -299,8 +379,8 @@ PostProcessUrb(
                 Urb);
             Status = STATUS_UNSUCCESSFUL;
         }
-        fdoContext->ScratchPad.FrameNumber = startFrame + 
-            Urb->UrbIsochronousTransfer.NumberOfPackets;
+        FrameClockObserve(fdoContext,
+            startFrame + Urb->UrbIsochronousTransfer.NumberOfPackets);
         break;
 
     case URB_FUNCTION_CLASS_DEVICE:
@@ -405,8 +485,14 @@ PostProcessSelectInterface(
 {
     NTSTATUS Status = STATUS_SUCCESS;
 
-    ASSERT(fdoContext->ConfigBusy);
-    fdoContext->ConfigBusy = FALSE;
+    ASSERT(fdoContext->InterfaceSwitching);
+    fdoContext->InterfaceSwitching = FALSE;
+
+    if (Urb->UrbSelectInterface.Interface.InterfaceNumber < MAX_TRACKED_INTERFACES)
+    {
+        fdoContext->AlternateSettings[Urb->UrbSelectInterface.Interface.InterfaceNumber] =
+            Urb->UrbSelectInterface.Interface.AlternateSetting;
+    }
 
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DPC,
         __FUNCTION__": interface %d %d complete\n",
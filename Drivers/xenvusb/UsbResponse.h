@@ -27,8 +27,7 @@ VOID
 PostProcessScratch(
     IN PUSB_FDO_CONTEXT fdoContext, 
     IN NTSTATUS usbdStatus,
-    IN PCHAR usbifStatusString,
-    IN PCHAR usbdStatusString,
+    IN LONG usbifStatus,
     IN ULONG BytesTransferred, 
     IN ULONG Data);
 
@@ -0,0 +1,495 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file UsbifCore.h platform neutral usbif ringbuffer and shadow id bookkeeping.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#pragma once
+
+//
+/// Nothing in this file calls WDF or the NT kernel. It depends only on
+/// usbxenif.h, the Xen ring macros, the USBD status codes and iso packet
+/// descriptor from usb.h and the USBIF_CORE_* hooks, which default to the
+/// kernel versions. Include it after usb.h and usbxenif.h.
+/// host/UsbifHost.h supplies the types and ring macros for a host build.
+//
+#ifndef USBIF_CORE_BARRIER
+#define USBIF_CORE_BARRIER() KeMemoryBarrier()
+#endif
+
+#ifndef USBIF_CORE_ASSERT
+#define USBIF_CORE_ASSERT(_exp_) ASSERT(_exp_)
+#endif
+
+//
+/// LIFO stack of free shadow ids. The most recently freed shadow is reused
+/// first, it is the one most likely to still be in the cache.
+//
+struct USBIF_ID_STACK
+{
+    uint16_t * Ids;     //!< Entries ids, caller allocated.
+    uint16_t   Entries;
+    uint16_t   Free;    //!< ids on the stack.
+    uint16_t   MinFree; //!< low water mark.
+};
+
+inline void
+UsbifIdStackInit(
+    USBIF_ID_STACK * Stack,
+    uint16_t * Ids,
+    uint16_t Entries)
+{
+    Stack->Ids = Ids;
+    Stack->Entries = Entries;
+    Stack->Free = 0;
+    Stack->MinFree = Entries;
+}
+
+inline bool
+UsbifIdStackPop(
+    USBIF_ID_STACK * Stack,
+    uint16_t * Id)
+{
+    if (Stack->Free == 0)
+    {
+        return false;
+    }
+    Stack->Free--;
+    if (Stack->Free < Stack->MinFree)
+    {
+        Stack->MinFree = Stack->Free;
+    }
+    *Id = Stack->Ids[Stack->Free];
+    return true;
+}
+
+inline bool
+UsbifIdStackPush(
+    USBIF_ID_STACK * Stack,
+    uint16_t Id)
+{
+    USBIF_CORE_ASSERT(Stack->Free < Stack->Entries);
+    if (Stack->Free >= Stack->Entries)
+    {
+        return false;
+    }
+    Stack->Ids[Stack->Free] = Id;
+    Stack->Free++;
+    return true;
+}
+
+//
+/// one bit per id, set while the id is allocated. Lets the owner visit the
+/// allocated ids without walking every entry.
+//
+#define USBIF_ID_BITMAP_WORDS(_entries_) (((_entries_) + 31) / 32)
+
+inline void
+UsbifIdBitmapSet(
+    uint32_t * Bitmap,
+    uint16_t Id)
+{
+    Bitmap[Id / 32] |= (1u << (Id % 32));
+}
+
+inline void
+UsbifIdBitmapClear(
+    uint32_t * Bitmap,
+    uint16_t Id)
+{
+    Bitmap[Id / 32] &= ~(1u << (Id % 32));
+}
+
+inline bool
+UsbifIdBitmapTest(
+    const uint32_t * Bitmap,
+    uint16_t Id)
+{
+    return (Bitmap[Id / 32] & (1u << (Id % 32))) != 0;
+}
+
+//
+/// the first set id at or after Start, Entries if there is none.
+//
+inline uint16_t
+UsbifIdBitmapNext(
+    const uint32_t * Bitmap,
+    uint16_t Entries,
+    uint32_t Start)
+{
+    uint32_t id = Start;
+    while (id < Entries)
+    {
+        uint32_t word = Bitmap[id / 32] >> (id % 32);
+        if (word == 0)
+        {
+            id = (id | 31) + 1;
+            continue;
+        }
+        while ((word & 1) == 0)
+        {
+            word >>= 1;
+            id++;
+        }
+        break;
+    }
+    return (uint16_t) ((id < Entries) ? id : Entries);
+}
+
+//
+/// copy a request into the next free slot of the front ring. The caller
+/// pushes the requests and notifies the backend.
+//
+inline usbif_request_t *
+UsbifRingPutRequest(
+    usbif_front_ring_t * Ring,
+    const usbif_request_t * Request)
+{
+    usbif_request_t * slot = RING_GET_REQUEST(Ring, Ring->req_prod_pvt);
+    memcpy(slot, Request, sizeof(usbif_request_t));
+    Ring->req_prod_pvt++;
+    return slot;
+}
+
+//
+/// the response producer index. Responses before it can be read once this
+/// returns.
+//
+inline RING_IDX
+UsbifRingResponseProducer(
+    usbif_front_ring_t * Ring)
+{
+    RING_IDX rp = Ring->sring->rsp_prod;
+    USBIF_CORE_BARRIER();
+    return rp;
+}
+
+//
+/// the response id is written by the backend, it has to name a shadow.
+//
+inline bool
+UsbifResponseIdValid(
+    const usbif_response_t * Response,
+    uint32_t Entries)
+{
+    return Response->id < Entries;
+}
+
+enum USBIF_RESPONSE_CHECK
+{
+    UsbifResponseValid,  //!< names an allocated id.
+    UsbifResponseBadId,  //!< the id is out of range.
+    UsbifResponseStale   //!< the id is not allocated, already completed or cancelled.
+};
+
+//
+/// copy the response at Index off the shared ring and check its id against
+/// the allocated ids. The backend can rewrite the ring at any time, only the
+/// copy may be used once it has been checked.
+//
+inline USBIF_RESPONSE_CHECK
+UsbifRingGetResponse(
+    usbif_front_ring_t * Ring,
+    RING_IDX Index,
+    const uint32_t * InUse,
+    uint16_t Entries,
+    usbif_response_t * Response)
+{
+    memcpy(Response, RING_GET_RESPONSE(Ring, Index), sizeof(usbif_response_t));
+    if (!UsbifResponseIdValid(Response, Entries))
+    {
+        return UsbifResponseBadId;
+    }
+    if (!UsbifIdBitmapTest(InUse, (uint16_t) Response->id))
+    {
+        return UsbifResponseStale;
+    }
+    return UsbifResponseValid;
+}
+
+//
+/// the responses before Index have been consumed. Returns true if more
+/// arrived in the meantime. Otherwise, if Rearm, asks the backend for an
+/// event with the next response. With requests outstanding the final check
+/// always rearms.
+//
+inline bool
+UsbifRingFinishResponses(
+    usbif_front_ring_t * Ring,
+    RING_IDX Index,
+    bool Rearm)
+{
+    Ring->rsp_cons = Index;
+    if (Index != Ring->req_prod_pvt)
+    {
+        int moreWork;
+        RING_FINAL_CHECK_FOR_RESPONSES(Ring, moreWork);
+        return moreWork != 0;
+    }
+    if (Rearm)
+    {
+        Ring->sring->rsp_event = Index + 1;
+    }
+    return false;
+}
+
+//
+/// Grant references for a request. GrantOps is the platform grant table:
+///
+///   grant_ref_t GetRef();     USBIF_INVALID_GRANT_REF if none are left.
+///   void GrantAccess(uint64_t Pfn, grant_ref_t Ref);
+///   bool EndAccess(grant_ref_t Ref);    false if the ref leaked.
+//
+#define USBIF_INVALID_GRANT_REF ((grant_ref_t) 0xFFFFFFFF)
+
+//
+/// grant Count pages to the backend, appended to Request->gref. Can be
+/// called more than once for a request, nr_segments is where the next
+/// gref goes. On failure the grefs already granted stay on the request
+/// for UsbifReleaseSegments().
+//
+template <class GrantOps, class Pfn>
+inline bool
+UsbifGrantSegments(
+    usbif_request_t * Request,
+    const Pfn * Pfns,
+    uint32_t Count,
+    GrantOps & Ops)
+{
+    for (uint32_t index = 0; index < Count; index++)
+    {
+        if (Request->nr_segments >= USBIF_URB_MAX_SEGMENTS_PER_REQUEST)
+        {
+            return false;
+        }
+        grant_ref_t ref = Ops.GetRef();
+        if (ref == USBIF_INVALID_GRANT_REF)
+        {
+            return false;
+        }
+        Ops.GrantAccess((uint64_t) Pfns[index], ref);
+        Request->gref[Request->nr_segments] = ref;
+        Request->nr_segments++;
+    }
+    return true;
+}
+
+//
+/// fill PageCount indirect pages with grefs for the PacketPages iso packet
+/// descriptor pages, which come first, then the Count data pages. The
+/// indirect pages themselves are granted with UsbifGrantSegments().
+//
+template <class GrantOps, class Pfn>
+inline bool
+UsbifGrantIndirectSegments(
+    usbif_indirect_page_t * Pages,
+    uint32_t PageCount,
+    const Pfn * PacketPfns,
+    uint32_t PacketPages,
+    const Pfn * Pfns,
+    uint32_t Count,
+    GrantOps & Ops)
+{
+    if ((PacketPages + Count) > (PageCount * INDIRECT_GREF_PAGES))
+    {
+        return false;
+    }
+    for (uint32_t page = 0; page < PageCount; page++)
+    {
+        Pages[page].nr_segments = 0;
+    }
+    for (uint32_t index = 0; index < (PacketPages + Count); index++)
+    {
+        usbif_indirect_page_t * page = &Pages[index / INDIRECT_GREF_PAGES];
+        grant_ref_t ref = Ops.GetRef();
+        if (ref == USBIF_INVALID_GRANT_REF)
+        {
+            return false;
+        }
+        Ops.GrantAccess((index < PacketPages) ?
+            (uint64_t) PacketPfns[index] : (uint64_t) Pfns[index - PacketPages], ref);
+        page->gref[page->nr_segments] = ref;
+        page->nr_segments++;
+    }
+    return true;
+}
+
+//
+/// end the backend's access to every gref of a request, in the indirect
+/// pages first if there are any. Returns the number of grefs leaked.
+//
+template <class GrantOps>
+inline uint32_t
+UsbifReleaseSegments(
+    usbif_request_t * Request,
+    usbif_indirect_page_t * Pages,
+    GrantOps & Ops)
+{
+    uint32_t leaked = 0;
+    if (Pages)
+    {
+        for (uint32_t page = 0; page < Request->nr_segments; page++)
+        {
+            for (uint32_t index = 0; index < Pages[page].nr_segments; index++)
+            {
+                if (!Ops.EndAccess(Pages[page].gref[index]))
+                {
+                    leaked++;
+                }
+            }
+            Pages[page].nr_segments = 0;
+        }
+    }
+    for (uint32_t index = 0; index < Request->nr_segments; index++)
+    {
+        if (!Ops.EndAccess(Request->gref[index]))
+        {
+            leaked++;
+        }
+    }
+    Request->nr_segments = 0;
+    return leaked;
+}
+
+//
+/// Error code translation. The backend's usb error codes count down from
+/// USBIF_RSP_USB_ERROR, the table is indexed by USBIF_RSP_USB_ERROR - status.
+/// USBIF_RSP_USB_ERROR itself and anything outside the table is an unknown
+/// code.
+//
+struct USBIF_STATUS_MAP
+{
+    USBD_STATUS  UsbdStatus;
+    const char * UsbifString;
+};
+
+inline const USBIF_STATUS_MAP *
+UsbifStatusLookup(
+    int32_t UsbIfStatus)
+{
+    static const USBIF_STATUS_MAP map[] =
+    {
+        { USBD_STATUS_INTERNAL_HC_ERROR,      "Unknown UsbIfCode" },
+        { USBD_STATUS_CANCELED,               "USBIF_RSP_USB_CANCELED" },
+        { USBD_STATUS_INTERNAL_HC_ERROR,      "USBIF_RSP_USB_PENDING" },
+        { USBD_STATUS_INTERNAL_HC_ERROR,      "USBIF_RSP_USB_PROTO" },
+        { USBD_STATUS_CANCELED,               "USBIF_RSP_USB_CRC" },      // was USBD_STATUS_CRC
+        { USBD_STATUS_STALL_PID,              "USBIF_RSP_USB_TIMEOUT" },  // USBD_STATUS_TIMEOUT
+        { USBD_STATUS_STALL_PID,              "USBIF_RSP_USB_STALLED" },
+        { USBD_STATUS_BUFFER_OVERRUN,         "USBIF_RSP_USB_INBUFF" },
+        { USBD_STATUS_BUFFER_UNDERRUN,        "USBIF_RSP_USB_OUTBUFF" },
+        { USBD_STATUS_STALL_PID,              "USBIF_RSP_USB_OVERFLOW" }, // USBD_STATUS_BABBLE_DETECTED
+        { USBD_STATUS_ERROR_SHORT_TRANSFER,   "USBIF_RSP_USB_SHORTPKT" },
+        { USBD_STATUS_DEVICE_GONE,            "USBIF_RSP_USB_DEVRMVD" },
+        { USBD_STATUS_INTERNAL_HC_ERROR,      "USBIF_RSP_USB_PARTIAL" },
+        { USBD_STATUS_INVALID_URB_FUNCTION,   "USBIF_RSP_USB_INVALID" },
+        { USBD_STATUS_TIMEOUT,                "USBIF_RSP_USB_RESET" },    // this is really a timeout
+        { USBD_STATUS_DEVICE_GONE,            "USBIF_RSP_USB_SHUTDOWN" }, // was USBD_STATUS_ENDPOINT_HALTED
+        { USBD_STATUS_ERROR_BUSY,             "USBIF_RSP_USB_UNKNOWN" },  // backend unplug detected! (or not.)
+    };
+    const uint32_t entries = sizeof(map) / sizeof(map[0]);
+    static_assert(sizeof(map) / sizeof(map[0]) == (USBIF_RSP_USB_ERROR - USBIF_RSP_USB_UNKNOWN + 1),
+        "one entry per usbif error code");
+    //
+    // out of range codes wrap to large values and map to entry 0.
+    //
+    uint32_t index = (uint32_t) (USBIF_RSP_USB_ERROR - UsbIfStatus);
+    return &map[(index < entries) ? index : 0];
+}
+
+//
+/// the USBD status for a response status. Device gone errors are treated
+/// as transient while a reset is in progress.
+//
+inline USBD_STATUS
+UsbifMapStatus(
+    bool ResetInProgress,
+    int32_t UsbIfStatus)
+{
+    if (UsbIfStatus == 0)
+    {
+        return USBD_STATUS_SUCCESS;
+    }
+    USBD_STATUS usbdStatus = UsbifStatusLookup(UsbIfStatus)->UsbdStatus;
+    if ((usbdStatus == USBD_STATUS_DEVICE_GONE) && ResetInProgress)
+    {
+        usbdStatus = USBD_STATUS_CANCELED;
+    }
+    return usbdStatus;
+}
+
+//
+/// copy the backend's iso packet results into the client's packet
+/// descriptors. This runs for every packet of every isoch transfer, so it
+/// is a straight copy with branch free accounting. The offsets the client
+/// set are kept and each length is clamped to the room after its offset in
+/// the BufferLength byte transfer buffer, so a bad response cannot point the
+/// client past it. Returns the bytes of the packets that succeeded, at most
+/// BufferLength.
+//
+inline uint32_t
+UsbifIsoCompletePackets(
+    const iso_packet_info * Info,
+    USBD_ISO_PACKET_DESCRIPTOR * Packets,
+    uint32_t Count,
+    uint32_t BufferLength,
+    uint32_t * ErrorCount)
+{
+    uint32_t totalBytes = 0;
+    uint32_t errorCount = 0;
+    for (uint32_t index = 0; index < Count; index++)
+    {
+        uint32_t offset = Packets[index].Offset;
+        uint32_t room = (offset < BufferLength) ? (BufferLength - offset) : 0;
+        uint32_t length = (Info[index].length < room) ? Info[index].length : room;
+        USBD_STATUS packetStatus = Info[index].status;
+        uint32_t failed = (packetStatus != USBD_STATUS_SUCCESS);
+
+        Packets[index].Length = length;
+        Packets[index].Status = packetStatus;
+
+        totalBytes += length & (failed - 1); // length if the packet succeeded
+        errorCount += failed;
+    }
+    *ErrorCount = errorCount;
+    return (totalBytes > BufferLength) ? BufferLength : totalBytes;
+}
+
+//
+/// xp usbaudio crashes on an iso transfer with zero total bytes. Succeed
+/// packet 0 and report its length, or the offset of packet 1 if packet 0
+/// is empty, clamped to BufferLength. Returns the new total.
+//
+inline uint32_t
+UsbifIsoSucceedFirstPacket(
+    USBD_ISO_PACKET_DESCRIPTOR * Packets,
+    uint32_t Count,
+    uint32_t BufferLength)
+{
+    if (Count == 0)
+    {
+        return 0;
+    }
+    Packets[0].Status = USBD_STATUS_SUCCESS;
+    uint32_t totalBytes = (Packets[0].Length || (Count < 2)) ?
+        Packets[0].Length : Packets[1].Offset;
+    return (totalBytes > BufferLength) ? BufferLength : totalBytes;
+}
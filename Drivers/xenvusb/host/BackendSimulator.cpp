@@ -0,0 +1,250 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file BackendSimulator.cpp a usbif backend with programmable latency and faults.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#include "FakeBackend.h"
+#include "BackendSimulator.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string>
+
+bool
+LatencyModel::Parse(
+    const char * Spec)
+{
+    char kind[16];
+    int fields = sscanf(Spec, "%15[a-z]:%lf:%lf:%lf", kind, &A, &B, &C);
+    if (fields < 2)
+    {
+        return false;
+    }
+    std::string name(kind);
+    if ((name == "fixed") && (fields == 2))
+    {
+        Type = Fixed;
+    }
+    else if ((name == "uniform") && (fields == 3) && (A <= B))
+    {
+        Type = Uniform;
+    }
+    else if ((name == "exp") && (fields == 2) && (A > 0))
+    {
+        Type = Exponential;
+    }
+    else if ((name == "lognormal") && (fields == 3) && (A > 0))
+    {
+        Type = LogNormal;
+    }
+    else if ((name == "bimodal") && (fields == 4) && (C >= 0) && (C <= 1))
+    {
+        Type = Bimodal;
+    }
+    else
+    {
+        return false;
+    }
+    return A >= 0;
+}
+
+double
+LatencyModel::SampleUs(
+    std::mt19937_64 & Random) const
+{
+    double us = A;
+    switch (Type)
+    {
+    case Fixed:
+        break;
+    case Uniform:
+        us = std::uniform_real_distribution<double>(A, B)(Random);
+        break;
+    case Exponential:
+        us = std::exponential_distribution<double>(1.0 / A)(Random);
+        break;
+    case LogNormal:
+        us = std::lognormal_distribution<double>(log(A), B)(Random);
+        break;
+    case Bimodal:
+        us = std::bernoulli_distribution(C)(Random) ? B : A;
+        break;
+    }
+    return (us > 0) ? us : 0;
+}
+
+BackendSimulator::BackendSimulator(
+    usbif_sring * Sring,
+    FakeGrantTable & Grants,
+    FakeEvent & ToBackend,
+    FakeEvent & ToFrontend,
+    const LatencyModel & Latency,
+    const FaultSchedule & Faults,
+    uint64_t Seed)
+    : m_grants(Grants),
+      m_toBackend(ToBackend),
+      m_toFrontend(ToFrontend),
+      m_latency(Latency),
+      m_faults(Faults),
+      m_random(Seed),
+      m_stop(false)
+{
+    BACK_RING_INIT(&m_ring, Sring, PAGE_SIZE);
+}
+
+BackendSimulator::~BackendSimulator()
+{
+    Stop();
+}
+
+void
+BackendSimulator::Start()
+{
+    m_stop = false;
+    m_thread = std::thread(&BackendSimulator::Run, this);
+}
+
+void
+BackendSimulator::Stop()
+{
+    if (m_thread.joinable())
+    {
+        m_stop = true;
+        m_toBackend.Signal();
+        m_thread.join();
+    }
+}
+
+void
+BackendSimulator::Respond(
+    const Pending & Pending)
+{
+    usbif_response_t response;
+    memset(&response, 0, sizeof(response));
+    response.id = Pending.Request.id;
+    //
+    // for isoch bytesTransferred is the number of packets in error.
+    //
+    response.bytesTransferred = (Pending.Request.type == 1) ? 0 : Pending.Request.length;
+
+    m_responses++;
+    if (!m_burstLeft && m_faults.DeviceRemovedEvery &&
+        ((m_responses % m_faults.DeviceRemovedEvery) == 0))
+    {
+        m_burstLeft = m_faults.DeviceRemovedBurst;
+    }
+    if (m_burstLeft)
+    {
+        m_burstLeft--;
+        response.status = USBIF_RSP_USB_DEVRMVD;
+        response.bytesTransferred = 0;
+        DeviceRemoved++;
+    }
+    else if (m_faults.StallEvery &&
+        ((m_responses % m_faults.StallEvery) == 0))
+    {
+        response.status = USBIF_RSP_USB_STALLED;
+        response.bytesTransferred = 0;
+        Stalled++;
+    }
+
+    if (Pending.Sequence < m_highestAnswered)
+    {
+        OutOfOrder++;
+    }
+    else
+    {
+        m_highestAnswered = Pending.Sequence;
+    }
+    memcpy(RING_GET_RESPONSE(&m_ring, m_ring.rsp_prod_pvt), &response, sizeof(response));
+    m_ring.rsp_prod_pvt++;
+}
+
+void
+BackendSimulator::Run()
+{
+    uint64_t seen = 0;
+    for (;;)
+    {
+        while (RING_HAS_UNCONSUMED_REQUESTS(&m_ring))
+        {
+            xen_rmb();
+            Pending pending;
+            memcpy(&pending.Request, RING_GET_REQUEST(&m_ring, m_ring.req_cons), sizeof(pending.Request));
+            m_ring.req_cons++;
+            Requests++;
+            BadGrants += m_grants.CheckRequest(pending.Request, &Segments);
+
+            pending.Sequence = ++m_sequence;
+            pending.Due = Clock::now() +
+                std::chrono::nanoseconds((int64_t) (m_latency.SampleUs(m_random) * 1000.0));
+            m_pending.push(pending);
+
+            if (m_faults.PauseEvery &&
+                ((Requests % m_faults.PauseEvery) == 0))
+            {
+                //
+                // nothing is answered while paused, responses fall due
+                // and go out together afterwards.
+                //
+                Pauses++;
+                std::this_thread::sleep_for(std::chrono::microseconds(m_faults.PauseUs));
+            }
+        }
+
+        Clock::time_point now = Clock::now();
+        bool answered = false;
+        while (!m_pending.empty() && (m_pending.top().Due <= now))
+        {
+            Respond(m_pending.top());
+            m_pending.pop();
+            answered = true;
+        }
+        if (answered)
+        {
+            int notify;
+            RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&m_ring, notify);
+            if (notify)
+            {
+                Notifies++;
+                m_toFrontend.Signal();
+            }
+        }
+
+        int moreWork;
+        RING_FINAL_CHECK_FOR_REQUESTS(&m_ring, moreWork);
+        if (moreWork)
+        {
+            continue;
+        }
+        if (m_stop && m_pending.empty())
+        {
+            break;
+        }
+        Clock::time_point deadline = now + std::chrono::milliseconds(EVENT_TIMEOUT_MS);
+        if (!m_pending.empty() && (m_pending.top().Due < deadline))
+        {
+            deadline = m_pending.top().Due;
+        }
+        m_toBackend.WaitUntil(&seen, deadline);
+    }
+}
@@ -0,0 +1,148 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file BackendSimulator.h a usbif backend with programmable latency and faults.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#include "FakeBackend.h"
+#pragma once
+
+#include "FakeBackend.h"
+
+#include <queue>
+#include <random>
+
+//
+/// how long the simulated backend takes to answer a request.
+///
+///   fixed:US
+///   uniform:MIN:MAX
+///   exp:MEAN
+///   lognormal:MEDIAN:SIGMA
+///   bimodal:FAST:SLOW:PSLOW     SLOW with probability PSLOW, else FAST.
+///
+/// All times in microseconds.
+//
+struct LatencyModel
+{
+    enum Kind
+    {
+        Fixed,
+        Uniform,
+        Exponential,
+        LogNormal,
+        Bimodal
+    };
+    Kind   Type = Fixed;
+    double A = 0;
+    double B = 0;
+    double C = 0;
+
+    //
+    /// false if Spec is not one of the forms above.
+    //
+    bool Parse(const char * Spec);
+    double SampleUs(std::mt19937_64 & Random) const;
+};
+
+//
+/// what the simulated backend does wrong. Counts are in responses or
+/// requests, 0 is off.
+//
+struct FaultSchedule
+{
+    uint32_t DeviceRemovedEvery = 0; //!< start a burst of USBIF_RSP_USB_DEVRMVD.
+    uint32_t DeviceRemovedBurst = 1; //!< responses in each burst.
+    uint32_t StallEvery = 0;         //!< answer USBIF_RSP_USB_STALLED.
+    uint32_t PauseEvery = 0;         //!< stop answering after this many requests,
+    uint32_t PauseUs = 0;            //!< for this long, like a descheduled dom0.
+};
+
+//
+/// Like FakeBackend, but each request is answered once its latency has
+/// passed, so requests complete out of order, and responses are failed or
+/// held back by the FaultSchedule.
+//
+class BackendSimulator
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    BackendSimulator(
+        usbif_sring * Sring,
+        FakeGrantTable & Grants,
+        FakeEvent & ToBackend,
+        FakeEvent & ToFrontend,
+        const LatencyModel & Latency,
+        const FaultSchedule & Faults,
+        uint64_t Seed);
+    ~BackendSimulator();
+
+    void Start();
+    //
+    /// answers the requests still pending, then stops.
+    //
+    void Stop();
+
+    //
+    // stats, read once the simulator has stopped.
+    //
+    uint64_t Requests = 0;
+    uint64_t Segments = 0;
+    uint64_t BadGrants = 0;
+    uint64_t Notifies = 0;
+    uint64_t OutOfOrder = 0;    //!< responses overtaken by a later request.
+    uint64_t DeviceRemoved = 0;
+    uint64_t Stalled = 0;
+    uint64_t Pauses = 0;
+
+private:
+    struct Pending
+    {
+        Clock::time_point Due;
+        uint64_t          Sequence;
+        usbif_request_t   Request;
+
+        bool operator>(const Pending & Other) const
+        {
+            return (Due > Other.Due) ||
+                ((Due == Other.Due) && (Sequence > Other.Sequence));
+        }
+    };
+
+    void Run();
+    void Respond(const Pending & Pending);
+
+    usbif_back_ring_t m_ring;
+    FakeGrantTable &  m_grants;
+    FakeEvent &       m_toBackend;
+    FakeEvent &       m_toFrontend;
+    LatencyModel      m_latency;
+    FaultSchedule     m_faults;
+    std::mt19937_64   m_random;
+    std::priority_queue<Pending, std::vector<Pending>, std::greater<Pending> > m_pending;
+    uint64_t          m_sequence = 0;
+    uint64_t          m_responses = 0;
+    uint32_t          m_burstLeft = 0;
+    uint64_t          m_highestAnswered = 0;
+    std::thread       m_thread;
+    std::atomic<bool> m_stop;
+};
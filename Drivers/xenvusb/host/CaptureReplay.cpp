@@ -0,0 +1,294 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file CaptureReplay.cpp replays a usbif capture through the host frontend.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#include "CaptureReplay.h"
+
+#include <deque>
+
+//
+/// the captured request as a host transfer. The packet descriptors go first,
+/// then the data pages from the request offset, as PutUrbOnRing() lays
+/// them out. A request without data still gets one page.
+//
+static HostTransfer
+CapturedTransfer(
+    const usbif_request_t & Req,
+    uint64_t Cookie)
+{
+    HostTransfer transfer;
+    memset(&transfer, 0, sizeof(transfer));
+    transfer.Type = Req.type;
+    transfer.Endpoint = Req.endpoint;
+    transfer.Length = Req.length;
+    transfer.Packets = Req.nr_packets;
+    transfer.Cookie = Cookie;
+    transfer.DataPages = (uint32_t) ((Req.offset + (uint64_t) Req.length + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (Req.type == 1) // isoch
+    {
+        transfer.PacketPages = (uint32_t)
+            ((Req.nr_packets * sizeof(iso_packet_info) + PAGE_SIZE - 1) / PAGE_SIZE);
+    }
+    if (!transfer.DataPages && !transfer.PacketPages)
+    {
+        transfer.DataPages = 1;
+    }
+    return transfer;
+}
+
+static uint32_t
+StatusIndex(
+    int16_t Status)
+{
+    const uint32_t others = -USBIF_RSP_USB_UNKNOWN + 1;
+    uint32_t index = (uint32_t) -Status;
+    return (index < others) ? index : others;
+}
+
+bool
+CaptureReplay(
+    const XENVUSB_CAPTURE & Capture,
+    CaptureReplayResult * Result)
+{
+    memset(Result, 0, sizeof(*Result));
+    const std::vector<XENVUSB_CAPTURED_MESSAGE> & messages = Capture.Messages;
+    const size_t none = (size_t) -1;
+
+    //
+    // pair each response with the latest request of its id, ids are shadow
+    // ids and are reused.
+    //
+    std::vector<size_t> responseOf(messages.size(), none);
+    std::vector<size_t> requestOf(messages.size(), none);
+    std::vector<size_t> pending(SHADOW_ENTRIES, none);
+    for (size_t index = 0; index < messages.size(); index++)
+    {
+        const XENVUSB_CAPTURED_MESSAGE & message = messages[index];
+        if (message.Kind == XenvusbCaptureRequest)
+        {
+            if (message.Request.id < SHADOW_ENTRIES)
+            {
+                pending[(size_t) message.Request.id] = index;
+            }
+            continue;
+        }
+        size_t request = (message.Response.id < SHADOW_ENTRIES) ?
+            pending[(size_t) message.Response.id] : none;
+        if (request == none)
+        {
+            Result->Orphans++;
+            continue;
+        }
+        pending[(size_t) message.Response.id] = none;
+        responseOf[request] = index;
+        requestOf[index] = request;
+    }
+
+    FakeGrantTable grants;
+    FakeEvent toBackend;
+    FakeEvent toFrontend;
+    HostFrontend frontend(grants, toBackend, toFrontend);
+    FakeBackend backend(frontend.SharedRing(), grants, toBackend, toFrontend);
+    std::deque<size_t> onRing;
+    std::vector<bool> completed(messages.size(), false);
+    std::vector<bool> submitted(messages.size(), false);
+
+    backend.Respond = [&](const usbif_request_t & Req, usbif_response_t & Rsp)
+    {
+        size_t request = onRing.front();
+        onRing.pop_front();
+        const usbif_request_t & captured = messages[request].Request;
+        if ((Req.type != captured.type) ||
+            (Req.endpoint != captured.endpoint) ||
+            (Req.length != captured.length) ||
+            (Req.nr_packets != captured.nr_packets))
+        {
+            Result->Mismatches++;
+        }
+        if ((Req.nr_segments != captured.nr_segments) ||
+            ((Req.flags & INDIRECT_GREF) != (captured.flags & INDIRECT_GREF)))
+        {
+            Result->LayoutDiffers++;
+        }
+        if (responseOf[request] != none)
+        {
+            Rsp = messages[responseOf[request]].Response;
+            Rsp.id = Req.id;
+        }
+    };
+    frontend.OnComplete = [&](const HostTransfer & Transfer,
+        const usbif_response_t & Response,
+        HostFrontend::Clock::duration,
+        HostFrontend::Clock::duration)
+    {
+        size_t request = (size_t) Transfer.Cookie;
+        completed[request] = true;
+        Result->Statuses[StatusIndex(Response.status)]++;
+        if (responseOf[request] == none)
+        {
+            Result->Unanswered++;
+            return;
+        }
+        const usbif_response_t & captured = messages[responseOf[request]].Response;
+        if ((Response.status != captured.status) ||
+            (Response.bytesTransferred != captured.bytesTransferred) ||
+            (Response.data != captured.data) ||
+            (Response.error_count != captured.error_count))
+        {
+            Result->Mismatches++;
+            return;
+        }
+        Result->Completed++;
+    };
+    //
+    // one round of the backend and the frontend, false if neither moved.
+    //
+    auto Step = [&]() -> bool
+    {
+        frontend.Push();
+        bool work = backend.Service();
+        uint64_t before = frontend.Completed;
+        while (frontend.ProcessResponses())
+        {
+        }
+        return work || (frontend.Completed != before);
+    };
+
+    bool stalled = false;
+    HostFrontend::Clock::time_point start = HostFrontend::Clock::now();
+    for (size_t index = 0; (index < messages.size()) && !stalled; index++)
+    {
+        const XENVUSB_CAPTURED_MESSAGE & message = messages[index];
+        if (message.Kind == XenvusbCaptureRequest)
+        {
+            HostTransfer transfer = CapturedTransfer(message.Request, index);
+            bool put;
+            while (!(put = frontend.Submit(transfer)) && frontend.Outstanding())
+            {
+                if (!Step())
+                {
+                    stalled = true;
+                    break;
+                }
+            }
+            if (!put)
+            {
+                Result->Unsupported += !stalled;
+                continue;
+            }
+            onRing.push_back(index);
+            submitted[index] = true;
+            Result->Requests++;
+            frontend.Push();
+            continue;
+        }
+        size_t request = requestOf[index];
+        if ((request == none) || !submitted[request])
+        {
+            continue;
+        }
+        while (!completed[request])
+        {
+            if (!Step())
+            {
+                stalled = true;
+                break;
+            }
+        }
+    }
+    while (!stalled && frontend.Outstanding())
+    {
+        stalled = !Step();
+    }
+    Result->Seconds = std::chrono::duration<double>(HostFrontend::Clock::now() - start).count();
+
+    Result->BadIds = frontend.BadIds;
+    Result->Stale = frontend.Stale;
+    Result->Leaked = frontend.Leaked;
+    Result->BadGrants = backend.BadGrants;
+    Result->GrantsInUse = grants.InUse();
+    Result->Outstanding = frontend.Outstanding();
+    return !stalled &&
+        !Result->Mismatches &&
+        !Result->BadIds &&
+        !Result->Stale &&
+        !Result->Leaked &&
+        !Result->BadGrants &&
+        !Result->GrantsInUse &&
+        !Result->Outstanding;
+}
+
+void
+CaptureReplayPrint(
+    FILE * File,
+    const CaptureReplayResult & Result,
+    bool Json)
+{
+    static const struct
+    {
+        const char *                         Name;
+        uint64_t CaptureReplayResult::*      Field;
+    } counts[] =
+    {
+        { "requests",       &CaptureReplayResult::Requests },
+        { "completed",      &CaptureReplayResult::Completed },
+        { "unanswered",     &CaptureReplayResult::Unanswered },
+        { "orphans",        &CaptureReplayResult::Orphans },
+        { "unsupported",    &CaptureReplayResult::Unsupported },
+        { "layout_differs", &CaptureReplayResult::LayoutDiffers },
+        { "mismatches",     &CaptureReplayResult::Mismatches },
+        { "bad_ids",        &CaptureReplayResult::BadIds },
+        { "stale",          &CaptureReplayResult::Stale },
+        { "leaked",         &CaptureReplayResult::Leaked },
+        { "bad_grants",     &CaptureReplayResult::BadGrants },
+    };
+    const uint32_t statuses = sizeof(Result.Statuses) / sizeof(Result.Statuses[0]);
+
+    fprintf(File, Json ? "{" : "replay:");
+    for (auto & count : counts)
+    {
+        fprintf(File, Json ? "\"%s\": %llu, " : " %s %llu",
+            count.Name,
+            (unsigned long long) (Result.*count.Field));
+    }
+    fprintf(File, Json ? "\"grants_in_use\": %u, \"outstanding\": %u, \"seconds\": %.6f, \"statuses\": {" :
+        " grants_in_use %u outstanding %u, %.6f s\nstatuses:",
+        Result.GrantsInUse,
+        Result.Outstanding,
+        Result.Seconds);
+    bool first = true;
+    for (uint32_t index = 0; index < statuses; index++)
+    {
+        if (!Result.Statuses[index])
+        {
+            continue;
+        }
+        std::string name = (index == statuses - 1) ? "other" : std::to_string(-(int) index);
+        fprintf(File, Json ? "%s\"%s\": %llu" : "%s %s %llu",
+            (Json && !first) ? ", " : "",
+            name.c_str(),
+            (unsigned long long) Result.Statuses[index]);
+        first = false;
+    }
+    fprintf(File, Json ? "}}\n" : "\n");
+}
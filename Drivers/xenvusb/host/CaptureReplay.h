@@ -0,0 +1,87 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file CaptureReplay.h replays a usbif capture through the host frontend.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#pragma once
+
+#include "FakeBackend.h"
+#include "HostFrontend.h"
+#include "XenvusbDecode.h"
+
+//
+/// Replays a decoded IOCTL_XENVUSB_READ_CAPTURE stream on the caller's
+/// thread. Each captured request is submitted through HostFrontend in
+/// capture order. At each captured response an in-thread FakeBackend runs
+/// until that request completes, and it answers every request with the
+/// response captured for it.
+///
+/// The backend answers in ring order, so a response the device gave out of
+/// order completes in submission order instead. No data moves: FakeBackend
+/// only looks up the grefs, and payloads are left alone.
+//
+struct CaptureReplayResult
+{
+    uint64_t Requests;     //!< submitted.
+    uint64_t Completed;    //!< with the response captured for them.
+    uint64_t Unanswered;   //!< captured without a response, completed with a default response.
+    uint64_t Orphans;      //!< captured responses to requests from before the capture.
+    uint64_t Unsupported;  //!< requests the host frontend cannot lay out, not replayed.
+    //
+    /// requests laid out with segments other than the captured ones, e.g.
+    /// the page the host frontend grants for a zero length request.
+    //
+    uint64_t LayoutDiffers;
+    //
+    /// requests the backend saw, or responses the frontend completed, that
+    /// are not what was captured. Any is a replay or ring error.
+    //
+    uint64_t Mismatches;
+    uint64_t Statuses[-USBIF_RSP_USB_UNKNOWN + 2]; //!< by -status, the last is any other.
+    double   Seconds;
+
+    //
+    // the frontend and backend stats at the end.
+    //
+    uint64_t BadIds;
+    uint64_t Stale;
+    uint64_t Leaked;
+    uint64_t BadGrants;
+    uint32_t GrantsInUse;
+    uint32_t Outstanding;
+};
+
+//
+/// false if the replay stalled or anything in Result marks an error:
+/// Mismatches, the frontend, backend or grant table stats, or transfers
+/// left outstanding.
+//
+bool
+CaptureReplay(
+    const XENVUSB_CAPTURE & Capture,
+    CaptureReplayResult * Result);
+
+void
+CaptureReplayPrint(
+    FILE * File,
+    const CaptureReplayResult & Result,
+    bool Json);
@@ -0,0 +1,296 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file FakeBackend.cpp threaded stand-in for the usbif backend.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#include "FakeBackend.h"
+
+#include <chrono>
+
+FakeGrantTable::FakeGrantTable(
+    uint32_t Entries)
+    : m_entries(Entries)
+{
+    //
+    // hand out low refs first, like the grant table does.
+    //
+    m_free.reserve(Entries);
+    for (uint32_t ref = Entries; ref > 0; ref--)
+    {
+        m_free.push_back(ref - 1);
+    }
+}
+
+grant_ref_t
+FakeGrantTable::GetRef()
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (m_free.empty())
+    {
+        return USBIF_INVALID_GRANT_REF;
+    }
+    grant_ref_t ref = m_free.back();
+    m_free.pop_back();
+    m_entries[ref].Allocated = true;
+    m_entries[ref].Granted = false;
+    return ref;
+}
+
+void
+FakeGrantTable::GrantAccess(
+    uint64_t Pfn,
+    grant_ref_t Ref)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    assert(Ref < m_entries.size() && m_entries[Ref].Allocated);
+    m_entries[Ref].Granted = true;
+    m_entries[Ref].Pfn = Pfn;
+}
+
+bool
+FakeGrantTable::EndAccess(
+    grant_ref_t Ref)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    if ((Ref >= m_entries.size()) || !m_entries[Ref].Allocated)
+    {
+        return false;
+    }
+    m_entries[Ref].Allocated = false;
+    m_entries[Ref].Granted = false;
+    m_free.push_back(Ref);
+    return true;
+}
+
+bool
+FakeGrantTable::Lookup(
+    grant_ref_t Ref,
+    uint64_t * Pfn)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    if ((Ref >= m_entries.size()) || !m_entries[Ref].Granted)
+    {
+        return false;
+    }
+    *Pfn = m_entries[Ref].Pfn;
+    return true;
+}
+
+uint32_t
+FakeGrantTable::CheckRequest(
+    const usbif_request_t & Request,
+    uint64_t * Segments)
+{
+    uint32_t bad = 0;
+    for (uint32_t index = 0; index < Request.nr_segments; index++)
+    {
+        uint64_t pfn;
+        if (!Lookup(Request.gref[index], &pfn))
+        {
+            bad++;
+            continue;
+        }
+        if (!(Request.flags & INDIRECT_GREF))
+        {
+            (*Segments)++;
+            continue;
+        }
+        //
+        // the host frontend grants indirect pages by their address.
+        //
+        const usbif_indirect_page_t * page =
+            (const usbif_indirect_page_t *) (uintptr_t) (pfn << PAGE_SHIFT);
+        if (page->nr_segments > INDIRECT_GREF_PAGES)
+        {
+            bad++;
+            continue;
+        }
+        for (uint32_t segment = 0; segment < page->nr_segments; segment++)
+        {
+            uint64_t dataPfn;
+            if (!Lookup(page->gref[segment], &dataPfn))
+            {
+                bad++;
+            }
+            (*Segments)++;
+        }
+    }
+    return bad;
+}
+
+uint32_t
+FakeGrantTable::InUse()
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    return (uint32_t) (m_entries.size() - m_free.size());
+}
+
+void
+FakeEvent::Signal()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_count++;
+    }
+    m_cv.notify_all();
+}
+
+bool
+FakeEvent::Wait(
+    uint64_t * Seen,
+    uint32_t TimeoutMs)
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    bool signalled = m_cv.wait_for(lock,
+        std::chrono::milliseconds(TimeoutMs),
+        [&] { return m_count != *Seen; });
+    *Seen = m_count;
+    return signalled;
+}
+
+bool
+FakeEvent::WaitUntil(
+    uint64_t * Seen,
+    std::chrono::steady_clock::time_point Deadline)
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    bool signalled = m_cv.wait_until(lock,
+        Deadline,
+        [&] { return m_count != *Seen; });
+    *Seen = m_count;
+    return signalled;
+}
+
+uint64_t
+FakeEvent::Count()
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_count;
+}
+
+FakeBackend::FakeBackend(
+    usbif_sring * Sring,
+    FakeGrantTable & Grants,
+    FakeEvent & ToBackend,
+    FakeEvent & ToFrontend)
+    : Requests(0),
+      Segments(0),
+      BadGrants(0),
+      Notifies(0),
+      LostEvents(0),
+      m_grants(Grants),
+      m_toBackend(ToBackend),
+      m_toFrontend(ToFrontend),
+      m_stop(false)
+{
+    BACK_RING_INIT(&m_ring, Sring, PAGE_SIZE);
+}
+
+FakeBackend::~FakeBackend()
+{
+    Stop();
+}
+
+void
+FakeBackend::Start()
+{
+    m_stop = false;
+    m_thread = std::thread(&FakeBackend::Run, this);
+}
+
+void
+FakeBackend::Stop()
+{
+    if (m_thread.joinable())
+    {
+        m_stop = true;
+        m_toBackend.Signal();
+        m_thread.join();
+    }
+}
+
+bool
+FakeBackend::Service()
+{
+    bool work = false;
+    while (RING_HAS_UNCONSUMED_REQUESTS(&m_ring))
+    {
+        work = true;
+        xen_rmb();
+        usbif_request_t request;
+        memcpy(&request, RING_GET_REQUEST(&m_ring, m_ring.req_cons), sizeof(request));
+        m_ring.req_cons++;
+        Requests++;
+        BadGrants += m_grants.CheckRequest(request, &Segments);
+
+        usbif_response_t response;
+        memset(&response, 0, sizeof(response));
+        response.id = request.id;
+        response.bytesTransferred = request.length;
+        if (Respond)
+        {
+            Respond(request, response);
+        }
+        memcpy(RING_GET_RESPONSE(&m_ring, m_ring.rsp_prod_pvt), &response, sizeof(response));
+        m_ring.rsp_prod_pvt++;
+    }
+
+    int notify;
+    RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&m_ring, notify);
+    if (notify)
+    {
+        Notifies++;
+        m_toFrontend.Signal();
+    }
+    return work;
+}
+
+void
+FakeBackend::Run()
+{
+    uint64_t seen = 0;
+    for (;;)
+    {
+        Service();
+
+        int moreWork;
+        RING_FINAL_CHECK_FOR_REQUESTS(&m_ring, moreWork);
+        if (moreWork)
+        {
+            continue;
+        }
+        if (m_stop)
+        {
+            break;
+        }
+        //
+        // requests found after a timeout, and still no event after a second
+        // wait, were put on the ring without notifying the backend.
+        //
+        if (!m_toBackend.Wait(&seen, EVENT_TIMEOUT_MS) &&
+            RING_HAS_UNCONSUMED_REQUESTS(&m_ring) &&
+            !m_toBackend.Wait(&seen, EVENT_TIMEOUT_MS))
+        {
+            LostEvents++;
+        }
+    }
+}
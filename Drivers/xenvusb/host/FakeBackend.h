@@ -0,0 +1,157 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file FakeBackend.h threaded stand-in for the usbif backend and the Xen
+/// grant table and event channel, for host tests of the usbif core.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#pragma once
+
+#include "UsbifHost.h"
+#include "usbxenif.h"
+#include "UsbifCore.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//
+/// how long either side waits for an event before looking at the ring anyway.
+//
+#define EVENT_TIMEOUT_MS 250
+
+//
+/// The grant table shared by the frontend and the backend. Every operation
+/// takes the table lock, the backend checks each gref of a request while
+/// the frontend may be granting or ending access to others.
+//
+class FakeGrantTable
+{
+public:
+    explicit FakeGrantTable(uint32_t Entries = 65536);
+
+    //
+    // GrantOps for the UsbifCore.h gref helpers.
+    //
+    grant_ref_t GetRef();
+    void GrantAccess(uint64_t Pfn, grant_ref_t Ref);
+    bool EndAccess(grant_ref_t Ref);
+
+    //
+    /// the pfn granted with Ref, false if Ref is not granted.
+    //
+    bool Lookup(grant_ref_t Ref, uint64_t * Pfn);
+
+    //
+    /// look up every gref of a request as the backend would map it,
+    /// including the grefs in indirect pages. Returns the number not
+    /// granted, Segments counts the data and packet grefs.
+    //
+    uint32_t CheckRequest(const usbif_request_t & Request, uint64_t * Segments);
+
+    uint32_t InUse();
+
+private:
+    struct Entry
+    {
+        bool     Allocated;
+        bool     Granted;
+        uint64_t Pfn;
+    };
+    std::mutex              m_lock;
+    std::vector<Entry>      m_entries;
+    std::vector<grant_ref_t> m_free;
+};
+
+//
+/// one direction of an event channel. Signal() counts, Wait() returns once
+/// the count has moved past the last value the waiter saw.
+//
+class FakeEvent
+{
+public:
+    FakeEvent() : m_count(0) {}
+
+    void Signal();
+    //
+    /// false on timeout.
+    //
+    bool Wait(uint64_t * Seen, uint32_t TimeoutMs);
+    bool WaitUntil(uint64_t * Seen, std::chrono::steady_clock::time_point Deadline);
+    uint64_t Count();
+
+private:
+    std::mutex              m_lock;
+    std::condition_variable m_cv;
+    uint64_t                m_count;
+};
+
+//
+/// Consumes requests from the back end of a shared ring on its own thread
+/// and answers each one. Every gref of a request, including the grefs in
+/// indirect pages, must be granted while the backend handles it.
+/// Respond, if set, fills in the response; the default succeeds with
+/// bytesTransferred equal to the request length.
+//
+class FakeBackend
+{
+public:
+    FakeBackend(
+        usbif_sring * Sring,
+        FakeGrantTable & Grants,
+        FakeEvent & ToBackend,
+        FakeEvent & ToFrontend);
+    ~FakeBackend();
+
+    void Start();
+    void Stop();
+
+    //
+    /// answer the requests on the ring and push the responses, on the
+    /// caller's thread. Not for use with Start(). Returns false if there
+    /// were no requests.
+    //
+    bool Service();
+
+    std::function<void (const usbif_request_t &, usbif_response_t &)> Respond;
+
+    //
+    // stats, read once the backend has stopped.
+    //
+    uint64_t Requests;
+    uint64_t Segments;    //!< data and packet grefs checked.
+    uint64_t BadGrants;   //!< grefs not granted when the request was handled.
+    uint64_t Notifies;    //!< events sent to the frontend.
+    uint64_t LostEvents;  //!< requests that arrived without an event.
+
+private:
+    void Run();
+
+    usbif_back_ring_t m_ring;
+    FakeGrantTable &  m_grants;
+    FakeEvent &       m_toBackend;
+    FakeEvent &       m_toFrontend;
+    std::thread       m_thread;
+    std::atomic<bool> m_stop;
+};
@@ -0,0 +1,290 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file HostFrontend.cpp the host usbif frontend.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#include "FakeBackend.h"
+#include "HostFrontend.h"
+
+#include <stdlib.h>
+
+//
+// data pages are never touched, the backend only looks their grefs up.
+//
+#define FAKE_DATA_PFN 0x100000
+
+HostFrontend::HostFrontend(
+    FakeGrantTable & Grants,
+    FakeEvent & ToBackend,
+    FakeEvent & ToFrontend)
+    : Completed(0),
+      BadIds(0),
+      Stale(0),
+      Leaked(0),
+      Notifies(0),
+      LostEvents(0),
+      m_grants(Grants),
+      m_toBackend(ToBackend),
+      m_toFrontend(ToFrontend),
+      m_seen(0)
+{
+    m_sring = (usbif_sring *) aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+    assert(m_sring);
+    memset(m_sring, 0, PAGE_SIZE);
+    SHARED_RING_INIT(m_sring);
+    FRONT_RING_INIT(&m_ring, m_sring, PAGE_SIZE);
+    m_entries = (uint16_t) RING_SIZE(&m_ring);
+    assert(m_entries <= SHADOW_ENTRIES);
+
+    UsbifIdStackInit(&m_freeIds, m_ids, m_entries);
+    memset(m_inUse, 0, sizeof(m_inUse));
+    for (uint16_t index = m_entries; index > 0; index--)
+    {
+        Shadow * shadow = &m_shadows[index - 1];
+        memset(&shadow->Req, 0, sizeof(shadow->Req));
+        shadow->Pages = NULL;
+        shadow->PageCount = 0;
+        shadow->IndirectPageMemory = (usbif_indirect_page_t *) aligned_alloc(PAGE_SIZE,
+            MAX_INDIRECT_PAGES * sizeof(usbif_indirect_page_t));
+        assert(shadow->IndirectPageMemory);
+        UsbifIdStackPush(&m_freeIds, (uint16_t) (index - 1));
+    }
+    m_freeIds.MinFree = m_freeIds.Free;
+}
+
+HostFrontend::~HostFrontend()
+{
+    for (uint16_t index = 0; index < m_entries; index++)
+    {
+        free(m_shadows[index].IndirectPageMemory);
+    }
+    free(m_sring);
+}
+
+bool
+HostFrontend::Submit(
+    const HostTransfer & Transfer)
+{
+    uint32_t totalPages = Transfer.DataPages + Transfer.PacketPages;
+    if ((totalPages == 0) || (totalPages > MAX_PAGES_FOR_INDIRECT_REQUEST) ||
+        RING_FULL(&m_ring))
+    {
+        return false;
+    }
+    uint16_t id;
+    if (!UsbifIdStackPop(&m_freeIds, &id))
+    {
+        return false;
+    }
+    Shadow * shadow = &m_shadows[id];
+    memset(&shadow->Req, 0, sizeof(shadow->Req));
+    shadow->Req.id = id;
+    shadow->Req.type = Transfer.Type;
+    shadow->Req.endpoint = Transfer.Endpoint;
+    shadow->Req.length = Transfer.Length;
+    shadow->Req.nr_packets = Transfer.Packets;
+    shadow->Req.flags = REQ_SHORT_PACKET_OK;
+    shadow->Transfer = Transfer;
+    shadow->Pages = NULL;
+    shadow->PageCount = 0;
+
+    //
+    // the packet descriptor pages, then the data pages, as PutUrbOnRing()
+    // lays them out. A buffer's page numbers stand in for the MDL's PFN
+    // array.
+    //
+    m_pfns.resize(totalPages);
+    for (uint32_t index = 0; index < totalPages; index++)
+    {
+        m_pfns[index] = FAKE_DATA_PFN + ((uint64_t) id << 16) + index;
+    }
+    if (Transfer.PacketDescriptors)
+    {
+        uint64_t pfn = ((uintptr_t) Transfer.PacketDescriptors) >> PAGE_SHIFT;
+        for (uint32_t index = 0; index < Transfer.PacketPages; index++)
+        {
+            m_pfns[index] = pfn + index;
+        }
+    }
+    if (Transfer.Buffer)
+    {
+        shadow->Req.offset = (uint16_t) (((uintptr_t) Transfer.Buffer) & (PAGE_SIZE - 1));
+        uint64_t pfn = ((uintptr_t) Transfer.Buffer) >> PAGE_SHIFT;
+        for (uint32_t index = 0; index < Transfer.DataPages; index++)
+        {
+            m_pfns[Transfer.PacketPages + index] = pfn + index;
+        }
+    }
+
+    bool granted;
+    if (totalPages <= USBIF_URB_MAX_SEGMENTS_PER_REQUEST)
+    {
+        granted = UsbifGrantSegments(&shadow->Req, m_pfns.data(), totalPages, m_grants);
+    }
+    else
+    {
+        uint32_t pageCount = INDIRECT_PAGES_REQUIRED(totalPages);
+        uint64_t pagePfns[MAX_INDIRECT_PAGES];
+        for (uint32_t page = 0; page < pageCount; page++)
+        {
+            pagePfns[page] = ((uintptr_t) &shadow->IndirectPageMemory[page]) >> PAGE_SHIFT;
+            shadow->IndirectPageMemory[page].nr_segments = 0;
+        }
+        shadow->Req.flags |= INDIRECT_GREF;
+        shadow->Pages = shadow->IndirectPageMemory;
+        shadow->PageCount = pageCount;
+        granted = UsbifGrantSegments(&shadow->Req, pagePfns, pageCount, m_grants) &&
+            UsbifGrantIndirectSegments(shadow->Pages, pageCount,
+                m_pfns.data(), Transfer.PacketPages,
+                m_pfns.data() + Transfer.PacketPages, Transfer.DataPages,
+                m_grants);
+    }
+    if (!granted)
+    {
+        Leaked += UsbifReleaseSegments(&shadow->Req, shadow->Pages, m_grants);
+        shadow->Pages = NULL;
+        UsbifIdStackPush(&m_freeIds, id);
+        return false;
+    }
+
+    shadow->PutTime = Clock::now();
+    UsbifIdBitmapSet(m_inUse, id);
+    UsbifRingPutRequest(&m_ring, &shadow->Req);
+    return true;
+}
+
+void
+HostFrontend::Push()
+{
+    int notify;
+    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&m_ring, notify);
+    if (notify)
+    {
+        Notifies++;
+        m_toBackend.Signal();
+    }
+}
+
+void
+HostFrontend::FreeShadow(
+    Shadow * shadow)
+{
+    uint16_t id = (uint16_t) shadow->Req.id;
+    Leaked += UsbifReleaseSegments(&shadow->Req, shadow->Pages, m_grants);
+    shadow->Pages = NULL;
+    shadow->PageCount = 0;
+    UsbifIdBitmapClear(m_inUse, id);
+    UsbifIdStackPush(&m_freeIds, id);
+}
+
+bool
+HostFrontend::ProcessResponses()
+{
+    RING_IDX rp = UsbifRingResponseProducer(&m_ring);
+    RING_IDX index;
+    for (index = m_ring.rsp_cons; index != rp; index++)
+    {
+        usbif_response_t response;
+        switch (UsbifRingGetResponse(&m_ring, index, m_inUse, m_entries, &response))
+        {
+        case UsbifResponseBadId:
+            BadIds++;
+            continue;
+        case UsbifResponseStale:
+            Stale++;
+            continue;
+        case UsbifResponseValid:
+            break;
+        }
+        Clock::time_point start = Clock::now();
+        Shadow * shadow = &m_shadows[response.id];
+        HostTransfer transfer = shadow->Transfer;
+        Clock::time_point putTime = shadow->PutTime;
+        //
+        // the grefs go back before the completion runs, as in XenDpc().
+        //
+        FreeShadow(shadow);
+        Completed++;
+        if (OnComplete)
+        {
+            Clock::time_point now = Clock::now();
+            OnComplete(transfer, response, now - putTime, now - start);
+        }
+    }
+    return UsbifRingFinishResponses(&m_ring, rp, true);
+}
+
+HostTransfer
+HostRandomTransfer(
+    std::mt19937 & Random,
+    uint64_t Cookie)
+{
+    HostTransfer transfer;
+    memset(&transfer, 0, sizeof(transfer));
+    transfer.Cookie = Cookie;
+    switch (Random() % 4)
+    {
+    case 0: // control
+        transfer.Endpoint = 0x80;
+        transfer.DataPages = 1;
+        break;
+    case 1: // isoch
+        transfer.Type = 1;
+        transfer.Endpoint = 0x81;
+        transfer.Packets = 8 << (Random() % 3);
+        transfer.PacketPages = 1;
+        transfer.DataPages = 1 + Random() % USBIF_URB_MAX_ISO_SEGMENTS;
+        break;
+    case 2: // bulk
+        transfer.Type = 2;
+        transfer.Endpoint = 0x82;
+        transfer.DataPages = 1 + Random() % 160;
+        break;
+    default: // interrupt
+        transfer.Type = 3;
+        transfer.Endpoint = 0x83;
+        transfer.DataPages = 1;
+        break;
+    }
+    transfer.Length = transfer.DataPages * PAGE_SIZE;
+    return transfer;
+}
+
+bool
+HostFrontend::WaitForEvent(
+    uint32_t TimeoutMs)
+{
+    if (m_toFrontend.Wait(&m_seen, TimeoutMs))
+    {
+        return true;
+    }
+    //
+    // responses found after a timeout, and still no event after a second
+    // wait, were pushed without notifying the frontend.
+    //
+    if (Outstanding() && RING_HAS_UNCONSUMED_RESPONSES(&m_ring) &&
+        !m_toFrontend.Wait(&m_seen, TimeoutMs))
+    {
+        LostEvents++;
+    }
+    return false;
+}
@@ -0,0 +1,153 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file HostFrontend.h the frontend half of the usbif protocol built on
+/// UsbifCore.h, shaped like the driver's PutOnRing() and XenDpc().
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#pragma once
+
+#include "FakeBackend.h"
+
+#include <chrono>
+#include <functional>
+#include <random>
+
+//
+/// a transfer as the driver would hand it to the ring.
+//
+struct HostTransfer
+{
+    uint8_t  Type;        //!< USBD_PIPE_TYPE.
+    uint8_t  Endpoint;
+    uint32_t Length;
+    uint32_t DataPages;   //!< pages of the data buffer.
+    uint32_t PacketPages; //!< iso packet descriptor pages, 0 if not isoch.
+    uint16_t Packets;
+    uint64_t Cookie;      //!< returned with the completion.
+    //
+    /// optional. The frontend grants the pages of these buffers, as the
+    /// driver grants the pages of an MDL, else it makes up page numbers.
+    /// DataPages and PacketPages must cover them.
+    //
+    uint8_t *         Buffer;
+    iso_packet_info * PacketDescriptors; //!< page aligned.
+};
+
+//
+/// a control, isoch, bulk or interrupt transfer of random size. Bulk
+/// transfers of more than 17 pages go through indirect pages.
+//
+HostTransfer
+HostRandomTransfer(
+    std::mt19937 & Random,
+    uint64_t Cookie);
+
+//
+/// The frontend owns the shared ring page, the shadows and the id stack and
+/// bitmap, as XEN_INTERFACE does in the driver. Single threaded, like the
+/// driver under the FDO lock.
+//
+class HostFrontend
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    HostFrontend(
+        FakeGrantTable & Grants,
+        FakeEvent & ToBackend,
+        FakeEvent & ToFrontend);
+    ~HostFrontend();
+
+    usbif_sring * SharedRing() { return m_sring; }
+
+    //
+    /// grant the pages and put the transfer on the ring, not yet pushed.
+    /// false if there is no shadow or no grant ref, nothing is left behind.
+    //
+    bool Submit(const HostTransfer & Transfer);
+
+    //
+    /// push the requests put since the last push and notify the backend if
+    /// it asked for an event.
+    //
+    void Push();
+
+    //
+    /// one pass over the response ring, like XenDpc(). Returns true if
+    /// more responses arrived during the pass.
+    //
+    bool ProcessResponses();
+
+    //
+    /// wait for an event from the backend, false on timeout.
+    //
+    bool WaitForEvent(uint32_t TimeoutMs);
+
+    //
+    /// called for each valid response, once the shadow has been freed.
+    /// Latency is from Submit() to now, Handling is the time the frontend
+    /// spent on the response.
+    //
+    std::function<void (const HostTransfer & Transfer,
+        const usbif_response_t & Response,
+        Clock::duration Latency,
+        Clock::duration Handling)> OnComplete;
+
+    uint32_t Outstanding() const { return m_entries - m_freeIds.Free; }
+    uint32_t Entries() const { return m_entries; }
+
+    //
+    // stats.
+    //
+    uint64_t Completed;
+    uint64_t BadIds;
+    uint64_t Stale;
+    uint64_t Leaked;      //!< grefs the grant table did not know.
+    uint64_t Notifies;    //!< events sent to the backend.
+    uint64_t LostEvents;  //!< responses that arrived without an event.
+
+private:
+    struct Shadow
+    {
+        usbif_request_t         Req;
+        HostTransfer            Transfer;
+        usbif_indirect_page_t * Pages;      //!< indirect pages in use, NULL if direct.
+        uint32_t                PageCount;
+        usbif_indirect_page_t * IndirectPageMemory; //!< MAX_INDIRECT_PAGES pages.
+        Clock::time_point       PutTime;
+    };
+
+    void FreeShadow(Shadow * shadow);
+
+    FakeGrantTable &   m_grants;
+    FakeEvent &        m_toBackend;
+    FakeEvent &        m_toFrontend;
+    uint64_t           m_seen;
+    usbif_sring *      m_sring;
+    usbif_front_ring_t m_ring;
+    uint16_t           m_entries;
+    Shadow             m_shadows[SHADOW_ENTRIES];
+    uint16_t           m_ids[SHADOW_ENTRIES];
+    USBIF_ID_STACK     m_freeIds;
+    uint32_t           m_inUse[USBIF_ID_BITMAP_WORDS(SHADOW_ENTRIES)];
+    std::vector<uint64_t> m_pfns;
+};
@@ -0,0 +1,125 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file LatencyStats.h latency samples and percentile reports for the host tools.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#include "FakeBackend.h"
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+//
+/// Every sample is kept, the percentiles are exact. Times are in
+/// nanoseconds.
+//
+class LatencySamples
+{
+public:
+    void Add(uint64_t Ns)
+    {
+        m_samples.push_back(Ns);
+        m_sorted = false;
+    }
+
+    size_t Count() const { return m_samples.size(); }
+
+    //
+    /// nearest rank, Percentile in [0, 100].
+    //
+    uint64_t Percentile(double Percentile)
+    {
+        if (m_samples.empty())
+        {
+            return 0;
+        }
+        Sort();
+        size_t rank = (size_t) ((Percentile / 100.0) * (double) m_samples.size());
+        if (rank >= m_samples.size())
+        {
+            rank = m_samples.size() - 1;
+        }
+        return m_samples[rank];
+    }
+
+    uint64_t Mean() const
+    {
+        if (m_samples.empty())
+        {
+            return 0;
+        }
+        long double total = 0;
+        for (uint64_t sample : m_samples)
+        {
+            total += sample;
+        }
+        return (uint64_t) (total / m_samples.size());
+    }
+
+    //
+    /// one line: count, mean, p50, p90, p99, p99.9 and max in microseconds.
+    //
+    void PrintText(FILE * File, const char * Name)
+    {
+        fprintf(File, "%-12s n=%-8zu mean=%9.2f p50=%9.2f p90=%9.2f p99=%9.2f p999=%9.2f max=%9.2f us\n",
+            Name,
+            Count(),
+            Mean() / 1000.0,
+            Percentile(50) / 1000.0,
+            Percentile(90) / 1000.0,
+            Percentile(99) / 1000.0,
+            Percentile(99.9) / 1000.0,
+            Percentile(100) / 1000.0);
+    }
+
+    //
+    /// the same as a JSON object, times in nanoseconds.
+    //
+    void PrintJson(FILE * File, const char * Name)
+    {
+        fprintf(File, "\"%s\": {\"count\": %zu, \"mean_ns\": %llu, \"p50_ns\": %llu, "
+            "\"p90_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}",
+            Name,
+            Count(),
+            (unsigned long long) Mean(),
+            (unsigned long long) Percentile(50),
+            (unsigned long long) Percentile(90),
+            (unsigned long long) Percentile(99),
+            (unsigned long long) Percentile(99.9),
+            (unsigned long long) Percentile(100));
+    }
+
+private:
+    void Sort()
+    {
+        if (!m_sorted)
+        {
+            std::sort(m_samples.begin(), m_samples.end());
+            m_sorted = true;
+        }
+    }
+
+    std::vector<uint64_t> m_samples;
+    bool                  m_sorted = true;
+};
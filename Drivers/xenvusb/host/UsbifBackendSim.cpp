@@ -0,0 +1,259 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file UsbifBackendSim.cpp drives the host frontend against the backend simulator
+/// and reports submission, completion and end to end latency percentiles.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#include "FakeBackend.h"
+#include "HostFrontend.h"
+#include "BackendSimulator.h"
+#include "LatencyStats.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static void
+Usage(
+    const char * Name)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  --count N           transfers to complete (200000)\n"
+        "  --depth N           most transfers on the ring (ring size)\n"
+        "  --latency SPEC      backend latency, see LatencyModel (lognormal:50:0.75)\n"
+        "  --devrmvd-every N   start a burst of DEVRMVD responses every N responses\n"
+        "  --devrmvd-burst N   responses in each burst (1)\n"
+        "  --stall-every N     STALLED response every N responses\n"
+        "  --pause-every N     backend pauses after every N requests\n"
+        "  --pause-us US       for this long\n"
+        "  --grants N          grant table entries (65536)\n"
+        "  --seed N\n"
+        "  --json              JSON report\n"
+        "  --check             fail unless every transfer completed once with no leaks\n",
+        Name);
+}
+
+int
+main(
+    int argc,
+    char ** argv)
+{
+    uint32_t count = 200000;
+    uint32_t depth = 0;
+    uint32_t grantEntries = 65536;
+    uint64_t seed = 1;
+    bool json = false;
+    bool check = false;
+    const char * latencySpec = "lognormal:50:0.75";
+    LatencyModel latency;
+    FaultSchedule faults;
+
+    static const struct option options[] =
+    {
+        { "count",         required_argument, NULL, 'n' },
+        { "depth",         required_argument, NULL, 'd' },
+        { "latency",       required_argument, NULL, 'l' },
+        { "devrmvd-every", required_argument, NULL, 'r' },
+        { "devrmvd-burst", required_argument, NULL, 'b' },
+        { "stall-every",   required_argument, NULL, 's' },
+        { "pause-every",   required_argument, NULL, 'p' },
+        { "pause-us",      required_argument, NULL, 'u' },
+        { "grants",        required_argument, NULL, 'g' },
+        { "seed",          required_argument, NULL, 'S' },
+        { "json",          no_argument,       NULL, 'j' },
+        { "check",         no_argument,       NULL, 'c' },
+        { NULL, 0, NULL, 0 }
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "", options, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'n': count = (uint32_t) strtoul(optarg, NULL, 0); break;
+        case 'd': depth = (uint32_t) strtoul(optarg, NULL, 0); break;
+        case 'l': latencySpec = optarg; break;
+        case 'r': faults.DeviceRemovedEvery = (uint32_t) strtoul(optarg, NULL, 0); break;
+        case 'b': faults.DeviceRemovedBurst = (uint32_t) strtoul(optarg, NULL, 0); break;
+        case 's': faults.StallEvery = (uint32_t) strtoul(optarg, NULL, 0); break;
+        case 'p': faults.PauseEvery = (uint32_t) strtoul(optarg, NULL, 0); break;
+        case 'u': faults.PauseUs = (uint32_t) strtoul(optarg, NULL, 0); break;
+        case 'g': grantEntries = (uint32_t) strtoul(optarg, NULL, 0); break;
+        case 'S': seed = strtoull(optarg, NULL, 0); break;
+        case 'j': json = true; break;
+        case 'c': check = true; break;
+        default:
+            Usage(argv[0]);
+            return 2;
+        }
+    }
+    if (!latency.Parse(latencySpec) || !count || (optind != argc))
+    {
+        Usage(argv[0]);
+        return 2;
+    }
+
+    FakeGrantTable grants(grantEntries);
+    FakeEvent toBackend;
+    FakeEvent toFrontend;
+    HostFrontend frontend(grants, toBackend, toFrontend);
+    BackendSimulator backend(frontend.SharedRing(), grants, toBackend, toFrontend,
+        latency, faults, seed);
+    if (!depth || (depth > frontend.Entries()))
+    {
+        depth = frontend.Entries();
+    }
+
+    LatencySamples submitPath;
+    LatencySamples completePath;
+    LatencySamples endToEnd;
+    std::vector<uint8_t> completions(count, 0);
+    uint64_t errors = 0;
+    frontend.OnComplete = [&](const HostTransfer & Transfer,
+        const usbif_response_t & Response,
+        HostFrontend::Clock::duration Latency,
+        HostFrontend::Clock::duration Handling)
+    {
+        completions[Transfer.Cookie]++;
+        errors += (Response.status != 0);
+        endToEnd.Add(std::chrono::duration_cast<std::chrono::nanoseconds>(Latency).count());
+        completePath.Add(std::chrono::duration_cast<std::chrono::nanoseconds>(Handling).count());
+    };
+
+    std::mt19937 random((uint32_t) seed);
+    uint32_t submitted = 0;
+    uint32_t skipped = 0;   //!< larger than the grant table.
+    uint64_t submitFailures = 0;
+    HostTransfer next = HostRandomTransfer(random, 0);
+    HostFrontend::Clock::time_point start = HostFrontend::Clock::now();
+
+    backend.Start();
+    while ((frontend.Completed + skipped) < count)
+    {
+        bool blocked = false;
+        while ((submitted < count) && (frontend.Outstanding() < depth))
+        {
+            HostFrontend::Clock::time_point submitStart = HostFrontend::Clock::now();
+            if (!frontend.Submit(next))
+            {
+                submitFailures++;
+                if (!frontend.Outstanding())
+                {
+                    skipped++;
+                    submitted++;
+                    next = HostRandomTransfer(random, submitted);
+                    continue;
+                }
+                blocked = true;
+                break;
+            }
+            submitPath.Add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                HostFrontend::Clock::now() - submitStart).count());
+            submitted++;
+            next = HostRandomTransfer(random, submitted);
+        }
+        frontend.Push();
+        if (frontend.Outstanding() &&
+            (blocked || (submitted == count) || (frontend.Outstanding() >= depth)))
+        {
+            frontend.WaitForEvent(EVENT_TIMEOUT_MS);
+        }
+        while (frontend.ProcessResponses());
+    }
+    backend.Stop();
+    double seconds = std::chrono::duration<double>(HostFrontend::Clock::now() - start).count();
+
+    uint32_t wrong = 0;
+    for (uint32_t index = 0; index < count; index++)
+    {
+        wrong += (completions[index] > 1);
+    }
+
+    if (json)
+    {
+        printf("{\"count\": %u, \"depth\": %u, \"latency\": \"%s\", \"grants\": %u, \"seconds\": %.3f,\n",
+            count, depth, latencySpec, grantEntries, seconds);
+        printf(" \"backend\": {\"requests\": %llu, \"out_of_order\": %llu, \"device_removed\": %llu, "
+            "\"stalled\": %llu, \"pauses\": %llu, \"bad_grants\": %llu},\n",
+            (unsigned long long) backend.Requests,
+            (unsigned long long) backend.OutOfOrder,
+            (unsigned long long) backend.DeviceRemoved,
+            (unsigned long long) backend.Stalled,
+            (unsigned long long) backend.Pauses,
+            (unsigned long long) backend.BadGrants);
+        printf(" \"frontend\": {\"completed\": %llu, \"errors\": %llu, \"submit_failures\": %llu, "
+            "\"skipped\": %u, \"bad_ids\": %llu, \"stale\": %llu, \"leaked\": %llu},\n",
+            (unsigned long long) frontend.Completed,
+            (unsigned long long) errors,
+            (unsigned long long) submitFailures,
+            skipped,
+            (unsigned long long) frontend.BadIds,
+            (unsigned long long) frontend.Stale,
+            (unsigned long long) frontend.Leaked);
+        printf(" ");
+        submitPath.PrintJson(stdout, "submit");
+        printf(",\n ");
+        completePath.PrintJson(stdout, "complete");
+        printf(",\n ");
+        endToEnd.PrintJson(stdout, "end_to_end");
+        printf("}\n");
+    }
+    else
+    {
+        printf("%u transfers in %.3fs, depth %u, latency %s, %u grants\n",
+            count, seconds, depth, latencySpec, grantEntries);
+        printf("backend:  %llu requests, %llu out of order, %llu device removed, %llu stalled, %llu pauses\n",
+            (unsigned long long) backend.Requests,
+            (unsigned long long) backend.OutOfOrder,
+            (unsigned long long) backend.DeviceRemoved,
+            (unsigned long long) backend.Stalled,
+            (unsigned long long) backend.Pauses);
+        printf("frontend: %llu completed, %llu errors, %llu submit failures, %u skipped\n",
+            (unsigned long long) frontend.Completed,
+            (unsigned long long) errors,
+            (unsigned long long) submitFailures,
+            skipped);
+        submitPath.PrintText(stdout, "submit");
+        completePath.PrintText(stdout, "complete");
+        endToEnd.PrintText(stdout, "end-to-end");
+    }
+
+    if (check)
+    {
+        bool ok = (wrong == 0) &&
+            ((frontend.Completed + skipped) == count) &&
+            (backend.Requests == frontend.Completed) &&
+            (frontend.Outstanding() == 0) &&
+            !frontend.BadIds && !frontend.Stale && !frontend.Leaked &&
+            !backend.BadGrants &&
+            (grants.InUse() == 0);
+        if (!ok)
+        {
+            fprintf(stderr, "check failed: %u completed more than once, %llu bad grants, %u grants in use\n",
+                wrong,
+                (unsigned long long) backend.BadGrants,
+                grants.InUse());
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,1291 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file UsbifBenchmark.cpp per transfer cost of the frontend ring paths.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#include "FakeBackend.h"
+#include "HostFrontend.h"
+#include "LatencyStats.h"
+#include "UsbDescriptorCore.h"
+#include "Trace.h"
+#include "UsbifLegacy.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+//
+/// The frontend and an in-thread FakeBackend exchange one kind of transfer
+/// in batches of the ring size. Timed per transfer:
+///
+///   submit    buffer pages to grefs and onto the ring (PutUrbOnRing()).
+///   response  response checked and grefs released (XenDpc()).
+///   post      iso packet results copied to the URB's packet descriptors
+///             (XenPostProcessIsoResponse()).
+///
+/// SubmitUrb() dispatch and request completion need WDF and are only timed
+/// in the driver, see IOCTL_XENVUSB_PATH_TIMING_QUERY.
+///
+/// The micro scenarios time one piece of driver code in a tight loop, in
+/// batches because a single call is shorter than the clock resolution. Each
+/// path is a variant of the same work, e.g. before and after a change.
+//
+struct BENCH_SCENARIO
+{
+    const char * Name;
+    uint8_t      Type;
+    uint8_t      Endpoint;
+    uint32_t     Length;
+    uint16_t     Packets;
+};
+
+#define ISO_PACKET_LENGTH 1024
+
+static const BENCH_SCENARIO gScenarios[] =
+{
+    { "interrupt",   3, 0x81, 8,          0 },
+    { "bulk-512k",   2, 0x82, 512 * 1024, 0 },
+    { "iso-8",       1, 0x83, 8 * ISO_PACKET_LENGTH,  8 },
+    { "iso-32",      1, 0x83, 32 * ISO_PACKET_LENGTH, 32 },
+};
+
+struct BENCH_RESULT
+{
+    const BENCH_SCENARIO * Scenario;
+    uint32_t         Transfers;
+    double           Seconds;
+    LatencySamples   Submit;
+    LatencySamples   Response;
+    LatencySamples   Post;
+    uint64_t         Errors;
+};
+
+static uint64_t
+Ns(
+    HostFrontend::Clock::duration Duration)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Duration).count();
+}
+
+static void
+RunScenario(
+    const BENCH_SCENARIO & Scenario,
+    uint32_t Transfers,
+    BENCH_RESULT & Result)
+{
+    FakeGrantTable grants;
+    FakeEvent toBackend;
+    FakeEvent toFrontend;
+    HostFrontend frontend(grants, toBackend, toFrontend);
+    FakeBackend backend(frontend.SharedRing(), grants, toBackend, toFrontend);
+
+    //
+    // one buffer and one packet descriptor page per shadow, reused.
+    //
+    uint32_t dataPages = (Scenario.Length + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t entries = frontend.Entries();
+    uint8_t * buffers = (uint8_t *) aligned_alloc(PAGE_SIZE, (size_t) entries * dataPages * PAGE_SIZE);
+    iso_packet_info * packets = (iso_packet_info *) aligned_alloc(PAGE_SIZE, (size_t) entries * PAGE_SIZE);
+    assert(buffers && packets);
+    memset(buffers, 0, (size_t) entries * dataPages * PAGE_SIZE);
+    memset(packets, 0, (size_t) entries * PAGE_SIZE);
+
+    //
+    // the backend fills in the packet descriptors of an isoch IN transfer.
+    //
+    backend.Respond = [&](const usbif_request_t & Request, usbif_response_t & Response)
+    {
+        if (Request.type != 1)
+        {
+            return;
+        }
+        uint64_t pfn;
+        if (grants.Lookup(Request.gref[0], &pfn))
+        {
+            iso_packet_info * packet = (iso_packet_info *) (uintptr_t) (pfn << PAGE_SHIFT);
+            for (uint32_t index = 0; index < Request.nr_packets; index++)
+            {
+                packet[index].length = ISO_PACKET_LENGTH;
+                packet[index].status = 0;
+            }
+        }
+        Response.bytesTransferred = 0;
+    };
+
+    //
+    // the client's packet descriptors, as in the URB.
+    //
+    std::vector<USBD_ISO_PACKET_DESCRIPTOR> urbPackets(Scenario.Packets);
+    for (uint32_t index = 0; index < Scenario.Packets; index++)
+    {
+        urbPackets[index].Offset = index * ISO_PACKET_LENGTH;
+    }
+
+    Result.Scenario = &Scenario;
+    Result.Transfers = Transfers;
+    Result.Errors = 0;
+    frontend.OnComplete = [&](const HostTransfer & Transfer,
+        const usbif_response_t & Response,
+        HostFrontend::Clock::duration,
+        HostFrontend::Clock::duration Handling)
+    {
+        Result.Response.Add(Ns(Handling));
+        HostFrontend::Clock::time_point start = HostFrontend::Clock::now();
+        uint32_t errorCount = 0;
+        uint32_t bytes = UsbifIsoCompletePackets(Transfer.PacketDescriptors,
+            urbPackets.data(),
+            Transfer.Packets,
+            Transfer.Length,
+            &errorCount);
+        Result.Errors += errorCount;
+        Result.Errors += (UsbifMapStatus(false, Response.status) != USBD_STATUS_SUCCESS) ||
+            (Transfer.Packets && (bytes != Transfer.Length));
+        if (Transfer.Packets)
+        {
+            Result.Post.Add(Ns(HostFrontend::Clock::now() - start));
+        }
+    };
+
+    uint32_t submitted = 0;
+    HostFrontend::Clock::time_point start = HostFrontend::Clock::now();
+    while (frontend.Completed < Transfers)
+    {
+        while ((submitted < Transfers) && (frontend.Outstanding() < entries))
+        {
+            uint32_t slot = submitted % entries;
+            HostTransfer transfer;
+            memset(&transfer, 0, sizeof(transfer));
+            transfer.Type = Scenario.Type;
+            transfer.Endpoint = Scenario.Endpoint;
+            transfer.Length = Scenario.Length;
+            transfer.DataPages = dataPages;
+            transfer.Packets = Scenario.Packets;
+            transfer.Cookie = submitted;
+            transfer.Buffer = buffers + ((size_t) slot * dataPages * PAGE_SIZE);
+            if (Scenario.Packets)
+            {
+                transfer.PacketPages = 1;
+                transfer.PacketDescriptors = (iso_packet_info *) ((uint8_t *) packets + ((size_t) slot * PAGE_SIZE));
+                for (uint32_t index = 0; index < Scenario.Packets; index++)
+                {
+                    transfer.PacketDescriptors[index].offset = index * ISO_PACKET_LENGTH;
+                    transfer.PacketDescriptors[index].length = 0;
+                    transfer.PacketDescriptors[index].status = 0;
+                }
+            }
+            HostFrontend::Clock::time_point submitStart = HostFrontend::Clock::now();
+            bool ok = frontend.Submit(transfer);
+            Result.Submit.Add(Ns(HostFrontend::Clock::now() - submitStart));
+            if (!ok)
+            {
+                fprintf(stderr, "%s: submit failed\n", Scenario.Name);
+                exit(1);
+            }
+            submitted++;
+        }
+        frontend.Push();
+        backend.Service();
+        while (frontend.ProcessResponses());
+    }
+    Result.Seconds = std::chrono::duration<double>(HostFrontend::Clock::now() - start).count();
+
+    if (backend.BadGrants || frontend.Leaked || grants.InUse())
+    {
+        fprintf(stderr, "%s: %llu bad grants %llu leaked\n",
+            Scenario.Name,
+            (unsigned long long) backend.BadGrants,
+            (unsigned long long) frontend.Leaked);
+        exit(1);
+    }
+    free(buffers);
+    free(packets);
+}
+
+static void
+PrintText(
+    BENCH_RESULT & Result)
+{
+    printf("%s: %u transfers, %.0f/s, %.1f MB/s, %llu errors\n",
+        Result.Scenario->Name,
+        Result.Transfers,
+        Result.Transfers / Result.Seconds,
+        ((double) Result.Transfers * Result.Scenario->Length) / (Result.Seconds * 1e6),
+        (unsigned long long) Result.Errors);
+    Result.Submit.PrintText(stdout, "  submit");
+    Result.Response.PrintText(stdout, "  response");
+    if (Result.Post.Count())
+    {
+        Result.Post.PrintText(stdout, "  post");
+    }
+}
+
+static void
+PrintJson(
+    BENCH_RESULT & Result,
+    bool Last)
+{
+    printf("  {\"scenario\": \"%s\", \"transfers\": %u, \"seconds\": %.6f, "
+        "\"transfers_per_second\": %.0f, \"mb_per_second\": %.1f, \"errors\": %llu,\n   ",
+        Result.Scenario->Name,
+        Result.Transfers,
+        Result.Seconds,
+        Result.Transfers / Result.Seconds,
+        ((double) Result.Transfers * Result.Scenario->Length) / (Result.Seconds * 1e6),
+        (unsigned long long) Result.Errors);
+    Result.Submit.PrintJson(stdout, "submit");
+    printf(",\n   ");
+    Result.Response.PrintJson(stdout, "response");
+    printf(",\n   ");
+    Result.Post.PrintJson(stdout, "post");
+    printf("}%s\n", Last ? "" : ",");
+}
+
+static void
+PrintCsvPath(
+    BENCH_RESULT & Result,
+    const char * Path,
+    LatencySamples & Samples)
+{
+    if (!Samples.Count())
+    {
+        return;
+    }
+    printf("%s,%s,%u,%.0f,%zu,%llu,%llu,%llu,%llu,%llu\n",
+        Result.Scenario->Name,
+        Path,
+        Result.Transfers,
+        Result.Transfers / Result.Seconds,
+        Samples.Count(),
+        (unsigned long long) Samples.Mean(),
+        (unsigned long long) Samples.Percentile(50),
+        (unsigned long long) Samples.Percentile(99),
+        (unsigned long long) Samples.Percentile(99.9),
+        (unsigned long long) Samples.Percentile(100));
+}
+
+struct MICRO_PATH
+{
+    const char *        Name;
+    uint32_t            Batch;    //!< operations per sample.
+    std::vector<double> NsPerOp;  //!< one sample per batch.
+
+    double
+    Percentile(
+        double Percentile)
+    {
+        std::sort(NsPerOp.begin(), NsPerOp.end());
+        size_t rank = (size_t) ((Percentile / 100.0) * (double) NsPerOp.size());
+        return NsPerOp[std::min(rank, NsPerOp.size() - 1)];
+    }
+};
+
+struct MICRO_RESULT;
+
+struct MICRO_SCENARIO
+{
+    const char * Name;
+    void      (* Run)(uint32_t Batches, MICRO_RESULT & Result);
+};
+
+struct MICRO_RESULT
+{
+    const MICRO_SCENARIO *  Scenario;
+    std::vector<MICRO_PATH> Paths;
+    uint64_t                Errors;
+};
+
+//
+/// keep a result so that the loop computing it is not optimized away.
+//
+static inline void
+MicroUse(
+    uint64_t Value)
+{
+    __asm__ volatile("" : : "r"(Value));
+}
+
+//
+/// time Batches batches of Batch calls of Op(index).
+//
+template <class Op>
+static void
+MicroTime(
+    MICRO_RESULT & Result,
+    const char * Name,
+    uint32_t Batches,
+    uint32_t Batch,
+    Op op)
+{
+    MICRO_PATH path;
+    path.Name = Name;
+    path.Batch = Batch;
+    path.NsPerOp.reserve(Batches);
+    for (uint32_t batch = 0; batch < Batches; batch++)
+    {
+        HostFrontend::Clock::time_point start = HostFrontend::Clock::now();
+        for (uint32_t index = 0; index < Batch; index++)
+        {
+            op(index);
+        }
+        path.NsPerOp.push_back((double) Ns(HostFrontend::Clock::now() - start) / Batch);
+    }
+    Result.Paths.push_back(path);
+}
+
+//
+// ParseConfig(): a composite device with 16 interfaces of 2 alternate
+// settings, each with a class specific descriptor and 4 endpoints.
+//
+#define PARSE_INTERFACES  16
+#define PARSE_ALTERNATES  2
+#define PARSE_ENDPOINTS   4
+
+static std::vector<uint8_t>
+BuildCompositeConfig()
+{
+    std::vector<uint8_t> config(sizeof(USB_CONFIGURATION_DESCRIPTOR));
+    for (uint8_t number = 0; number < PARSE_INTERFACES; number++)
+    {
+        for (uint8_t alternate = 0; alternate < PARSE_ALTERNATES; alternate++)
+        {
+            USB_INTERFACE_DESCRIPTOR interface;
+            memset(&interface, 0, sizeof(interface));
+            interface.bLength = sizeof(interface);
+            interface.bDescriptorType = USB_INTERFACE_DESCRIPTOR_TYPE;
+            interface.bInterfaceNumber = number;
+            interface.bAlternateSetting = alternate;
+            interface.bNumEndpoints = PARSE_ENDPOINTS;
+            interface.bInterfaceClass = 0xFF;
+            config.insert(config.end(), (uint8_t *) &interface, (uint8_t *) (&interface + 1));
+
+            static const uint8_t classSpecific[] = { 9, 0x24, 1, 0, 1, 0, 0, 0, 0 };
+            config.insert(config.end(), classSpecific, classSpecific + sizeof(classSpecific));
+
+            for (uint8_t index = 0; index < PARSE_ENDPOINTS; index++)
+            {
+                USB_ENDPOINT_DESCRIPTOR endpoint;
+                memset(&endpoint, 0, sizeof(endpoint));
+                endpoint.bLength = sizeof(endpoint);
+                endpoint.bDescriptorType = USB_ENDPOINT_DESCRIPTOR_TYPE;
+                endpoint.bEndpointAddress = (uint8_t) ((((number * PARSE_ENDPOINTS) + index) % 15) + 1) |
+                    ((index & 1) ? 0x80 : 0);
+                endpoint.bmAttributes = 2;
+                endpoint.wMaxPacketSize = 512;
+                config.insert(config.end(), (uint8_t *) &endpoint, (uint8_t *) (&endpoint + 1));
+            }
+        }
+    }
+    USB_CONFIGURATION_DESCRIPTOR * header = (USB_CONFIGURATION_DESCRIPTOR *) config.data();
+    memset(header, 0, sizeof(*header));
+    header->bLength = sizeof(*header);
+    header->bDescriptorType = USB_CONFIGURATION_DESCRIPTOR_TYPE;
+    header->wTotalLength = (USHORT) config.size();
+    header->bNumInterfaces = PARSE_INTERFACES;
+    header->bConfigurationValue = 1;
+    return config;
+}
+
+//
+/// CONFIG_PARSE_VISITOR without the traces, into preallocated arrays.
+//
+struct BenchConfigVisitor
+{
+    USB_INTERFACE_DESCRIPTOR ** Interfaces;
+    ULONG *                     FirstPipe;
+    ULONG *                     NumPipes;
+    USB_ENDPOINT_DESCRIPTOR **  Pipes;
+
+    void
+    Interface(
+        USB_INTERFACE_DESCRIPTOR * Descriptor,
+        ULONG InterfaceIndex,
+        ULONG FirstEndpoint)
+    {
+        Interfaces[InterfaceIndex] = Descriptor;
+        FirstPipe[InterfaceIndex] = FirstEndpoint;
+        NumPipes[InterfaceIndex] = 0;
+    }
+
+    void
+    Endpoint(
+        USB_ENDPOINT_DESCRIPTOR * Descriptor,
+        ULONG InterfaceIndex,
+        ULONG EndpointIndex)
+    {
+        Pipes[EndpointIndex] = Descriptor;
+        NumPipes[InterfaceIndex]++;
+    }
+
+    void
+    Other(
+        USB_COMMON_DESCRIPTOR *)
+    {
+    }
+};
+
+//
+/// count  UsbConfigCount(), the header only pass that sizes the arena.
+/// walk   UsbConfigWalk() into the arena.
+/// parse  both, as ParseConfig() runs them.
+//
+static void
+RunParseConfig(
+    uint32_t Batches,
+    MICRO_RESULT & Result)
+{
+    std::vector<uint8_t> buffer = BuildCompositeConfig();
+    USB_CONFIGURATION_DESCRIPTOR * config = (USB_CONFIGURATION_DESCRIPTOR *) buffer.data();
+    if (!UsbConfigCheckHeader(config))
+    {
+        Result.Errors++;
+        return;
+    }
+    const ULONG interfaces = PARSE_INTERFACES * PARSE_ALTERNATES;
+    const ULONG endpoints = interfaces * PARSE_ENDPOINTS;
+    std::vector<USB_INTERFACE_DESCRIPTOR *> interfaceArray(interfaces);
+    std::vector<ULONG> firstPipe(interfaces);
+    std::vector<ULONG> numPipes(interfaces);
+    std::vector<USB_ENDPOINT_DESCRIPTOR *> pipes(endpoints);
+    BenchConfigVisitor visitor = { interfaceArray.data(), firstPipe.data(), numPipes.data(), pipes.data() };
+
+    MicroTime(Result, "count", Batches, 16, [&](uint32_t)
+    {
+        USB_CONFIG_WALK count;
+        UsbConfigCount(config, &count);
+        Result.Errors += (count.Interfaces != interfaces) || (count.Endpoints != endpoints);
+    });
+    MicroTime(Result, "walk", Batches, 16, [&](uint32_t)
+    {
+        USB_CONFIG_WALK walk;
+        Result.Errors += (UsbConfigWalk(config, interfaces, endpoints, visitor, &walk) != UsbConfigValid);
+        MicroUse((uintptr_t) pipes[endpoints - 1]);
+    });
+    MicroTime(Result, "parse", Batches, 16, [&](uint32_t)
+    {
+        USB_CONFIG_WALK count;
+        UsbConfigCount(config, &count);
+        USB_CONFIG_WALK walk;
+        Result.Errors += (UsbConfigWalk(config, count.Interfaces, count.Endpoints, visitor, &walk) != UsbConfigValid);
+        MicroUse((uintptr_t) pipes[endpoints - 1]);
+    });
+}
+
+volatile int gLegacyTraceEnabled = 0;
+
+//
+/// XenPostProcessIsoResponse()'s packet loop on responses of 8, 64 and 512
+/// packets, one in 16 failed. old is the loop before the change that
+/// tightened it, LegacyIsoCompletePackets(), new is UsbifIsoCompletePackets().
+/// One operation is one response.
+//
+static void
+RunIsoPost(
+    uint32_t Batches,
+    MICRO_RESULT & Result)
+{
+    static const struct
+    {
+        uint32_t     Packets;
+        const char * Old;
+        const char * New;
+    } sizes[] =
+    {
+        { 8,   "old-8",   "new-8" },
+        { 64,  "old-64",  "new-64" },
+        { 512, "old-512", "new-512" },
+    };
+    for (auto & size : sizes)
+    {
+        std::vector<iso_packet_info> info(size.Packets);
+        std::vector<USBD_ISO_PACKET_DESCRIPTOR> packets(size.Packets);
+        uint32_t expectedBytes = 0;
+        uint32_t expectedErrors = 0;
+        for (uint32_t index = 0; index < size.Packets; index++)
+        {
+            info[index].offset = index * ISO_PACKET_LENGTH;
+            info[index].length = (uint16_t) (ISO_PACKET_LENGTH - (index % 64));
+            info[index].status = ((index % 16) == 15) ? USBIF_USB_CRC : 0;
+            packets[index].Offset = info[index].offset;
+            if (info[index].status)
+            {
+                expectedErrors++;
+            }
+            else
+            {
+                expectedBytes += info[index].length;
+            }
+        }
+        uint32_t bufferLength = size.Packets * ISO_PACKET_LENGTH;
+
+        MicroTime(Result, size.Old, Batches, 64, [&](uint32_t)
+        {
+            uint32_t errors;
+            uint32_t bytes = LegacyIsoCompletePackets(info.data(), packets.data(), size.Packets, &errors);
+            Result.Errors += (bytes != expectedBytes) || (errors != expectedErrors);
+        });
+        MicroTime(Result, size.New, Batches, 64, [&](uint32_t)
+        {
+            uint32_t errors;
+            uint32_t bytes = UsbifIsoCompletePackets(info.data(), packets.data(), size.Packets,
+                bufferLength, &errors);
+            Result.Errors += (bytes != expectedBytes) || (errors != expectedErrors);
+        });
+    }
+}
+
+//
+/// the usbif to USBD status translation, through the old switch
+/// (LegacyMapUsbifToUsbdStatus(), with its string results as XenDpc() and
+/// the iso packet loop took them) and through UsbifMapStatus().
+///
+///   old-response, new-response   one per response, 1 in 16 failed.
+///   old-errors, new-errors       one per response, every one failed,
+///                                each usbif error code in turn.
+///   old-packet, new-packet       one per iso packet of a 64 packet
+///                                response, 1 in 16 failed.
+//
+static void
+RunStatusMap(
+    uint32_t Batches,
+    MICRO_RESULT & Result)
+{
+    const uint32_t codes = USBIF_RSP_USB_ERROR - USBIF_RSP_USB_UNKNOWN;
+    std::vector<int16_t> responses(1024);
+    std::vector<int16_t> errors(1024);
+    for (uint32_t index = 0; index < responses.size(); index++)
+    {
+        int16_t error = (int16_t) (USBIF_RSP_USB_ERROR - 1 - (int32_t) ((index / 16) % codes));
+        responses[index] = ((index % 16) == 15) ? error : 0;
+        errors[index] = (int16_t) (USBIF_RSP_USB_ERROR - 1 - (int32_t) (index % codes));
+    }
+    std::vector<int16_t> packets(64);
+    for (uint32_t index = 0; index < packets.size(); index++)
+    {
+        packets[index] = ((index % 16) == 15) ? USBIF_USB_CRC : 0;
+    }
+    for (uint32_t index = 0; index < responses.size(); index++)
+    {
+        Result.Errors +=
+            (UsbifMapStatus(false, responses[index]) !=
+                LegacyMapUsbifToUsbdStatus(false, responses[index], NULL, NULL)) +
+            (UsbifMapStatus(true, errors[index]) !=
+                LegacyMapUsbifToUsbdStatus(true, errors[index], NULL, NULL));
+    }
+
+    auto Old = [](int16_t Status) -> USBD_STATUS
+    {
+        const char * usbifString;
+        const char * usbdString;
+        USBD_STATUS status = LegacyMapUsbifToUsbdStatus(false, Status, &usbifString, &usbdString);
+        MicroUse((uintptr_t) usbifString + (uintptr_t) usbdString);
+        return status;
+    };
+    auto New = [](int16_t Status) -> USBD_STATUS
+    {
+        return UsbifMapStatus(false, Status);
+    };
+    const uint32_t mask = (uint32_t) responses.size() - 1;
+    MicroTime(Result, "old-response", Batches, 64, [&](uint32_t index)
+    {
+        MicroUse(Old(responses[index & mask]));
+    });
+    MicroTime(Result, "new-response", Batches, 64, [&](uint32_t index)
+    {
+        MicroUse(New(responses[index & mask]));
+    });
+    MicroTime(Result, "old-errors", Batches, 64, [&](uint32_t index)
+    {
+        MicroUse(Old(errors[index & mask]));
+    });
+    MicroTime(Result, "new-errors", Batches, 64, [&](uint32_t index)
+    {
+        MicroUse(New(errors[index & mask]));
+    });
+    MicroTime(Result, "old-packet", Batches, (uint32_t) packets.size(), [&](uint32_t index)
+    {
+        MicroUse(Old(packets[index]));
+    });
+    MicroTime(Result, "new-packet", Batches, (uint32_t) packets.size(), [&](uint32_t index)
+    {
+        MicroUse(New(packets[index]));
+    });
+}
+
+//
+/// xenif.cpp usbif_shadow_ex_t as it is now. Everything XenDpc() and
+/// PutShadowOnFreelist() read for every response is ahead of req.gref.
+//
+struct alignas(64) BENCH_SHADOW
+{
+    BOOLEAN         InUse;
+    BOOLEAN         isReset;
+    BOOLEAN         isCancel;
+    BOOLEAN         isFrameSync;
+    BOOLEAN         endpointCounted;
+    BOOLEAN         mdlAllocated;
+    UCHAR           indirectPages;
+    UCHAR           isoPacketPages;
+    PVOID           Request;
+    PVOID           isoFastSlot;
+    LONGLONG        putTime;
+    usbif_request_t req;
+    PVOID           indirectPageMemory;
+    PVOID           isoPacketDescriptor;
+    PMDL            allocatedMdl;
+    ULONG           Tag;
+};
+
+static_assert(offsetof(BENCH_SHADOW, req.gref) <= 64, "first line");
+static_assert(sizeof(BENCH_SHADOW) == sizeof(LEGACY_SHADOW), "same footprint");
+
+//
+/// what the response path does with a shadow besides reading it.
+//
+struct BENCH_DPC
+{
+    uint64_t Latency;                  //!< putTime, for RecordEndpointHistograms().
+    uint64_t PipeBytes[4];
+    uint64_t Freed;                    //!< MDLs and pages PutShadowOnFreelist() frees.
+    uint64_t FreeIds;
+    uint32_t EndpointRequests[256];
+
+    bool
+    EndAccess(
+        grant_ref_t Ref)
+    {
+        Freed += Ref;
+        return true;
+    }
+};
+
+static bool
+ShadowIndirect(
+    const LEGACY_SHADOW & Shadow)
+{
+    return Shadow.indirectPageMemory != NULL;
+}
+
+static bool
+ShadowIndirect(
+    const BENCH_SHADOW & Shadow)
+{
+    return Shadow.indirectPages != 0;
+}
+
+//
+/// the reads of a free build XenDpc() for a response that completes a WDF
+/// request. Returns the bytes transferred.
+//
+template <class Shadow>
+static uint32_t
+ShadowResponse(
+    Shadow & shadow,
+    uint32_t BytesTransferred,
+    BENCH_DPC & Dpc)
+{
+    if ((shadow.req.type != 1) && (BytesTransferred > shadow.req.length)) // isoch
+    {
+        BytesTransferred = shadow.req.length;
+    }
+    PVOID request = shadow.Request;
+    if ((request || shadow.isoFastSlot) && !shadow.isReset)
+    {
+        Dpc.Latency += (uint64_t) shadow.putTime;
+        if (shadow.req.type <= 3) // interrupt
+        {
+            Dpc.PipeBytes[shadow.req.type] += BytesTransferred;
+        }
+    }
+    if (shadow.isoFastSlot || shadow.isCancel || !request)
+    {
+        return 0;
+    }
+    if (ShadowIndirect(shadow))
+    {
+        Dpc.PipeBytes[0] = std::max<uint64_t>(Dpc.PipeBytes[0], shadow.req.length);
+    }
+    return BytesTransferred;
+}
+
+//
+/// PutShadowOnFreelist() before the teardown tested the first line.
+//
+static void
+LegacyShadowFree(
+    LEGACY_SHADOW & Shadow,
+    BENCH_DPC & Dpc)
+{
+    if (!Shadow.InUse)
+    {
+        return;
+    }
+    if (Shadow.isoPacketMdl)
+    {
+        Dpc.Freed++;
+        Shadow.isoPacketMdl = NULL;
+    }
+    if (Shadow.allocatedMdl)
+    {
+        Dpc.Freed++;
+        Shadow.allocatedMdl = NULL;
+    }
+    if (Shadow.isoFastSlot)
+    {
+        Shadow.isoPacketDescriptor = NULL;
+        Shadow.isoFastSlot = NULL;
+    }
+    if (Shadow.isoPacketDescriptor)
+    {
+        Dpc.Freed++;
+        Shadow.isoPacketDescriptor = NULL;
+    }
+    UsbifReleaseSegments(&Shadow.req, (usbif_indirect_page_t *) Shadow.indirectPageMemory, Dpc);
+    if (Shadow.indirectPageMemory)
+    {
+        Dpc.Freed++;
+        Shadow.indirectPageMemory = NULL;
+    }
+    if (Shadow.endpointCounted)
+    {
+        Dpc.EndpointRequests[Shadow.req.endpoint]--;
+        Shadow.endpointCounted = FALSE;
+    }
+    Shadow.Request = NULL;
+    Shadow.isCancel = FALSE;
+    Shadow.InUse = FALSE;
+    Dpc.FreeIds += Shadow.req.id;
+}
+
+//
+/// PutShadowOnFreelist() as it is now.
+//
+static void
+ShadowFree(
+    BENCH_SHADOW & Shadow,
+    BENCH_DPC & Dpc)
+{
+    if (!Shadow.InUse)
+    {
+        return;
+    }
+    if (Shadow.mdlAllocated)
+    {
+        Dpc.Freed++;
+        Shadow.allocatedMdl = NULL;
+        Shadow.mdlAllocated = FALSE;
+    }
+    if (Shadow.isoFastSlot)
+    {
+        Shadow.isoPacketDescriptor = NULL;
+        Shadow.isoFastSlot = NULL;
+    }
+    if (Shadow.isoPacketPages)
+    {
+        Dpc.Freed++;
+        Shadow.isoPacketDescriptor = NULL;
+        Shadow.isoPacketPages = 0;
+    }
+    if (Shadow.req.nr_segments)
+    {
+        UsbifReleaseSegments(&Shadow.req,
+            Shadow.indirectPages ? (usbif_indirect_page_t *) Shadow.indirectPageMemory : NULL,
+            Dpc);
+    }
+    if (Shadow.indirectPages)
+    {
+        Dpc.Freed++;
+        Shadow.indirectPageMemory = NULL;
+        Shadow.indirectPages = 0;
+    }
+    if (Shadow.endpointCounted)
+    {
+        Dpc.EndpointRequests[Shadow.req.endpoint]--;
+        Shadow.endpointCounted = FALSE;
+    }
+    Shadow.req.nr_segments = 0;
+    Shadow.Request = NULL;
+    Shadow.isCancel = FALSE;
+    Shadow.isFrameSync = FALSE;
+    Shadow.InUse = FALSE;
+    Dpc.FreeIds += Shadow.req.id;
+}
+
+//
+/// what the submit side sets for a bulk IN transfer of Segments pages, or
+/// of no data, from a buffer with an MDL: the fields the response path reads.
+//
+template <class Shadow>
+static void
+ShadowArm(
+    Shadow & shadow,
+    uint32_t Id,
+    uint8_t Segments,
+    BENCH_DPC & Dpc)
+{
+    shadow.InUse = TRUE;
+    shadow.Request = &shadow;
+    shadow.putTime = Id;
+    shadow.endpointCounted = TRUE;
+    Dpc.EndpointRequests[shadow.req.endpoint]++;
+    shadow.req.nr_segments = Segments;
+    for (uint8_t index = 0; index < Segments; index++)
+    {
+        shadow.req.gref[index] = Id + index;
+    }
+}
+
+template <class Shadow>
+static Shadow *
+AllocateShadows(
+    uint32_t Count,
+    uint8_t Segments,
+    BENCH_DPC & Dpc)
+{
+    Shadow * shadows = (Shadow *) aligned_alloc(4096, sizeof(Shadow) * Count);
+    if (shadows)
+    {
+        memset(shadows, 0, sizeof(Shadow) * Count);
+        for (uint32_t id = 0; id < Count; id++)
+        {
+            shadows[id].Tag = 'Shdw';
+            shadows[id].req.id = id;
+            shadows[id].req.type = 2; // bulk
+            shadows[id].req.endpoint = 0x82;
+            shadows[id].req.length = Segments * PAGE_SIZE;
+            ShadowArm(shadows[id], id, Segments, Dpc);
+        }
+    }
+    return shadows;
+}
+
+//
+/// SHADOW_POOL shadows, 24MB of either layout, outgrow L2. The cold paths
+/// take responses from them in a random order, so that each response
+/// finds its shadow out of L1 and L2 as a DPC does after the guest has
+/// run something else since the request was put on the ring. The cache
+/// lines are served from L3, misses to memory are not timed.
+//
+#define SHADOW_POOL (1u << 17)
+
+//
+/// XenDpc()'s reads of a shadow and PutShadowOnFreelist() with the old
+/// layout, LEGACY_SHADOW, and the layout that keeps them in the first
+/// cache line, BENCH_SHADOW. One operation is one response, its teardown
+/// and ShadowArm() setting the shadow up again.
+///
+///   old-warm, new-warm       a ring's SHADOW_ENTRIES shadows in ring
+///                            order, one page bulk transfers: in L1.
+///   old-cold, new-cold       one page bulk transfers from the pool.
+///   old-nodata, new-nodata   transfers without data from the pool.
+//
+static void
+RunShadow(
+    uint32_t Batches,
+    MICRO_RESULT & Result)
+{
+    static const struct
+    {
+        const char * Old;
+        const char * New;
+        uint32_t     Shadows;
+        uint8_t      Segments;
+    } cases[] =
+    {
+        { "old-warm",   "new-warm",   SHADOW_ENTRIES, 1 },
+        { "old-cold",   "new-cold",   SHADOW_POOL,    1 },
+        { "old-nodata", "new-nodata", SHADOW_POOL,    0 },
+    };
+    std::vector<uint32_t> order(SHADOW_POOL);
+    uint32_t seed = 0x2545F491;
+    for (uint32_t index = 0; index < order.size(); index++)
+    {
+        order[index] = index;
+    }
+    for (uint32_t index = (uint32_t) order.size() - 1; index > 0; index--)
+    {
+        seed = seed * 1664525 + 1013904223;
+        std::swap(order[index], order[(seed >> 8) % (index + 1)]);
+    }
+    for (auto & test : cases)
+    {
+        BENCH_DPC oldDpc = {};
+        BENCH_DPC newDpc = {};
+        LEGACY_SHADOW * oldShadows = AllocateShadows<LEGACY_SHADOW>(test.Shadows, test.Segments, oldDpc);
+        BENCH_SHADOW * newShadows = AllocateShadows<BENCH_SHADOW>(test.Shadows, test.Segments, newDpc);
+        if (!oldShadows || !newShadows)
+        {
+            Result.Errors++;
+            free(oldShadows);
+            free(newShadows);
+            return;
+        }
+        uint64_t oldBytes = 0;
+        uint64_t newBytes = 0;
+        uint32_t next = 0;
+        auto Id = [&]() -> uint32_t
+        {
+            uint32_t id = (test.Shadows == SHADOW_POOL) ? order[next] : next;
+            next = (next + 1) % test.Shadows;
+            return id;
+        };
+        MicroTime(Result, test.Old, Batches, 64, [&](uint32_t)
+        {
+            uint32_t id = Id();
+            oldBytes += ShadowResponse(oldShadows[id], 512, oldDpc);
+            LegacyShadowFree(oldShadows[id], oldDpc);
+            ShadowArm(oldShadows[id], id, test.Segments, oldDpc);
+        });
+        next = 0;
+        MicroTime(Result, test.New, Batches, 64, [&](uint32_t)
+        {
+            uint32_t id = Id();
+            newBytes += ShadowResponse(newShadows[id], 512, newDpc);
+            ShadowFree(newShadows[id], newDpc);
+            ShadowArm(newShadows[id], id, test.Segments, newDpc);
+        });
+        Result.Errors += (oldBytes != newBytes) ||
+            (oldDpc.Latency != newDpc.Latency) ||
+            (oldDpc.Freed != newDpc.Freed) ||
+            (oldDpc.FreeIds != newDpc.FreeIds) ||
+            (memcmp(oldDpc.PipeBytes, newDpc.PipeBytes, sizeof(oldDpc.PipeBytes)) != 0);
+        free(oldShadows);
+        free(newShadows);
+    }
+}
+
+ULONG gDebugLevel = XenTraceLevelNotice;
+ULONG gDebugFlag = TRACE_DRIVER | TRACE_DEVICE;
+
+//
+/// the host ___XenTrace() formats the message and drops it. xenutil's may
+/// drop a level nobody reads before formatting, gHostTraceFormat 0 times
+/// that: a trace cost the old macro no less than the call.
+//
+static volatile int gHostTraceFormat = 1;
+
+extern "C" void
+___XenTrace(
+    XEN_TRACE_LEVEL lvl,
+    PCSTR module,
+    size_t module_size,
+    PCSTR fmt,
+    va_list args)
+{
+    UNREFERENCED_PARAMETER(lvl);
+    UNREFERENCED_PARAMETER(module);
+    UNREFERENCED_PARAMETER(module_size);
+    if (!gHostTraceFormat)
+    {
+        return;
+    }
+    char message[256];
+    int length = vsnprintf(message, sizeof(message), fmt, args);
+    MicroUse((uint64_t) length + (uint8_t) message[0]);
+}
+
+//
+/// the verbose per request trace of PutUrbOnRing() through Trace.h, built
+/// as a free build (XENVUSB_TRACE_VERBOSE 0) with the release default
+/// gDebugLevel, and through the macro as it was. One operation is one
+/// trace site reached.
+///
+///   old           LegacyTraceEvents(): arguments, va_list, formatted.
+///   old-call      the same, ___XenTrace() returns without formatting.
+///   new-verbose   TraceEvents(), verbose: compiled out.
+///   new-masked    TraceEvents(), information, below gDebugLevel.
+///   new-traced    TraceEvents(), information and enabled: the cost of a
+///                 trace somebody asked for, as old.
+//
+static void
+RunTrace(
+    uint32_t Batches,
+    MICRO_RESULT & Result)
+{
+    usbif_request_t req = {};
+    req.type = 2; // bulk
+    req.endpoint = 0x82;
+    req.length = 0x10000;
+    req.nr_segments = 16;
+
+#define TRACE_REQUEST(_macro_, _lvl_) \
+    _macro_(_lvl_, TRACE_DEVICE, \
+        "PutUrbOnRing:request: id %llu type %d endpoint %x length %x offset %x nr_segs %d\n", \
+        (unsigned long long) req.id, \
+        req.type, \
+        req.endpoint, \
+        req.length, \
+        req.offset, \
+        req.nr_segments)
+
+    MicroTime(Result, "old", Batches, 64, [&](uint32_t index)
+    {
+        req.id = index;
+        TRACE_REQUEST(LegacyTraceEvents, TRACE_LEVEL_VERBOSE);
+    });
+    gHostTraceFormat = 0;
+    MicroTime(Result, "old-call", Batches, 64, [&](uint32_t index)
+    {
+        req.id = index;
+        TRACE_REQUEST(LegacyTraceEvents, TRACE_LEVEL_VERBOSE);
+    });
+    gHostTraceFormat = 1;
+    MicroTime(Result, "new-verbose", Batches, 64, [&](uint32_t index)
+    {
+        req.id = index;
+        TRACE_REQUEST(TraceEvents, TRACE_LEVEL_VERBOSE);
+        MicroUse(req.id);
+    });
+    MicroTime(Result, "new-masked", Batches, 64, [&](uint32_t index)
+    {
+        req.id = index;
+        TRACE_REQUEST(TraceEvents, TRACE_LEVEL_INFORMATION);
+        MicroUse(req.id);
+    });
+    ULONG debugLevel = gDebugLevel;
+    gDebugLevel = XenTraceLevelInfo;
+    MicroTime(Result, "new-traced", Batches, 64, [&](uint32_t index)
+    {
+        req.id = index;
+        TRACE_REQUEST(TraceEvents, TRACE_LEVEL_INFORMATION);
+    });
+    gDebugLevel = debugLevel;
+
+#undef TRACE_REQUEST
+}
+
+static const MICRO_SCENARIO gMicroScenarios[] =
+{
+    { "parse-config", RunParseConfig },
+    { "iso-post",     RunIsoPost },
+    { "status-map",   RunStatusMap },
+    { "trace",        RunTrace },
+    { "shadow",       RunShadow },
+};
+
+static void
+PrintMicroText(
+    MICRO_RESULT & Result)
+{
+    printf("%s: %llu errors\n",
+        Result.Scenario->Name,
+        (unsigned long long) Result.Errors);
+    for (MICRO_PATH & path : Result.Paths)
+    {
+        printf("  %-12s n=%-8zu p50=%9.2f p99=%9.2f min=%9.2f ns/op\n",
+            path.Name,
+            path.NsPerOp.size(),
+            path.Percentile(50),
+            path.Percentile(99),
+            path.Percentile(0));
+    }
+}
+
+static void
+PrintMicroJson(
+    MICRO_RESULT & Result,
+    bool Last)
+{
+    printf("  {\"scenario\": \"%s\", \"errors\": %llu",
+        Result.Scenario->Name,
+        (unsigned long long) Result.Errors);
+    for (MICRO_PATH & path : Result.Paths)
+    {
+        printf(",\n   \"%s\": {\"batches\": %zu, \"batch\": %u, \"p50_ns_per_op\": %.3f, "
+            "\"p99_ns_per_op\": %.3f, \"min_ns_per_op\": %.3f}",
+            path.Name,
+            path.NsPerOp.size(),
+            path.Batch,
+            path.Percentile(50),
+            path.Percentile(99),
+            path.Percentile(0));
+    }
+    printf("}%s\n", Last ? "" : ",");
+}
+
+static void
+PrintMicroCsv(
+    MICRO_RESULT & Result)
+{
+    for (MICRO_PATH & path : Result.Paths)
+    {
+        printf("%s,%s,%zu,%u,%.3f,%.3f,%.3f\n",
+            Result.Scenario->Name,
+            path.Name,
+            path.NsPerOp.size(),
+            path.Batch,
+            path.Percentile(50),
+            path.Percentile(99),
+            path.Percentile(0));
+    }
+}
+
+static void
+Usage(
+    const char * Name)
+{
+    fprintf(stderr,
+        "usage: %s [--iterations N] [--scenario NAME] [--json | --csv]\n"
+        "scenarios:",
+        Name);
+    for (const BENCH_SCENARIO & scenario : gScenarios)
+    {
+        fprintf(stderr, " %s", scenario.Name);
+    }
+    for (const MICRO_SCENARIO & scenario : gMicroScenarios)
+    {
+        fprintf(stderr, " %s", scenario.Name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int
+main(
+    int argc,
+    char ** argv)
+{
+    uint32_t iterations = 100000;
+    const char * only = NULL;
+    enum { Text, Json, Csv } format = Text;
+
+    static const struct option options[] =
+    {
+        { "iterations", required_argument, NULL, 'n' },
+        { "scenario",   required_argument, NULL, 's' },
+        { "json",       no_argument,       NULL, 'j' },
+        { "csv",        no_argument,       NULL, 'c' },
+        { NULL, 0, NULL, 0 }
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "", options, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'n': iterations = (uint32_t) strtoul(optarg, NULL, 0); break;
+        case 's': only = optarg; break;
+        case 'j': format = Json; break;
+        case 'c': format = Csv; break;
+        default:
+            Usage(argv[0]);
+            return 2;
+        }
+    }
+    if (!iterations || (optind != argc))
+    {
+        Usage(argv[0]);
+        return 2;
+    }
+
+    std::vector<BENCH_RESULT> results;
+    results.reserve(sizeof(gScenarios) / sizeof(gScenarios[0]));
+    for (const BENCH_SCENARIO & scenario : gScenarios)
+    {
+        if (only && (std::string(only) != scenario.Name))
+        {
+            continue;
+        }
+        results.emplace_back();
+        RunScenario(scenario, iterations, results.back());
+    }
+    //
+    // a micro sample is a batch, fewer of them are enough.
+    //
+    uint32_t batches = (iterations / 10) + 1;
+    std::vector<MICRO_RESULT> microResults;
+    microResults.reserve(sizeof(gMicroScenarios) / sizeof(gMicroScenarios[0]));
+    for (const MICRO_SCENARIO & scenario : gMicroScenarios)
+    {
+        if (only && (std::string(only) != scenario.Name))
+        {
+            continue;
+        }
+        microResults.emplace_back();
+        microResults.back().Scenario = &scenario;
+        microResults.back().Errors = 0;
+        scenario.Run(batches, microResults.back());
+    }
+    if (results.empty() && microResults.empty())
+    {
+        Usage(argv[0]);
+        return 2;
+    }
+
+    uint64_t errors = 0;
+    if (format == Json)
+    {
+        printf("{\"iterations\": %u, \"results\": [\n", iterations);
+    }
+    else if (format == Csv)
+    {
+        printf("scenario,path,transfers,transfers_per_second,samples,mean_ns,p50_ns,p99_ns,p999_ns,max_ns\n");
+    }
+    for (size_t index = 0; index < results.size(); index++)
+    {
+        BENCH_RESULT & result = results[index];
+        errors += result.Errors;
+        switch (format)
+        {
+        case Text:
+            PrintText(result);
+            break;
+        case Json:
+            PrintJson(result, index == (results.size() - 1));
+            break;
+        case Csv:
+            PrintCsvPath(result, "submit", result.Submit);
+            PrintCsvPath(result, "response", result.Response);
+            PrintCsvPath(result, "post", result.Post);
+            break;
+        }
+    }
+    if (format == Json)
+    {
+        printf("],\n\"micro\": [\n");
+    }
+    else if (format == Csv && !microResults.empty())
+    {
+        printf("\nscenario,path,batches,batch,p50_ns_per_op,p99_ns_per_op,min_ns_per_op\n");
+    }
+    for (size_t index = 0; index < microResults.size(); index++)
+    {
+        MICRO_RESULT & result = microResults[index];
+        errors += result.Errors;
+        switch (format)
+        {
+        case Text:
+            PrintMicroText(result);
+            break;
+        case Json:
+            PrintMicroJson(result, index == (microResults.size() - 1));
+            break;
+        case Csv:
+            PrintMicroCsv(result);
+            break;
+        }
+    }
+    if (format == Json)
+    {
+        printf("]}\n");
+    }
+    return errors ? 1 : 0;
+}
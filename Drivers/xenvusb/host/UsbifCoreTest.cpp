@@ -0,0 +1,396 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file UsbifCoreTest.cpp host tests of the usbif core against the fake backend.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#include "FakeBackend.h"
+#include "HostFrontend.h"
+#include "UsbifLegacy.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <random>
+
+static int gFailures = 0;
+
+#define CHECK(_exp_) do {                                               \
+    if (!(_exp_)) {                                                     \
+        fprintf(stderr, "%s:%d: %s: CHECK(%s) failed\n",                \
+            __FILE__, __LINE__, __FUNCTION__, #_exp_);                  \
+        gFailures++;                                                    \
+    }                                                                   \
+} while (0)
+
+//
+// the driver sizes its shadows and the ring from these.
+//
+static_assert(sizeof(usbif_request_t) == 104, "usbif_request_t layout");
+static_assert(sizeof(usbif_indirect_page_t) == PAGE_SIZE, "usbif_indirect_page_t layout");
+static_assert(USB_RING_SIZE == 32, "USB_RING_SIZE");
+
+static void
+TestIdStack()
+{
+    uint16_t ids[4];
+    USBIF_ID_STACK stack;
+    UsbifIdStackInit(&stack, ids, 4);
+    for (uint16_t id = 0; id < 4; id++)
+    {
+        CHECK(UsbifIdStackPush(&stack, id));
+    }
+    stack.MinFree = stack.Free;
+
+    uint16_t id;
+    CHECK(UsbifIdStackPop(&stack, &id) && id == 3);
+    CHECK(UsbifIdStackPop(&stack, &id) && id == 2);
+    CHECK(stack.MinFree == 2);
+    //
+    // LIFO: the last id freed is the next one used.
+    //
+    CHECK(UsbifIdStackPush(&stack, 3));
+    CHECK(UsbifIdStackPop(&stack, &id) && id == 3);
+    CHECK(UsbifIdStackPop(&stack, &id) && id == 1);
+    CHECK(UsbifIdStackPop(&stack, &id) && id == 0);
+    CHECK(!UsbifIdStackPop(&stack, &id));
+    CHECK(stack.MinFree == 0);
+}
+
+static void
+TestIdBitmap()
+{
+    uint32_t inUse[USBIF_ID_BITMAP_WORDS(SHADOW_ENTRIES)] = { 0 };
+    CHECK(UsbifIdBitmapNext(inUse, SHADOW_ENTRIES, 0) == SHADOW_ENTRIES);
+
+    UsbifIdBitmapSet(inUse, 5);
+    UsbifIdBitmapSet(inUse, 31);
+    CHECK(UsbifIdBitmapTest(inUse, 5));
+    CHECK(!UsbifIdBitmapTest(inUse, 6));
+    CHECK(UsbifIdBitmapNext(inUse, SHADOW_ENTRIES, 0) == 5);
+    CHECK(UsbifIdBitmapNext(inUse, SHADOW_ENTRIES, 6) == 31);
+
+    UsbifIdBitmapClear(inUse, 5);
+    UsbifIdBitmapClear(inUse, 31);
+    CHECK(!UsbifIdBitmapTest(inUse, 5));
+    CHECK(UsbifIdBitmapNext(inUse, SHADOW_ENTRIES, 0) == SHADOW_ENTRIES);
+}
+
+static void
+TestGrantSegments()
+{
+    FakeGrantTable grants(64);
+    uint64_t pfns[USBIF_URB_MAX_SEGMENTS_PER_REQUEST + 1];
+    for (uint32_t index = 0; index < USBIF_URB_MAX_SEGMENTS_PER_REQUEST + 1; index++)
+    {
+        pfns[index] = 0x1000 + index;
+    }
+
+    usbif_request_t request;
+    memset(&request, 0, sizeof(request));
+    CHECK(UsbifGrantSegments(&request, pfns, 1, grants));
+    CHECK(UsbifGrantSegments(&request, pfns + 1, USBIF_URB_MAX_SEGMENTS_PER_REQUEST - 1, grants));
+    CHECK(request.nr_segments == USBIF_URB_MAX_SEGMENTS_PER_REQUEST);
+    for (uint32_t index = 0; index < request.nr_segments; index++)
+    {
+        uint64_t pfn;
+        CHECK(grants.Lookup(request.gref[index], &pfn) && pfn == pfns[index]);
+    }
+    //
+    // no room for an 18th segment.
+    //
+    CHECK(!UsbifGrantSegments(&request, pfns, 1, grants));
+    CHECK(grants.InUse() == USBIF_URB_MAX_SEGMENTS_PER_REQUEST);
+    CHECK(UsbifReleaseSegments(&request, (usbif_indirect_page_t *) NULL, grants) == 0);
+    CHECK(request.nr_segments == 0);
+    CHECK(grants.InUse() == 0);
+
+    //
+    // running out of grefs part way leaves what was granted for release.
+    //
+    FakeGrantTable small(3);
+    CHECK(!UsbifGrantSegments(&request, pfns, 5, small));
+    CHECK(request.nr_segments == 3);
+    CHECK(UsbifReleaseSegments(&request, (usbif_indirect_page_t *) NULL, small) == 0);
+    CHECK(small.InUse() == 0);
+
+    //
+    // a gref ended twice is reported as leaked.
+    //
+    CHECK(UsbifGrantSegments(&request, pfns, 2, grants));
+    CHECK(grants.EndAccess(request.gref[1]));
+    CHECK(UsbifReleaseSegments(&request, (usbif_indirect_page_t *) NULL, grants) == 1);
+    CHECK(grants.InUse() == 0);
+}
+
+static void
+TestGrantIndirectSegments()
+{
+    FakeGrantTable grants;
+    const uint32_t packetPages = 2;
+    const uint32_t dataPages = INDIRECT_GREF_PAGES + 10;
+    const uint32_t pageCount = INDIRECT_PAGES_REQUIRED(packetPages + dataPages);
+    CHECK(pageCount == 2);
+
+    std::vector<usbif_indirect_page_t> pages(pageCount);
+    std::vector<uint64_t> packetPfns(packetPages);
+    std::vector<uint64_t> pfns(dataPages);
+    for (uint32_t index = 0; index < packetPages; index++)
+    {
+        packetPfns[index] = 0x2000 + index;
+    }
+    for (uint32_t index = 0; index < dataPages; index++)
+    {
+        pfns[index] = 0x4000 + index;
+    }
+
+    usbif_request_t request;
+    memset(&request, 0, sizeof(request));
+    uint64_t pagePfns[2] = { 0x10, 0x11 };
+    CHECK(UsbifGrantSegments(&request, pagePfns, pageCount, grants));
+    CHECK(UsbifGrantIndirectSegments(pages.data(), pageCount,
+        packetPfns.data(), packetPages, pfns.data(), dataPages, grants));
+    CHECK(pages[0].nr_segments == INDIRECT_GREF_PAGES);
+    CHECK(pages[1].nr_segments == packetPages + dataPages - INDIRECT_GREF_PAGES);
+
+    //
+    // packet descriptor pages first, then the data.
+    //
+    uint64_t pfn;
+    CHECK(grants.Lookup(pages[0].gref[0], &pfn) && pfn == 0x2000);
+    CHECK(grants.Lookup(pages[0].gref[packetPages], &pfn) && pfn == 0x4000);
+    CHECK(grants.Lookup(pages[1].gref[pages[1].nr_segments - 1], &pfn) &&
+        pfn == 0x4000 + dataPages - 1);
+    CHECK(grants.InUse() == pageCount + packetPages + dataPages);
+
+    CHECK(UsbifReleaseSegments(&request, pages.data(), grants) == 0);
+    CHECK(grants.InUse() == 0);
+    CHECK(pages[0].nr_segments == 0 && pages[1].nr_segments == 0);
+
+    //
+    // too many pages for the indirect pages supplied.
+    //
+    CHECK(!UsbifGrantIndirectSegments(pages.data(), 1,
+        packetPfns.data(), packetPages, pfns.data(), dataPages, grants));
+    CHECK(grants.InUse() == 0);
+}
+
+//
+// responses the backend should never send: an id out of range, an id that
+// is not on the ring, and a second response for a completed id.
+//
+static void
+TestBadResponses()
+{
+    FakeGrantTable grants;
+    FakeEvent toBackend;
+    FakeEvent toFrontend;
+    HostFrontend frontend(grants, toBackend, toFrontend);
+    usbif_back_ring_t back;
+    BACK_RING_INIT(&back, frontend.SharedRing(), PAGE_SIZE);
+
+    HostTransfer transfer = { 2, 0x81, 64, 1, 0, 0, 1 };
+    CHECK(frontend.Submit(transfer));
+    frontend.Push();
+    CHECK(toBackend.Count() == 1);
+
+    usbif_request_t request = *RING_GET_REQUEST(&back, back.req_cons);
+    back.req_cons++;
+
+    usbif_response_t response;
+    memset(&response, 0, sizeof(response));
+    response.id = SHADOW_ENTRIES + 7;
+    *RING_GET_RESPONSE(&back, back.rsp_prod_pvt++) = response;
+    response.id = (request.id + 1) % SHADOW_ENTRIES;
+    *RING_GET_RESPONSE(&back, back.rsp_prod_pvt++) = response;
+    response.id = request.id;
+    *RING_GET_RESPONSE(&back, back.rsp_prod_pvt++) = response;
+    *RING_GET_RESPONSE(&back, back.rsp_prod_pvt++) = response;
+    int notify;
+    RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&back, notify);
+    CHECK(notify);
+
+    CHECK(!frontend.ProcessResponses());
+    CHECK(frontend.BadIds == 1);
+    CHECK(frontend.Stale == 2);
+    CHECK(frontend.Completed == 1);
+    CHECK(frontend.Outstanding() == 0);
+    CHECK(grants.InUse() == 0);
+    //
+    // nothing outstanding, the frontend still wants an event for the next
+    // response.
+    //
+    CHECK(frontend.SharedRing()->rsp_event == back.rsp_prod_pvt + 1);
+}
+
+//
+// the frontend and a backend thread exchange random transfers, direct and
+// indirect, until Count have completed.
+//
+//
+/// UsbifMapStatus() and UsbifStatusLookup() against the switch they
+/// replaced, LegacyMapUsbifToUsbdStatus(), with and without a reset in
+/// progress: every usbif status, the values either side of them and the
+/// extremes of the ring's int16_t and of the LONG the driver passes.
+//
+static void
+TestStatusMapMatchesLegacy()
+{
+    std::vector<int32_t> statuses;
+    for (int32_t status = USBIF_RSP_USB_UNKNOWN - 64; status <= 64; status++)
+    {
+        statuses.push_back(status);
+    }
+    static const int32_t extremes[] =
+    {
+        SHRT_MIN, SHRT_MIN + 1, SHRT_MAX, SHRT_MAX + 1, SHRT_MIN - 1,
+        INT_MIN, INT_MIN + 1, INT_MAX, INT_MAX - 1,
+    };
+    statuses.insert(statuses.end(), extremes, extremes + sizeof(extremes) / sizeof(extremes[0]));
+
+    uint32_t compared = 0;
+    uint32_t known = 0;
+    for (int reset = 0; reset < 2; reset++)
+    {
+        for (int32_t status : statuses)
+        {
+            const char * legacyUsbif = NULL;
+            const char * legacyUsbd = NULL;
+            USBD_STATUS legacy = LegacyMapUsbifToUsbdStatus(reset != 0, status, &legacyUsbif, &legacyUsbd);
+            USBD_STATUS mapped = UsbifMapStatus(reset != 0, status);
+            const char * usbif = status ? UsbifStatusLookup(status)->UsbifString : "USBIF_SUCCESS";
+            if ((mapped != legacy) || strcmp(usbif, legacyUsbif))
+            {
+                fprintf(stderr, "status %d reset %d: %x %s, was %x %s\n",
+                    status, reset, mapped, usbif, legacy, legacyUsbif);
+            }
+            CHECK(mapped == legacy);
+            CHECK(!strcmp(usbif, legacyUsbif));
+            if (status && (status >= USBIF_RSP_USB_UNKNOWN) && (status < USBIF_RSP_USB_ERROR))
+            {
+                CHECK(strcmp(usbif, "Unknown UsbIfCode"));
+                known++;
+            }
+            compared++;
+        }
+    }
+    CHECK(known == 2 * (USBIF_RSP_USB_ERROR - USBIF_RSP_USB_UNKNOWN));
+    CHECK(LegacyMapUsbifToUsbdStatus(false, USBIF_RSP_USB_DEVRMVD, NULL, NULL) == USBD_STATUS_DEVICE_GONE);
+    CHECK(UsbifMapStatus(true, USBIF_RSP_USB_DEVRMVD) == USBD_STATUS_CANCELED);
+    CHECK(UsbifMapStatus(true, USBIF_RSP_USB_SHUTDOWN) == USBD_STATUS_CANCELED);
+    printf("status map: %u statuses match the old switch\n", compared);
+}
+
+static void
+TestThreadedBackend(
+    uint32_t Count)
+{
+    FakeGrantTable grants;
+    FakeEvent toBackend;
+    FakeEvent toFrontend;
+    HostFrontend frontend(grants, toBackend, toFrontend);
+    FakeBackend backend(frontend.SharedRing(), grants, toBackend, toFrontend);
+
+    std::vector<uint8_t> completions(Count, 0);
+    frontend.OnComplete = [&](const HostTransfer & Transfer,
+        const usbif_response_t & Response,
+        HostFrontend::Clock::duration,
+        HostFrontend::Clock::duration)
+    {
+        CHECK(Response.bytesTransferred == Transfer.Length);
+        completions[Transfer.Cookie]++;
+    };
+
+    backend.Start();
+    std::mt19937 random(0x5553427b);
+    uint32_t submitted = 0;
+    while (frontend.Completed < Count)
+    {
+        uint32_t batch = 1 + random() % 8;
+        for (; batch && (submitted < Count); batch--)
+        {
+            HostTransfer transfer = HostRandomTransfer(random, submitted);
+            if (!frontend.Submit(transfer))
+            {
+                break;
+            }
+            submitted++;
+        }
+        frontend.Push();
+        //
+        // sometimes wait for the backend's event, sometimes poll, always
+        // wait with the ring full.
+        //
+        if ((frontend.Outstanding() == frontend.Entries()) ||
+            ((submitted == Count) && frontend.Outstanding()) ||
+            (random() % 2))
+        {
+            frontend.WaitForEvent(EVENT_TIMEOUT_MS);
+        }
+        while (frontend.ProcessResponses());
+    }
+    backend.Stop();
+
+    uint32_t wrong = 0;
+    for (uint32_t index = 0; index < Count; index++)
+    {
+        wrong += (completions[index] != 1);
+    }
+    CHECK(wrong == 0);
+    CHECK(frontend.Completed == Count);
+    CHECK(backend.Requests == Count);
+    CHECK(frontend.Outstanding() == 0);
+    CHECK(frontend.BadIds == 0);
+    CHECK(frontend.Stale == 0);
+    CHECK(frontend.Leaked == 0);
+    CHECK(backend.BadGrants == 0);
+    CHECK(frontend.LostEvents == 0);
+    CHECK(backend.LostEvents == 0);
+    CHECK(grants.InUse() == 0);
+    printf("threaded: %u transfers, %llu segments, %llu/%llu events to backend/frontend\n",
+        Count,
+        (unsigned long long) backend.Segments,
+        (unsigned long long) frontend.Notifies,
+        (unsigned long long) backend.Notifies);
+}
+
+int
+main(
+    int argc,
+    char ** argv)
+{
+    uint32_t count = (argc > 1) ? (uint32_t) strtoul(argv[1], NULL, 0) : 100000;
+
+    TestIdStack();
+    TestIdBitmap();
+    TestGrantSegments();
+    TestGrantIndirectSegments();
+    TestBadResponses();
+    TestStatusMapMatchesLegacy();
+    TestThreadedBackend(count);
+
+    if (gFailures)
+    {
+        fprintf(stderr, "%d checks failed\n", gFailures);
+        return 1;
+    }
+    printf("usbif core: all checks passed\n");
+    return 0;
+}
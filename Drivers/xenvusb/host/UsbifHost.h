@@ -0,0 +1,314 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file UsbifHost.h NT and Xen types for building the usbif core on a host.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#pragma once
+
+//
+/// Just enough of the NT, usb.h and Xen headers for usbxenif.h,
+/// UsbifCore.h and UsbDescriptorCore.h to build with a host compiler.
+/// Include this, then usbxenif.h, then the cores. Nothing here is used by
+/// the driver build.
+//
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#include <atomic>
+#include <type_traits>
+
+//
+// NT types, with the Windows sizes.
+//
+typedef uint8_t             UCHAR, *PUCHAR;
+typedef uint16_t            USHORT, *PUSHORT;
+typedef uint32_t            ULONG, *PULONG;
+typedef int32_t             LONG, *PLONG;
+typedef uint64_t            ULONGLONG;
+typedef int64_t             LONGLONG;
+typedef uintptr_t           ULONG_PTR;
+typedef UCHAR               BOOLEAN;
+typedef void *              PVOID;
+typedef char *              PCHAR;
+typedef LONG                NTSTATUS;
+typedef ULONG_PTR           PFN_NUMBER, *PPFN_NUMBER;
+typedef struct _IRP *       PIRP;
+typedef struct _MDL *       PMDL;
+typedef uint16_t            WCHAR; // the Windows size, not wchar_t.
+
+#ifndef TRUE
+#define TRUE  1
+#define FALSE 0
+#endif
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE  4096
+#define PAGE_SHIFT 12
+#endif
+
+//
+// Xen types.
+//
+typedef uint32_t grant_ref_t;
+typedef uint16_t domid_t;
+
+#define xen_mb()  std::atomic_thread_fence(std::memory_order_seq_cst)
+#define xen_rmb() std::atomic_thread_fence(std::memory_order_acquire)
+#define xen_wmb() std::atomic_thread_fence(std::memory_order_release)
+
+//
+// io/ring.h. The layout matches the Xen public header, the sizing uses
+// offsetof so that USB_RING_SIZE is a constant expression.
+//
+typedef unsigned int RING_IDX;
+
+#define __RD2(_x)  (((_x) & 0x00000002) ? 0x2 : ((_x) & 0x1))
+#define __RD4(_x)  (((_x) & 0x0000000c) ? __RD2((_x)>>2)<<2    : __RD2(_x))
+#define __RD8(_x)  (((_x) & 0x000000f0) ? __RD4((_x)>>4)<<4    : __RD4(_x))
+#define __RD16(_x) (((_x) & 0x0000ff00) ? __RD8((_x)>>8)<<8    : __RD8(_x))
+#define __RD32(_x) (((_x) & 0xffff0000) ? __RD16((_x)>>16)<<16 : __RD16(_x))
+
+#define __RING_SIZE(_s, _sz) \
+    (__RD32(((_sz) - offsetof(std::remove_pointer<decltype(_s)>::type, ring)) / \
+        sizeof((_s)->ring[0])))
+
+#define DEFINE_RING_TYPES(__name, __req_t, __rsp_t)                     \
+union __name##_sring_entry {                                            \
+    __req_t req;                                                        \
+    __rsp_t rsp;                                                        \
+};                                                                      \
+struct __name##_sring {                                                 \
+    RING_IDX req_prod, req_event;                                       \
+    RING_IDX rsp_prod, rsp_event;                                       \
+    uint8_t  pvt_pad[4];                                                \
+    uint8_t  __pad[44];                                                 \
+    union __name##_sring_entry ring[1]; /* variable-length */           \
+};                                                                      \
+struct __name##_front_ring {                                            \
+    RING_IDX req_prod_pvt;                                              \
+    RING_IDX rsp_cons;                                                  \
+    unsigned int nr_ents;                                               \
+    struct __name##_sring *sring;                                       \
+};                                                                      \
+struct __name##_back_ring {                                             \
+    RING_IDX rsp_prod_pvt;                                              \
+    RING_IDX req_cons;                                                  \
+    unsigned int nr_ents;                                               \
+    struct __name##_sring *sring;                                       \
+};                                                                      \
+typedef struct __name##_sring __name##_sring_t;                         \
+typedef struct __name##_front_ring __name##_front_ring_t;               \
+typedef struct __name##_back_ring __name##_back_ring_t
+
+#define SHARED_RING_INIT(_s) do {                                       \
+    (_s)->req_prod  = (_s)->rsp_prod  = 0;                              \
+    (_s)->req_event = (_s)->rsp_event = 1;                              \
+    memset((_s)->pvt_pad, 0, sizeof((_s)->pvt_pad));                    \
+    memset((_s)->__pad, 0, sizeof((_s)->__pad));                        \
+} while (0)
+
+#define FRONT_RING_INIT(_r, _s, __size) do {                            \
+    (_r)->req_prod_pvt = 0;                                             \
+    (_r)->rsp_cons = 0;                                                 \
+    (_r)->nr_ents = __RING_SIZE(_s, __size);                            \
+    (_r)->sring = (_s);                                                 \
+} while (0)
+
+#define BACK_RING_INIT(_r, _s, __size) do {                             \
+    (_r)->rsp_prod_pvt = 0;                                             \
+    (_r)->req_cons = 0;                                                 \
+    (_r)->nr_ents = __RING_SIZE(_s, __size);                            \
+    (_r)->sring = (_s);                                                 \
+} while (0)
+
+#define RING_SIZE(_r) ((_r)->nr_ents)
+
+#define RING_FREE_REQUESTS(_r) \
+    (RING_SIZE(_r) - ((_r)->req_prod_pvt - (_r)->rsp_cons))
+
+#define RING_FULL(_r) (RING_FREE_REQUESTS(_r) == 0)
+
+#define RING_HAS_UNCONSUMED_RESPONSES(_r) \
+    ((_r)->sring->rsp_prod - (_r)->rsp_cons)
+
+#define RING_HAS_UNCONSUMED_REQUESTS(_r)                                \
+    ((((_r)->sring->req_prod - (_r)->req_cons) <                        \
+      (RING_SIZE(_r) - ((_r)->req_cons - (_r)->rsp_prod_pvt))) ?        \
+     ((_r)->sring->req_prod - (_r)->req_cons) :                         \
+     (RING_SIZE(_r) - ((_r)->req_cons - (_r)->rsp_prod_pvt)))
+
+#define RING_GET_REQUEST(_r, _idx) \
+    (&((_r)->sring->ring[((_idx) & (RING_SIZE(_r) - 1))].req))
+
+#define RING_GET_RESPONSE(_r, _idx) \
+    (&((_r)->sring->ring[((_idx) & (RING_SIZE(_r) - 1))].rsp))
+
+#define RING_REQUEST_CONS_OVERFLOW(_r, _cons) \
+    (((_cons) - (_r)->rsp_prod_pvt) >= RING_SIZE(_r))
+
+#define RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(_r, _notify) do {           \
+    RING_IDX __old = (_r)->sring->req_prod;                             \
+    RING_IDX __new = (_r)->req_prod_pvt;                                \
+    xen_wmb();                                                          \
+    (_r)->sring->req_prod = __new;                                      \
+    xen_mb();                                                           \
+    (_notify) = ((RING_IDX)(__new - (_r)->sring->req_event) <           \
+                 (RING_IDX)(__new - __old));                            \
+} while (0)
+
+#define RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(_r, _notify) do {          \
+    RING_IDX __old = (_r)->sring->rsp_prod;                             \
+    RING_IDX __new = (_r)->rsp_prod_pvt;                                \
+    xen_wmb();                                                          \
+    (_r)->sring->rsp_prod = __new;                                      \
+    xen_mb();                                                           \
+    (_notify) = ((RING_IDX)(__new - (_r)->sring->rsp_event) <           \
+                 (RING_IDX)(__new - __old));                            \
+} while (0)
+
+#define RING_FINAL_CHECK_FOR_REQUESTS(_r, _work_to_do) do {             \
+    (_work_to_do) = RING_HAS_UNCONSUMED_REQUESTS(_r);                   \
+    if (_work_to_do) break;                                             \
+    (_r)->sring->req_event = (_r)->req_cons + 1;                        \
+    xen_mb();                                                           \
+    (_work_to_do) = RING_HAS_UNCONSUMED_REQUESTS(_r);                   \
+} while (0)
+
+#define RING_FINAL_CHECK_FOR_RESPONSES(_r, _work_to_do) do {            \
+    (_work_to_do) = RING_HAS_UNCONSUMED_RESPONSES(_r);                  \
+    if (_work_to_do) break;                                             \
+    (_r)->sring->rsp_event = (_r)->rsp_cons + 1;                        \
+    xen_mb();                                                           \
+    (_work_to_do) = RING_HAS_UNCONSUMED_RESPONSES(_r);                  \
+} while (0)
+
+//
+// usbspec.h descriptors, packed as in the WDK.
+//
+#define USB_CONFIGURATION_DESCRIPTOR_TYPE   0x02
+#define USB_STRING_DESCRIPTOR_TYPE          0x03
+#define USB_INTERFACE_DESCRIPTOR_TYPE       0x04
+#define USB_ENDPOINT_DESCRIPTOR_TYPE        0x05
+
+#pragma pack(push, 1)
+typedef struct _USB_COMMON_DESCRIPTOR {
+    UCHAR bLength;
+    UCHAR bDescriptorType;
+} USB_COMMON_DESCRIPTOR, *PUSB_COMMON_DESCRIPTOR;
+
+typedef struct _USB_CONFIGURATION_DESCRIPTOR {
+    UCHAR  bLength;
+    UCHAR  bDescriptorType;
+    USHORT wTotalLength;
+    UCHAR  bNumInterfaces;
+    UCHAR  bConfigurationValue;
+    UCHAR  iConfiguration;
+    UCHAR  bmAttributes;
+    UCHAR  MaxPower;
+} USB_CONFIGURATION_DESCRIPTOR, *PUSB_CONFIGURATION_DESCRIPTOR;
+
+typedef struct _USB_INTERFACE_DESCRIPTOR {
+    UCHAR bLength;
+    UCHAR bDescriptorType;
+    UCHAR bInterfaceNumber;
+    UCHAR bAlternateSetting;
+    UCHAR bNumEndpoints;
+    UCHAR bInterfaceClass;
+    UCHAR bInterfaceSubClass;
+    UCHAR bInterfaceProtocol;
+    UCHAR iInterface;
+} USB_INTERFACE_DESCRIPTOR, *PUSB_INTERFACE_DESCRIPTOR;
+
+typedef struct _USB_ENDPOINT_DESCRIPTOR {
+    UCHAR  bLength;
+    UCHAR  bDescriptorType;
+    UCHAR  bEndpointAddress;
+    UCHAR  bmAttributes;
+    USHORT wMaxPacketSize;
+    UCHAR  bInterval;
+} USB_ENDPOINT_DESCRIPTOR, *PUSB_ENDPOINT_DESCRIPTOR;
+
+typedef struct _OS_STRING {
+    UCHAR bLength;
+    UCHAR bDescriptorType;
+    WCHAR MicrosoftString[7];
+    UCHAR bVendorCode;
+    UCHAR bPad;
+} OS_STRING, *POS_STRING;
+#pragma pack(pop)
+
+static_assert(sizeof(USB_CONFIGURATION_DESCRIPTOR) == 9, "usbspec.h size");
+static_assert(sizeof(USB_INTERFACE_DESCRIPTOR) == 9, "usbspec.h size");
+static_assert(sizeof(USB_ENDPOINT_DESCRIPTOR) == 7, "usbspec.h size");
+static_assert(sizeof(OS_STRING) == 0x12, "usbspec.h size");
+
+//
+// usb.h status codes and iso packet descriptor.
+//
+typedef LONG USBD_STATUS;
+
+#define USBD_STATUS_SUCCESS                 ((USBD_STATUS) 0x00000000L)
+#define USBD_STATUS_STALL_PID               ((USBD_STATUS) 0xC0000004L)
+#define USBD_STATUS_BUFFER_OVERRUN          ((USBD_STATUS) 0xC000000CL)
+#define USBD_STATUS_BUFFER_UNDERRUN         ((USBD_STATUS) 0xC000000DL)
+#define USBD_STATUS_TIMEOUT                 ((USBD_STATUS) 0xC0006000L)
+#define USBD_STATUS_DEVICE_GONE             ((USBD_STATUS) 0xC0007000L)
+#define USBD_STATUS_CANCELED                ((USBD_STATUS) 0xC0010000L)
+#define USBD_STATUS_INVALID_URB_FUNCTION    ((USBD_STATUS) 0x80000200L)
+#define USBD_STATUS_ERROR_BUSY              ((USBD_STATUS) 0x80000400L)
+#define USBD_STATUS_INTERNAL_HC_ERROR       ((USBD_STATUS) 0x80000800L)
+#define USBD_STATUS_ERROR_SHORT_TRANSFER    ((USBD_STATUS) 0x80000900L)
+
+typedef struct _USBD_ISO_PACKET_DESCRIPTOR {
+    ULONG       Offset;
+    ULONG       Length;
+    USBD_STATUS Status;
+} USBD_ISO_PACKET_DESCRIPTOR, *PUSBD_ISO_PACKET_DESCRIPTOR;
+
+//
+// winioctl.h, for Public.h.
+//
+#define FILE_DEVICE_UNKNOWN 0x00000022
+#define METHOD_BUFFERED     0
+#define FILE_READ_ACCESS    0x0001
+#define FILE_WRITE_ACCESS   0x0002
+#define CTL_CODE(DeviceType, Function, Method, Access) \
+    (((DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+
+//
+// Trace.h. Its ntstrsafe.h is an empty stand in here, ___XenTrace() is the
+// program's.
+//
+#define __pragma(_x_)
+#define __in_ecount(_n_)
+#define EXTERN_C extern "C"
+#define IN
+#define UNREFERENCED_PARAMETER(_p_) ((void) (_p_))
+typedef const char *            PCSTR;
+typedef struct _UNICODE_STRING * PUNICODE_STRING;
+
+//
+// UsbifCore.h hooks.
+//
+#define USBIF_CORE_BARRIER() xen_mb()
+#define USBIF_CORE_ASSERT(_exp_) assert(_exp_)
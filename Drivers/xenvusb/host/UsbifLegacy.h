@@ -0,0 +1,244 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file UsbifLegacy.h driver code that UsbifCore.h replaced, kept for the
+/// equivalence tests and as the "before" of the usbif_benchmark micro scenarios.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#pragma once
+
+//
+/// Copies of the driver code as it was before it moved to UsbifCore.h or was
+/// rewritten. Keep them as they were: they are what the new code is checked
+/// and timed against. Include after UsbifHost.h and usbxenif.h, and after
+/// Trace.h for LegacyTraceEvents().
+//
+#include <stdio.h>
+
+//
+/// stands in for the WPP level and flag check of a disabled TraceEvents().
+//
+extern volatile int gLegacyTraceEnabled;
+
+//
+/// Trace.h TraceEvents() before the level and flag were checked first: every
+/// argument evaluated and the message handed to ___XenTrace().
+//
+#define LegacyTraceEvents(_lvl_, _flg_, format, ...) \
+    __XenTrace((XEN_TRACE_LEVEL)_lvl_, _flg_, format, __VA_ARGS__)
+
+//
+/// xenif.cpp MapUsbifToUsbdStatus() before the lookup table.
+//
+inline USBD_STATUS
+LegacyMapUsbifToUsbdStatus(
+    bool ResetInProgress,
+    int32_t UsbIfStatus,
+    const char ** OutUsbIfString,
+    const char ** OutUsbdString)
+{
+    USBD_STATUS UsbdStatus = USBD_STATUS_INTERNAL_HC_ERROR;
+    const char * UsbifString = "Unknown UsbIfCode";
+    const char * UsbdString = "USBD_STATUS_INTERNAL_HC_ERROR";
+
+    switch(UsbIfStatus)
+    {
+    case 0:
+        UsbdStatus = USBD_STATUS_SUCCESS;
+        UsbifString = "USBIF_SUCCESS";
+        UsbdString = "USBD_STATUS_SUCCESS";
+        break;
+    case USBIF_RSP_USB_CANCELED:
+        UsbdStatus = USBD_STATUS_CANCELED;
+        UsbifString = "USBIF_RSP_USB_CANCELED";
+        UsbdString = "USBD_STATUS_CANCELED";
+        break;
+    case USBIF_RSP_USB_PENDING:
+        UsbdStatus = USBD_STATUS_INTERNAL_HC_ERROR;
+        UsbifString = "USBIF_RSP_USB_PENDING";
+        UsbdString = "USBD_STATUS_INTERNAL_HC_ERROR";
+        break;
+    case USBIF_RSP_USB_PROTO:
+        UsbdStatus = USBD_STATUS_INTERNAL_HC_ERROR;
+        UsbifString = "USBIF_RSP_USB_PROTO";
+        UsbdString = "USBD_STATUS_INTERNAL_HC_ERROR";
+        break;
+    case USBIF_RSP_USB_CRC:
+        UsbdStatus = USBD_STATUS_CANCELED; // was USBD_STATUS_CRC;
+        UsbifString = "USBIF_RSP_USB_CRC";
+        UsbdString = "USBD_STATUS_CANCELED";
+        break;
+    case USBIF_RSP_USB_TIMEOUT:
+        UsbdStatus = USBD_STATUS_STALL_PID; // USBD_STATUS_TIMEOUT;
+        UsbifString = "USBIF_RSP_USB_TIMEOUT";
+        UsbdString = "USBD_STATUS_STALL_PID";
+        break;
+    case USBIF_RSP_USB_STALLED:
+        UsbdStatus = USBD_STATUS_STALL_PID;
+        UsbifString = "USBIF_RSP_USB_STALLED";
+        UsbdString = "USBD_STATUS_STALL_PID";
+        break;
+    case USBIF_RSP_USB_INBUFF:
+        UsbdStatus = USBD_STATUS_BUFFER_OVERRUN;
+        UsbifString = "USBIF_RSP_USB_INBUFF";
+        UsbdString = "USBD_STATUS_BUFFER_OVERRUN";
+        break;
+    case USBIF_RSP_USB_OUTBUFF:
+        UsbdStatus = USBD_STATUS_BUFFER_UNDERRUN;
+        UsbifString = "USBIF_RSP_USB_OUTBUFF";
+        UsbdString = "USBD_STATUS_BUFFER_UNDERRUN";
+        break;
+    case USBIF_RSP_USB_OVERFLOW: // stall? babble - for bulk, perhaps not for isoch or interrupt?
+        UsbdStatus = USBD_STATUS_STALL_PID; // USBD_STATUS_BABBLE_DETECTED;
+        UsbifString = "USBIF_RSP_USB_OVERFLOW";
+        UsbdString = "USBD_STATUS_STALL_PID";
+        break;
+    case USBIF_RSP_USB_SHORTPKT:
+        UsbdStatus = USBD_STATUS_ERROR_SHORT_TRANSFER;
+        UsbifString = "USBIF_RSP_USB_SHORTPKT";
+        UsbdString = "USBD_STATUS_ERROR_SHORT_TRANSFER";
+        break;
+    case USBIF_RSP_USB_DEVRMVD:
+        UsbdStatus = USBD_STATUS_DEVICE_GONE;
+        UsbifString = "USBIF_RSP_USB_DEVRMVD";
+        UsbdString = "USBD_STATUS_DEVICE_GONE";
+        break;
+    case USBIF_RSP_USB_INVALID:
+        UsbdStatus = USBD_STATUS_INVALID_URB_FUNCTION; // ?
+        UsbifString = "USBIF_RSP_USB_INVALID";
+        UsbdString = "USBD_STATUS_INVALID_URB_FUNCTION";
+        break;
+    case USBIF_RSP_USB_PARTIAL:
+        UsbdStatus = USBD_STATUS_INTERNAL_HC_ERROR;
+        UsbifString = "USBIF_RSP_USB_PARTIAL";
+        UsbdString = "USBD_STATUS_INTERNAL_HC_ERROR";
+        break;
+    case USBIF_RSP_USB_RESET: // this is really a timeout
+        UsbdStatus = USBD_STATUS_TIMEOUT;
+        UsbifString = "USBIF_RSP_USB_RESET";
+        UsbdString = "USBD_STATUS_TIMEOUT";
+        break;
+    case USBIF_RSP_USB_SHUTDOWN:
+        UsbdStatus = USBD_STATUS_DEVICE_GONE; // was USBD_STATUS_ENDPOINT_HALTED
+        UsbifString = "USBIF_RSP_USB_SHUTDOWN";
+        UsbdString = "USBD_STATUS_DEVICE_GONE";
+        break;
+    case USBIF_RSP_USB_UNKNOWN: // backend unplug detected! (or not.)
+        UsbdStatus = USBD_STATUS_ERROR_BUSY; // was USBD_STATUS_DEVICE_GONE;
+        UsbifString = "USBIF_RSP_USB_UNKNOWN";
+        UsbdString = "USBD_STATUS_ERROR_BUSY";
+        break;
+    }
+    //
+    // treat device gone errors as transient if ResetInProgress.
+    //
+    if ((UsbdStatus == USBD_STATUS_DEVICE_GONE) &&
+        (ResetInProgress))
+    {
+        UsbdStatus = USBD_STATUS_CANCELED;
+        UsbdString = "USBD_STATUS_CANCELED";
+    }
+    if (OutUsbIfString)
+    {
+        *OutUsbIfString = UsbifString;
+    }
+    if (OutUsbdString)
+    {
+        *OutUsbdString = UsbdString;
+    }
+    return UsbdStatus;
+}
+
+//
+/// the packet loop of xenif.cpp XenPostProcessIsoResponse() before it was
+/// tightened: a status translation, a branch and a verbose trace per packet.
+/// Returns the bytes of the packets that succeeded.
+//
+inline uint32_t
+LegacyIsoCompletePackets(
+    const iso_packet_info * Info,
+    USBD_ISO_PACKET_DESCRIPTOR * Packets,
+    uint32_t Count,
+    uint32_t * ErrorCount)
+{
+    uint32_t totalBytes = 0;
+    *ErrorCount = 0;
+    for (uint32_t Index = 0;
+        Index < Count;
+        Index++)
+    {
+        const char * usbifStatusString = "UnknownUsbIf";
+        const char * usbdStatusString = "";
+
+        LegacyMapUsbifToUsbdStatus(
+            false,
+            Info[Index].status,
+            &usbifStatusString,
+            &usbdStatusString);
+
+        Packets[Index].Offset = Info[Index].offset;
+        Packets[Index].Length = Info[Index].length;
+        Packets[Index].Status = Info[Index].status;
+
+        if (Info[Index].status == USBD_STATUS_SUCCESS)
+        {
+            totalBytes += Info[Index].length;
+        }
+        else
+        {
+            (*ErrorCount)++;
+        }
+
+        if (gLegacyTraceEnabled)
+        {
+            fprintf(stderr, "packet %u offset %u length %u status %x %s %s\n",
+                Index,
+                Packets[Index].Offset,
+                Packets[Index].Length,
+                Packets[Index].Status,
+                usbifStatusString,
+                usbdStatusString);
+        }
+    }
+    return totalBytes;
+}
+
+//
+/// xenif.cpp usbif_shadow_ex_t before XenDpc()'s fields were moved to its
+/// first cache line. WDFREQUEST and PISO_FAST_SLOT are PVOID here.
+//
+typedef struct
+{
+    usbif_request_t req;                 //<! The associated ringbuffer request
+    ULONG           Tag;                 //<! must be 'Shdw'
+    BOOLEAN         InUse;               //<! Must be FALSE when unallocated.
+    PVOID           Request;             //<! NULL if internal request
+    PMDL            allocatedMdl;        //<! if not NULL an MDL that must be deallocated
+    ULONG           length;              //<! ??? figure out if this is used!
+    BOOLEAN         isReset;             //<! is this a reset request
+    PVOID           isoPacketDescriptor; //<! allocated page for iso packets
+    PMDL            isoPacketMdl;        //<! allocated iso packet MDL
+    PVOID           indirectPageMemory;  //<! allocated indirect memory
+    BOOLEAN         endpointCounted;     //<! included in EndpointRequests
+    PVOID           isoFastSlot;         //<! FdoSubmitIsoOutUrb() request, Request is NULL
+    BOOLEAN         isCancel;            //<! CANCEL_REQUEST for another shadow, Request is NULL
+    LONGLONG        putTime;             //<! performance counter when put on the ring
+} LEGACY_SHADOW;
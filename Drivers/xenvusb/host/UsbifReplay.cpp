@@ -0,0 +1,93 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file UsbifReplay.cpp replays a saved usbif capture through the host frontend.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#include "CaptureReplay.h"
+
+#include <getopt.h>
+#include <stdio.h>
+
+static void
+Usage(
+    const char * Name)
+{
+    fprintf(stderr,
+        "usage: %s [options] FILE\n"
+        "  FILE is IOCTL_XENVUSB_READ_CAPTURE output, one or more reads appended,\n"
+        "  - for stdin.\n"
+        "  --json              JSON report\n"
+        "  --check             fail on a mismatch, a ring error or a leak\n",
+        Name);
+}
+
+int
+main(
+    int argc,
+    char ** argv)
+{
+    bool json = false;
+    bool check = false;
+
+    static const struct option options[] =
+    {
+        { "json",  no_argument, NULL, 'j' },
+        { "check", no_argument, NULL, 'c' },
+        { NULL, 0, NULL, 0 }
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "", options, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'j': json = true; break;
+        case 'c': check = true; break;
+        default:
+            Usage(argv[0]);
+            return 2;
+        }
+    }
+    if ((argc - optind) != 1)
+    {
+        Usage(argv[0]);
+        return 2;
+    }
+
+    std::vector<uint8_t> buffer;
+    std::string error;
+    XENVUSB_CAPTURE capture;
+    if (!XenvusbReadFile(argv[optind], &buffer, &error) ||
+        !XenvusbDecodeCapture(buffer.data(), buffer.size(), &capture, &error))
+    {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+    CaptureReplayResult result;
+    bool clean = CaptureReplay(capture, &result);
+    CaptureReplayPrint(stdout, result, json);
+    if (check && !clean)
+    {
+        fprintf(stderr, "replay failed\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,624 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file XenvusbDecode.cpp decoders for the diagnostic IOCTL output of Public.h.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#include "XenvusbDecode.h"
+
+#include <errno.h>
+#include <string.h>
+
+bool
+XenvusbReadFile(
+    const char * Path,
+    std::vector<uint8_t> * Buffer,
+    std::string * Error)
+{
+    bool stdinput = !strcmp(Path, "-");
+    FILE * file = stdinput ? stdin : fopen(Path, "rb");
+    if (!file)
+    {
+        *Error = std::string(Path) + ": " + strerror(errno);
+        return false;
+    }
+    Buffer->clear();
+    uint8_t chunk[4096];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) != 0)
+    {
+        Buffer->insert(Buffer->end(), chunk, chunk + read);
+    }
+    bool failed = ferror(file) != 0;
+    if (!stdinput)
+    {
+        fclose(file);
+    }
+    if (failed)
+    {
+        *Error = std::string(Path) + ": read failed";
+        return false;
+    }
+    return true;
+}
+
+const char *
+XenvusbPipeTypeName(
+    UCHAR Type)
+{
+    static const char * names[] = { "control", "isoch", "bulk", "interrupt" };
+    return (Type < (sizeof(names) / sizeof(names[0]))) ? names[Type] : "unknown";
+}
+
+//
+/// the Version and Size every structure starts with.
+//
+static bool
+CheckHeader(
+    const void * Buffer,
+    size_t Length,
+    ULONG Version,
+    size_t Size,
+    const char * Name,
+    std::string * Error)
+{
+    ULONG header[2];
+    if (Length < sizeof(header))
+    {
+        *Error = std::string(Name) + ": " + std::to_string(Length) + " bytes, too short for a header";
+        return false;
+    }
+    memcpy(header, Buffer, sizeof(header));
+    if (header[0] != Version)
+    {
+        *Error = std::string(Name) + ": version " + std::to_string(header[0]) +
+            ", this decoder reads version " + std::to_string(Version);
+        return false;
+    }
+    if (header[1] != Size)
+    {
+        *Error = std::string(Name) + ": size " + std::to_string(header[1]) +
+            ", expected " + std::to_string(Size);
+        return false;
+    }
+    if (Length < Size)
+    {
+        *Error = std::string(Name) + ": " + std::to_string(Length) + " of " +
+            std::to_string(Size) + " bytes";
+        return false;
+    }
+    return true;
+}
+
+bool
+XenvusbDecodeHistograms(
+    const void * Buffer,
+    size_t Length,
+    XENVUSB_ENDPOINT_HISTOGRAMS * Histograms,
+    std::string * Error)
+{
+    if (!CheckHeader(Buffer, Length, XENVUSB_HISTOGRAM_VERSION,
+        sizeof(XENVUSB_ENDPOINT_HISTOGRAMS), "histograms", Error))
+    {
+        return false;
+    }
+    memcpy(Histograms, Buffer, sizeof(*Histograms));
+    return true;
+}
+
+void
+XenvusbHistogramBucketRange(
+    ULONG Bucket,
+    uint64_t * Low,
+    uint64_t * High)
+{
+    if (Bucket == 0)
+    {
+        *Low = 0;
+        *High = 1;
+        return;
+    }
+    *Low = 1ULL << (Bucket - 1);
+    *High = (Bucket < (XENVUSB_HISTOGRAM_BUCKETS - 1)) ? (1ULL << Bucket) : UINT64_MAX;
+}
+
+ULONG
+XenvusbHistogramPercentileBucket(
+    const ULONG * Buckets,
+    double Percentile)
+{
+    uint64_t total = 0;
+    for (ULONG bucket = 0; bucket < XENVUSB_HISTOGRAM_BUCKETS; bucket++)
+    {
+        total += Buckets[bucket];
+    }
+    if (total == 0)
+    {
+        return XENVUSB_HISTOGRAM_BUCKETS;
+    }
+    uint64_t rank = (uint64_t) ((Percentile / 100.0) * (double) total);
+    if (rank >= total)
+    {
+        rank = total - 1;
+    }
+    uint64_t seen = 0;
+    for (ULONG bucket = 0; bucket < XENVUSB_HISTOGRAM_BUCKETS; bucket++)
+    {
+        seen += Buckets[bucket];
+        if (seen > rank)
+        {
+            return bucket;
+        }
+    }
+    return XENVUSB_HISTOGRAM_BUCKETS - 1;
+}
+
+//
+/// "< High" of the percentile's bucket, "-" if empty.
+//
+static std::string
+PercentileText(
+    const ULONG * Buckets,
+    double Percentile)
+{
+    ULONG bucket = XenvusbHistogramPercentileBucket(Buckets, Percentile);
+    if (bucket == XENVUSB_HISTOGRAM_BUCKETS)
+    {
+        return "-";
+    }
+    uint64_t low, high;
+    XenvusbHistogramBucketRange(bucket, &low, &high);
+    return (high == UINT64_MAX) ? (">= " + std::to_string(low)) : ("< " + std::to_string(high));
+}
+
+static void
+PrintHistogramText(
+    FILE * File,
+    const char * Name,
+    const ULONG * Buckets)
+{
+    if (XenvusbHistogramPercentileBucket(Buckets, 0) == XENVUSB_HISTOGRAM_BUCKETS)
+    {
+        return;
+    }
+    fprintf(File, "  %s: p50 %s p99 %s max %s\n",
+        Name,
+        PercentileText(Buckets, 50).c_str(),
+        PercentileText(Buckets, 99).c_str(),
+        PercentileText(Buckets, 100).c_str());
+    for (ULONG bucket = 0; bucket < XENVUSB_HISTOGRAM_BUCKETS; bucket++)
+    {
+        if (!Buckets[bucket])
+        {
+            continue;
+        }
+        uint64_t low, high;
+        XenvusbHistogramBucketRange(bucket, &low, &high);
+        if (high == UINT64_MAX)
+        {
+            fprintf(File, "    [%llu, ...) %u\n", (unsigned long long) low, Buckets[bucket]);
+        }
+        else
+        {
+            fprintf(File, "    [%llu, %llu) %u\n",
+                (unsigned long long) low,
+                (unsigned long long) high,
+                Buckets[bucket]);
+        }
+    }
+}
+
+//
+/// {"buckets": [[low, count], ...], "p50": high, ...}, a bound of -1 is
+/// the open last bucket.
+//
+static void
+PrintHistogramJson(
+    FILE * File,
+    const char * Name,
+    const ULONG * Buckets)
+{
+    fprintf(File, "\"%s\": {\"buckets\": [", Name);
+    bool first = true;
+    for (ULONG bucket = 0; bucket < XENVUSB_HISTOGRAM_BUCKETS; bucket++)
+    {
+        if (!Buckets[bucket])
+        {
+            continue;
+        }
+        uint64_t low, high;
+        XenvusbHistogramBucketRange(bucket, &low, &high);
+        fprintf(File, "%s[%llu, %u]", first ? "" : ", ", (unsigned long long) low, Buckets[bucket]);
+        first = false;
+    }
+    fprintf(File, "]");
+    static const struct { const char * Name; double Percentile; } percentiles[] =
+    {
+        { "p50", 50 }, { "p99", 99 }, { "max", 100 },
+    };
+    for (auto & percentile : percentiles)
+    {
+        ULONG bucket = XenvusbHistogramPercentileBucket(Buckets, percentile.Percentile);
+        if (bucket == XENVUSB_HISTOGRAM_BUCKETS)
+        {
+            fprintf(File, ", \"%s\": null", percentile.Name);
+            continue;
+        }
+        uint64_t low, high;
+        XenvusbHistogramBucketRange(bucket, &low, &high);
+        fprintf(File, ", \"%s\": %lld", percentile.Name,
+            (high == UINT64_MAX) ? -1LL : (long long) high);
+    }
+    fprintf(File, "}");
+}
+
+void
+XenvusbPrintHistograms(
+    FILE * File,
+    const XENVUSB_ENDPOINT_HISTOGRAMS & Histograms,
+    bool Json)
+{
+    if (Json)
+    {
+        fprintf(File, "{\"version\": %u, \"endpoints\": [", Histograms.Version);
+    }
+    bool first = true;
+    for (ULONG index = 0; index < XENVUSB_HISTOGRAM_ENDPOINTS; index++)
+    {
+        const XENVUSB_ENDPOINT_HISTOGRAM & endpoint = Histograms.Endpoints[index];
+        if (!endpoint.Completions)
+        {
+            continue;
+        }
+        if (Json)
+        {
+            fprintf(File, "%s\n  {\"endpoint\": %u, \"type\": \"%s\", \"completions\": %u,\n   ",
+                first ? "" : ",",
+                endpoint.EndpointAddress,
+                XenvusbPipeTypeName(endpoint.Type),
+                endpoint.Completions);
+            PrintHistogramJson(File, "ring_latency_us", endpoint.RingLatency);
+            fprintf(File, ",\n   ");
+            PrintHistogramJson(File, "bytes", endpoint.Bytes);
+            fprintf(File, ",\n   ");
+            PrintHistogramJson(File, "iso_jitter_us", endpoint.IsoJitter);
+            fprintf(File, "}");
+        }
+        else
+        {
+            fprintf(File, "endpoint 0x%02x %s: %u completions\n",
+                endpoint.EndpointAddress,
+                XenvusbPipeTypeName(endpoint.Type),
+                endpoint.Completions);
+            PrintHistogramText(File, "ring latency us", endpoint.RingLatency);
+            PrintHistogramText(File, "bytes", endpoint.Bytes);
+            PrintHistogramText(File, "iso jitter us", endpoint.IsoJitter);
+        }
+        first = false;
+    }
+    if (Json)
+    {
+        fprintf(File, "\n]}\n");
+    }
+    else if (first)
+    {
+        fprintf(File, "no completions\n");
+    }
+}
+
+const char *
+XenvusbFlightEventName(
+    UCHAR Event)
+{
+    static const char * names[] = { "none", "submit", "ring", "response", "complete" };
+    return (Event < (sizeof(names) / sizeof(names[0]))) ? names[Event] : "unknown";
+}
+
+bool
+XenvusbDecodeFlightRecorder(
+    const void * Buffer,
+    size_t Length,
+    XENVUSB_FLIGHT_RECORDER * Recorder,
+    std::string * Error)
+{
+    if (!CheckHeader(Buffer, Length, XENVUSB_FLIGHT_RECORDER_VERSION,
+        sizeof(XENVUSB_FLIGHT_RECORDER), "flight recorder", Error))
+    {
+        return false;
+    }
+    memcpy(Recorder, Buffer, sizeof(*Recorder));
+    if (Recorder->Frequency <= 0)
+    {
+        *Error = "flight recorder: frequency " + std::to_string(Recorder->Frequency);
+        return false;
+    }
+    return true;
+}
+
+std::vector<XENVUSB_FLIGHT_RECORD>
+XenvusbFlightRecords(
+    const XENVUSB_FLIGHT_RECORDER & Recorder,
+    ULONG * Torn)
+{
+    std::vector<XENVUSB_FLIGHT_RECORD> records;
+    ULONG count = (Recorder.Next < XENVUSB_FLIGHT_RECORDS) ? Recorder.Next : XENVUSB_FLIGHT_RECORDS;
+    *Torn = 0;
+    records.reserve(count);
+    //
+    // ULONG arithmetic, Next wraps.
+    //
+    for (ULONG sequence = Recorder.Next - count + 1; count; sequence++, count--)
+    {
+        const XENVUSB_FLIGHT_RECORD & record =
+            Recorder.Records[(sequence - 1) & (XENVUSB_FLIGHT_RECORDS - 1)];
+        if (record.Sequence != sequence)
+        {
+            (*Torn)++;
+            continue;
+        }
+        records.push_back(record);
+    }
+    return records;
+}
+
+void
+XenvusbPrintFlightRecorder(
+    FILE * File,
+    const XENVUSB_FLIGHT_RECORDER & Recorder,
+    bool Json)
+{
+    ULONG torn;
+    std::vector<XENVUSB_FLIGHT_RECORD> records = XenvusbFlightRecords(Recorder, &torn);
+    LONGLONG origin = records.empty() ? 0 : records[0].Timestamp;
+
+    if (Json)
+    {
+        fprintf(File, "{\"version\": %u, \"frequency\": %lld, \"next\": %u, \"torn\": %u, \"records\": [",
+            Recorder.Version,
+            (long long) Recorder.Frequency,
+            Recorder.Next,
+            torn);
+    }
+    else
+    {
+        fprintf(File, "%zu of %u records, frequency %lld, %u torn\n",
+            records.size(),
+            Recorder.Next,
+            (long long) Recorder.Frequency,
+            torn);
+    }
+    bool first = true;
+    for (const XENVUSB_FLIGHT_RECORD & record : records)
+    {
+        double us = (double) (record.Timestamp - origin) * 1000000.0 / (double) Recorder.Frequency;
+        std::string shadow = (record.ShadowId == XENVUSB_FLIGHT_NO_SHADOW) ?
+            (Json ? "null" : "-") : std::to_string(record.ShadowId);
+        if (Json)
+        {
+            fprintf(File, "%s\n  {\"sequence\": %u, \"time_us\": %.3f, \"event\": \"%s\", "
+                "\"shadow_id\": %s, \"endpoint\": %u, \"type\": \"%s\", \"function\": %u, "
+                "\"length\": %u, \"status\": %d, \"start_frame\": %u}",
+                first ? "" : ",",
+                record.Sequence,
+                us,
+                XenvusbFlightEventName(record.Event),
+                shadow.c_str(),
+                record.Endpoint,
+                XenvusbPipeTypeName(record.Type),
+                record.Function,
+                record.Length,
+                record.Status,
+                record.StartFrame);
+        }
+        else
+        {
+            fprintf(File, "%10u %12.3f %-8s id %-5s ep %02x %-9s function %04x length %u status %08x frame %x\n",
+                record.Sequence,
+                us,
+                XenvusbFlightEventName(record.Event),
+                shadow.c_str(),
+                record.Endpoint,
+                XenvusbPipeTypeName(record.Type),
+                record.Function,
+                record.Length,
+                (ULONG) record.Status,
+                record.StartFrame);
+        }
+        first = false;
+    }
+    if (Json)
+    {
+        fprintf(File, "\n]}\n");
+    }
+}
+
+bool
+XenvusbDecodeCapture(
+    const void * Buffer,
+    size_t Length,
+    XENVUSB_CAPTURE * Capture,
+    std::string * Error)
+{
+    const uint8_t * bytes = (const uint8_t *) Buffer;
+    size_t offset = 0;
+    Capture->Frequency = 0;
+    Capture->Dropped = 0;
+    Capture->Messages.clear();
+
+    while (offset < Length)
+    {
+        XENVUSB_CAPTURE_HEADER header;
+        if (Length - offset < sizeof(header))
+        {
+            *Error = "capture: " + std::to_string(Length - offset) +
+                " bytes at " + std::to_string(offset) + ", too short for a header";
+            return false;
+        }
+        memcpy(&header, bytes + offset, sizeof(header));
+        if (header.Version != XENVUSB_CAPTURE_VERSION)
+        {
+            *Error = "capture: version " + std::to_string(header.Version) + " at " +
+                std::to_string(offset) + ", this decoder reads version " +
+                std::to_string(XENVUSB_CAPTURE_VERSION);
+            return false;
+        }
+        if ((header.Frequency <= 0) ||
+            (Capture->Frequency && (header.Frequency != Capture->Frequency)))
+        {
+            *Error = "capture: frequency " + std::to_string(header.Frequency) +
+                " at " + std::to_string(offset);
+            return false;
+        }
+        offset += sizeof(header);
+        if (header.Length > Length - offset)
+        {
+            *Error = "capture: " + std::to_string(header.Length) + " bytes of records at " +
+                std::to_string(offset) + ", " + std::to_string(Length - offset) + " left";
+            return false;
+        }
+        Capture->Frequency = header.Frequency;
+        Capture->Dropped = header.Dropped;
+
+        size_t end = offset + header.Length;
+        while (offset < end)
+        {
+            XENVUSB_CAPTURE_RECORD record;
+            if (end - offset < sizeof(record))
+            {
+                *Error = "capture: partial record at " + std::to_string(offset);
+                return false;
+            }
+            memcpy(&record, bytes + offset, sizeof(record));
+            size_t messageLength = 0;
+            if (record.Kind == XenvusbCaptureRequest)
+            {
+                messageLength = sizeof(usbif_request_t);
+            }
+            else if (record.Kind == XenvusbCaptureResponse)
+            {
+                messageLength = sizeof(usbif_response_t);
+            }
+            size_t needed = sizeof(record) + record.MessageLength + record.PayloadLength;
+            if (!messageLength ||
+                (record.MessageLength != messageLength) ||
+                (record.PayloadLength > record.OriginalLength) ||
+                (record.PayloadLength > XENVUSB_CAPTURE_MAX_PAYLOAD) ||
+                (record.RecordLength & 7) ||
+                (record.RecordLength < needed) ||
+                (record.RecordLength > end - offset))
+            {
+                *Error = "capture: bad record at " + std::to_string(offset) +
+                    ", kind " + std::to_string(record.Kind) +
+                    " length " + std::to_string(record.RecordLength) +
+                    " message " + std::to_string(record.MessageLength) +
+                    " payload " + std::to_string(record.PayloadLength) +
+                    " of " + std::to_string(record.OriginalLength);
+                return false;
+            }
+            XENVUSB_CAPTURED_MESSAGE message;
+            memset(&message.Request, 0, sizeof(message.Request));
+            memset(&message.Response, 0, sizeof(message.Response));
+            message.Kind = (XENVUSB_CAPTURE_KIND) record.Kind;
+            message.Timestamp = record.Timestamp;
+            message.OriginalLength = record.OriginalLength;
+            const uint8_t * body = bytes + offset + sizeof(record);
+            memcpy((message.Kind == XenvusbCaptureRequest) ?
+                (void *) &message.Request : (void *) &message.Response,
+                body, messageLength);
+            message.Payload.assign(body + messageLength, body + messageLength + record.PayloadLength);
+            Capture->Messages.push_back(std::move(message));
+            offset += record.RecordLength;
+        }
+    }
+    return true;
+}
+
+void
+XenvusbPrintCapture(
+    FILE * File,
+    const XENVUSB_CAPTURE & Capture,
+    bool Json)
+{
+    LONGLONG origin = Capture.Messages.empty() ? 0 : Capture.Messages[0].Timestamp;
+    if (Json)
+    {
+        fprintf(File, "{\"frequency\": %lld, \"dropped\": %u, \"messages\": [",
+            (long long) Capture.Frequency,
+            Capture.Dropped);
+    }
+    else
+    {
+        fprintf(File, "%zu messages, frequency %lld, %u dropped\n",
+            Capture.Messages.size(),
+            (long long) Capture.Frequency,
+            Capture.Dropped);
+    }
+    bool first = true;
+    for (const XENVUSB_CAPTURED_MESSAGE & message : Capture.Messages)
+    {
+        double us = (double) (message.Timestamp - origin) * 1000000.0 / (double) Capture.Frequency;
+        if (message.Kind == XenvusbCaptureRequest)
+        {
+            const usbif_request_t & req = message.Request;
+            fprintf(File, Json ?
+                "%s\n  {\"time_us\": %.3f, \"kind\": \"request\", \"id\": %llu, \"type\": \"%s\", "
+                "\"endpoint\": %u, \"setup\": %llu, \"offset\": %u, \"length\": %u, \"segments\": %u, "
+                "\"flags\": %u, \"packets\": %u, \"start_frame\": %u" :
+                "%s%12.3f request  id %-4llu %-9s ep %02x setup %016llx offset %x length %u "
+                "segments %u flags %x packets %u frame %x",
+                Json ? (first ? "" : ",") : "",
+                us,
+                (unsigned long long) req.id,
+                XenvusbPipeTypeName(req.type),
+                req.endpoint,
+                (unsigned long long) req.setup,
+                req.offset,
+                req.length,
+                req.nr_segments,
+                req.flags,
+                req.nr_packets,
+                req.startframe);
+        }
+        else
+        {
+            const usbif_response_t & rsp = message.Response;
+            fprintf(File, Json ?
+                "%s\n  {\"time_us\": %.3f, \"kind\": \"response\", \"id\": %llu, \"status\": %d, "
+                "\"bytes\": %u, \"data\": %u, \"error_count\": %u" :
+                "%s%12.3f response id %-4llu status %d bytes %u data %x errors %u",
+                Json ? (first ? "" : ",") : "",
+                us,
+                (unsigned long long) rsp.id,
+                rsp.status,
+                rsp.bytesTransferred,
+                rsp.data,
+                rsp.error_count);
+        }
+        fprintf(File, Json ? ", \"payload\": %zu, \"original_length\": %u}" : " payload %zu of %u\n",
+            message.Payload.size(),
+            message.OriginalLength);
+        first = false;
+    }
+    if (Json)
+    {
+        fprintf(File, "\n]}\n");
+    }
+}
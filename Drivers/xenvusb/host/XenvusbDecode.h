@@ -0,0 +1,188 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file XenvusbDecode.h decoders for the diagnostic IOCTL output of Public.h.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#pragma once
+
+//
+/// The controller IOCTLs return fixed layout, versioned structures. A
+/// Windows tool saves the output buffer to a file as it is, these decode it
+/// on any host. Both ends are little endian and Public.h has the Windows
+/// type sizes through UsbifHost.h, so the structures are read as they are
+/// after the version and size have been checked.
+//
+#include "UsbifHost.h"
+#include "usbxenif.h"
+#include "Public.h"
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+static_assert(sizeof(XENVUSB_ENDPOINT_HISTOGRAM) == 8 + (3 * 4 * XENVUSB_HISTOGRAM_BUCKETS),
+    "XENVUSB_ENDPOINT_HISTOGRAM layout");
+static_assert(sizeof(XENVUSB_ENDPOINT_HISTOGRAMS) ==
+    8 + (XENVUSB_HISTOGRAM_ENDPOINTS * sizeof(XENVUSB_ENDPOINT_HISTOGRAM)),
+    "XENVUSB_ENDPOINT_HISTOGRAMS layout");
+static_assert(sizeof(XENVUSB_FLIGHT_RECORD) == 32, "XENVUSB_FLIGHT_RECORD layout");
+static_assert(sizeof(XENVUSB_CAPTURE_RECORD) == 24, "XENVUSB_CAPTURE_RECORD layout");
+static_assert(sizeof(XENVUSB_CAPTURE_HEADER) == 24, "XENVUSB_CAPTURE_HEADER layout");
+static_assert(sizeof(usbif_response_t) == 24, "usbif_response_t layout");
+static_assert(sizeof(XENVUSB_FLIGHT_RECORDER) == 24 + (XENVUSB_FLIGHT_RECORDS * 32),
+    "XENVUSB_FLIGHT_RECORDER layout");
+
+//
+/// the whole of Path, "-" is stdin.
+//
+bool
+XenvusbReadFile(
+    const char * Path,
+    std::vector<uint8_t> * Buffer,
+    std::string * Error);
+
+//
+/// USBD_PIPE_TYPE as a name.
+//
+const char *
+XenvusbPipeTypeName(
+    UCHAR Type);
+
+//
+/// IOCTL_XENVUSB_GET_ENDPOINT_HISTOGRAMS output. Returns false and says why
+/// in Error if Buffer is not a complete XENVUSB_ENDPOINT_HISTOGRAMS of a
+/// version this decoder knows.
+//
+bool
+XenvusbDecodeHistograms(
+    const void * Buffer,
+    size_t Length,
+    XENVUSB_ENDPOINT_HISTOGRAMS * Histograms,
+    std::string * Error);
+
+//
+/// the values bucket Bucket counts, [Low, High). High is UINT64_MAX for the
+/// last bucket.
+//
+void
+XenvusbHistogramBucketRange(
+    ULONG Bucket,
+    uint64_t * Low,
+    uint64_t * High);
+
+//
+/// the bucket holding the Percentile'th count, nearest rank, or
+/// XENVUSB_HISTOGRAM_BUCKETS if the histogram is empty.
+//
+ULONG
+XenvusbHistogramPercentileBucket(
+    const ULONG * Buckets,
+    double Percentile);
+
+//
+/// every endpoint with completions, as text or as one JSON object.
+//
+void
+XenvusbPrintHistograms(
+    FILE * File,
+    const XENVUSB_ENDPOINT_HISTOGRAMS & Histograms,
+    bool Json);
+
+//
+/// XENVUSB_FLIGHT_EVENT as a name.
+//
+const char *
+XenvusbFlightEventName(
+    UCHAR Event);
+
+//
+/// IOCTL_XENVUSB_GET_FLIGHT_RECORDER output, checked as
+/// XenvusbDecodeHistograms() checks its.
+//
+bool
+XenvusbDecodeFlightRecorder(
+    const void * Buffer,
+    size_t Length,
+    XENVUSB_FLIGHT_RECORDER * Recorder,
+    std::string * Error);
+
+//
+/// the records still in the recorder, oldest first. A record a writer was
+/// part way through when the driver copied the recorder does not have the
+/// Sequence of its slot, it is left out and counted in Torn.
+//
+std::vector<XENVUSB_FLIGHT_RECORD>
+XenvusbFlightRecords(
+    const XENVUSB_FLIGHT_RECORDER & Recorder,
+    ULONG * Torn);
+
+//
+/// the records oldest first, times in microseconds from the oldest, as text
+/// or as one JSON object.
+//
+void
+XenvusbPrintFlightRecorder(
+    FILE * File,
+    const XENVUSB_FLIGHT_RECORDER & Recorder,
+    bool Json);
+
+//
+/// one XENVUSB_CAPTURE_RECORD and the message and payload that follow it.
+//
+struct XENVUSB_CAPTURED_MESSAGE
+{
+    XENVUSB_CAPTURE_KIND Kind;
+    LONGLONG             Timestamp;
+    usbif_request_t      Request;        //!< XenvusbCaptureRequest.
+    usbif_response_t     Response;       //!< XenvusbCaptureResponse.
+    ULONG                OriginalLength; //!< data bytes in the transfer.
+    std::vector<uint8_t> Payload;        //!< the first of them, if any were captured.
+};
+
+struct XENVUSB_CAPTURE
+{
+    LONGLONG Frequency;
+    ULONG    Dropped;  //!< as of the last read.
+    std::vector<XENVUSB_CAPTURED_MESSAGE> Messages;
+};
+
+//
+/// IOCTL_XENVUSB_READ_CAPTURE output: one read, or the output of several
+/// reads appended as a tool polling the capture saves them. Every header
+/// and record is checked, Error says what is wrong with the first bad one.
+//
+bool
+XenvusbDecodeCapture(
+    const void * Buffer,
+    size_t Length,
+    XENVUSB_CAPTURE * Capture,
+    std::string * Error);
+
+//
+/// the messages, times in microseconds from the first, as text or as one
+/// JSON object.
+//
+void
+XenvusbPrintCapture(
+    FILE * File,
+    const XENVUSB_CAPTURE & Capture,
+    bool Json);
@@ -0,0 +1,582 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file XenvusbDecodeTest.cpp round trips synthetic IOCTL output through the decoders.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#include "XenvusbDecode.h"
+#include "CaptureReplay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <memory>
+
+static int gFailures = 0;
+
+#define CHECK(_exp_) do {                                               \
+    if (!(_exp_)) {                                                     \
+        fprintf(stderr, "%s:%d: %s: CHECK(%s) failed\n",                \
+            __FILE__, __LINE__, __FUNCTION__, #_exp_);                  \
+        gFailures++;                                                    \
+    }                                                                   \
+} while (0)
+
+//
+/// Bytes as the driver would return them, through a file as the tool reads
+/// them.
+//
+static std::vector<uint8_t>
+ThroughFile(
+    const void * Bytes,
+    size_t Length)
+{
+    std::vector<uint8_t> buffer;
+    char path[] = "/tmp/xenvusb_decode_XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    if (fd < 0)
+    {
+        return buffer;
+    }
+    CHECK(write(fd, Bytes, Length) == (ssize_t) Length);
+    close(fd);
+    std::string error;
+    CHECK(XenvusbReadFile(path, &buffer, &error));
+    unlink(path);
+    return buffer;
+}
+
+//
+/// what Print(FILE *) writes.
+//
+template <class Print>
+static std::string
+Printed(
+    Print print)
+{
+    char * text = NULL;
+    size_t length = 0;
+    FILE * file = open_memstream(&text, &length);
+    print(file);
+    fclose(file);
+    std::string printed(text, length);
+    free(text);
+    return printed;
+}
+
+static bool
+Contains(
+    const std::string & Text,
+    const char * Expected)
+{
+    if (Text.find(Expected) != std::string::npos)
+    {
+        return true;
+    }
+    fprintf(stderr, "\"%s\" not in:\n%s\n", Expected, Text.c_str());
+    return false;
+}
+
+static void
+TestBuckets()
+{
+    uint64_t low, high;
+    XenvusbHistogramBucketRange(0, &low, &high);
+    CHECK(low == 0 && high == 1);
+    XenvusbHistogramBucketRange(1, &low, &high);
+    CHECK(low == 1 && high == 2);
+    XenvusbHistogramBucketRange(11, &low, &high);
+    CHECK(low == 1024 && high == 2048);
+    XenvusbHistogramBucketRange(XENVUSB_HISTOGRAM_BUCKETS - 1, &low, &high);
+    CHECK(low == (1ULL << 30) && high == UINT64_MAX);
+
+    ULONG buckets[XENVUSB_HISTOGRAM_BUCKETS] = {};
+    CHECK(XenvusbHistogramPercentileBucket(buckets, 50) == XENVUSB_HISTOGRAM_BUCKETS);
+    buckets[3] = 98;
+    buckets[9] = 1;
+    buckets[20] = 1;
+    CHECK(XenvusbHistogramPercentileBucket(buckets, 0) == 3);
+    CHECK(XenvusbHistogramPercentileBucket(buckets, 50) == 3);
+    CHECK(XenvusbHistogramPercentileBucket(buckets, 98) == 9);
+    CHECK(XenvusbHistogramPercentileBucket(buckets, 99) == 20);
+    CHECK(XenvusbHistogramPercentileBucket(buckets, 100) == 20);
+}
+
+static void
+TestHistograms()
+{
+    std::unique_ptr<XENVUSB_ENDPOINT_HISTOGRAMS> sent(new XENVUSB_ENDPOINT_HISTOGRAMS);
+    memset(sent.get(), 0, sizeof(*sent));
+    sent->Version = XENVUSB_HISTOGRAM_VERSION;
+    sent->Size = sizeof(*sent);
+
+    XENVUSB_ENDPOINT_HISTOGRAM & control = sent->Endpoints[0];
+    control.EndpointAddress = 0x00;
+    control.Type = 0;
+    control.Completions = 10;
+    control.RingLatency[8] = 9;                 // [128, 256)
+    control.RingLatency[12] = 1;                // [2048, 4096)
+    control.Bytes[0] = 4;
+    control.Bytes[5] = 6;
+
+    XENVUSB_ENDPOINT_HISTOGRAM & isoch = sent->Endpoints[17];
+    isoch.EndpointAddress = 0x81;
+    isoch.Type = 1;
+    isoch.Completions = 1000;
+    isoch.RingLatency[10] = 1000;
+    isoch.Bytes[XENVUSB_HISTOGRAM_BUCKETS - 1] = 1000;
+    isoch.IsoJitter[0] = 990;
+    isoch.IsoJitter[7] = 10;
+
+    std::vector<uint8_t> buffer = ThroughFile(sent.get(), sizeof(*sent));
+    CHECK(buffer.size() == sizeof(*sent));
+
+    std::unique_ptr<XENVUSB_ENDPOINT_HISTOGRAMS> received(new XENVUSB_ENDPOINT_HISTOGRAMS);
+    std::string error;
+    CHECK(XenvusbDecodeHistograms(buffer.data(), buffer.size(), received.get(), &error));
+    CHECK(!memcmp(sent.get(), received.get(), sizeof(*sent)));
+    CHECK(received->Endpoints[17].EndpointAddress == 0x81);
+    CHECK(received->Endpoints[17].IsoJitter[7] == 10);
+
+    std::string text = Printed([&](FILE * file) { XenvusbPrintHistograms(file, *received, false); });
+    CHECK(Contains(text, "endpoint 0x00 control: 10 completions\n"));
+    CHECK(Contains(text, "  ring latency us: p50 < 256 p99 < 4096 max < 4096\n"));
+    CHECK(Contains(text, "    [2048, 4096) 1\n"));
+    CHECK(Contains(text, "endpoint 0x81 isoch: 1000 completions\n"));
+    CHECK(Contains(text, "  bytes: p50 >= 1073741824 p99 >= 1073741824"));
+    CHECK(Contains(text, "    [1073741824, ...) 1000\n"));
+    CHECK(Contains(text, "  iso jitter us: p50 < 1 p99 < 128"));
+    CHECK(text.find("iso jitter us", text.find("endpoint 0x00")) > text.find("endpoint 0x81"));
+
+    std::string json = Printed([&](FILE * file) { XenvusbPrintHistograms(file, *received, true); });
+    CHECK(Contains(json, "{\"version\": 1, \"endpoints\": ["));
+    CHECK(Contains(json, "{\"endpoint\": 129, \"type\": \"isoch\", \"completions\": 1000,"));
+    CHECK(Contains(json, "\"ring_latency_us\": {\"buckets\": [[128, 9], [2048, 1]], \"p50\": 256, \"p99\": 4096, \"max\": 4096}"));
+    CHECK(Contains(json, "\"bytes\": {\"buckets\": [[1073741824, 1000]], \"p50\": -1"));
+    CHECK(Contains(json, "\"iso_jitter_us\": {\"buckets\": [], \"p50\": null"));
+
+    memset(received.get(), 0, sizeof(*received));
+    received->Version = XENVUSB_HISTOGRAM_VERSION;
+    received->Size = sizeof(*received);
+    CHECK(Printed([&](FILE * file) { XenvusbPrintHistograms(file, *received, false); }) ==
+        "no completions\n");
+}
+
+static void
+TestHistogramsRejected()
+{
+    std::unique_ptr<XENVUSB_ENDPOINT_HISTOGRAMS> sent(new XENVUSB_ENDPOINT_HISTOGRAMS);
+    std::unique_ptr<XENVUSB_ENDPOINT_HISTOGRAMS> received(new XENVUSB_ENDPOINT_HISTOGRAMS);
+    memset(sent.get(), 0, sizeof(*sent));
+    sent->Version = XENVUSB_HISTOGRAM_VERSION;
+    sent->Size = sizeof(*sent);
+    std::string error;
+
+    CHECK(!XenvusbDecodeHistograms(sent.get(), 4, received.get(), &error));
+    CHECK(Contains(error, "too short"));
+    CHECK(!XenvusbDecodeHistograms(sent.get(), sizeof(*sent) - 1, received.get(), &error));
+    CHECK(Contains(error, "bytes"));
+
+    sent->Version = XENVUSB_HISTOGRAM_VERSION + 1;
+    CHECK(!XenvusbDecodeHistograms(sent.get(), sizeof(*sent), received.get(), &error));
+    CHECK(Contains(error, "version 2"));
+
+    sent->Version = XENVUSB_HISTOGRAM_VERSION;
+    sent->Size = sizeof(*sent) - sizeof(sent->Endpoints[0]);
+    CHECK(!XenvusbDecodeHistograms(sent.get(), sizeof(*sent), received.get(), &error));
+    CHECK(Contains(error, "size"));
+
+    std::vector<uint8_t> buffer;
+    CHECK(!XenvusbReadFile("/nonexistent/xenvusb", &buffer, &error));
+}
+
+//
+/// a recorder that has wrapped: Next records written, each slot holding the
+/// latest of its sequences, one URB's four events per 4 records.
+//
+static void
+FillRecorder(
+    XENVUSB_FLIGHT_RECORDER * Recorder,
+    ULONG Next)
+{
+    memset(Recorder, 0, sizeof(*Recorder));
+    Recorder->Version = XENVUSB_FLIGHT_RECORDER_VERSION;
+    Recorder->Size = sizeof(*Recorder);
+    Recorder->Frequency = 10000000;
+    Recorder->Next = Next;
+    ULONG count = (Next < XENVUSB_FLIGHT_RECORDS) ? Next : XENVUSB_FLIGHT_RECORDS;
+    for (ULONG sequence = Next - count + 1; count; sequence++, count--)
+    {
+        XENVUSB_FLIGHT_RECORD & record = Recorder->Records[(sequence - 1) & (XENVUSB_FLIGHT_RECORDS - 1)];
+        record.Sequence = sequence;
+        record.Timestamp = 5000000000LL + (LONGLONG) sequence * 25; // 2.5us apart
+        record.Event = (UCHAR) (XenvusbFlightSubmitUrb + ((sequence - 1) % 4));
+        record.Endpoint = 0x82;
+        record.Type = 2;
+        record.ShadowId = (record.Event == XenvusbFlightSubmitUrb) ?
+            XENVUSB_FLIGHT_NO_SHADOW : (USHORT) (((sequence - 1) / 4) % 32);
+        record.Function = 0x0009; // URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER
+        record.Length = 512;
+        record.Status = (record.Event == XenvusbFlightComplete) ? (LONG) 0xC0000004 : 0;
+    }
+}
+
+static void
+TestFlightRecorder()
+{
+    std::unique_ptr<XENVUSB_FLIGHT_RECORDER> sent(new XENVUSB_FLIGHT_RECORDER);
+    std::unique_ptr<XENVUSB_FLIGHT_RECORDER> received(new XENVUSB_FLIGHT_RECORDER);
+    std::string error;
+    ULONG torn;
+
+    FillRecorder(sent.get(), 6);
+    std::vector<uint8_t> buffer = ThroughFile(sent.get(), sizeof(*sent));
+    CHECK(XenvusbDecodeFlightRecorder(buffer.data(), buffer.size(), received.get(), &error));
+    CHECK(!memcmp(sent.get(), received.get(), sizeof(*sent)));
+    std::vector<XENVUSB_FLIGHT_RECORD> records = XenvusbFlightRecords(*received, &torn);
+    CHECK(records.size() == 6);
+    CHECK(torn == 0);
+    CHECK(records[0].Sequence == 1 && records[5].Sequence == 6);
+
+    std::string text = Printed([&](FILE * file) { XenvusbPrintFlightRecorder(file, *received, false); });
+    CHECK(Contains(text, "6 of 6 records, frequency 10000000, 0 torn\n"));
+    CHECK(Contains(text, "         1        0.000 submit   id -     ep 82 bulk      function 0009 length 512 status 00000000 frame 0\n"));
+    CHECK(Contains(text, "         4        7.500 complete id 0     ep 82 bulk      function 0009 length 512 status c0000004 frame 0\n"));
+    CHECK(Contains(text, "         6       12.500 ring     id 1 "));
+
+    //
+    // wrapped, with the slot of sequence 2000 part way through a write.
+    //
+    FillRecorder(sent.get(), 2500);
+    sent->Records[(2000 - 1) & (XENVUSB_FLIGHT_RECORDS - 1)].Sequence = 0;
+    buffer = ThroughFile(sent.get(), sizeof(*sent));
+    CHECK(XenvusbDecodeFlightRecorder(buffer.data(), buffer.size(), received.get(), &error));
+    records = XenvusbFlightRecords(*received, &torn);
+    CHECK(torn == 1);
+    CHECK(records.size() == XENVUSB_FLIGHT_RECORDS - 1);
+    CHECK(records.front().Sequence == 2500 - XENVUSB_FLIGHT_RECORDS + 1);
+    CHECK(records.back().Sequence == 2500);
+    bool ordered = true;
+    for (size_t index = 1; index < records.size(); index++)
+    {
+        ordered &= (records[index].Sequence > records[index - 1].Sequence);
+        ordered &= (records[index].Sequence != 2000);
+    }
+    CHECK(ordered);
+
+    std::string json = Printed([&](FILE * file) { XenvusbPrintFlightRecorder(file, *received, true); });
+    CHECK(Contains(json, "{\"version\": 1, \"frequency\": 10000000, \"next\": 2500, \"torn\": 1, \"records\": ["));
+    CHECK(Contains(json, "{\"sequence\": 1477, \"time_us\": 0.000, \"event\": \"submit\", \"shadow_id\": null, "
+        "\"endpoint\": 130, \"type\": \"bulk\", \"function\": 9, \"length\": 512, \"status\": 0, \"start_frame\": 0}"));
+    CHECK(Contains(json, "\"sequence\": 1480, \"time_us\": 7.500, \"event\": \"complete\", \"shadow_id\": 17, "));
+    CHECK(Contains(json, "\"status\": -1073741820"));
+
+    //
+    // the last Next before it wraps, and an empty recorder.
+    //
+    FillRecorder(sent.get(), 0xFFFFFFFF);
+    records = XenvusbFlightRecords(*sent, &torn);
+    CHECK(records.size() == XENVUSB_FLIGHT_RECORDS && torn == 0);
+    CHECK(records.back().Sequence == 0xFFFFFFFF);
+    FillRecorder(sent.get(), 0);
+    records = XenvusbFlightRecords(*sent, &torn);
+    CHECK(records.empty() && torn == 0);
+
+    sent->Frequency = 0;
+    CHECK(!XenvusbDecodeFlightRecorder(sent.get(), sizeof(*sent), received.get(), &error));
+    CHECK(Contains(error, "frequency"));
+    FillRecorder(sent.get(), 1);
+    CHECK(!XenvusbDecodeFlightRecorder(sent.get(), sizeof(*sent) / 2, received.get(), &error));
+    sent->Size = sizeof(XENVUSB_ENDPOINT_HISTOGRAMS);
+    CHECK(!XenvusbDecodeFlightRecorder(sent.get(), sizeof(*sent), received.get(), &error));
+    CHECK(Contains(error, "size"));
+}
+
+//
+/// IOCTL_XENVUSB_READ_CAPTURE output as XenCaptureRead() writes it, reads
+/// appended.
+//
+struct CaptureWriter
+{
+    std::vector<uint8_t> Bytes;
+    size_t               Header;
+    LONGLONG             Now;
+
+    CaptureWriter() : Header(0), Now(1000) {}
+
+    void
+    Read(
+        ULONG Dropped)
+    {
+        XENVUSB_CAPTURE_HEADER header = {};
+        header.Version = XENVUSB_CAPTURE_VERSION;
+        header.Frequency = 10000000;
+        header.Dropped = Dropped;
+        Header = Bytes.size();
+        Append(&header, sizeof(header));
+    }
+
+    void
+    Add(
+        XENVUSB_CAPTURE_KIND Kind,
+        const void * Message,
+        size_t MessageLength,
+        ULONG PayloadLength,
+        ULONG OriginalLength)
+    {
+        XENVUSB_CAPTURE_RECORD record = {};
+        record.RecordLength = (ULONG) ((sizeof(record) + MessageLength + PayloadLength + 7) & ~7);
+        record.Kind = (UCHAR) Kind;
+        record.MessageLength = (USHORT) MessageLength;
+        record.Timestamp = Now;
+        record.PayloadLength = PayloadLength;
+        record.OriginalLength = OriginalLength;
+        Now += 1250; // 125us
+        size_t start = Bytes.size();
+        Append(&record, sizeof(record));
+        Append(Message, MessageLength);
+        for (ULONG index = 0; index < PayloadLength; index++)
+        {
+            Bytes.push_back((uint8_t) index);
+        }
+        Bytes.resize(start + record.RecordLength, 0);
+        XENVUSB_CAPTURE_HEADER * header = (XENVUSB_CAPTURE_HEADER *) &Bytes[Header];
+        header->Length += record.RecordLength;
+    }
+
+    void
+    Request(
+        uint64_t Id,
+        uint8_t Type,
+        uint8_t Endpoint,
+        uint32_t Length,
+        uint8_t Segments,
+        uint8_t Flags = 0,
+        uint16_t Packets = 0,
+        ULONG PayloadLength = 0)
+    {
+        usbif_request_t req = {};
+        req.id = Id;
+        req.type = Type;
+        req.endpoint = Endpoint;
+        req.length = Length;
+        req.nr_segments = Segments;
+        req.flags = Flags;
+        req.nr_packets = Packets;
+        if (Type == 0)
+        {
+            req.setup = 0x0012000001000680ULL; // GET_DESCRIPTOR device
+        }
+        Add(XenvusbCaptureRequest, &req, sizeof(req), PayloadLength,
+            (Endpoint & 0x80) ? 0 : Length);
+    }
+
+    void
+    Response(
+        uint64_t Id,
+        int16_t Status,
+        uint32_t Bytes,
+        uint32_t Data = 0,
+        uint32_t ErrorCount = 0,
+        ULONG PayloadLength = 0)
+    {
+        usbif_response_t rsp = {};
+        rsp.id = Id;
+        rsp.status = Status;
+        rsp.bytesTransferred = Bytes;
+        rsp.data = Data;
+        rsp.error_count = ErrorCount;
+        Add(XenvusbCaptureResponse, &rsp, sizeof(rsp), PayloadLength, PayloadLength);
+    }
+
+    void
+    Append(
+        const void * Data,
+        size_t Length)
+    {
+        Bytes.insert(Bytes.end(), (const uint8_t *) Data, (const uint8_t *) Data + Length);
+    }
+};
+
+//
+/// a capture of every transfer type, started with a response outstanding,
+/// stopped with a request outstanding and read twice.
+//
+static std::vector<uint8_t>
+SyntheticCapture()
+{
+    CaptureWriter writer;
+    writer.Read(0);
+    writer.Response(5, 0, 64);                                  // orphan
+    writer.Request(0, 0, 0x80, 18, 1);                          // control in
+    writer.Request(1, 2, 0x02, 512, 1, 0, 0, 16);               // bulk out, 16 of 512 bytes
+    writer.Request(2, 1, 0x81, 8 * 192, 2, 0, 8);               // isoch in
+    writer.Request(3, 3, 0x83, 8, 1);                           // interrupt in
+    writer.Response(1, 0, 512);
+    writer.Response(0, 0, 18, 0, 0, 18);
+    writer.Read(2);
+    writer.Response(3, USBIF_RSP_USB_STALLED, 0);
+    writer.Response(2, 0, 1, 0x1234, 1, 8 * 192);
+    writer.Request(0, 0, 0x00, 0, 0);                           // zero length control, id reused
+    writer.Response(0, 0, 0);
+    writer.Request(6, 2, 0x82, 32 * PAGE_SIZE, INDIRECT_PAGES_REQUIRED(32), INDIRECT_GREF);
+    writer.Response(6, 0, 32 * PAGE_SIZE);
+    writer.Request(4, 2, 0x82, 4096, 1);                        // stopped before the response
+    return writer.Bytes;
+}
+
+static void
+TestCapture()
+{
+    std::vector<uint8_t> bytes = SyntheticCapture();
+    std::vector<uint8_t> buffer = ThroughFile(bytes.data(), bytes.size());
+    XENVUSB_CAPTURE capture;
+    std::string error;
+    CHECK(XenvusbDecodeCapture(buffer.data(), buffer.size(), &capture, &error));
+    CHECK(capture.Frequency == 10000000);
+    CHECK(capture.Dropped == 2);
+    CHECK(capture.Messages.size() == 14);
+    CHECK(capture.Messages[0].Kind == XenvusbCaptureResponse);
+    CHECK(capture.Messages[2].Kind == XenvusbCaptureRequest);
+    CHECK(capture.Messages[2].Request.length == 512);
+    CHECK(capture.Messages[2].OriginalLength == 512);
+    CHECK(capture.Messages[2].Payload.size() == 16);
+    CHECK(capture.Messages[2].Payload[15] == 15);
+    CHECK(capture.Messages[7].Response.status == USBIF_RSP_USB_STALLED);
+    CHECK(capture.Messages[8].Response.data == 0x1234);
+    CHECK(capture.Messages[8].Payload.size() == 8 * 192);
+
+    std::string text = Printed([&](FILE * file) { XenvusbPrintCapture(file, capture, false); });
+    CHECK(Contains(text, "14 messages, frequency 10000000, 2 dropped\n"));
+    CHECK(Contains(text, "     125.000 request  id 0    control   ep 80 setup 0012000001000680 offset 0 length 18 "
+        "segments 1 flags 0 packets 0 frame 0 payload 0 of 0\n"));
+    CHECK(Contains(text, "     875.000 response id 3    status -16 bytes 0 data 0 errors 0 payload 0 of 0\n"));
+    std::string json = Printed([&](FILE * file) { XenvusbPrintCapture(file, capture, true); });
+    CHECK(Contains(json, "{\"time_us\": 250.000, \"kind\": \"request\", \"id\": 1, \"type\": \"bulk\", "
+        "\"endpoint\": 2, \"setup\": 0, \"offset\": 0, \"length\": 512, \"segments\": 1, \"flags\": 0, "
+        "\"packets\": 0, \"start_frame\": 0, \"payload\": 16, \"original_length\": 512}"));
+
+    //
+    // a truncated read, a record that is not 8 byte aligned, a message of
+    // the wrong size and a second read at another frequency.
+    //
+    CHECK(!XenvusbDecodeCapture(bytes.data(), bytes.size() - 8, &capture, &error));
+    std::vector<uint8_t> bad = bytes;
+    XENVUSB_CAPTURE_RECORD * record = (XENVUSB_CAPTURE_RECORD *) &bad[sizeof(XENVUSB_CAPTURE_HEADER)];
+    record->RecordLength -= 4;
+    CHECK(!XenvusbDecodeCapture(bad.data(), bad.size(), &capture, &error));
+    CHECK(Contains(error, "bad record at 24"));
+    bad = bytes;
+    record = (XENVUSB_CAPTURE_RECORD *) &bad[sizeof(XENVUSB_CAPTURE_HEADER)];
+    record->MessageLength = sizeof(usbif_request_t);
+    CHECK(!XenvusbDecodeCapture(bad.data(), bad.size(), &capture, &error));
+    CaptureWriter writer;
+    writer.Read(0);
+    writer.Request(0, 2, 0x82, 512, 1);
+    writer.Read(0);
+    ((XENVUSB_CAPTURE_HEADER *) &writer.Bytes[writer.Header])->Frequency = 3000000;
+    CHECK(!XenvusbDecodeCapture(writer.Bytes.data(), writer.Bytes.size(), &capture, &error));
+    CHECK(Contains(error, "frequency 3000000"));
+    CHECK(XenvusbDecodeCapture(NULL, 0, &capture, &error));
+    CHECK(capture.Messages.empty());
+}
+
+static void
+TestCaptureReplay()
+{
+    std::vector<uint8_t> bytes = SyntheticCapture();
+    XENVUSB_CAPTURE capture;
+    std::string error;
+    CHECK(XenvusbDecodeCapture(bytes.data(), bytes.size(), &capture, &error));
+
+    CaptureReplayResult result;
+    CHECK(CaptureReplay(capture, &result));
+    CHECK(result.Requests == 7);
+    CHECK(result.Completed == 6);
+    CHECK(result.Unanswered == 1);
+    CHECK(result.Orphans == 1);
+    CHECK(result.Unsupported == 0);
+    CHECK(result.LayoutDiffers == 1); // the zero length control request
+    CHECK(result.Mismatches == 0);
+    CHECK(result.Statuses[0] == 6);
+    CHECK(result.Statuses[-USBIF_RSP_USB_STALLED] == 1);
+    CHECK(result.BadIds == 0 && result.Stale == 0 && result.Leaked == 0 && result.BadGrants == 0);
+    CHECK(result.GrantsInUse == 0 && result.Outstanding == 0);
+
+    std::string text = Printed([&](FILE * file) { CaptureReplayPrint(file, result, false); });
+    CHECK(Contains(text, "replay: requests 7 completed 6 unanswered 1 orphans 1 unsupported 0 "
+        "layout_differs 1 mismatches 0 "));
+    CHECK(Contains(text, "statuses: 0 6 -16 1\n"));
+    std::string json = Printed([&](FILE * file) { CaptureReplayPrint(file, result, true); });
+    CHECK(Contains(json, "\"statuses\": {\"0\": 6, \"-16\": 1}}\n"));
+
+    //
+    // more transfers than the ring holds: a long run of requests before any
+    // response, as a capture of a device that never answers would have.
+    // Ids cycle through the shadows, the replay drains the ring to submit.
+    //
+    CaptureWriter writer;
+    writer.Read(0);
+    for (uint32_t index = 0; index < 3 * SHADOW_ENTRIES; index++)
+    {
+        writer.Request(index % SHADOW_ENTRIES, 2, 0x82, 1024, 1);
+    }
+    CHECK(XenvusbDecodeCapture(writer.Bytes.data(), writer.Bytes.size(), &capture, &error));
+    CHECK(CaptureReplay(capture, &result));
+    CHECK(result.Requests == 3 * SHADOW_ENTRIES);
+    CHECK(result.Unanswered == 3 * SHADOW_ENTRIES);
+    CHECK(result.Outstanding == 0);
+
+    //
+    // a request the host frontend cannot lay out is skipped.
+    //
+    writer = CaptureWriter();
+    writer.Read(0);
+    writer.Request(0, 2, 0x82, (MAX_PAGES_FOR_INDIRECT_REQUEST + 1) * PAGE_SIZE, 1, INDIRECT_GREF);
+    writer.Response(0, 0, 0);
+    CHECK(XenvusbDecodeCapture(writer.Bytes.data(), writer.Bytes.size(), &capture, &error));
+    CHECK(CaptureReplay(capture, &result));
+    CHECK(result.Unsupported == 1);
+    CHECK(result.Requests == 0);
+}
+
+int
+main(
+    int argc,
+    char ** argv)
+{
+    TestBuckets();
+    TestHistograms();
+    TestHistogramsRejected();
+    TestFlightRecorder();
+    TestCapture();
+    TestCaptureReplay();
+
+    if (gFailures)
+    {
+        fprintf(stderr, "%d checks failed\n", gFailures);
+        return 1;
+    }
+    printf("xenvusb decode: all checks passed\n");
+    return 0;
+}
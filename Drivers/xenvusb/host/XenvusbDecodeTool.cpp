@@ -0,0 +1,117 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file XenvusbDecodeTool.cpp prints saved diagnostic IOCTL output.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#include "XenvusbDecode.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <memory>
+
+static void
+Usage(
+    const char * Name)
+{
+    fprintf(stderr,
+        "usage: %s [--json] KIND FILE\n"
+        "  FILE is the output buffer of the IOCTL as saved, - for stdin. KIND is\n"
+        "  histograms          IOCTL_XENVUSB_GET_ENDPOINT_HISTOGRAMS\n"
+        "  flight              IOCTL_XENVUSB_GET_FLIGHT_RECORDER\n"
+        "  capture             IOCTL_XENVUSB_READ_CAPTURE, one or more reads appended\n"
+        "  --json              JSON output\n",
+        Name);
+}
+
+int
+main(
+    int argc,
+    char ** argv)
+{
+    bool json = false;
+
+    static const struct option options[] =
+    {
+        { "json", no_argument, NULL, 'j' },
+        { NULL, 0, NULL, 0 }
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "", options, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'j': json = true; break;
+        default:
+            Usage(argv[0]);
+            return 2;
+        }
+    }
+    if ((argc - optind) != 2)
+    {
+        Usage(argv[0]);
+        return 2;
+    }
+    std::string kind = argv[optind];
+    std::vector<uint8_t> buffer;
+    std::string error;
+    if (!XenvusbReadFile(argv[optind + 1], &buffer, &error))
+    {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+
+    if (kind == "histograms")
+    {
+        std::unique_ptr<XENVUSB_ENDPOINT_HISTOGRAMS> histograms(new XENVUSB_ENDPOINT_HISTOGRAMS);
+        if (!XenvusbDecodeHistograms(buffer.data(), buffer.size(), histograms.get(), &error))
+        {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+        XenvusbPrintHistograms(stdout, *histograms, json);
+        return 0;
+    }
+    if (kind == "flight")
+    {
+        std::unique_ptr<XENVUSB_FLIGHT_RECORDER> recorder(new XENVUSB_FLIGHT_RECORDER);
+        if (!XenvusbDecodeFlightRecorder(buffer.data(), buffer.size(), recorder.get(), &error))
+        {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+        XenvusbPrintFlightRecorder(stdout, *recorder, json);
+        return 0;
+    }
+    if (kind == "capture")
+    {
+        XENVUSB_CAPTURE capture;
+        if (!XenvusbDecodeCapture(buffer.data(), buffer.size(), &capture, &error))
+        {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+        XenvusbPrintCapture(stdout, capture, json);
+        return 0;
+    }
+    Usage(argv[0]);
+    return 2;
+}
@@ -0,0 +1,239 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file FuzzConfig.cpp fuzz ParseConfig()'s walk of a configuration descriptor.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#include "FuzzTarget.h"
+
+#include <vector>
+
+//
+// xenusb.h.
+//
+#define USB_INTERFACE_CLASS_HID 0x03
+#define USB_DESCRIPTOR_TYPE_HID 0x21
+#define USB_CLASS_AUDIO         0x20
+
+namespace
+{
+    //
+    /// ParseConfig()'s visitor without the traces: the same arrays, the same
+    /// HID bookkeeping and the same class specific descriptor reads.
+    //
+    struct FuzzConfigVisitor
+    {
+        const uint8_t * Begin;
+        const uint8_t * End;
+        std::vector<USB_INTERFACE_DESCRIPTOR *> Interfaces;
+        std::vector<ULONG> FirstPipe;
+        std::vector<ULONG> NumPipes;
+        std::vector<USB_ENDPOINT_DESCRIPTOR *> Pipes;
+        std::vector<USB_INTERFACE_DESCRIPTOR *> PipeInterface;
+        USB_INTERFACE_DESCRIPTOR * Current;
+        bool  IsHid;
+        bool  HidBeforeEndpoint;
+        ULONG HidEndpoints;
+        ULONG HidEndpointsFound;
+        ULONG Sum;
+
+        void
+        Interface(
+            USB_INTERFACE_DESCRIPTOR * Descriptor,
+            ULONG InterfaceIndex,
+            ULONG FirstEndpoint)
+        {
+            FUZZ_CHECK(FuzzInside(Descriptor, sizeof(*Descriptor), Begin, End));
+            FUZZ_CHECK(Descriptor->bLength >= sizeof(*Descriptor));
+            FUZZ_CHECK(InterfaceIndex < Interfaces.size());
+            FUZZ_CHECK(FirstEndpoint <= Pipes.size());
+            if (Current)
+            {
+                Sum += (NumPipes[InterfaceIndex - 1] != Current->bNumEndpoints);
+            }
+            Current = Descriptor;
+            Interfaces[InterfaceIndex] = Descriptor;
+            FirstPipe[InterfaceIndex] = FirstEndpoint;
+            NumPipes[InterfaceIndex] = 0;
+            IsHid = (Descriptor->bInterfaceClass == USB_INTERFACE_CLASS_HID);
+            if (IsHid)
+            {
+                HidBeforeEndpoint = false;
+                HidEndpoints = Descriptor->bNumEndpoints;
+                HidEndpointsFound = 0;
+            }
+            Sum += Descriptor->iInterface + Descriptor->bInterfaceProtocol;
+        }
+
+        void
+        Endpoint(
+            USB_ENDPOINT_DESCRIPTOR * Descriptor,
+            ULONG InterfaceIndex,
+            ULONG EndpointIndex)
+        {
+            FUZZ_CHECK(FuzzInside(Descriptor, sizeof(*Descriptor), Begin, End));
+            FUZZ_CHECK(Descriptor->bLength >= sizeof(*Descriptor));
+            FUZZ_CHECK(Current != NULL);
+            FUZZ_CHECK(InterfaceIndex < Interfaces.size());
+            FUZZ_CHECK(Interfaces[InterfaceIndex] == Current);
+            FUZZ_CHECK(EndpointIndex < Pipes.size());
+            FUZZ_CHECK(EndpointIndex == FirstPipe[InterfaceIndex] + NumPipes[InterfaceIndex]);
+            Pipes[EndpointIndex] = Descriptor;
+            PipeInterface[EndpointIndex] = Current;
+            NumPipes[InterfaceIndex]++;
+            if (IsHid)
+            {
+                HidEndpointsFound++;
+            }
+            Sum += Descriptor->bInterval + Descriptor->wMaxPacketSize;
+        }
+
+        void
+        Other(
+            USB_COMMON_DESCRIPTOR * Descriptor)
+        {
+            FUZZ_CHECK(FuzzInside(Descriptor, Descriptor->bLength, Begin, End));
+            FUZZ_CHECK(Descriptor->bLength >= sizeof(*Descriptor));
+            switch (Descriptor->bDescriptorType)
+            {
+            case USB_DESCRIPTOR_TYPE_HID:
+                if (IsHid && (HidEndpointsFound == 0) && HidEndpoints)
+                {
+                    HidBeforeEndpoint = true;
+                }
+                break;
+
+            case (USB_CLASS_AUDIO | USB_INTERFACE_DESCRIPTOR_TYPE):
+                {
+                    USB_INTERFACE_DESCRIPTOR * audio =
+                        UsbDescriptorAs<USB_INTERFACE_DESCRIPTOR>(Descriptor);
+                    if (audio)
+                    {
+                        FUZZ_CHECK(FuzzInside(audio, sizeof(*audio), Begin, End));
+                        Sum += audio->bInterfaceNumber + audio->iInterface;
+                    }
+                }
+                break;
+
+            case (USB_CLASS_AUDIO | USB_ENDPOINT_DESCRIPTOR_TYPE):
+                {
+                    USB_ENDPOINT_DESCRIPTOR * audio =
+                        UsbDescriptorAs<USB_ENDPOINT_DESCRIPTOR>(Descriptor);
+                    if (audio)
+                    {
+                        FUZZ_CHECK(FuzzInside(audio, sizeof(*audio), Begin, End));
+                        Sum += audio->bEndpointAddress + audio->bInterval;
+                    }
+                }
+                break;
+
+            default:
+                break;
+            }
+        }
+    };
+}
+
+extern "C" int
+LLVMFuzzerTestOneInput(
+    const uint8_t * Data,
+    size_t Size)
+{
+    //
+    // the whole configuration descriptor as the device returned it, trimmed
+    // to the bytes received as GetCompleteConfigDescriptor() does.
+    //
+    if ((Size < sizeof(USB_CONFIGURATION_DESCRIPTOR)) || (Size > 0xFFFF))
+    {
+        return 0;
+    }
+    std::vector<uint8_t> buffer(Data, Data + Size);
+    USB_CONFIGURATION_DESCRIPTOR * config = (USB_CONFIGURATION_DESCRIPTOR *) buffer.data();
+    if (config->wTotalLength > Size)
+    {
+        config->wTotalLength = (USHORT) Size;
+    }
+    if (!UsbConfigCheckHeader(config))
+    {
+        return 0;
+    }
+
+    USB_CONFIG_WALK count;
+    UsbConfigCount(config, &count);
+    FUZZ_CHECK(count.Interfaces + count.Endpoints < count.EnumIndex);
+    if (count.Interfaces == 0)
+    {
+        return 0;
+    }
+
+    FuzzConfigVisitor visitor;
+    visitor.Begin = buffer.data();
+    visitor.End = buffer.data() + config->wTotalLength;
+    visitor.Interfaces.resize(count.Interfaces);
+    visitor.FirstPipe.resize(count.Interfaces);
+    visitor.NumPipes.resize(count.Interfaces);
+    visitor.Pipes.resize(count.Endpoints);
+    visitor.PipeInterface.resize(count.Endpoints);
+    visitor.Current = NULL;
+    visitor.IsHid = false;
+    visitor.HidBeforeEndpoint = false;
+    visitor.HidEndpoints = 0;
+    visitor.HidEndpointsFound = 0;
+    visitor.Sum = 0;
+
+    USB_CONFIG_WALK walk;
+    USB_CONFIG_CHECK check = UsbConfigWalk(config,
+        count.Interfaces,
+        count.Endpoints,
+        visitor,
+        &walk);
+
+    //
+    // the count is always room enough for the walk.
+    //
+    FUZZ_CHECK(check != UsbConfigTooMany);
+    FUZZ_CHECK(walk.Interfaces <= count.Interfaces);
+    FUZZ_CHECK(walk.Endpoints <= count.Endpoints);
+    FUZZ_CHECK(walk.EnumIndex <= count.EnumIndex);
+    FUZZ_CHECK(walk.Remaining < config->wTotalLength);
+    if (check != UsbConfigValid)
+    {
+        FUZZ_CHECK(walk.Remaining == 0);
+        return 0;
+    }
+    //
+    // what ParseConfig() hands on in the USB_CONFIG_INFO.
+    //
+    FUZZ_CHECK(walk.Interfaces > 0);
+    ULONG pipes = 0;
+    for (ULONG index = 0; index < walk.Interfaces; index++)
+    {
+        FUZZ_CHECK(visitor.FirstPipe[index] == pipes);
+        for (ULONG pipe = 0; pipe < visitor.NumPipes[index]; pipe++)
+        {
+            FUZZ_CHECK(visitor.PipeInterface[pipes + pipe] == visitor.Interfaces[index]);
+        }
+        pipes += visitor.NumPipes[index];
+    }
+    FUZZ_CHECK(pipes == walk.Endpoints);
+    FuzzUse(visitor.Sum);
+    return 0;
+}
@@ -0,0 +1,122 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file FuzzIsoResponse.cpp fuzz XenPostProcessIsoResponse()'s copy of the
+/// backend's iso packet results into the client's packet descriptors.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#include "FuzzTarget.h"
+
+#include <vector>
+
+//
+// one packet of input: the offset the client set and the backend's result.
+//
+#define ISO_FUZZ_PACKET_SIZE (sizeof(uint32_t) + sizeof(iso_packet_info))
+
+//
+// MAX_ISO_PACKETS_INDIRECT in xenif.cpp, the most packets MaxIsoPackets()
+// lets through.
+//
+#define ISO_FUZZ_MAX_PACKETS ((PAGE_SIZE / sizeof(iso_packet_info)) * 8)
+
+extern "C" int
+LLVMFuzzerTestOneInput(
+    const uint8_t * Data,
+    size_t Size)
+{
+    //
+    // TransferBufferLength, then the packets. The offsets come from the
+    // client and are no more trusted than the backend's results.
+    //
+    uint32_t bufferLength;
+    if (Size < sizeof(bufferLength))
+    {
+        return 0;
+    }
+    memcpy(&bufferLength, Data, sizeof(bufferLength));
+    Data += sizeof(bufferLength);
+    Size -= sizeof(bufferLength);
+
+    uint32_t count = (uint32_t) (Size / ISO_FUZZ_PACKET_SIZE);
+    if (count > ISO_FUZZ_MAX_PACKETS)
+    {
+        count = ISO_FUZZ_MAX_PACKETS;
+    }
+    std::vector<USBD_ISO_PACKET_DESCRIPTOR> packets(count);
+    std::vector<iso_packet_info> info(count);
+    for (uint32_t index = 0; index < count; index++)
+    {
+        const uint8_t * packet = Data + (index * ISO_FUZZ_PACKET_SIZE);
+        memcpy(&packets[index].Offset, packet, sizeof(uint32_t));
+        memcpy(&info[index], packet + sizeof(uint32_t), sizeof(iso_packet_info));
+        packets[index].Length = 0xDEADBEEF;
+        packets[index].Status = USBD_STATUS_ERROR_BUSY;
+    }
+
+    uint32_t errorCount = 0;
+    uint32_t totalBytes = UsbifIsoCompletePackets(info.data(),
+        packets.data(),
+        count,
+        bufferLength,
+        &errorCount);
+
+    //
+    // no packet reaches past the buffer and the total is what the client
+    // can read.
+    //
+    uint64_t succeeded = 0;
+    uint32_t failed = 0;
+    for (uint32_t index = 0; index < count; index++)
+    {
+        const USBD_ISO_PACKET_DESCRIPTOR & packet = packets[index];
+        FUZZ_CHECK(packet.Length <= info[index].length);
+        if (packet.Offset >= bufferLength)
+        {
+            FUZZ_CHECK(packet.Length == 0);
+        }
+        else
+        {
+            FUZZ_CHECK(packet.Length <= bufferLength - packet.Offset);
+        }
+        FUZZ_CHECK(packet.Status == (USBD_STATUS) info[index].status);
+        if (packet.Status == USBD_STATUS_SUCCESS)
+        {
+            succeeded += packet.Length;
+        }
+        else
+        {
+            failed++;
+        }
+    }
+    FUZZ_CHECK(errorCount == failed);
+    FUZZ_CHECK(totalBytes <= bufferLength);
+    FUZZ_CHECK(totalBytes == ((succeeded > bufferLength) ? bufferLength : succeeded));
+
+    if (totalBytes == 0)
+    {
+        totalBytes = UsbifIsoSucceedFirstPacket(packets.data(), count, bufferLength);
+        FUZZ_CHECK(totalBytes <= bufferLength);
+        FUZZ_CHECK((count == 0) || (packets[0].Status == USBD_STATUS_SUCCESS));
+        FUZZ_CHECK((count != 0) || (totalBytes == 0));
+    }
+    return 0;
+}
@@ -0,0 +1,409 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file FuzzMain.cpp stand-in for the libFuzzer driver where the compiler
+/// has no -fsanitize=fuzzer.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/common_interface_defs.h>
+#endif
+
+//
+/// Replays every file of the corpus through the target, then runs
+/// mutations of the corpus entries: bit flips, interesting bytes and
+/// lengths, inserts, erases and splices. There is no coverage feedback, the
+/// seeds have to reach the code, the mutations probe the checks around it.
+/// The input being run when the target aborts, or a sanitizer reports, is
+/// written to crash-<target>-<pid> for replay.
+//
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * Data, size_t Size);
+
+#ifndef FUZZ_TARGET_NAME
+#define FUZZ_TARGET_NAME "fuzz"
+#endif
+
+typedef std::vector<uint8_t> FUZZ_INPUT;
+
+static const uint8_t * gCurrent;
+static size_t gCurrentSize;
+
+static void
+WriteCrashInput()
+{
+    char name[64];
+    snprintf(name, sizeof(name), "crash-%s-%d", FUZZ_TARGET_NAME, (int) getpid());
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0)
+    {
+        if (gCurrent && gCurrentSize)
+        {
+            ssize_t written = write(fd, gCurrent, gCurrentSize);
+            (void) written;
+        }
+        close(fd);
+    }
+    static const char message[] = "fuzz: input written to crash file\n";
+    ssize_t written = write(2, message, sizeof(message) - 1);
+    (void) written;
+}
+
+static void
+CrashSignal(
+    int Signal)
+{
+    WriteCrashInput();
+    signal(Signal, SIG_DFL);
+    raise(Signal);
+}
+
+static void
+RunOne(
+    const FUZZ_INPUT & Input)
+{
+    //
+    // a copy of exactly the input size so that the sanitizers see reads
+    // past the end, as with libFuzzer.
+    //
+    uint8_t * data = (uint8_t *) malloc(Input.size() ? Input.size() : 1);
+    if (!Input.empty())
+    {
+        memcpy(data, Input.data(), Input.size());
+    }
+    gCurrent = data;
+    gCurrentSize = Input.size();
+    LLVMFuzzerTestOneInput(data, Input.size());
+    gCurrent = NULL;
+    gCurrentSize = 0;
+    free(data);
+}
+
+static bool
+ReadFile(
+    const std::string & Path,
+    FUZZ_INPUT & Input)
+{
+    FILE * file = fopen(Path.c_str(), "rb");
+    if (!file)
+    {
+        return false;
+    }
+    uint8_t buffer[4096];
+    size_t bytes;
+    Input.clear();
+    while ((bytes = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        Input.insert(Input.end(), buffer, buffer + bytes);
+    }
+    fclose(file);
+    return true;
+}
+
+//
+/// a file, or the files in a directory sorted by name.
+//
+static bool
+LoadCorpus(
+    const char * Path,
+    std::vector<FUZZ_INPUT> & Corpus)
+{
+    struct stat info;
+    if (stat(Path, &info) != 0)
+    {
+        fprintf(stderr, "fuzz: %s not found\n", Path);
+        return false;
+    }
+    std::vector<std::string> files;
+    if (S_ISDIR(info.st_mode))
+    {
+        DIR * dir = opendir(Path);
+        if (!dir)
+        {
+            return false;
+        }
+        struct dirent * entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            std::string file = std::string(Path) + "/" + entry->d_name;
+            if ((entry->d_name[0] != '.') &&
+                (stat(file.c_str(), &info) == 0) &&
+                S_ISREG(info.st_mode))
+            {
+                files.push_back(file);
+            }
+        }
+        closedir(dir);
+        std::sort(files.begin(), files.end());
+    }
+    else
+    {
+        files.push_back(Path);
+    }
+    for (const std::string & file : files)
+    {
+        FUZZ_INPUT input;
+        if (!ReadFile(file, input))
+        {
+            fprintf(stderr, "fuzz: cannot read %s\n", file.c_str());
+            return false;
+        }
+        Corpus.push_back(input);
+    }
+    return true;
+}
+
+//
+/// values at the edges of the checks: lengths, type bytes and signs.
+//
+static const uint8_t gInteresting[] =
+{
+    0x00, 0x01, 0x02, 0x07, 0x08, 0x09, 0x10, 0x12, 0x20, 0x21,
+    0x24, 0x25, 0x28, 0x7F, 0x80, 0xF6, 0xFF
+};
+
+static void
+Mutate(
+    std::mt19937 & Random,
+    const std::vector<FUZZ_INPUT> & Corpus,
+    size_t MaxLength,
+    FUZZ_INPUT & Input)
+{
+    uint32_t mutations = 1 + (Random() % 4);
+    for (uint32_t count = 0; count < mutations; count++)
+    {
+        size_t size = Input.size();
+        switch (Random() % 7)
+        {
+        case 0: // flip a bit
+            if (size)
+            {
+                Input[Random() % size] ^= (uint8_t) (1 << (Random() % 8));
+            }
+            break;
+
+        case 1: // an interesting byte
+            if (size)
+            {
+                Input[Random() % size] = gInteresting[Random() % sizeof(gInteresting)];
+            }
+            break;
+
+        case 2: // a random byte
+            if (size)
+            {
+                Input[Random() % size] = (uint8_t) Random();
+            }
+            break;
+
+        case 3: // insert bytes
+            if (size < MaxLength)
+            {
+                size_t at = size ? (Random() % (size + 1)) : 0;
+                size_t bytes = 1 + (Random() % std::min<size_t>(16, MaxLength - size));
+                Input.insert(Input.begin() + at, bytes, (uint8_t) Random());
+            }
+            break;
+
+        case 4: // erase bytes
+            if (size)
+            {
+                size_t at = Random() % size;
+                size_t bytes = 1 + (Random() % std::min<size_t>(16, size - at));
+                Input.erase(Input.begin() + at, Input.begin() + at + bytes);
+            }
+            break;
+
+        case 5: // truncate
+            if (size)
+            {
+                Input.resize(Random() % size);
+            }
+            break;
+
+        case 6: // splice in part of another entry
+            {
+                const FUZZ_INPUT & other = Corpus[Random() % Corpus.size()];
+                if (!other.empty() && size)
+                {
+                    size_t from = Random() % other.size();
+                    size_t at = Random() % size;
+                    size_t bytes = std::min(other.size() - from, size - at);
+                    std::copy(other.begin() + from, other.begin() + from + bytes,
+                        Input.begin() + at);
+                }
+            }
+            break;
+        }
+    }
+    if (Input.size() > MaxLength)
+    {
+        Input.resize(MaxLength);
+    }
+}
+
+static void
+Usage(
+    const char * Name)
+{
+    fprintf(stderr,
+        "usage: %s [--runs N] [--seed S] [--max-len BYTES] [--min-rate EXECS_PER_SEC]\n"
+        "       [--json] CORPUS...\n"
+        "CORPUS is a file or a directory of files, each is run once before the\n"
+        "N mutations. --min-rate fails the run if the mutations ran slower.\n",
+        Name);
+}
+
+int
+main(
+    int argc,
+    char ** argv)
+{
+    uint64_t runs = 100000;
+    uint32_t seed = 1;
+    size_t maxLength = 4096 + 64;
+    double minRate = 0;
+    bool json = false;
+
+    static const struct option options[] =
+    {
+        { "runs",     required_argument, NULL, 'r' },
+        { "seed",     required_argument, NULL, 's' },
+        { "max-len",  required_argument, NULL, 'm' },
+        { "min-rate", required_argument, NULL, 'e' },
+        { "json",     no_argument,       NULL, 'j' },
+        { NULL, 0, NULL, 0 }
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "", options, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'r': runs = strtoull(optarg, NULL, 0); break;
+        case 's': seed = (uint32_t) strtoul(optarg, NULL, 0); break;
+        case 'm': maxLength = strtoul(optarg, NULL, 0); break;
+        case 'e': minRate = strtod(optarg, NULL); break;
+        case 'j': json = true; break;
+        default:
+            Usage(argv[0]);
+            return 2;
+        }
+    }
+    if ((optind == argc) || (maxLength == 0))
+    {
+        Usage(argv[0]);
+        return 2;
+    }
+
+    std::vector<FUZZ_INPUT> corpus;
+    for (int index = optind; index < argc; index++)
+    {
+        if (!LoadCorpus(argv[index], corpus))
+        {
+            return 2;
+        }
+    }
+    if (corpus.empty())
+    {
+        fprintf(stderr, "fuzz: empty corpus\n");
+        return 2;
+    }
+
+    signal(SIGABRT, CrashSignal);
+    signal(SIGSEGV, CrashSignal);
+    signal(SIGBUS, CrashSignal);
+    signal(SIGFPE, CrashSignal);
+#if defined(__SANITIZE_ADDRESS__)
+    __sanitizer_set_death_callback(WriteCrashInput);
+#endif
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    for (const FUZZ_INPUT & input : corpus)
+    {
+        RunOne(input);
+    }
+    double replaySeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::mt19937 random(seed);
+    FUZZ_INPUT input;
+    uint64_t bytes = 0;
+    start = Clock::now();
+    for (uint64_t run = 0; run < runs; run++)
+    {
+        input = corpus[random() % corpus.size()];
+        Mutate(random, corpus, maxLength, input);
+        bytes += input.size();
+        RunOne(input);
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    double rate = (runs && (seconds > 0)) ? (runs / seconds) : 0;
+
+    if (json)
+    {
+        printf("{\"target\": \"%s\", \"corpus\": %zu, \"replay_seconds\": %.6f, "
+            "\"runs\": %llu, \"seconds\": %.6f, \"execs_per_second\": %.0f, "
+            "\"mean_input_bytes\": %.1f, \"min_rate\": %.0f}\n",
+            FUZZ_TARGET_NAME,
+            corpus.size(),
+            replaySeconds,
+            (unsigned long long) runs,
+            seconds,
+            rate,
+            runs ? ((double) bytes / runs) : 0.0,
+            minRate);
+    }
+    else
+    {
+        printf("%s: %zu corpus entries replayed, %llu runs in %.3fs, %.0f execs/s\n",
+            FUZZ_TARGET_NAME,
+            corpus.size(),
+            (unsigned long long) runs,
+            seconds,
+            rate);
+    }
+    if (runs && (rate < minRate))
+    {
+        fprintf(stderr, "fuzz: %s %.0f execs/s below the %.0f floor\n",
+            FUZZ_TARGET_NAME,
+            rate,
+            minRate);
+        return 1;
+    }
+    return 0;
+}
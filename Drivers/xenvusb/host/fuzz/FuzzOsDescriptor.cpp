@@ -0,0 +1,108 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file FuzzOsDescriptor.cpp fuzz GetOsDescriptorString()'s checks of the OS
+/// string and the extended compat ID descriptor.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#include "FuzzTarget.h"
+
+#include <vector>
+
+//
+// GetString() allocates a zeroed USB_STRING, 128 WCHARs and a NULL after
+// the two byte header.
+//
+#define USB_STRING_SIZE (2 + (2 * (128 + 1)))
+
+//
+// the length GetOsDescriptorString() asks for the compat ID header with.
+//
+#define OS_FEATURE_HEADER_REQUEST 0x10
+
+extern "C" int
+LLVMFuzzerTestOneInput(
+    const uint8_t * Data,
+    size_t Size)
+{
+    //
+    // the input is the OS string descriptor, then the device's answer to
+    // the first fetch of the extended compat ID descriptor, up to
+    // OS_FEATURE_HEADER_REQUEST bytes, then its answer to the second. The
+    // device need not give the same header twice.
+    //
+    if (Size < sizeof(OS_STRING))
+    {
+        return 0;
+    }
+    std::vector<uint8_t> string(USB_STRING_SIZE, 0);
+    memcpy(string.data(), Data, sizeof(OS_STRING));
+    const OS_STRING * osString = (const OS_STRING *) string.data();
+    if (UsbOsStringCheck(osString) != UsbOsDescriptorValid)
+    {
+        return 0;
+    }
+    FUZZ_CHECK(osString->bLength == sizeof(OS_STRING));
+    FUZZ_CHECK(osString->MicrosoftString[0] == 'M');
+
+    const uint8_t * device = Data + sizeof(OS_STRING);
+    size_t deviceSize = Size - sizeof(OS_STRING);
+    size_t received = (deviceSize < OS_FEATURE_HEADER_REQUEST) ?
+        deviceSize : OS_FEATURE_HEADER_REQUEST;
+    std::vector<uint8_t> first(device, device + received);
+    device += received;
+    deviceSize -= received;
+    USHORT length = 0;
+    if (UsbOsFeatureHeaderCheck((const OS_FEATURE_HEADER *) first.data(),
+        (ULONG) received,
+        PAGE_SIZE,
+        &length) != UsbOsDescriptorValid)
+    {
+        return 0;
+    }
+    FUZZ_CHECK(length >= sizeof(OS_FEATURE_HEADER) + sizeof(OS_COMPATID_FUNCTION));
+    FUZZ_CHECK(length <= PAGE_SIZE);
+
+    received = (deviceSize < length) ? deviceSize : length;
+    std::vector<uint8_t> second(device, device + received);
+    const OS_COMPAT_ID * compatIds = (const OS_COMPAT_ID *) second.data();
+    if (UsbOsCompatIdCheck(compatIds, (ULONG) received, length) != UsbOsDescriptorValid)
+    {
+        return 0;
+    }
+    //
+    // GetOsDescriptorString() keeps a copy of length bytes, every function
+    // the header counts is inside it.
+    //
+    std::vector<uint8_t> copy(second.begin(), second.begin() + length);
+    compatIds = (const OS_COMPAT_ID *) copy.data();
+    FUZZ_CHECK(compatIds->header.dwLength == length);
+    ULONG sum = 0;
+    for (ULONG index = 0; index < compatIds->header.bCount; index++)
+    {
+        const OS_COMPATID_FUNCTION * function = &compatIds->functions[index];
+        FUZZ_CHECK(FuzzInside(function, sizeof(*function),
+            copy.data(), copy.data() + copy.size()));
+        sum += function->compatibleID[0] + function->subCompatibleID[7];
+    }
+    FuzzUse(sum);
+    return 0;
+}
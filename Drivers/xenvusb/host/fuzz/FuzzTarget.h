@@ -0,0 +1,77 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file FuzzTarget.h common definitions for the fuzz targets.
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#pragma once
+
+//
+/// Each target defines LLVMFuzzerTestOneInput() and is built either as a
+/// libFuzzer binary or with FuzzMain.cpp. The input is what a device or the
+/// backend controls, the targets check the invariants the driver relies on
+/// and abort() if one is broken so that either driver reports the input.
+/// Buffers are heap allocated at the exact size the driver would have valid
+/// so that the sanitizers catch any read past them.
+//
+#include "UsbifHost.h"
+#include "usbxenif.h"
+#include "UsbifCore.h"
+#include "UsbDescriptorCore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define FUZZ_CHECK(_exp_) do {                                          \
+    if (!(_exp_)) {                                                     \
+        fprintf(stderr, "%s:%d: FUZZ_CHECK(%s) failed\n",               \
+            __FILE__, __LINE__, #_exp_);                                \
+        abort();                                                        \
+    }                                                                   \
+} while (0)
+
+//
+/// true if the Size bytes at Pointer are inside [Begin, End).
+//
+inline bool
+FuzzInside(
+    const void * Pointer,
+    size_t Size,
+    const void * Begin,
+    const void * End)
+{
+    const uint8_t * p = (const uint8_t *) Pointer;
+    return (p >= (const uint8_t *) Begin) &&
+        (Size <= (size_t) ((const uint8_t *) End - p));
+}
+
+//
+/// keep a value the target computed only by reading the input, so that the
+/// reads are not optimized away before the sanitizers see them.
+//
+inline void
+FuzzUse(
+    ULONG Value)
+{
+    __asm__ volatile("" : : "r"(Value));
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * Data, size_t Size);
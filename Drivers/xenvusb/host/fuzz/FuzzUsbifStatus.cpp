@@ -0,0 +1,141 @@
+//
+// Copyright (c) Citrix Systems, Inc.
+//
+/// @file FuzzUsbifStatus.cpp fuzz XenDpc()'s checks of the responses the
+/// backend puts on the ring and MapUsbifToUsbdStatus().
+//
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+#include "FuzzTarget.h"
+
+namespace
+{
+    //
+    /// the USBD status codes the map may produce.
+    //
+    bool
+    KnownUsbdStatus(
+        USBD_STATUS Status)
+    {
+        switch (Status)
+        {
+        case USBD_STATUS_SUCCESS:
+        case USBD_STATUS_STALL_PID:
+        case USBD_STATUS_BUFFER_OVERRUN:
+        case USBD_STATUS_BUFFER_UNDERRUN:
+        case USBD_STATUS_TIMEOUT:
+        case USBD_STATUS_DEVICE_GONE:
+        case USBD_STATUS_CANCELED:
+        case USBD_STATUS_INVALID_URB_FUNCTION:
+        case USBD_STATUS_ERROR_BUSY:
+        case USBD_STATUS_INTERNAL_HC_ERROR:
+        case USBD_STATUS_ERROR_SHORT_TRANSFER:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    //
+    /// one shared ring page for all the runs, the ring is reset each run.
+    //
+    usbif_sring *
+    SharedRing()
+    {
+        static usbif_sring * sring = (usbif_sring *) aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+        return sring;
+    }
+}
+
+extern "C" int
+LLVMFuzzerTestOneInput(
+    const uint8_t * Data,
+    size_t Size)
+{
+    //
+    // the first 4 bytes are the allocated id bitmap, SHADOW_ENTRIES is
+    // more than 32 so only the low ids can be allocated, then up to a ring
+    // of responses as the backend wrote them.
+    //
+    uint32_t inUse[USBIF_ID_BITMAP_WORDS(SHADOW_ENTRIES)] = { 0 };
+    if (Size < sizeof(inUse[0]))
+    {
+        return 0;
+    }
+    memcpy(&inUse[0], Data, sizeof(inUse[0]));
+    Data += sizeof(inUse[0]);
+    Size -= sizeof(inUse[0]);
+
+    usbif_sring * sring = SharedRing();
+    usbif_front_ring_t ring;
+    SHARED_RING_INIT(sring);
+    FRONT_RING_INIT(&ring, sring, PAGE_SIZE);
+
+    RING_IDX count = (RING_IDX) (Size / sizeof(usbif_response_t));
+    if (count > RING_SIZE(&ring))
+    {
+        count = RING_SIZE(&ring);
+    }
+    for (RING_IDX index = 0; index < count; index++)
+    {
+        memcpy(RING_GET_RESPONSE(&ring, index),
+            Data + (index * sizeof(usbif_response_t)),
+            sizeof(usbif_response_t));
+    }
+    ring.req_prod_pvt = count;
+    sring->rsp_prod = count;
+
+    RING_IDX rp = UsbifRingResponseProducer(&ring);
+    FUZZ_CHECK(rp == count);
+    for (RING_IDX index = ring.rsp_cons; index != rp; index++)
+    {
+        usbif_response_t response;
+        USBIF_RESPONSE_CHECK check = UsbifRingGetResponse(&ring,
+            index,
+            inUse,
+            SHADOW_ENTRIES,
+            &response);
+        if (check != UsbifResponseValid)
+        {
+            FUZZ_CHECK((check == UsbifResponseBadId) ?
+                (response.id >= SHADOW_ENTRIES) :
+                !UsbifIdBitmapTest(inUse, (uint16_t) response.id));
+            continue;
+        }
+        FUZZ_CHECK(response.id < 32);
+        FUZZ_CHECK(inUse[0] & (1u << response.id));
+
+        USBD_STATUS usbdStatus = UsbifMapStatus(false, response.status);
+        USBD_STATUS resetStatus = UsbifMapStatus(true, response.status);
+        FUZZ_CHECK(KnownUsbdStatus(usbdStatus));
+        FUZZ_CHECK((response.status == 0) == (usbdStatus == USBD_STATUS_SUCCESS));
+        FUZZ_CHECK(resetStatus != USBD_STATUS_DEVICE_GONE);
+        FUZZ_CHECK((resetStatus == usbdStatus) ||
+            ((usbdStatus == USBD_STATUS_DEVICE_GONE) && (resetStatus == USBD_STATUS_CANCELED)));
+        FUZZ_CHECK(UsbifStatusLookup(response.status)->UsbifString != NULL);
+        //
+        // a completed id cannot complete again.
+        //
+        UsbifIdBitmapClear(inUse, (uint16_t) response.id);
+    }
+    FUZZ_CHECK(!UsbifRingFinishResponses(&ring, rp, true));
+    FUZZ_CHECK(sring->rsp_event == rp + 1);
+    return 0;
+}
@@ -38,6 +38,7 @@
 #include <ring.h>
 #include <xenbus.h>
 #include "usbxenif.h"
+#include "UsbifCore.h"
 #include "xenif.h"
 #include "UsbResponse.h"
 #include "UsbRequest.h"
@@ -53,24 +54,78 @@ XXX_TODO("--XT-- Better logging integration.");
 #define XEN_BUS L"Xen"
 #define RB_VERSION_REQUIRED "3"
 #define MAX_ISO_PACKETS (PAGE_SIZE/sizeof(iso_packet_info))
+//
+// Packet descriptor arrays of more than one page are passed as the leading
+// grefs of an indirect request, up to the maximum agreed with the backend.
+//
+#define MAX_ISO_PACKET_PAGES 8
+#define MAX_ISO_PACKETS_INDIRECT (MAX_ISO_PACKETS * MAX_ISO_PACKET_PAGES)
+#define ISO_PACKET_PAGES(_packets_) BYTES_TO_PAGES((_packets_) * sizeof(iso_packet_info))
+//
+// usbflags PollMode: how long the DPC spins for more responses.
+//
+#define XEN_POLL_MICROSECONDS 20
+//
+// how long, in 100ns units, the backend has to answer a CANCEL_REQUEST
+// before the pipe is aborted. See GetTimedOutCancelRequest().
+//
+#define CANCEL_ON_RING_TIMEOUT (2 * 1000 * 1000 * 10)
+//
+// index into EndpointRequests by endpoint number and direction.
+//
+#define ENDPOINT_INDEX(_ea_) (((_ea_) & 0x0F) | (USB_ENDPOINT_DIRECTION_IN(_ea_) ? 0x10 : 0))
+#define MAX_ENDPOINT_INDEX 32
+//
+// Size classes, in pages, for the transient pages of a request: indirect
+// pages and iso packet descriptor pages. See AllocateTransientPages().
+//
+#define PAGE_CLASS_COUNT 2
+#define PAGE_CLASS_MAX_PAGES 2
+#define PAGE_CLASS_INDEX(_pages_) ((_pages_) <= 1 ? 0 : 1)
+//
+// Data buffer MDLs for URBs with a TransferBuffer and no TransferBufferMDL,
+// see BuildTransferMdl(). 64KB at any offset fits the cached MDL.
+//
+#define STACK_MDL_PAGES 2
+#define TRANSFER_MDL_PAGES 17
+
+struct STACK_MDL
+{
+    MDL         Mdl;
+    PFN_NUMBER  Pfn[STACK_MDL_PAGES]; //!< MmGetMdlPfnArray(&Mdl)
+};
 
 //
 /// local context for ringbuffer entry.
+/// The entries are cache aligned and everything ahead of req.gref is in the
+/// first line: what XenDpc() reads for every response and what
+/// PutShadowOnFreelist() decides the teardown on. The grant array and the
+/// pointers after req are only read when those fields say there is
+/// something there: nr_segments for the grants, indirectPages,
+/// isoPacketPages and mdlAllocated for the memory.
 //
-typedef struct 
+typedef struct DECLSPEC_CACHEALIGN
 {
-    usbif_request_t req;                 //<! The associated ringbuffer request
-    ULONG           Tag;                 //<! must be 'Shdw'
     BOOLEAN         InUse;               //<! Must be FALSE when unallocated.
-    WDFREQUEST      Request;             //<! NULL if internal request
-    PMDL            allocatedMdl;        //<! if not NULL an MDL that must be deallocated
-    ULONG           length;              //<! ??? figure out if this is used!
     BOOLEAN         isReset;             //<! is this a reset request
-    PVOID           isoPacketDescriptor; //<! allocated page for iso packets
-    PMDL            isoPacketMdl;        //<! allocated iso packet MDL
+    BOOLEAN         isCancel;            //<! CANCEL_REQUEST for another shadow, Request is NULL
+    BOOLEAN         isFrameSync;         //<! SyncFrameClock() request, Request is NULL
+    BOOLEAN         endpointCounted;     //<! included in EndpointRequests
+    BOOLEAN         mdlAllocated;        //<! allocatedMdl must be deallocated
+    UCHAR           indirectPages;       //<! size of indirectPageMemory in pages
+    UCHAR           isoPacketPages;      //<! size of isoPacketDescriptor in pages, 0 for isoFastSlot
+    WDFREQUEST      Request;             //<! NULL if internal request
+    PISO_FAST_SLOT  isoFastSlot;         //<! FdoSubmitIsoOutUrb() request, Request is NULL
+    LONGLONG        putTime;             //<! performance counter when put on the ring
+    usbif_request_t req;                 //<! The associated ringbuffer request
     PVOID           indirectPageMemory;  //<! allocated indirect memory
+    PVOID           isoPacketDescriptor; //<! page(s) for iso packets
+    PMDL            allocatedMdl;        //<! an MDL the request built for its buffer
+    ULONG           Tag;                 //<! must be 'Shdw'
 } usbif_shadow_ex_t;
 
+C_ASSERT(FIELD_OFFSET(usbif_shadow_ex_t, req.gref) <= SYSTEM_CACHE_ALIGNMENT_SIZE);
+
 //
 /// Device resources allocated for the xen bus interface.
 //
@@ -84,6 +139,36 @@ struct XEN_BUS_PLATFORM_RESOURCE
     USHORT           Flags;
 };
 
+//
+/// usbif capture buffer, see XenCaptureControl().
+//
+#define CAPTURE_BUFFER_SIZE (1024 * 1024)
+
+//
+/// Payloads are the device's data, keystrokes included, and the capture
+/// IOCTLs only need read and write access to the controller. Free builds
+/// capture the usbif messages alone, define XENVUSB_CAPTURE_PAYLOAD=1 to
+/// allow a PayloadLimit.
+//
+#ifndef XENVUSB_CAPTURE_PAYLOAD
+#if DBG
+#define XENVUSB_CAPTURE_PAYLOAD 1
+#else
+#define XENVUSB_CAPTURE_PAYLOAD 0
+#endif
+#endif
+
+struct XEN_CAPTURE
+{
+    PUCHAR                    Buffer;  //!< CAPTURE_BUFFER_SIZE, NULL until the first capture.
+    ULONG                     Head;    //!< next record is written here.
+    ULONG                     Tail;    //!< oldest unread record.
+    ULONG                     Used;
+    ULONG                     PayloadLimit;
+    ULONG                     Dropped;
+    BOOLEAN                   Active;
+};
+
 //
 /// This keeps the interface to Xenbus private to this module.
 /// Theoretically it could be a separate static or dynamic library component.
@@ -110,19 +195,63 @@ struct XEN_INTERFACE
     usbif_sring *             Sring; //!< shared ring
     usbif_front_ring_t        Ring;  //!< front ring
     ULONG                     RequestsOnRingbuffer; //!< data URBs only
+    ULONG                     MaxRequestsOnRingbuffer; //!< high water mark.
     PMDL                      SringPage; // --XT-- added to track the mapped page
     
     ULONG                     MaxIsoSegments;
     ULONG                     MaxSegments;
+    ULONG                     MaxIsoPackets; //!< negotiated with the backend.
+    LONGLONG                  PerformanceFrequency; //!< for the endpoint histograms.
 
     usbif_shadow_ex_t *       Shadows;
     ULONG                     ShadowArrayEntries;
-    USHORT *                  ShadowFreeList;
-    USHORT                    ShadowFree;
-    USHORT                    ShadowMinFree;
-
+    USHORT *                  ShadowFreeList; //!< storage for FreeShadows.
+    USBIF_ID_STACK            FreeShadows;
+    uint32_t                  ShadowInUse[USBIF_ID_BITMAP_WORDS(SHADOW_ENTRIES)];
+    //
+    /// free shadows held back for FdoSubmitIsoOutUrb(), one per idle slot.
+    //
+    USHORT                    ReservedShadows;
+    //
+    /// bulk/interrupt requests on the ringbuffer by ENDPOINT_INDEX.
+    /// Only maintained when usbflags MaxInFlightPerEndpoint is set.
+    //
+    USHORT                    EndpointRequests[MAX_ENDPOINT_INDEX];
+    //
+    /// requests held in the ThrottleQueue by ENDPOINT_INDEX, counted again
+    /// by each ReleaseThrottledRequests().
+    //
+    USHORT                    EndpointHeld[MAX_ENDPOINT_INDEX];
 
     BOOLEAN                   IndirectGrefSupport; //!< has to be true!
+    BOOLEAN                   CancelRequestSupport; //!< both ends publish feature-cancel-request.
+
+    XEN_CAPTURE               Capture;
+    //
+    /// one lookaside list per page class, see AllocateTransientPages().
+    //
+    NPAGED_LOOKASIDE_LIST     PageLookaside[PAGE_CLASS_COUNT];
+    BOOLEAN                   PageLookasideInitialized;
+    ULONG                     PageLookasideHits;   //!< served by a page class.
+    ULONG                     PageLookasideMisses; //!< too large, went to pool.
+    //
+    /// preallocated data buffer MDL, see BuildTransferMdl().
+    //
+    PMDL                      TransferMdl;
+    BOOLEAN                   TransferMdlInUse;
+    ULONG                     TransferMdlStack;  //!< buffers described on the stack.
+    ULONG                     TransferMdlHits;   //!< buffers described by TransferMdl.
+    ULONG                     TransferMdlMisses; //!< went to IoAllocateMdl().
+    ULONG                     GrantRefFailures; //!< GetGrantFromFreelist() found none.
+#if DBG
+    ULONG                     FaultGrants;    //!< see gFaultInjection.
+    ULONG                     FaultResponses;
+    //
+    /// reruns the DPC for a response held back by ResponseFaultDue().
+    //
+    KTIMER                    FaultTimer;
+    KDPC                      FaultDpc;
+#endif
 };
 
 
@@ -149,10 +278,37 @@ static grant_ref_t
 GetGrantFromFreelist(
     IN PXEN_INTERFACE Xen);
 
+//
+/// the grant table operations for the UsbifCore.h gref helpers.
+//
+struct XEN_GRANT_OPS
+{
+    PXEN_INTERFACE Xen;
+
+    grant_ref_t GetRef()
+    {
+        return GetGrantFromFreelist(Xen);
+    }
+
+    void GrantAccess(uint64_t Pfn, grant_ref_t Ref)
+    {
+        XenLowerGntTblGrantAccess(0, (uint32_t) Pfn, 0, Ref);
+    }
+
+    bool EndAccess(grant_ref_t Ref)
+    {
+        return PutGrantOnFreelist(Xen, Ref) ? true : false;
+    }
+};
+
 static usbif_shadow_ex_t *
 GetShadowFromFreeList(
     IN PXEN_INTERFACE Xen);
 
+#if DBG
+static KDEFERRED_ROUTINE FaultTimerDpc;
+#endif
+
 static VOID
 PutShadowOnFreelist(
     IN PXEN_INTERFACE Xen,
@@ -173,13 +329,20 @@ AllocateIndirectGrefs(
     IN PMDL Mdl,
     IN PMDL IndirectPageMdl,
     IN ULONG PagesUsed,
-    IN PPFN_NUMBER PacketPfnArray);
+    IN PPFN_NUMBER PacketPfnArray,
+    IN ULONG PacketPages);
 
 static VOID
 PutOnRing(
     IN PXEN_INTERFACE Xen,
     IN usbif_shadow_ex_t *shadow);
 
+_Requires_lock_held_(Xen->FdoContext->WdfDevice)
+static VOID
+CaptureRequest(
+    IN PXEN_INTERFACE Xen,
+    IN usbif_shadow_ex_t *shadow);
+
 static VOID
 DecrementRingBufferRequests(
     IN PXEN_INTERFACE Xen);
@@ -309,6 +472,174 @@ XenCreateSring(
     return TRUE;
 }
 
+//
+/// Indirect pages and iso packet pages are allocated and freed for almost
+/// every request. Requests of up to PAGE_CLASS_MAX_PAGES pages are served by
+/// the per device lookaside list for their page class, anything larger
+/// comes from pool with the caller's Tag.
+/// Allocations of PAGE_SIZE or more are page aligned, as the grant refs require.
+//
+static PVOID
+AllocateTransientPages(
+    IN PXEN_INTERFACE Xen,
+    IN ULONG Pages,
+    IN ULONG Tag)
+{
+    if (Pages <= PAGE_CLASS_MAX_PAGES)
+    {
+        Xen->PageLookasideHits++;
+        return ExAllocateFromNPagedLookasideList(&Xen->PageLookaside[PAGE_CLASS_INDEX(Pages)]);
+    }
+    Xen->PageLookasideMisses++;
+#pragma warning(push)
+#pragma warning(disable: 28197)
+    return ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE * Pages, Tag);
+#pragma warning(pop)
+}
+
+static VOID
+FreeTransientPages(
+    IN PXEN_INTERFACE Xen,
+    IN PVOID Buffer,
+    IN ULONG Pages)
+{
+    if (Pages <= PAGE_CLASS_MAX_PAGES)
+    {
+        ExFreeToNPagedLookasideList(&Xen->PageLookaside[PAGE_CLASS_INDEX(Pages)], Buffer);
+    }
+    else
+    {
+        ExFreePool(Buffer);
+    }
+}
+
+static VOID
+XenInitializePageLookaside(
+    IN PXEN_INTERFACE Xen)
+{
+    for (ULONG index = 0; index < PAGE_CLASS_COUNT; index++)
+    {
+        ExInitializeNPagedLookasideList(&Xen->PageLookaside[index],
+            NULL,
+            NULL,
+            0,
+            PAGE_SIZE * (index + 1),
+            XVUN,
+            0);
+    }
+    Xen->PageLookasideInitialized = TRUE;
+}
+
+static VOID
+XenDeletePageLookaside(
+    IN PXEN_INTERFACE Xen)
+{
+    if (!Xen->PageLookasideInitialized)
+    {
+        return;
+    }
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE,
+        __FUNCTION__": %s page classes: hits %d misses %d\n"
+        "    one page: allocations %d from pool %d\n"
+        "    two pages: allocations %d from pool %d\n",
+        Xen->FrontendPath,
+        Xen->PageLookasideHits,
+        Xen->PageLookasideMisses,
+        Xen->PageLookaside[0].L.TotalAllocates,
+        Xen->PageLookaside[0].L.AllocateMisses,
+        Xen->PageLookaside[1].L.TotalAllocates,
+        Xen->PageLookaside[1].L.AllocateMisses);
+
+    for (ULONG index = 0; index < PAGE_CLASS_COUNT; index++)
+    {
+        ExDeleteNPagedLookasideList(&Xen->PageLookaside[index]);
+    }
+    Xen->PageLookasideInitialized = FALSE;
+}
+
+//
+/// Builds the data buffer MDL for a URB that has a TransferBuffer but no
+/// TransferBufferMDL. The MDL is only read while the grant refs are set up
+/// under the FDO lock, so rather than allocate an MDL per request small
+/// buffers are described by StackMdl and buffers of up to
+/// TRANSFER_MDL_PAGES pages by the one preallocated TransferMdl.
+/// Anything else gets an MDL from IoAllocateMdl() and *Allocated is set,
+/// the caller owns it. Otherwise the caller calls ReleaseTransferMdl().
+//
+_Requires_lock_held_(Xen->FdoContext->WdfDevice)
+static PMDL
+BuildTransferMdl(
+    IN PXEN_INTERFACE Xen,
+    IN PVOID Buffer,
+    IN ULONG Length,
+    IN STACK_MDL * StackMdl,
+    OUT BOOLEAN * Allocated)
+{
+    ULONG pages = ADDRESS_AND_SIZE_TO_SPAN_PAGES(Buffer, Length);
+    PMDL mdl;
+
+    *Allocated = FALSE;
+    if (pages <= STACK_MDL_PAGES)
+    {
+        mdl = &StackMdl->Mdl;
+        Xen->TransferMdlStack++;
+    }
+    else if ((pages <= TRANSFER_MDL_PAGES) &&
+        Xen->TransferMdl &&
+        !Xen->TransferMdlInUse)
+    {
+        mdl = Xen->TransferMdl;
+        Xen->TransferMdlInUse = TRUE;
+        Xen->TransferMdlHits++;
+    }
+    else
+    {
+        Xen->TransferMdlMisses++;
+        mdl = IoAllocateMdl(Buffer, Length, FALSE, FALSE, NULL);
+        if (mdl)
+        {
+            MmBuildMdlForNonPagedPool(mdl);
+            *Allocated = TRUE;
+        }
+        return mdl;
+    }
+    MmInitializeMdl(mdl, Buffer, Length);
+    MmBuildMdlForNonPagedPool(mdl);
+    return mdl;
+}
+
+_Requires_lock_held_(Xen->FdoContext->WdfDevice)
+static VOID
+ReleaseTransferMdl(
+    IN PXEN_INTERFACE Xen,
+    IN PMDL Mdl)
+{
+    if (Mdl && (Mdl == Xen->TransferMdl))
+    {
+        ASSERT(Xen->TransferMdlInUse);
+        Xen->TransferMdlInUse = FALSE;
+    }
+}
+
+static VOID
+XenDeleteTransferMdl(
+    IN PXEN_INTERFACE Xen)
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE,
+        __FUNCTION__": %s transfer buffer mdls: stack %d cached %d allocated %d\n",
+        Xen->FrontendPath,
+        Xen->TransferMdlStack,
+        Xen->TransferMdlHits,
+        Xen->TransferMdlMisses);
+
+    if (Xen->TransferMdl)
+    {
+        ExFreePool(Xen->TransferMdl);
+        Xen->TransferMdl = NULL;
+    }
+}
+
 static VOID
 XenInterfaceCleanup(
     IN PXEN_INTERFACE Xen)
@@ -329,6 +660,12 @@ XenInterfaceCleanup(
         ExFreePool(Xen->ShadowFreeList);
         Xen->ShadowFreeList = NULL;
     }
+
+    if (Xen->Capture.Buffer)
+    {
+        ExFreePool(Xen->Capture.Buffer);
+        Xen->Capture.Buffer = NULL;
+    }
 }
 
 PXEN_INTERFACE
@@ -348,6 +685,17 @@ AllocateXenInterface(
             ExFreePool(xen);
             return NULL;
         }
+        XenInitializePageLookaside(xen);
+#if DBG
+        KeInitializeTimer(&xen->FaultTimer);
+        KeInitializeDpc(&xen->FaultDpc, FaultTimerDpc, xen);
+#endif
+        //
+        // not fatal, BuildTransferMdl() falls back to IoAllocateMdl().
+        //
+        xen->TransferMdl = (PMDL) ExAllocatePoolWithTag(NonPagedPool,
+            sizeof(MDL) + (sizeof(PFN_NUMBER) * TRANSFER_MDL_PAGES),
+            XVUO);
     }
     return xen;
 }
@@ -356,9 +704,15 @@ VOID
 DeallocateXenInterface(
     IN PXEN_INTERFACE Xen)
 {
+#if DBG
+    KeCancelTimer(&Xen->FaultTimer);
+    KeFlushQueuedDpcs();
+#endif
     XenLowerFree(Xen->XenLower);
     // XXX TODO do we want to clean all this up on shutdown?
     XenInterfaceCleanup(Xen);
+    XenDeletePageLookaside(Xen);
+    XenDeleteTransferMdl(Xen);
     ExFreePool(Xen);
 }
 
@@ -423,8 +777,28 @@ XenDeviceInitialize(
         Xen->IndirectGrefSupport = TRUE;
         Xen->MaxIsoSegments = USBIF_URB_MAX_ISO_SEGMENTS;
         Xen->MaxSegments = USBIF_URB_MAX_SEGMENTS_PER_REQUEST;
+        //
+        // more than one page of packet descriptors needs indirect grefs
+        // and a backend that knows to look for them.
+        //
+        Xen->MaxIsoPackets = XenLowerNegotiateMaxIsoPackets(Xen->XenLower,
+            MAX_ISO_PACKETS_INDIRECT);
+        if (Xen->MaxIsoPackets > MAX_ISO_PACKETS_INDIRECT)
+        {
+            Xen->MaxIsoPackets = MAX_ISO_PACKETS_INDIRECT;
+        }
+        if (Xen->MaxIsoPackets < MAX_ISO_PACKETS)
+        {
+            Xen->MaxIsoPackets = MAX_ISO_PACKETS;
+        }
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE,
+            __FUNCTION__ ": max iso packets %d\n",
+            Xen->MaxIsoPackets);
+        Xen->CancelRequestSupport = XenLowerNegotiateCancelRequest(Xen->XenLower);
 
-        Xen->ShadowFree = 0;
+        LARGE_INTEGER frequency;
+        KeQueryPerformanceCounter(&frequency);
+        Xen->PerformanceFrequency = frequency.QuadPart;
 
         // Somewhere around here the initial setup code called XenPci_XenConfigDevice
         // which setup the backend. This involved setting up all the values in the
@@ -495,6 +869,11 @@ XenDeviceInitialize(
             status = STATUS_NO_MEMORY;
             break;
         }
+        //
+        // pool allocations of a page or more are page aligned, which keeps
+        // each shadow on its own cache lines.
+        //
+        ASSERT(((ULONG_PTR) Xen->Shadows & (SYSTEM_CACHE_ALIGNMENT_SIZE - 1)) == 0);
 
         Xen->ShadowFreeList = (PUSHORT)ExAllocatePoolWithTag(NonPagedPool,
             sizeof(USHORT)* SHADOW_ENTRIES,
@@ -511,7 +890,8 @@ XenDeviceInitialize(
         // set up the mapping from shadow request to request/respons through
         // the request.id field.
         //
-        memset(Xen->Shadows, 0, sizeof(usbif_shadow_t)* SHADOW_ENTRIES);
+        memset(Xen->Shadows, 0, sizeof(usbif_shadow_ex_t)* SHADOW_ENTRIES);
+        UsbifIdStackInit(&Xen->FreeShadows, Xen->ShadowFreeList, SHADOW_ENTRIES);
         for (i = 0; i < SHADOW_ENTRIES; i++)
         {
             Xen->Shadows[i].req.id = i;
@@ -519,6 +899,7 @@ XenDeviceInitialize(
             Xen->Shadows[i].InUse = TRUE;
             PutShadowOnFreelist(Xen, &Xen->Shadows[i]);
         }
+        Xen->ReservedShadows = Xen->FdoContext->IsoFastPath ? ISO_FAST_SLOTS : 0;
         TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE,
             __FUNCTION__ ": Fetched shared ring and setup shadows\n");
 
@@ -598,6 +979,9 @@ VOID
 XenDisconnectDPC(
     IN PXEN_INTERFACE Xen)
 {
+#if DBG
+    KeCancelTimer(&Xen->FaultTimer);
+#endif
     XenLowerDisconnectEvtChnDPC(Xen->XenLower);
 }
 
@@ -608,32 +992,32 @@ XenDeviceDisconnectBackend(
     XenLowerDisonnectBackend(Xen->XenLower);
 }
 
+//
+// The request context records the shadow a request was put on the ring
+// with. It is only trusted if that shadow still points back at the request.
+//
 void 
 FreeShadowForRequest(
     IN PXEN_INTERFACE Xen,
     WDFREQUEST Request)
 {
-    for (ULONG index = 0;
-        index < SHADOW_ENTRIES;
-        index++)
+    ULONG index = RequestGetRequestContext(Request)->ShadowIndex;
+    if ((index < SHADOW_ENTRIES) &&
+        (Request == Xen->Shadows[index].Request))
     {
-        if (Request == Xen->Shadows[index].Request)
-        {
-            TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
-                __FUNCTION__ ": Device %p Found backend Request %p shadow %p index %d requests on ringbuffer: %d\n",
-                Xen->FdoContext->WdfDevice,
-                Request,
-                &Xen->Shadows[index],
-                index,
-                OnRingBuffer(Xen));
-            //
-            // reclaim any shadow resources
-            //
-            Xen->Shadows[index].Request = NULL;
-            PutShadowOnFreelist(Xen, &Xen->Shadows[index]);
-            DecrementRingBufferRequests(Xen);
-            break;
-        }
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
+            __FUNCTION__ ": Device %p Found backend Request %p shadow %p index %d requests on ringbuffer: %d\n",
+            Xen->FdoContext->WdfDevice,
+            Request,
+            &Xen->Shadows[index],
+            index,
+            OnRingBuffer(Xen));
+        //
+        // reclaim any shadow resources
+        //
+        Xen->Shadows[index].Request = NULL;
+        PutShadowOnFreelist(Xen, &Xen->Shadows[index]);
+        DecrementRingBufferRequests(Xen);
     }
 }
 
@@ -642,7 +1026,6 @@ PutShadowOnFreelist(
     IN PXEN_INTERFACE Xen,
     IN usbif_shadow_ex_t *shadow)
 {
-    uint8_t index;
     ASSERT(shadow->InUse == TRUE);
     if (!shadow->InUse)
     {
@@ -652,70 +1035,70 @@ PutShadowOnFreelist(
         return;
     }
 
-    if (shadow->isoPacketMdl)
-    {
-        IoFreeMdl(shadow->isoPacketMdl);
-        shadow->isoPacketMdl = NULL;
-    }
-    if (shadow->allocatedMdl)
+    if (shadow->mdlAllocated)
     {
         IoFreeMdl(shadow->allocatedMdl);
         shadow->allocatedMdl = NULL;
+        shadow->mdlAllocated = FALSE;
+    }
+    if (shadow->isoFastSlot)
+    {
+        //
+        // the packet page belongs to the slot. Return the reservation.
+        //
+        shadow->isoPacketDescriptor = NULL;
+        shadow->isoFastSlot = NULL;
+        Xen->ReservedShadows++;
     }
-    if (shadow->isoPacketDescriptor)
+    if (shadow->isoPacketPages)
     {
-        ExFreePool(shadow->isoPacketDescriptor);
+        FreeTransientPages(Xen, shadow->isoPacketDescriptor, shadow->isoPacketPages);
         shadow->isoPacketDescriptor = NULL;
+        shadow->isoPacketPages = 0;
     }
     //
     // Free the grant refs allocated to this request.
     //
-    if (shadow->indirectPageMemory)
+    if (shadow->req.nr_segments)
     {
-        usbif_indirect_page_t * indirectPage = 
-            (usbif_indirect_page_t *) shadow->indirectPageMemory;
-
-        for (index = 0; index <shadow->req.nr_segments; index++)
+        XEN_GRANT_OPS grantOps = { Xen };
+        ULONG leaked = UsbifReleaseSegments(&shadow->req,
+            shadow->indirectPages ? (usbif_indirect_page_t *) shadow->indirectPageMemory : NULL,
+            grantOps);
+        if (leaked)
         {
-            for (uint32_t index2 = 0;
-                index2 < indirectPage[index].nr_segments;
-                index2++)
-            {
-                if (!PutGrantOnFreelist(Xen, indirectPage[index].gref[index2]))
-                {
-                    TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
-                        __FUNCTION__": leaked grant ref %p for indirect data segment\n",
-                        indirectPage[index].gref[index2]);
-                }
-            }
+            TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
+                __FUNCTION__": leaked %d grant refs for shadow %d\n",
+                leaked,
+                shadow->req.id);
         }
-        ExFreePool(shadow->indirectPageMemory);
+    }
+    if (shadow->indirectPages)
+    {
+        FreeTransientPages(Xen, shadow->indirectPageMemory, shadow->indirectPages);
         shadow->indirectPageMemory = NULL;
+        shadow->indirectPages = 0;
     }
-    for(index = 0; index < shadow->req.nr_segments; index++)
+    if (shadow->endpointCounted)
     {
-        if (!PutGrantOnFreelist(Xen, shadow->req.gref[index]))
-        {
-            TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
-                __FUNCTION__": leaked grant ref %p for data segment\n",
-                shadow->req.gref[index]);
-        }
+        ASSERT(Xen->EndpointRequests[ENDPOINT_INDEX(shadow->req.endpoint)]);
+        Xen->EndpointRequests[ENDPOINT_INDEX(shadow->req.endpoint)]--;
+        shadow->endpointCounted = FALSE;
     }
     shadow->req.nr_segments = 0;
     shadow->Request = NULL;
+    shadow->isCancel = FALSE;
+    shadow->isFrameSync = FALSE;
     shadow->InUse = FALSE;
+    UsbifIdBitmapClear(Xen->ShadowInUse, (uint16_t) shadow->req.id);
 
-    ASSERT(Xen->ShadowFree < Xen->ShadowArrayEntries);
-    if (Xen->ShadowFree >= Xen->ShadowArrayEntries)
+    if (!UsbifIdStackPush(&Xen->FreeShadows, (uint16_t) shadow->req.id))
     {
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
             __FUNCTION__": ShadowFree %d >= ShadowArrayEntries %d!\n",
-            Xen->ShadowFree,
+            Xen->FreeShadows.Free,
             Xen->ShadowArrayEntries);
-        return;
     }
-    Xen->ShadowFreeList[Xen->ShadowFree] = (USHORT)shadow->req.id;
-    Xen->ShadowFree++;
 }
 
 void
@@ -731,11 +1114,30 @@ CompleteRequestsFromShadow(
         fdoContext->WdfDevice,
         OnRingBuffer(fdoContext->Xen));
     
-    for (ULONG index = 0;
+    //
+    // only the shadows in use can own a request. The bitmap is re-read after
+    // each completion as the lock is dropped around it.
+    //
+    for (ULONG index = UsbifIdBitmapNext(fdoContext->Xen->ShadowInUse, SHADOW_ENTRIES, 0);
         index < SHADOW_ENTRIES;
-        index++)
+        index = UsbifIdBitmapNext(fdoContext->Xen->ShadowInUse, SHADOW_ENTRIES, index + 1))
     {
-        WDFREQUEST Request = fdoContext->Xen->Shadows[index].Request;
+        usbif_shadow_ex_t * shadow = &fdoContext->Xen->Shadows[index];
+        if (shadow->InUse && shadow->isoFastSlot)
+        {
+            PISO_FAST_SLOT slot = shadow->isoFastSlot;
+            RequestsProcessed++;
+            PutShadowOnFreelist(fdoContext->Xen, shadow);
+            CompleteIsoFastSlot(fdoContext, slot, USBD_STATUS_DEVICE_GONE);
+            continue;
+        }
+        if (shadow->InUse && shadow->isFrameSync)
+        {
+            PutShadowOnFreelist(fdoContext->Xen, shadow);
+            FrameClockSyncComplete(fdoContext, FALSE, 0);
+            continue;
+        }
+        WDFREQUEST Request = shadow->Request;
         if (Request)
         {
             PFDO_REQUEST_CONTEXT requestContext = RequestGetRequestContext(Request);
@@ -815,31 +1217,58 @@ static usbif_shadow_ex_t *
 GetShadowFromFreeList(
     IN PXEN_INTERFACE Xen)
 {
-    if (Xen->ShadowFree == 0)
+    uint16_t id;
+    if (!UsbifIdStackPop(&Xen->FreeShadows, &id))
     {
         return NULL;
     }
-    Xen->ShadowFree--;
-    if (Xen->ShadowFree < Xen->ShadowMinFree)
+    usbif_shadow_ex_t *shadow = &Xen->Shadows[id];
+    ASSERT(shadow->InUse == FALSE);
+    shadow->InUse = TRUE;
+    UsbifIdBitmapSet(Xen->ShadowInUse, id);
+    shadow->req.nr_segments = 0;
+    shadow->req.nr_packets = 0;
+    shadow->req.flags = 0;
+    shadow->req.length = 0;
+    return shadow;
+}
+
+//
+// associate a request with its shadow, see FreeShadowForRequest().
+//
+static __forceinline VOID
+SetShadowRequest(
+    IN usbif_shadow_ex_t *shadow,
+    IN WDFREQUEST Request)
+{
+    shadow->Request = Request;
+    if (Request)
     {
-        Xen->ShadowMinFree = Xen->ShadowFree;
+        RequestGetRequestContext(Request)->ShadowIndex = shadow->req.id;
     }
-    ASSERT(Xen->Shadows[Xen->ShadowFreeList[Xen->ShadowFree]].InUse == FALSE);
-    Xen->Shadows[Xen->ShadowFreeList[Xen->ShadowFree]].InUse = TRUE;
-    Xen->Shadows[Xen->ShadowFreeList[Xen->ShadowFree]].req.nr_segments = 0;
-    Xen->Shadows[Xen->ShadowFreeList[Xen->ShadowFree]].req.nr_packets = 0;
-    Xen->Shadows[Xen->ShadowFreeList[Xen->ShadowFree]].req.flags = 0;
-    Xen->Shadows[Xen->ShadowFreeList[Xen->ShadowFree]].req.length = 0;
-    return &Xen->Shadows[Xen->ShadowFreeList[Xen->ShadowFree]];
 }
 
 static grant_ref_t
 GetGrantFromFreelist(
     IN PXEN_INTERFACE Xen)
 {
-    UNREFERENCED_PARAMETER(Xen);
-
-    return XenLowerGntTblGetRef();
+    grant_ref_t ref;
+#if DBG
+    if (gFaultInjection.GrantFailEvery &&
+        ((++Xen->FaultGrants % gFaultInjection.GrantFailEvery) == 0))
+    {
+        ref = INVALID_GRANT_REF;
+    }
+    else
+#endif
+    {
+        ref = XenLowerGntTblGetRef();
+    }
+    if (ref == INVALID_GRANT_REF)
+    {
+        Xen->GrantRefFailures++;
+    }
+    return ref;
 }
 
 static BOOLEAN
@@ -879,38 +1308,18 @@ AllocateGrefs(
     IN PPFN_NUMBER pfnArray,
     IN ULONG PagesUsed)
 {
-    ULONG index;
+    XEN_GRANT_OPS grantOps = { Xen };
 
     TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_DEVICE,
             __FUNCTION__ "==> PagesUsed: %d (0x%x)\n", PagesUsed, PagesUsed);
 
-    for (index = 0;
-        index < PagesUsed;
-        index++)
+    if (!UsbifGrantSegments(&shadow->req, pfnArray, PagesUsed, grantOps))
     {
-        PFN_NUMBER pfn = pfnArray[index];
-        grant_ref_t gref = GetGrantFromFreelist(Xen);
-        if (gref == INVALID_GRANT_REF)
-        {
-            TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
-                __FUNCTION__ "GetGrantFromFreelist failed\n");
-            return FALSE;
-        }     
-        shadow->req.gref[shadow->req.nr_segments] = gref;
-
-        XenLowerGntTblGrantAccess(
-            0,
-            (uint32_t) pfn,
-            0,
-            shadow->req.gref[shadow->req.nr_segments]);
-
-        shadow->req.nr_segments++;
-        TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_DEVICE,
-            __FUNCTION__ "Mapped PFN(%d): %d (0x%x)\n", index, pfn, pfn);
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
+            __FUNCTION__ "GetGrantFromFreelist failed (%d failures)\n",
+            Xen->GrantRefFailures);
+        return FALSE;
     }
-
-    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_DEVICE,
-            __FUNCTION__ "<==\n");
     return TRUE;
 }
 
@@ -928,7 +1337,8 @@ AllocateGrefs(
  * @param[in] Mdl. The Mdl for the data page.
  * @param[in] IndirectPageMdl. The MDL for the indirect pages.
  * @param[in] PagesUsed. Number of data pages being transferred.
- * @param[in] PacketPfnArray. Optional. If an Iso packet the first data page is the ISO packets.
+ * @param[in] PacketPfnArray. Optional. If an Iso packet the first data pages are the ISO packets.
+ * @param[in] PacketPages. The number of ISO packet pages in PacketPfnArray.
  * 
  * @returns BOOLEAN success or failure.
  */
@@ -940,115 +1350,74 @@ AllocateIndirectGrefs(
     IN PMDL Mdl,
     IN PMDL IndirectPageMdl,
     IN ULONG PagesUsed,
-    IN PPFN_NUMBER PacketPfnArray)
+    IN PPFN_NUMBER PacketPfnArray,
+    IN ULONG PacketPages)
 {
     ASSERT(Shadow);
     Shadow->req.nr_segments = 0;
     //
     // req.nr_segments is the number of indirect gref pages we need, and that is
     //  ( PagesUsed / 1023 )
-    // 
-    PPFN_NUMBER pfnArray = MmGetMdlPfnArray(IndirectPageMdl);
+    //
+    usbif_indirect_page_t * indirectPages = (usbif_indirect_page_t *) Shadow->indirectPageMemory;
+    ASSERT(indirectPages != NULL);
+    //
+    // PutShadowOnFreelist() walks the granted indirect pages, they must be
+    // valid before the first one is granted.
+    //
+    for (ULONG index = 0; index < IndirectPagesNeeded; index++)
+    {
+        indirectPages[index].nr_segments = 0;
+    }
     //
     // set up the descriptors for the indirect pages in the request.
     //
-    if (!AllocateGrefs(Xen, Shadow, pfnArray, IndirectPagesNeeded))
+    if (!AllocateGrefs(Xen, Shadow, MmGetMdlPfnArray(IndirectPageMdl), IndirectPagesNeeded))
     {
         return FALSE;
     }
     //
     // now build the descriptors for the data pages pointed to
-    // by the indirect pages.
+    // by the indirect pages. The iso packet descriptor pages, if any,
+    // are the first grefs of the first indirect page.
     //
-    usbif_indirect_page_t * indirectPages = (usbif_indirect_page_t *) Shadow->indirectPageMemory;
-    ASSERT(indirectPages != NULL);
+    XEN_GRANT_OPS grantOps = { Xen };
+    ASSERT(!PacketPfnArray || (PacketPages && (PacketPages < INDIRECT_GREF_PAGES)));
+    return UsbifGrantIndirectSegments(indirectPages,
+        IndirectPagesNeeded,
+        PacketPfnArray,
+        PacketPfnArray ? PacketPages : 0,
+        MmGetMdlPfnArray(Mdl),
+        PagesUsed,
+        grantOps) ? TRUE : FALSE;
+}
 
-    ULONG indirectIndex = 0;
-    ULONG indirectArrayIndex = 0;
-    ULONG pfnIndex = 0;
-    pfnArray = MmGetMdlPfnArray(Mdl);
-    indirectPages[0].nr_segments = 0;
+static VOID
+PutRequest(
+    IN PXEN_INTERFACE Xen,
+    usbif_request_t *shadowReq)
+{
+    usbif_request_t *req = UsbifRingPutRequest(&Xen->Ring, shadowReq);
 
-    if (PacketPfnArray)
+    // XXX STUB: print level too high
+    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_DEVICE,
+        __FUNCTION__": req %p index %d id %I64d pipetype %x endpointId %x\n"
+        "           offset %x length %x segments %x flags %x packets %x startframe %x\n",
+        req,
+        Xen->Ring.req_prod_pvt - 1,
+        req->id,
+        req->type,
+        req->endpoint,
+        req->offset,
+        req->length,
+        req->nr_segments,
+        req->flags,
+        req->nr_packets,
+        req->startframe);
+    Xen->RequestsOnRingbuffer++;
+    if (Xen->RequestsOnRingbuffer > Xen->MaxRequestsOnRingbuffer)
     {
-        //
-        // set up the descriptor for the iso packets - it is the first page 
-        // of the first indirect page. We have to fill in pagesUsed + 1 pages;
-        // The first gref of the first page points to the iso packet descriptor page.
-        //
-        indirectPages[0].gref[0] = GetGrantFromFreelist(Xen);
-        if (indirectPages[0].gref[0] == INVALID_GRANT_REF)
-        {
-            return FALSE;
-        }
-        XenLowerGntTblGrantAccess(
-            0,
-            (uint32_t) PacketPfnArray[0], 
-            0, 
-            indirectPages[0].gref[0]);
-
-        indirectPages[0].nr_segments = 1;
-        indirectIndex = 1; 
-    }
-    //
-    // now set up the data grefs.
-    //
-    while ( pfnIndex < PagesUsed )
-    {
-        indirectPages[indirectArrayIndex].gref[indirectIndex] = GetGrantFromFreelist(Xen);
-        if (indirectPages[indirectArrayIndex].gref[indirectIndex]  == INVALID_GRANT_REF)
-        {
-            return FALSE;
-        }
-
-        XenLowerGntTblGrantAccess(          
-            0, 
-            (uint32_t) pfnArray[pfnIndex], 
-            0, 
-            indirectPages[indirectArrayIndex].gref[indirectIndex]);
-        
-        pfnIndex++;
-        indirectPages[indirectArrayIndex].nr_segments++;
-        indirectIndex++;
-        if (indirectIndex == 1023)
-        {
-            indirectArrayIndex++;
-            indirectPages[indirectArrayIndex].nr_segments = 0;
-            indirectIndex = 0;
-        }
-    }
-    return TRUE;
-}
-
-static VOID
-PutRequest(
-    IN PXEN_INTERFACE Xen,
-    usbif_request_t *shadowReq)
-{
-    usbif_request_t *req = RING_GET_REQUEST(&Xen->Ring, Xen->Ring.req_prod_pvt);
-    if (NT_VERIFY(req))
-    {
-        memcpy(req,
-            shadowReq,
-            sizeof(usbif_request_t));
-
-        // XXX STUB: print level too high
-        TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_DEVICE,
-            __FUNCTION__": req %p index %d id %I64d pipetype %x endpointId %x\n"
-            "           offset %x length %x segments %x flags %x packets %x startframe %x\n",
-            req,
-            Xen->Ring.req_prod_pvt,
-            req->id,
-            req->type,
-            req->endpoint,
-            req->offset,
-            req->length,
-            req->nr_segments,
-            req->flags,
-            req->nr_packets,
-            req->startframe);
-        Xen->Ring.req_prod_pvt++;
-        Xen->RequestsOnRingbuffer++;
+        Xen->MaxRequestsOnRingbuffer = Xen->RequestsOnRingbuffer;
     }
 }
 
@@ -1058,7 +1427,15 @@ PutOnRing(
     IN usbif_shadow_ex_t *shadow)
 {
     int notify;
+    shadow->putTime = KeQueryPerformanceCounter(NULL).QuadPart;
+    FlightRecord(Xen->FdoContext, XenvusbFlightPutOnRing, (USHORT) shadow->req.id,
+        shadow->req.endpoint, shadow->req.type, 0, shadow->req.length, 0,
+        shadow->req.startframe);
     PutRequest(Xen, &shadow->req);
+    if (Xen->Capture.Active)
+    {
+        CaptureRequest(Xen, shadow);
+    }
     RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&Xen->Ring, notify);
     // --XT-- Lower context is holding on the the EC port, arg not used.
     XenLowerEvtChnNotify(Xen->XenLower);
@@ -1325,9 +1702,12 @@ PutResetOrCycleUrbOnRing(
         //
         WdfObjectReference(Request);
         fdoContext->ResetInProgress = TRUE;
+        DescriptorCacheFlush(fdoContext);
+        fdoContext->StandardStateValid = FALSE;
+        fdoContext->RemoteWakeupEnabled = FALSE;
 
         uint8_t ResetOrCycle = IsReset ? RESET_TARGET_DEVICE : CYCLE_PORT;
-        shadow->Request = Request;
+        SetShadowRequest(shadow, Request);
         shadow->req.endpoint = 0;
         shadow->req.type = 0;
         shadow->req.length = 0;
@@ -1378,14 +1758,390 @@ PutResetOrCycleUrbOnRing(
     }
 }
 
+/**
+ * @brief asks the backend to cancel one request that is on the ring.
+ * *Must be called with lock held*
+ * The cancelled request is completed by the DPC when its own response
+ * arrives, the response to the cancel message is only traced.
+ *
+ * @returns TRUE if the cancel message is on the ring. FALSE if the backend
+ * does not support it, the request has no shadow, or the ring is too full,
+ * the caller has to abort the pipe instead.
+ */
+_Requires_lock_held_(fdoContext->WdfDevice)
+BOOLEAN
+PutCancelRequestOnRing(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN WDFREQUEST Request)
+{
+    PXEN_INTERFACE Xen = fdoContext->Xen;
+    if (!Xen->CancelRequestSupport)
+    {
+        return FALSE;
+    }
+    ULONG index = RequestGetRequestContext(Request)->ShadowIndex;
+    if ((index >= SHADOW_ENTRIES) ||
+        (Xen->Shadows[index].Request != Request) ||
+        Xen->Shadows[index].isReset)
+    {
+        return FALSE;
+    }
+    //
+    // like any other request leave one shadow for a reset.
+    //
+    if (AvailableRequests(Xen) <= 1)
+    {
+        return FALSE;
+    }
+    usbif_shadow_ex_t *shadow = GetShadowFromFreeList(Xen);
+    if (!shadow)
+    {
+        return FALSE;
+    }
+    shadow->Request = NULL;
+    shadow->req.endpoint = Xen->Shadows[index].req.endpoint;
+    shadow->req.type = 0;
+    shadow->req.length = 0;
+    shadow->req.offset = 0;
+    shadow->req.nr_segments = 0;
+    shadow->req.flags = CANCEL_REQUEST;
+    shadow->allocatedMdl = NULL;
+    shadow->req.setup = Xen->Shadows[index].req.id;
+    shadow->isReset = FALSE;
+    shadow->isCancel = TRUE;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE,
+        __FUNCTION__": %s Request %p cancel id %I64d with id %I64d\n",
+        fdoContext->FrontEndPath,
+        Request,
+        shadow->req.setup,
+        shadow->req.id);
+
+    PutOnRing(Xen, shadow);
+    return TRUE;
+}
+
+/**
+ * @brief finds a request cancelled with PutCancelRequestOnRing() that the
+ * backend has not completed within CANCEL_ON_RING_TIMEOUT.
+ * *Must be called with lock held*
+ * The request is marked CancelTimedOut, from then on the DPC leaves its
+ * response to the pipe abort.
+ *
+ * @returns the request or NULL.
+ */
+_Requires_lock_held_(fdoContext->WdfDevice)
+WDFREQUEST
+GetTimedOutCancelRequest(
+    IN PUSB_FDO_CONTEXT fdoContext)
+{
+    PXEN_INTERFACE Xen = fdoContext->Xen;
+    ULONGLONG now = KeQueryInterruptTime();
+
+    for (ULONG index = 0; index < SHADOW_ENTRIES; index++)
+    {
+        WDFREQUEST Request = Xen->Shadows[index].Request;
+        if (!Xen->Shadows[index].InUse || !Request)
+        {
+            continue;
+        }
+        PFDO_REQUEST_CONTEXT requestContext = RequestGetRequestContext(Request);
+        if (!requestContext->CancelOnRing ||
+            requestContext->CancelTimedOut ||
+            requestContext->RequestCompleted ||
+            ((now - requestContext->CancelOnRingTime) < CANCEL_ON_RING_TIMEOUT))
+        {
+            continue;
+        }
+        requestContext->CancelTimedOut = 1;
+
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
+            __FUNCTION__": %s Request %p id %d no answer to cancel after %I64d ms\n",
+            fdoContext->FrontEndPath,
+            Request,
+            index,
+            (now - requestContext->CancelOnRingTime) / (10 * 1000));
+        return Request;
+    }
+    return NULL;
+}
+
+/**
+ * @brief put an XenUsbdGetCurrentFrame request for SyncFrameClock() on the
+ * ring. It has its own shadow and no data, the backend returns the frame
+ * number in the response data and the DPC passes it to
+ * FrameClockSyncComplete().
+ * *Must be called with lock held*
+ */
+_Requires_lock_held_(fdoContext->WdfDevice)
+NTSTATUS
+PutFrameSyncOnRing(
+    IN PUSB_FDO_CONTEXT fdoContext)
+{
+    PXEN_INTERFACE Xen = fdoContext->Xen;
+    //
+    // like any other request leave one shadow for a reset.
+    //
+    if (AvailableRequests(Xen) <= 1)
+    {
+        return STATUS_DEVICE_BUSY;
+    }
+    usbif_shadow_ex_t *shadow = GetShadowFromFreeList(Xen);
+    if (!shadow)
+    {
+        return STATUS_DEVICE_BUSY;
+    }
+    shadow->Request = NULL;
+    shadow->req.endpoint = USB_ENDPOINT_TYPE_CONTROL | USB_ENDPOINT_DIRECTION_MASK; //!< Control IN
+    shadow->req.type = (uint8_t) XenUsbdGetCurrentFrame;
+    shadow->req.length = 0;
+    shadow->req.offset = 0;
+    shadow->req.nr_segments = 0;
+    shadow->req.flags = REQ_SHORT_PACKET_OK;
+    shadow->allocatedMdl = NULL;
+    shadow->req.setup = 0L;
+    shadow->isReset = FALSE;
+    shadow->isFrameSync = TRUE;
+
+    PutOnRing(Xen, shadow);
+    return STATUS_SUCCESS;
+}
+
 /**
  * @brief Puts a request on the Xen ringbuffer.
  * *Must be called with lock held*
  * *Must Complete, requeue, or put the request on the ringbuffer.*
  * 
+ * @returns STATUS_SUCCESS if the request is now owned by the backend,
+ * otherwise the request has already been completed or requeued.
+ */
+//
+/// park a bulk or interrupt request held back by MaxInFlightPerEndpoint in
+/// the ThrottleQueue. Unlike RequeueRequest() the UrbQueue keeps running.
+/// A request that was released and is held again goes back to the head.
+//
+_Requires_lock_held_(fdoContext->WdfDevice)
+static VOID
+ThrottleRequest(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN WDFREQUEST Request,
+    IN UCHAR EndpointAddress)
+{
+    PFDO_REQUEST_CONTEXT requestContext = RequestGetRequestContext(Request);
+    ULONG index = ENDPOINT_INDEX(EndpointAddress);
+
+    requestContext->Throttled = 1;
+    requestContext->ThrottledEndpoint = EndpointAddress;
+    fdoContext->Xen->EndpointHeld[index]++;
+
+    ReleaseFdoLock(fdoContext);
+    NTSTATUS Status;
+    if (WdfRequestGetIoQueue(Request) != fdoContext->ThrottleQueue)
+    {
+        Status = WdfRequestForwardToIoQueue(Request, fdoContext->ThrottleQueue);
+    }
+    else
+    {
+        Status = WdfRequestRequeue(Request);
+    }
+    AcquireFdoLock(fdoContext);
+
+    if (!NT_SUCCESS(Status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_URB,
+            __FUNCTION__": %s Device %p Error %x holding Request %p for endpoint %x\n",
+            fdoContext->FrontEndPath,
+            fdoContext->WdfDevice,
+            Status,
+            Request,
+            EndpointAddress);
+        ASSERT(fdoContext->Xen->EndpointHeld[index]);
+        fdoContext->Xen->EndpointHeld[index]--;
+        requestContext->Throttled = 0;
+        requestContext->RequestCompleted = 1;
+        ReleaseFdoLock(fdoContext);
+        WdfRequestComplete(Request, Status);
+        AcquireFdoLock(fdoContext);
+    }
+}
+
+/**
+ * @brief submit the requests held in the ThrottleQueue whose endpoints have
+ * room on the ring again, oldest first. A request is not released while an
+ * older one for the same endpoint is still held, so per endpoint order is
+ * kept. EndpointHeld is counted again from the requests left in the queue.
+ * *Will release and re-acquire the device lock.*
+ *
+ * @param[in] fdoContext. The context for the FDO device.
+ */
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+ReleaseThrottledRequests(
+    IN PUSB_FDO_CONTEXT fdoContext)
+{
+    PXEN_INTERFACE Xen = fdoContext->Xen;
+    USHORT held[MAX_ENDPOINT_INDEX];
+    WDFREQUEST previous = NULL;
+    BOOLEAN ringBusy = FALSE;
+    ULONG index;
+
+    for (index = 0; index < MAX_ENDPOINT_INDEX; index++)
+    {
+        if (Xen->EndpointHeld[index])
+        {
+            break;
+        }
+    }
+    if (index == MAX_ENDPOINT_INDEX)
+    {
+        //
+        // nothing held.
+        //
+        return;
+    }
+
+    RtlZeroMemory(held, sizeof(held));
+    for (;;)
+    {
+        WDFREQUEST found;
+        NTSTATUS Status = WdfIoQueueFindRequest(fdoContext->ThrottleQueue,
+            previous,
+            NULL,
+            NULL,
+            &found);
+        if (previous)
+        {
+            WdfObjectDereference(previous);
+            previous = NULL;
+        }
+        if (Status == STATUS_NOT_FOUND)
+        {
+            //
+            // previous was cancelled, start again from the head.
+            //
+            RtlZeroMemory(held, sizeof(held));
+            continue;
+        }
+        if (!NT_SUCCESS(Status))
+        {
+            break;
+        }
+
+        //
+        // MaxInFlightPerEndpoint can be reloaded as 0, unlimited.
+        //
+        index = ENDPOINT_INDEX(RequestGetRequestContext(found)->ThrottledEndpoint);
+        if (!fdoContext->DeviceUnplugged &&
+            (ringBusy ||
+             fdoContext->ResetInProgress ||
+             held[index] ||
+             (fdoContext->MaxInFlightPerEndpoint &&
+              (Xen->EndpointRequests[index] >= fdoContext->MaxInFlightPerEndpoint))))
+        {
+            held[index]++;
+            previous = found;
+            continue;
+        }
+
+        WDFREQUEST Request;
+        Status = WdfIoQueueRetrieveFoundRequest(fdoContext->ThrottleQueue,
+            found,
+            &Request);
+        WdfObjectDereference(found);
+        RtlZeroMemory(held, sizeof(held));
+        if (!NT_SUCCESS(Status))
+        {
+            //
+            // cancelled since it was found.
+            //
+            continue;
+        }
+        if (fdoContext->DeviceUnplugged)
+        {
+            RequestGetRequestContext(Request)->RequestCompleted = 1;
+            ReleaseFdoLock(fdoContext);
+            WdfRequestComplete(Request, STATUS_DEVICE_DOES_NOT_EXIST);
+            AcquireFdoLock(fdoContext);
+            continue;
+        }
+        //
+        // SubmitUrb() can drop the lock. Start again from the head.
+        //
+        fdoContext->RequeuedCount = 0;
+        SubmitUrb(fdoContext, Request, URB_FROM_REQUEST(Request));
+        if (fdoContext->RequeuedCount)
+        {
+            ringBusy = TRUE;
+        }
+    }
+    RtlCopyMemory(Xen->EndpointHeld, held, sizeof(held));
+}
+
+/**
+ * @brief complete the requests held in the ThrottleQueue for an endpoint
+ * that is being aborted.
+ * *Will release and re-acquire the device lock.*
+ *
+ * @param[in] fdoContext. The context for the FDO device.
+ * @param[in] EndpointAddress. The endpoint being aborted.
  */
 _Requires_lock_held_(fdoContext->WdfDevice)
 VOID
+AbortThrottledRequests(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN UCHAR EndpointAddress)
+{
+    WDFREQUEST previous = NULL;
+
+    if (!fdoContext->Xen->EndpointHeld[ENDPOINT_INDEX(EndpointAddress)])
+    {
+        return;
+    }
+    for (;;)
+    {
+        WDFREQUEST found;
+        NTSTATUS Status = WdfIoQueueFindRequest(fdoContext->ThrottleQueue,
+            previous,
+            NULL,
+            NULL,
+            &found);
+        if (previous)
+        {
+            WdfObjectDereference(previous);
+            previous = NULL;
+        }
+        if (Status == STATUS_NOT_FOUND)
+        {
+            continue;
+        }
+        if (!NT_SUCCESS(Status))
+        {
+            break;
+        }
+        if (RequestGetRequestContext(found)->ThrottledEndpoint != EndpointAddress)
+        {
+            previous = found;
+            continue;
+        }
+
+        WDFREQUEST Request;
+        Status = WdfIoQueueRetrieveFoundRequest(fdoContext->ThrottleQueue,
+            found,
+            &Request);
+        WdfObjectDereference(found);
+        if (NT_SUCCESS(Status))
+        {
+            RequestGetRequestContext(Request)->RequestCompleted = 1;
+            ReleaseFdoLock(fdoContext);
+            WdfRequestComplete(Request, STATUS_CANCELLED);
+            AcquireFdoLock(fdoContext);
+        }
+    }
+    fdoContext->Xen->EndpointHeld[ENDPOINT_INDEX(EndpointAddress)] = 0;
+}
+
+_Requires_lock_held_(fdoContext->WdfDevice)
+NTSTATUS
 PutUrbOnRing(
     IN PUSB_FDO_CONTEXT fdoContext,
     IN PWDF_USB_CONTROL_SETUP_PACKET packet,
@@ -1401,12 +2157,14 @@ PutUrbOnRing(
     ULONG pagesUsed  = 0;
     PPFN_NUMBER pfnArray = NULL;
     BOOLEAN mdlAllocated = FALSE;
+    STACK_MDL stackMdl;
     PVOID buffer;
     usbif_shadow_ex_t *shadow = NULL;
     PURB Urb = NULL;
     PMDL IndirectPageMdl = NULL;
     
     NTSTATUS Status = STATUS_UNSUCCESSFUL;
+    LONGLONG timingStart = PathTimingStart(fdoContext);
 
     TRY
     {
@@ -1428,6 +2186,32 @@ PutUrbOnRing(
             Status = STATUS_UNSUCCESSFUL;
             LEAVE;
         }
+        //
+        // usbflags MaxInFlightPerEndpoint: hold back bulk and interrupt
+        // requests for an endpoint that already has enough on the ring, or
+        // that has older requests held, in the ThrottleQueue. The other
+        // endpoints keep going. The DPC releases the held requests as
+        // responses arrive.
+        //
+        BOOLEAN countEndpoint = fdoContext->MaxInFlightPerEndpoint &&
+            ((PipeType == UsbdPipeTypeBulk) || (PipeType == UsbdPipeTypeInterrupt));
+        if (countEndpoint)
+        {
+            PFDO_REQUEST_CONTEXT requestContext = RequestGetRequestContext(Request);
+            ULONG index = ENDPOINT_INDEX(EndpointAddress);
+            BOOLEAN released = requestContext->Throttled ? TRUE : FALSE;
+
+            requestContext->Throttled = 0;
+            if ((fdoContext->Xen->EndpointRequests[index] >= fdoContext->MaxInFlightPerEndpoint) ||
+                (!released && fdoContext->Xen->EndpointHeld[index]))
+            {
+                fdoContext->totalEndpointThrottles++;
+                ThrottleRequest(fdoContext, Request, EndpointAddress);
+                Request = NULL;
+                Status = STATUS_UNSUCCESSFUL;
+                LEAVE;
+            }
+        }
 
         Urb = (PURB) URB_FROM_IRP(WdfRequestWdmGetIrp(Request));  
 
@@ -1486,21 +2270,15 @@ PutUrbOnRing(
             else if (buffer)
             {
                 //
-                // we have to allocate it
+                // we have to build it
                 //
-                Mdl = IoAllocateMdl(
+                Mdl = BuildTransferMdl(fdoContext->Xen,
                     buffer,
                     transferLength,
-                    FALSE,
-                    FALSE,
-                    NULL);
+                    &stackMdl,
+                    &mdlAllocated);
 
-                if (Mdl)
-                {
-                    MmBuildMdlForNonPagedPool(Mdl);
-                    mdlAllocated = TRUE;
-                }
-                else
+                if (!Mdl)
                 {
                     TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
                         __FUNCTION__": %s cannot allocate mdl for transfer\n",
@@ -1558,13 +2336,9 @@ PutUrbOnRing(
                 
                 ULONG indirectPagesNeeded = INDIRECT_PAGES_REQUIRED(pagesUsed );
                 ASSERT(indirectPagesNeeded <= MAX_INDIRECT_PAGES);
-#pragma warning(push)
-#pragma warning(disable: 28197)
-                shadow->indirectPageMemory = ExAllocatePoolWithTag(
-                    NonPagedPool,
-                    (PAGE_SIZE * indirectPagesNeeded),
+                shadow->indirectPageMemory = AllocateTransientPages(fdoContext->Xen,
+                    indirectPagesNeeded,
                     XVUC);
-#pragma warning(pop)
 
                 if (!shadow->indirectPageMemory )
                 {
@@ -1576,6 +2350,7 @@ PutUrbOnRing(
                     Status = STATUS_INSUFFICIENT_RESOURCES;
                     LEAVE;
                 }           
+                shadow->indirectPages = (UCHAR) indirectPagesNeeded;
                 RtlZeroMemory(shadow->indirectPageMemory, (PAGE_SIZE * indirectPagesNeeded));
 
                 IndirectPageMdl = IoAllocateMdl(shadow->indirectPageMemory,
@@ -1601,7 +2376,8 @@ PutUrbOnRing(
                     Mdl,
                     IndirectPageMdl,
                     pagesUsed,
-                    NULL))
+                    NULL,
+                    0))
                 {
                     TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
                         __FUNCTION__": %s AllocateIndirectGrefs failed\n",
@@ -1652,7 +2428,7 @@ PutUrbOnRing(
         Status = STATUS_SUCCESS;
 
         shadow->isReset = FALSE;
-        shadow->Request = Request;
+        SetShadowRequest(shadow, Request);
         ASSERT(Urb->UrbHeader.Function < 0x100);
         shadow->req.endpoint = EndpointAddress;
         shadow->req.type = (uint8_t) PipeType;
@@ -1660,6 +2436,7 @@ PutUrbOnRing(
         ASSERT(offset < 0x00010000);
         shadow->req.offset = (uint16_t) offset;
         shadow->allocatedMdl = mdlAllocated ? Mdl : NULL; // remember we allocated this mdl.
+        shadow->mdlAllocated = mdlAllocated;
         shadow->isoPacketDescriptor = NULL;
         RtlCopyMemory(&shadow->req.setup, packet, sizeof(shadow->req.setup));
 
@@ -1673,6 +2450,11 @@ PutUrbOnRing(
         {
             fdoContext->totalDirectTransfers++;
         }
+        if (countEndpoint)
+        {
+            fdoContext->Xen->EndpointRequests[ENDPOINT_INDEX(EndpointAddress)]++;
+            shadow->endpointCounted = TRUE;
+        }
 
         PutOnRing(fdoContext->Xen, shadow);
         //
@@ -1691,6 +2473,7 @@ PutUrbOnRing(
         {
             IoFreeMdl(IndirectPageMdl);
         }
+        ReleaseTransferMdl(fdoContext->Xen, Mdl);
         if (Status != STATUS_SUCCESS)
         {
             if (shadow)
@@ -1727,7 +2510,8 @@ PutUrbOnRing(
         {
             ASSERT(Request == NULL);
         }
-        return;
+        PathTimingStop(fdoContext, XenvusbPathPutUrbOnRing, timingStart);
+        return Status;
     }
 }
 
@@ -1735,13 +2519,17 @@ PutUrbOnRing(
 //
 // Must be called with device lock held
 //
+// FastSlot is set for FdoSubmitIsoOutUrb() transfers. There is no Request,
+// the slot supplies the shadow and the packet page, and the caller
+// completes the slot if this fails.
 //
 _Requires_lock_held_(fdoContext->WdfDevice)
-VOID
+NTSTATUS
 PutIsoUrbOnRing(
     IN PUSB_FDO_CONTEXT fdoContext,
     IN PWDF_USB_CONTROL_SETUP_PACKET packet,
     IN WDFREQUEST Request,
+    IN PISO_FAST_SLOT FastSlot,
     IN UCHAR EndpointAddress,
     IN BOOLEAN transferAsap,
     IN BOOLEAN ShortOK) 
@@ -1752,8 +2540,10 @@ PutIsoUrbOnRing(
     ULONG pagesUsed  = 0;
     PPFN_NUMBER pfnArray = NULL;
     BOOLEAN mdlAllocated = FALSE;
+    STACK_MDL stackMdl;
     PVOID buffer;
     ULONG numberOfPackets;
+    ULONG packetPages = 0;
     iso_packet_info * packetBuffer = NULL;
     PMDL packetMdl = NULL; 
     usbif_shadow_ex_t *shadow = NULL;
@@ -1763,24 +2553,49 @@ PutIsoUrbOnRing(
     // reserve one request for cancellation of all requests
     // 
     NTSTATUS Status = STATUS_UNSUCCESSFUL;
+    LONGLONG timingStart = PathTimingStart(fdoContext);
 
     TRY
     {
-        if (!Request)
+        if (FastSlot)
+        {
+            Urb = FastSlot->Urb;
+        }
+        else if (Request)
+        {
+            Urb = (PURB) URB_FROM_IRP(WdfRequestWdmGetIrp(Request));
+        }
+        else
         {
             LEAVE;
         }        
-        Urb = (PURB) URB_FROM_IRP(WdfRequestWdmGetIrp(Request));
 
-        if (AvailableRequests(fdoContext->Xen) <= 1)
+        if (FastSlot)
         {
-            RequeueRequest(fdoContext, Request);
-            Request = NULL;
-            Status = STATUS_UNSUCCESSFUL;
-            LEAVE;
+            //
+            // the reservation guarantees a shadow for every slot.
+            //
+            ASSERT(fdoContext->Xen->ReservedShadows);
+            shadow = fdoContext->Xen->ReservedShadows ?
+                GetShadowFromFreeList(fdoContext->Xen) : NULL;
+            if (shadow)
+            {
+                fdoContext->Xen->ReservedShadows--;
+                shadow->isoFastSlot = FastSlot;
+            }
         }
+        else
+        {
+            if (AvailableRequests(fdoContext->Xen) <= 1)
+            {
+                RequeueRequest(fdoContext, Request);
+                Request = NULL;
+                Status = STATUS_UNSUCCESSFUL;
+                LEAVE;
+            }
 
-        shadow = GetShadowFromFreeList(fdoContext->Xen);
+            shadow = GetShadowFromFreeList(fdoContext->Xen);
+        }
         ASSERT(shadow);
         if (!shadow)
         {
@@ -1794,33 +2609,52 @@ PutIsoUrbOnRing(
 
         transferLength = Urb->UrbIsochronousTransfer.TransferBufferLength;
         numberOfPackets = Urb->UrbIsochronousTransfer.NumberOfPackets; 
+        packetPages = ISO_PACKET_PAGES(numberOfPackets);
 
-        packetBuffer = (iso_packet_info *)  ExAllocatePoolWithTag(NonPagedPool,
-            PAGE_SIZE, XVUD);
-
-        if (!packetBuffer)
+        if (FastSlot)
         {
-            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
-                __FUNCTION__": %s packet buffer allocation failed\n",
-                fdoContext->FrontEndPath);
+            if (packetPages > 1)
+            {
+                TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
+                    __FUNCTION__": %s %d packets do not fit the slot packet page\n",
+                    fdoContext->FrontEndPath,
+                    numberOfPackets);
 
-            Status = STATUS_UNSUCCESSFUL;
-            LEAVE;
+                Status = STATUS_INVALID_PARAMETER;
+                LEAVE;
+            }
+            packetBuffer = (iso_packet_info *) FastSlot->PacketBuffer;
+            packetMdl = FastSlot->PacketMdl;
         }
-
-        packetMdl = IoAllocateMdl(packetBuffer,
-            PAGE_SIZE,
-            FALSE,
-            FALSE,
-            NULL);
-        if (!packetMdl)
+        else
         {
-            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
-                __FUNCTION__": %s packet buffer mdl allocation failed\n",
-                fdoContext->FrontEndPath);
-            LEAVE;
+            packetBuffer = (iso_packet_info *) AllocateTransientPages(fdoContext->Xen,
+                packetPages, XVUD);
+
+            if (!packetBuffer)
+            {
+                TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
+                    __FUNCTION__": %s packet buffer allocation failed\n",
+                    fdoContext->FrontEndPath);
+
+                Status = STATUS_UNSUCCESSFUL;
+                LEAVE;
+            }
+
+            packetMdl = IoAllocateMdl(packetBuffer,
+                PAGE_SIZE * packetPages,
+                FALSE,
+                FALSE,
+                NULL);
+            if (!packetMdl)
+            {
+                TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
+                    __FUNCTION__": %s packet buffer mdl allocation failed\n",
+                    fdoContext->FrontEndPath);
+                LEAVE;
+            }
+            MmBuildMdlForNonPagedPool(packetMdl);
         }
-        MmBuildMdlForNonPagedPool(packetMdl);
         //
         // set up the transfer the packet descriptors 
         //
@@ -1870,21 +2704,15 @@ PutIsoUrbOnRing(
         else if (buffer && !Mdl)
         {
             //
-            // we have to allocate it
+            // we have to build it
             //
-            Mdl = IoAllocateMdl(
+            Mdl = BuildTransferMdl(fdoContext->Xen,
                 buffer,
                 transferLength,
-                FALSE,
-                FALSE,
-                NULL);
+                &stackMdl,
+                &mdlAllocated);
 
-            if (Mdl)
-            {
-                MmBuildMdlForNonPagedPool(Mdl);            
-                mdlAllocated = TRUE;
-            }
-            else
+            if (!Mdl)
             {
                 TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
                     __FUNCTION__": %s cannot allocate mdl for transfer\n",
@@ -1917,35 +2745,34 @@ PutIsoUrbOnRing(
             MmGetMdlVirtualAddress(Mdl), 
             transferLength);
 
-        if (pagesUsed > MaxIsoSegments(fdoContext->Xen))
+        if ((pagesUsed > MaxIsoSegments(fdoContext->Xen)) ||
+            (packetPages > 1))
         {
             //
             // indirect gref required.
+            // Multi-page packet descriptor arrays are only ever passed indirectly.
             //
-            if (pagesUsed > MAX_PAGES_FOR_INDIRECT_ISO_REQUEST)
+            if ((pagesUsed + packetPages) > MAX_PAGES_FOR_INDIRECT_REQUEST)
             {
                 //
                 // this should never happen.
                 //
                 TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
-                    __FUNCTION__": %s pagesUsed: %d greater than MAX_INDIRECT_PAGES %d\n",
+                    __FUNCTION__": %s pagesUsed: %d packet pages %d greater than MAX_PAGES_FOR_INDIRECT_REQUEST %d\n",
                     fdoContext->FrontEndPath,
                     pagesUsed,
-                    MAX_PAGES_FOR_INDIRECT_ISO_REQUEST);
+                    packetPages,
+                    MAX_PAGES_FOR_INDIRECT_REQUEST);
 
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 LEAVE;
             }
 
-            ULONG indirectPagesNeeded = INDIRECT_PAGES_REQUIRED(pagesUsed + 1); // + 1 for the iso packet page
+            ULONG indirectPagesNeeded = INDIRECT_PAGES_REQUIRED(pagesUsed + packetPages); // + the iso packet pages
             ASSERT(indirectPagesNeeded <= MAX_INDIRECT_PAGES);
-#pragma warning(push)
-#pragma warning(disable: 28197)
-            shadow->indirectPageMemory = ExAllocatePoolWithTag(
-                NonPagedPool,
-                (PAGE_SIZE * indirectPagesNeeded),
+            shadow->indirectPageMemory = AllocateTransientPages(fdoContext->Xen,
+                indirectPagesNeeded,
                 XVUE);
-#pragma warning(pop)
 
             if (!shadow->indirectPageMemory)
             {
@@ -1957,6 +2784,7 @@ PutIsoUrbOnRing(
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 LEAVE;
             }           
+            shadow->indirectPages = (UCHAR) indirectPagesNeeded;
             RtlZeroMemory(shadow->indirectPageMemory, (PAGE_SIZE * indirectPagesNeeded));
 
             IndirectPageMdl = IoAllocateMdl(shadow->indirectPageMemory,
@@ -1982,42 +2810,50 @@ PutIsoUrbOnRing(
                 Mdl,
                 IndirectPageMdl,
                 pagesUsed,
-                packetPfnArray))
+                packetPfnArray,
+                packetPages))
             {
                 Status = STATUS_INSUFFICIENT_RESOURCES;
                 LEAVE;
             }
-            //
-            // If we get here this request is going to DOM0.
-            // Mark the request as cancelable, unfortunately this step can fail.
-            //
-            Status = WdfRequestMarkCancelableEx(Request,
-                EvtFdoOnHardwareRequestCancelled);
-
-            if (!NT_SUCCESS(Status))
+            if (Request)
             {
-                TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
-                    __FUNCTION__": Device %p Request %p WdfRequestMarkCancelableEx error %x\n",
-                    fdoContext->WdfDevice,
-                    Request,
-                    Status);
                 //
-                // we own the request. Cleanup and complete below.
+                // If we get here this request is going to DOM0.
+                // Mark the request as cancelable, unfortunately this step can fail.
                 //
-                LEAVE;
+                Status = WdfRequestMarkCancelableEx(Request,
+                    EvtFdoOnHardwareRequestCancelled);
+
+                if (!NT_SUCCESS(Status))
+                {
+                    TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
+                        __FUNCTION__": Device %p Request %p WdfRequestMarkCancelableEx error %x\n",
+                        fdoContext->WdfDevice,
+                        Request,
+                        Status);
+                    //
+                    // we own the request. Cleanup and complete below.
+                    //
+                    LEAVE;
+                }
+                RequestGetRequestContext(Request)->CancelSet = 1; 
+                //
+                // Add a reference to the Request when it is going to the ringbuffer.
+                //
+                WdfObjectReference(Request);
+            }
+            else
+            {
+                Status = STATUS_SUCCESS;
             }
-            RequestGetRequestContext(Request)->CancelSet = 1; 
-            //
-            // Add a reference to the Request when it is going to the ringbuffer.
-            //
-            WdfObjectReference(Request);
 
             //
             // Use INDIRECT_GREF
             //
 
             shadow->isReset = FALSE;
-            shadow->Request = Request;
+            SetShadowRequest(shadow, Request);
             shadow->req.endpoint = EndpointAddress;
             shadow->req.type = (uint8_t) UsbdPipeTypeIsochronous;
             shadow->req.length = (usbif_request_len_t) transferLength;
@@ -2029,8 +2865,10 @@ PutIsoUrbOnRing(
             shadow->req.nr_packets = (uint16_t) numberOfPackets;
             shadow->req.startframe = Urb->UrbIsochronousTransfer.StartFrame;
             shadow->isoPacketDescriptor = packetBuffer;
+            shadow->isoPacketPages = FastSlot ? 0 : (UCHAR) packetPages;
 
             shadow->allocatedMdl = mdlAllocated ? Mdl : NULL;
+            shadow->mdlAllocated = mdlAllocated;
             RtlCopyMemory(&shadow->req.setup, packet, sizeof(shadow->req.setup));
             fdoContext->totalIndirectTransfers++;
 
@@ -2068,35 +2906,42 @@ PutIsoUrbOnRing(
                 Request);
             LEAVE;
         }
-        //
-        // If we get here this request is going to DOM0.
-        // Mark the request as cancelable, unfortunately this step can fail.
-        //        
-        Status = WdfRequestMarkCancelableEx(Request,
-            EvtFdoOnHardwareRequestCancelled);
-
-        if (!NT_SUCCESS(Status))
+        if (Request)
         {
-            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
-                __FUNCTION__": Device %p Request %p WdfRequestMarkCancelableEx error %x\n",
-                fdoContext->WdfDevice,
-                Request,
-                Status);
             //
-            // we own the request. Cleanup and complete below.
+            // If we get here this request is going to DOM0.
+            // Mark the request as cancelable, unfortunately this step can fail.
+            //        
+            Status = WdfRequestMarkCancelableEx(Request,
+                EvtFdoOnHardwareRequestCancelled);
+
+            if (!NT_SUCCESS(Status))
+            {
+                TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
+                    __FUNCTION__": Device %p Request %p WdfRequestMarkCancelableEx error %x\n",
+                    fdoContext->WdfDevice,
+                    Request,
+                    Status);
+                //
+                // we own the request. Cleanup and complete below.
+                //
+                LEAVE;
+            }
+            RequestGetRequestContext(Request)->CancelSet = 1; 
             //
-            LEAVE;
+            // Add a reference to the Request when it is going to the ringbuffer.
+            //
+            WdfObjectReference(Request);
+        }
+        else
+        {
+            Status = STATUS_SUCCESS;
         }
-        RequestGetRequestContext(Request)->CancelSet = 1; 
-        //
-        // Add a reference to the Request when it is going to the ringbuffer.
-        //
-        WdfObjectReference(Request);
         //
         // payload fits directly into the xen usb request.
         //
         shadow->isReset = FALSE;
-        shadow->Request = Request;
+        SetShadowRequest(shadow, Request);
         ASSERT(Urb->UrbHeader.Function < 0x100);
         shadow->req.endpoint = EndpointAddress;
         shadow->req.type = (uint8_t) UsbdPipeTypeIsochronous;
@@ -2108,8 +2953,10 @@ PutIsoUrbOnRing(
         shadow->req.nr_packets = (uint16_t) numberOfPackets;
         shadow->req.startframe = Urb->UrbIsochronousTransfer.StartFrame;
         shadow->isoPacketDescriptor = packetBuffer;
+        shadow->isoPacketPages = FastSlot ? 0 : (UCHAR) packetPages;
 
         shadow->allocatedMdl = mdlAllocated ? Mdl : NULL;
+        shadow->mdlAllocated = mdlAllocated;
 
         RtlCopyMemory(&shadow->req.setup, packet, sizeof(shadow->req.setup));
         TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_DEVICE,
@@ -2135,10 +2982,11 @@ PutIsoUrbOnRing(
         {
             IoFreeMdl(IndirectPageMdl);
         }
-        if (packetMdl)
+        if (packetMdl && !FastSlot)
         {                
             IoFreeMdl(packetMdl);
         }
+        ReleaseTransferMdl(fdoContext->Xen, Mdl);
 
         if (Status != STATUS_SUCCESS)
         {
@@ -2149,9 +2997,9 @@ PutIsoUrbOnRing(
             }
             else
             {
-                if (packetBuffer)
+                if (packetBuffer && !FastSlot)
                 {
-                    ExFreePool(packetBuffer); 
+                    FreeTransientPages(fdoContext->Xen, packetBuffer, packetPages);
                 } 
                 if (mdlAllocated)
                 {
@@ -2183,53 +3031,502 @@ PutIsoUrbOnRing(
         { 
             ASSERT(Request == NULL);
         }
+        PathTimingStop(fdoContext, XenvusbPathPutIsoUrbOnRing, timingStart);
+        return Status;
+    }
+}
+
+//
+// --XT-- Removed ISR and DPC processing.
+//
+
+static void
+TraceUsbIfRequest(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN usbif_request_t * request)
+{
+    WDF_USB_CONTROL_SETUP_PACKET packet;
+    RtlCopyMemory(&packet, &request->setup, sizeof(packet));
+    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_URB,
+        "%s Device %p usbif_request %p\n"
+        "  id %x type %x endpoint %x\n"
+        "  offset %x length %x nr_segments %x\n"
+        "  flags %x nr_packets %x startframe %x\n"
+        "  bm %x brequest %x wValue %x wIndex %x wLength %x\n",
+        fdoContext->FrontEndPath, fdoContext->WdfDevice, request,
+        request->id, request->type, request->endpoint,
+        request->offset, request->length, request->nr_segments,
+        request->flags, request->nr_packets, request->startframe,
+        packet.Packet.bm.Byte, packet.Packet.bRequest,
+        packet.Packet.wValue.Value, packet.Packet.wIndex.Value,
+        packet.Packet.wLength);
+}
+
+//
+// usbflags PollMode: spin briefly for responses that are about to arrive
+// rather than rearming the event channel and taking another interrupt and DPC.
+//
+static BOOLEAN
+PollForResponses(
+    IN PXEN_INTERFACE Xen)
+{
+    for (ULONG microseconds = 0; microseconds < XEN_POLL_MICROSECONDS; microseconds++)
+    {
+        KeMemoryBarrier();
+        if (RING_HAS_UNCONSUMED_RESPONSES(&Xen->Ring))
+        {
+            return TRUE;
+        }
+        KeStallExecutionProcessor(1);
+    }
+    return FALSE;
+}
+
+
+//
+// usbif capture. Records are written to the capture buffer under the FDO
+// lock and removed by XenCaptureRead(). A record never wraps, the space
+// left at the end of the buffer is skipped.
+//
+static BOOLEAN
+CaptureDirectionIn(
+    IN usbif_request_t *req)
+{
+    if (req->type == UsbdPipeTypeControl)
+    {
+        //
+        // bmRequestType has the direction in the same bit.
+        //
+        return USB_ENDPOINT_DIRECTION_IN(((PUCHAR) &req->setup)[0]) ? TRUE : FALSE;
+    }
+    return USB_ENDPOINT_DIRECTION_IN(req->endpoint) ? TRUE : FALSE;
+}
+
+static PUCHAR
+CaptureData(
+    IN PXEN_INTERFACE Xen,
+    IN usbif_shadow_ex_t *shadow)
+{
+    PURB Urb = NULL;
+    if (shadow->isReset)
+    {
+        return NULL;
+    }
+    if (shadow->isoFastSlot)
+    {
+        Urb = shadow->isoFastSlot->Urb;
+    }
+    else if (shadow->Request)
+    {
+        Urb = URB_FROM_REQUEST(shadow->Request);
+    }
+    else
+    {
+        return (PUCHAR) Xen->FdoContext->ScratchPad.Buffer;
+    }
+    //
+    // the same layout for every URB that goes to the ringbuffer.
+    //
+    if (Urb->UrbBulkOrInterruptTransfer.TransferBufferMDL)
+    {
+        return (PUCHAR) MmGetSystemAddressForMdlSafe(
+            Urb->UrbBulkOrInterruptTransfer.TransferBufferMDL,
+            NormalPagePriority);
+    }
+    return (PUCHAR) Urb->UrbBulkOrInterruptTransfer.TransferBuffer;
+}
+
+_Requires_lock_held_(Xen->FdoContext->WdfDevice)
+static VOID
+CaptureMessage(
+    IN PXEN_INTERFACE Xen,
+    IN XENVUSB_CAPTURE_KIND Kind,
+    IN PVOID Message,
+    IN USHORT MessageLength,
+    IN PUCHAR Data,
+    IN ULONG DataLength)
+{
+    XEN_CAPTURE * capture = &Xen->Capture;
+    ULONG payload = Data ? min(DataLength, capture->PayloadLimit) : 0;
+    ULONG recordLength = (ULONG) ALIGN_UP_BY(sizeof(XENVUSB_CAPTURE_RECORD) + MessageLength + payload, 8);
+    ULONG toEnd = CAPTURE_BUFFER_SIZE - capture->Head;
+    ULONG needed = (recordLength > toEnd) ? recordLength + toEnd : recordLength;
+
+    if (capture->Used + needed > CAPTURE_BUFFER_SIZE)
+    {
+        capture->Dropped++;
+        return;
+    }
+    if (recordLength > toEnd)
+    {
+        if (toEnd >= sizeof(XENVUSB_CAPTURE_RECORD))
+        {
+            PXENVUSB_CAPTURE_RECORD pad = (PXENVUSB_CAPTURE_RECORD) &capture->Buffer[capture->Head];
+            RtlZeroMemory(pad, sizeof(XENVUSB_CAPTURE_RECORD));
+            pad->RecordLength = toEnd;
+            pad->Kind = XenvusbCaptureNone;
+        }
+        capture->Used += toEnd;
+        capture->Head = 0;
+    }
+
+    PUCHAR buffer = &capture->Buffer[capture->Head];
+    PXENVUSB_CAPTURE_RECORD record = (PXENVUSB_CAPTURE_RECORD) buffer;
+    RtlZeroMemory(record, recordLength);
+    record->RecordLength = recordLength;
+    record->Kind = (UCHAR) Kind;
+    record->MessageLength = MessageLength;
+    record->Timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+    record->PayloadLength = payload;
+    record->OriginalLength = DataLength;
+    buffer += sizeof(XENVUSB_CAPTURE_RECORD);
+    RtlCopyMemory(buffer, Message, MessageLength);
+    if (payload)
+    {
+        RtlCopyMemory(buffer + MessageLength, Data, payload);
+    }
+
+    capture->Head += recordLength;
+    if (capture->Head == CAPTURE_BUFFER_SIZE)
+    {
+        capture->Head = 0;
+    }
+    capture->Used += recordLength;
+}
+
+_Requires_lock_held_(Xen->FdoContext->WdfDevice)
+static VOID
+CaptureRequest(
+    IN PXEN_INTERFACE Xen,
+    IN usbif_shadow_ex_t *shadow)
+{
+    PUCHAR data = NULL;
+    if (shadow->req.length && !CaptureDirectionIn(&shadow->req))
+    {
+        data = CaptureData(Xen, shadow);
+    }
+    CaptureMessage(Xen, XenvusbCaptureRequest,
+        &shadow->req, sizeof(usbif_request_t),
+        data, shadow->req.length);
+}
+
+_Requires_lock_held_(Xen->FdoContext->WdfDevice)
+static VOID
+CaptureResponse(
+    IN PXEN_INTERFACE Xen,
+    IN usbif_shadow_ex_t *shadow,
+    IN usbif_response_t *response)
+{
+    PUCHAR data = NULL;
+    ULONG length = 0;
+    if (CaptureDirectionIn(&shadow->req))
+    {
+        //
+        // bytesTransferred is the error count for isoch responses.
+        //
+        length = (shadow->req.type == UsbdPipeTypeIsochronous) ?
+            shadow->req.length : min(response->bytesTransferred, shadow->req.length);
+        if (length)
+        {
+            data = CaptureData(Xen, shadow);
+        }
+    }
+    CaptureMessage(Xen, XenvusbCaptureResponse,
+        response, sizeof(usbif_response_t),
+        data, length);
+}
+
+/**
+ * @brief start or stop capturing the usbif message stream.
+ * Starting discards any unread records.
+ * IRQL <= DISPATCH_LEVEL
+ *
+ * @param[in] Xen. The Xen interface context.
+ * @param[in] Enable. TRUE to start, FALSE to stop.
+ * @param[in] PayloadLimit. Data bytes captured per message, 0 unless
+ * XENVUSB_CAPTURE_PAYLOAD.
+ *
+ * @returns NTSTATUS value indicating success or failure.
+ */
+NTSTATUS
+XenCaptureControl(
+    IN PXEN_INTERFACE Xen,
+    IN BOOLEAN Enable,
+    IN ULONG PayloadLimit)
+{
+    PUCHAR buffer = NULL;
+    if (Enable && PayloadLimit && !XENVUSB_CAPTURE_PAYLOAD)
+    {
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE,
+            __FUNCTION__": %s payload limit %d, payload capture is not in this build\n",
+            Xen->FdoContext->FrontEndPath,
+            PayloadLimit);
+        return STATUS_NOT_SUPPORTED;
+    }
+    if (Enable && !Xen->Capture.Buffer)
+    {
+        buffer = (PUCHAR) ExAllocatePoolWithTag(NonPagedPool,
+            CAPTURE_BUFFER_SIZE, XVUM);
+        if (!buffer)
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
+                __FUNCTION__": %s ExAllocatePoolWithTag failed\n",
+                Xen->FdoContext->FrontEndPath);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    AcquireFdoLock(Xen->FdoContext);
+    if (buffer && !Xen->Capture.Buffer)
+    {
+        Xen->Capture.Buffer = buffer;
+        buffer = NULL;
+    }
+    if (Enable)
+    {
+        Xen->Capture.Head = 0;
+        Xen->Capture.Tail = 0;
+        Xen->Capture.Used = 0;
+        Xen->Capture.Dropped = 0;
+        Xen->Capture.PayloadLimit = min(PayloadLimit, XENVUSB_CAPTURE_MAX_PAYLOAD);
+    }
+    Xen->Capture.Active = Enable;
+    ReleaseFdoLock(Xen->FdoContext);
+
+    if (buffer)
+    {
+        ExFreePool(buffer);
+    }
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE,
+        __FUNCTION__": %s capture %s payload limit %d\n",
+        Xen->FdoContext->FrontEndPath,
+        Enable ? "started" : "stopped",
+        Xen->Capture.PayloadLimit);
+
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief remove captured records.
+ * IRQL <= DISPATCH_LEVEL
+ *
+ * @param[in] Xen. The Xen interface context.
+ * @param[out] Header. The output buffer, records are copied after the header.
+ * @param[in] OutputLength. The size of the output buffer, at least sizeof(XENVUSB_CAPTURE_HEADER).
+ *
+ * @returns the number of bytes written to the output buffer.
+ */
+ULONG
+XenCaptureRead(
+    IN PXEN_INTERFACE Xen,
+    OUT PXENVUSB_CAPTURE_HEADER Header,
+    IN ULONG OutputLength)
+{
+    XEN_CAPTURE * capture = &Xen->Capture;
+    PUCHAR output = (PUCHAR) (Header + 1);
+    ULONG space = OutputLength - sizeof(XENVUSB_CAPTURE_HEADER);
+    ULONG copied = 0;
+
+    AcquireFdoLock(Xen->FdoContext);
+    while (capture->Used)
+    {
+        ULONG toEnd = CAPTURE_BUFFER_SIZE - capture->Tail;
+        if (toEnd < sizeof(XENVUSB_CAPTURE_RECORD))
+        {
+            capture->Used -= toEnd;
+            capture->Tail = 0;
+            continue;
+        }
+        PXENVUSB_CAPTURE_RECORD record = (PXENVUSB_CAPTURE_RECORD) &capture->Buffer[capture->Tail];
+        if (record->Kind != XenvusbCaptureNone)
+        {
+            if (record->RecordLength > space - copied)
+            {
+                break;
+            }
+            RtlCopyMemory(output + copied, record, record->RecordLength);
+            copied += record->RecordLength;
+        }
+        capture->Tail += record->RecordLength;
+        if (capture->Tail == CAPTURE_BUFFER_SIZE)
+        {
+            capture->Tail = 0;
+        }
+        capture->Used -= record->RecordLength;
     }
+    Header->Version = XENVUSB_CAPTURE_VERSION;
+    Header->Length = copied;
+    Header->Frequency = Xen->PerformanceFrequency;
+    Header->Dropped = capture->Dropped;
+    Header->Active = capture->Active;
+    ReleaseFdoLock(Xen->FdoContext);
+
+    return sizeof(XENVUSB_CAPTURE_HEADER) + copied;
+}
+
+#if DBG
+static VOID
+FaultTimerDpc(
+    IN PKDPC Dpc,
+    IN PVOID DeferredContext,
+    IN PVOID SystemArgument1,
+    IN PVOID SystemArgument2)
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+    XenScheduleDPC((PXEN_INTERFACE) DeferredContext);
 }
 
 //
-// --XT-- Removed ISR and DPC processing.
+// gFaultInjection.ResponseDelayUs: a response is not handled until its
+// request has been on the ring that long. A response that is not yet due
+// stays on the ring, and FaultTimer reruns the DPC, rather than spinning
+// at DISPATCH_LEVEL.
 //
+static BOOLEAN
+ResponseFaultDue(
+    IN PXEN_INTERFACE Xen,
+    IN usbif_shadow_ex_t *shadow)
+{
+    if (!gFaultInjection.ResponseDelayUs || !Xen->PerformanceFrequency)
+    {
+        return TRUE;
+    }
+    LONGLONG elapsedUs = ((KeQueryPerformanceCounter(NULL).QuadPart - shadow->putTime) * 1000000) /
+        Xen->PerformanceFrequency;
+    if (elapsedUs >= (LONGLONG) gFaultInjection.ResponseDelayUs)
+    {
+        return TRUE;
+    }
+    LARGE_INTEGER dueTime;
+    dueTime.QuadPart = -10 * ((LONGLONG) gFaultInjection.ResponseDelayUs - elapsedUs);
+    KeSetTimer(&Xen->FaultTimer, dueTime, &Xen->FaultDpc);
+    return FALSE;
+}
 
-static usbif_response_t *
-GetResponse(
+//
+// gFaultInjection: make a response look failed. Only the DPC's private
+// copy of the response is rewritten, never the shared ring.
+//
+static VOID
+InjectResponseFault(
     IN PXEN_INTERFACE Xen,
-    IN int index)
+    IN OUT usbif_response_t *responseCopy)
 {
-    usbif_response_t * rsp = RING_GET_RESPONSE(&Xen->Ring, index);
-    if (NT_VERIFY(rsp))
+    if (!gFaultInjection.StallEvery && !gFaultInjection.DeviceRemovedEvery)
     {
-        TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_DPC,
-            __FUNCTION__": %p id %I64d status %x bytesTransferred %x\n",
-            rsp,
-            rsp->id,
-            rsp->status,
-            rsp->bytesTransferred);
+        return;
+    }
+    Xen->FaultResponses++;
+    if (gFaultInjection.DeviceRemovedEvery &&
+        ((Xen->FaultResponses % gFaultInjection.DeviceRemovedEvery) == 0))
+    {
+        responseCopy->status = USBIF_RSP_USB_DEVRMVD;
+        responseCopy->bytesTransferred = 0;
+    }
+    else if (gFaultInjection.StallEvery &&
+        ((Xen->FaultResponses % gFaultInjection.StallEvery) == 0))
+    {
+        responseCopy->status = USBIF_RSP_USB_STALLED;
+        responseCopy->bytesTransferred = 0;
     }
-    return rsp;
 }
+#endif
 
-static void
-TraceUsbIfRequest(
-    IN PUSB_FDO_CONTEXT fdoContext,
-    IN usbif_request_t * request)
+//
+// log2 bucket, see XENVUSB_HISTOGRAM_BUCKETS.
+//
+static __forceinline ULONG
+HistogramBucket(
+    IN ULONGLONG Value)
 {
-    WDF_USB_CONTROL_SETUP_PACKET packet;
-    RtlCopyMemory(&packet, &request->setup, sizeof(packet));
-    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_URB,
-        "%s Device %p usbif_request %p\n"
-        "  id %x type %x endpoint %x\n"
-        "  offset %x length %x nr_segments %x\n"
-        "  flags %x nr_packets %x startframe %x\n"
-        "  bm %x brequest %x wValue %x wIndex %x wLength %x\n",
-        fdoContext->FrontEndPath, fdoContext->WdfDevice, request,
-        request->id, request->type, request->endpoint,
-        request->offset, request->length, request->nr_segments,
-        request->flags, request->nr_packets, request->startframe,
-        packet.Packet.bm.Byte, packet.Packet.bRequest,
-        packet.Packet.wValue.Value, packet.Packet.wIndex.Value,
-        packet.Packet.wLength);
+    ULONG index;
+    if (Value >= (1ULL << (XENVUSB_HISTOGRAM_BUCKETS - 2)))
+    {
+        return XENVUSB_HISTOGRAM_BUCKETS - 1;
+    }
+    if (!_BitScanReverse(&index, (ULONG) Value))
+    {
+        return 0;
+    }
+    return index + 1;
+}
+
+static __forceinline VOID
+HistogramAdd(
+    IN ULONG * Histogram,
+    IN ULONGLONG Value)
+{
+    InterlockedIncrement((volatile LONG *) &Histogram[HistogramBucket(Value)]);
 }
 
+/**
+ * @brief record a response in the histograms for its endpoint.
+ * Only the DPC calls this, IOCTL readers see each counter update atomically.
+ *
+ * @param[in] Xen. The Xen interface context.
+ * @param[in] shadow. The shadow for a data transfer, still on the ring.
+ * @param[in] response. The response for the shadow.
+ */
+static VOID
+RecordEndpointHistograms(
+    IN PXEN_INTERFACE Xen,
+    IN usbif_shadow_ex_t *shadow,
+    IN usbif_response_t *response)
+{
+    LONGLONG now = KeQueryPerformanceCounter(NULL).QuadPart;
+    LONGLONG frequency = Xen->PerformanceFrequency;
+    ENDPOINT_HISTOGRAM * endpoint = 
+        &Xen->FdoContext->EndpointHistograms[ENDPOINT_INDEX(shadow->req.endpoint)];
+    XENVUSB_ENDPOINT_HISTOGRAM * histogram = &endpoint->Histogram;
+
+    if (!frequency)
+    {
+        return;
+    }
+    histogram->EndpointAddress = shadow->req.endpoint;
+    histogram->Type = shadow->req.type;
+    InterlockedIncrement((volatile LONG *) &histogram->Completions);
+
+    HistogramAdd(histogram->RingLatency,
+        ((ULONGLONG) (now - shadow->putTime) * 1000000) / frequency);
+
+    if (shadow->req.type != UsbdPipeTypeIsochronous)
+    {
+        HistogramAdd(histogram->Bytes, response->bytesTransferred);
+        return;
+    }
+    //
+    // bytesTransferred is the error count for isoch responses.
+    //
+    HistogramAdd(histogram->Bytes, shadow->req.length);
+
+    if (endpoint->LastIsoCompletion)
+    {
+        LONGLONG interval = now - endpoint->LastIsoCompletion;
+        if (interval > frequency)
+        {
+            //
+            // idle for more than a second, the stream restarted.
+            //
+            interval = 0;
+        }
+        else if (endpoint->LastIsoInterval)
+        {
+            LONGLONG jitter = interval - endpoint->LastIsoInterval;
+            if (jitter < 0)
+            {
+                jitter = -jitter;
+            }
+            HistogramAdd(histogram->IsoJitter,
+                ((ULONGLONG) jitter * 1000000) / frequency);
+        }
+        endpoint->LastIsoInterval = interval;
+    }
+    endpoint->LastIsoCompletion = now;
+}
 
 /**
  * @brief DPC handler for XEN interface.
@@ -2249,11 +3546,10 @@ XenDpc(
     IN WDFCOLLECTION RequestCollection)
 {
     RING_IDX index, rp;
-    rp = fdoContext->Xen->Ring.sring->rsp_prod;
+    rp = UsbifRingResponseProducer(&fdoContext->Xen->Ring);
     ULONG responsesProcessed = 0;
-    RING_IDX moreWork = FALSE;
+    BOOLEAN responseHeld = FALSE;
 
-    KeMemoryBarrier();
     for (index = fdoContext->Xen->Ring.rsp_cons; index != rp; index++)
     {
         NTSTATUS NtStatus = STATUS_SUCCESS;
@@ -2270,11 +3566,37 @@ XenDpc(
         }
 
         responsesProcessed++;
-        usbif_response_t *response =  GetResponse(fdoContext->Xen, index);
+        //
+        // the ring is shared with the backend. Work on a private copy so the
+        // fields validated below cannot change after they have been checked.
+        //
+        usbif_response_t responseCopy;
+        usbif_response_t *response = &responseCopy;
+        USBIF_RESPONSE_CHECK check = UsbifRingGetResponse(&fdoContext->Xen->Ring,
+            index,
+            fdoContext->Xen->ShadowInUse,
+            (uint16_t) fdoContext->Xen->ShadowArrayEntries,
+            response);
+
+        TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_DPC,
+            __FUNCTION__": %d id %I64d status %x bytesTransferred %x\n",
+            index,
+            response->id,
+            response->status,
+            response->bytesTransferred);
 
+        if (check == UsbifResponseBadId)
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DPC,
+                __FUNCTION__": %s response %d bad id %I64x\n",
+                fdoContext->FrontEndPath,
+                index,
+                response->id);
+            continue;
+        }
         usbif_shadow_ex_t *shadow = &fdoContext->Xen->Shadows[response->id];
         ASSERT(shadow->Tag == SHADOW_TAG);
-        if (!shadow->InUse)
+        if (check == UsbifResponseStale)
         {
             //
             // handled by cancel side.
@@ -2287,17 +3609,56 @@ XenDpc(
                 shadow->Request);
             continue;
         }
+        ASSERT(shadow->InUse);
+#if DBG
+        if (!ResponseFaultDue(fdoContext->Xen, shadow))
+        {
+            responseHeld = TRUE;
+            break;
+        }
+        InjectResponseFault(fdoContext->Xen, response);
+#endif
+        if ((shadow->req.type != UsbdPipeTypeIsochronous) &&
+            (response->bytesTransferred > shadow->req.length))
+        {
+            //
+            // never report more data than the frontend asked for.
+            //
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DPC,
+                __FUNCTION__": %s shadow %p bytesTransferred %d exceeds request length %d\n",
+                fdoContext->FrontEndPath,
+                shadow,
+                response->bytesTransferred,
+                shadow->req.length);
+            response->bytesTransferred = shadow->req.length;
+        }
 
         WDFREQUEST Request = shadow->Request;
-
-        PCHAR usbifStatusString = "UnknownUsbIf";
-        PCHAR usbdStatusString = "";
+        FlightRecord(fdoContext, XenvusbFlightResponse, (USHORT) response->id,
+            shadow->req.endpoint, shadow->req.type, 0, response->bytesTransferred,
+            response->status, response->data);
+        if (fdoContext->Xen->Capture.Active)
+        {
+            CaptureResponse(fdoContext->Xen, shadow, response);
+        }
+        if ((Request || shadow->isoFastSlot) && !shadow->isReset)
+        {
+            RecordEndpointHistograms(fdoContext->Xen, shadow, response);
+            fdoContext->totalCompletedTransfers++;
+            if (shadow->req.type <= UsbdPipeTypeInterrupt)
+            {
+                //
+                // bytesTransferred is the error count for isoch responses.
+                //
+                fdoContext->totalPipeBytes[shadow->req.type] +=
+                    (shadow->req.type == UsbdPipeTypeIsochronous) ?
+                    shadow->req.length : response->bytesTransferred;
+            }
+        }
 
         NTSTATUS usbdStatus = MapUsbifToUsbdStatus(
             shadow->isReset,
-            response->status,
-            &usbifStatusString,
-            &usbdStatusString);
+            response->status);
 
         if (usbdStatus == USBD_STATUS_DEVICE_GONE)
         {
@@ -2314,15 +3675,82 @@ XenDpc(
                     fdoContext->FrontEndPath,
                     Request,
                     fdoContext->Xen->DeviceGoneRequestCount,
-                    usbifStatusString);
+                    UsbifStatusToString(response->status));
             }
         }
+        if (shadow->isoFastSlot)
+        {
+            //
+            // FdoSubmitIsoOutUrb() transfer. Nothing to cancel and nothing
+            // to put on the collection, hand the URB straight back.
+            //
+            PISO_FAST_SLOT slot = shadow->isoFastSlot;
+            DecrementRingBufferRequests(fdoContext->Xen);
+
+            LONGLONG timingStart = PathTimingStart(fdoContext);
+            PostProcessUrb(
+                fdoContext,
+                slot->Urb,
+                &usbdStatus,
+                response->bytesTransferred,
+                response->data,
+                shadow->isoPacketDescriptor);
+            PathTimingStop(fdoContext, XenvusbPathPostProcessUrb, timingStart);
+
+            FlightRecord(fdoContext, XenvusbFlightComplete, (USHORT) response->id,
+                shadow->req.endpoint, shadow->req.type, slot->Urb->UrbHeader.Function,
+                slot->Urb->UrbIsochronousTransfer.TransferBufferLength, usbdStatus,
+                slot->Urb->UrbIsochronousTransfer.StartFrame);
+            PutShadowOnFreelist(fdoContext->Xen, shadow);
+            CompleteIsoFastSlot(fdoContext, slot, usbdStatus);
+            continue;
+        }
+        if (shadow->isCancel)
+        {
+            //
+            // PutCancelRequestOnRing(). The cancelled request completes
+            // with its own response.
+            //
+            DecrementRingBufferRequests(fdoContext->Xen);
+            TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DPC,
+                __FUNCTION__": %s cancel of id %I64d usbif status %x (%s)\n",
+                fdoContext->FrontEndPath,
+                shadow->req.setup,
+                response->status,
+                UsbifStatusToString(response->status));
+            PutShadowOnFreelist(fdoContext->Xen, shadow);
+            continue;
+        }
+        if (shadow->isFrameSync)
+        {
+            DecrementRingBufferRequests(fdoContext->Xen);
+            PutShadowOnFreelist(fdoContext->Xen, shadow);
+            FrameClockSyncComplete(fdoContext,
+                (usbdStatus == USBD_STATUS_SUCCESS),
+                response->data);
+            continue;
+        }
         //
         // deal with the cancel race here.
         //
         if (Request)
         {
             PFDO_REQUEST_CONTEXT requestContext = RequestGetRequestContext(Request);
+            if (requestContext->CancelTimedOut && !requestContext->RequestCompleted)
+            {
+                //
+                // the response beat the pipe abort queued by
+                // AbortTimedOutCancels(), which completes the request.
+                //
+                TraceEvents(TRACE_LEVEL_WARNING, TRACE_URB,
+                    __FUNCTION__": %s Request %p owned by pipe abort\n",
+                    fdoContext->FrontEndPath,
+                    Request);
+                requestContext->ResponseReceived = 1;
+                WdfObjectDereference(Request);
+                Request = NULL;
+                continue;
+            }
             if (requestContext->CancelSet && !requestContext->RequestCompleted)
             {
                 //
@@ -2338,6 +3766,7 @@ XenDpc(
                         __FUNCTION__": %s Request %p owned by cancel routine\n",
                         fdoContext->FrontEndPath,
                         Request);
+                    requestContext->ResponseReceived = 1;
                     WdfObjectDereference(Request);
                     Request = NULL;
                     continue;
@@ -2387,6 +3816,10 @@ XenDpc(
                 NtStatus = STATUS_SUCCESS;
                 fdoContext->ResetInProgress = FALSE;
                 //
+                // drop anything captured while the reset was in progress.
+                //
+                DescriptorCacheFlush(fdoContext);
+                //
                 // the Hub PDO needs to transition the port
                 // to Enabled state if it is not already there.
                 //
@@ -2405,17 +3838,28 @@ XenDpc(
                     TraceUsbIfRequest(fdoContext, &shadow->req);
                 }
 
+                LONGLONG timingStart = PathTimingStart(fdoContext);
                 NtStatus = PostProcessUrb(
                     fdoContext,
                     Urb, 
                     &usbdStatus, 
                     response->bytesTransferred,
                     response->data,
-                    shadow->isoPacketDescriptor);
+                    shadow->isoPacketPages ? shadow->isoPacketDescriptor : NULL);
+                PathTimingStop(fdoContext, XenvusbPathPostProcessUrb, timingStart);
+                if (requestContext->CancelOnRing &&
+                    (usbdStatus == USBD_STATUS_CANCELED))
+                {
+                    NtStatus = STATUS_CANCELLED;
+                }
+
+                FlightRecord(fdoContext, XenvusbFlightComplete, (USHORT) response->id,
+                    shadow->req.endpoint, shadow->req.type, Urb->UrbHeader.Function,
+                    response->bytesTransferred, usbdStatus, response->data);
 
                 if (!NT_SUCCESS(NtStatus))
                 {
-                    if (shadow->indirectPageMemory)
+                    if (shadow->indirectPages)
                     {
                         fdoContext->totalIndirectErrors++;
                     }
@@ -2426,7 +3870,7 @@ XenDpc(
                 }
                 else
                 {
-                    if (shadow->indirectPageMemory)
+                    if (shadow->indirectPages)
                     {
                         if (shadow->req.length > fdoContext->largestIndirectTransfer)
                         {
@@ -2454,9 +3898,9 @@ XenDpc(
                     fdoContext->FrontEndPath,
                     response->status ? "response error" : "response",
                     response->status,
-                    usbifStatusString,
+                    UsbifStatusToString(response->status),
                     usbdStatus,
-                    usbdStatusString,
+                    UsbdStatusToString(usbdStatus),
                     NtStatus,
                     shadow->req.type,
                     shadow->req.endpoint,
@@ -2473,8 +3917,7 @@ XenDpc(
         {
             PostProcessScratch(fdoContext, 
                 usbdStatus, 
-                usbifStatusString,
-                usbdStatusString,
+                response->status,
                 response->bytesTransferred, 
                 response->data);
         }
@@ -2505,24 +3948,30 @@ XenDpc(
 
         }
     }
+    if (responseHeld)
+    {
+        //
+        // FaultTimer reruns the DPC when the held response is due.
+        //
+        fdoContext->Xen->Ring.rsp_cons = index;
+        return FALSE;
+    }
     //
     // check for more work
     //
-    fdoContext->Xen->Ring.rsp_cons = index;
-    if (index != fdoContext->Xen->Ring.req_prod_pvt)
-    {
-        RING_FINAL_CHECK_FOR_RESPONSES(&fdoContext->Xen->Ring, moreWork);
-    }
-    else if (!fdoContext->DeviceUnplugged)
-    {
-        fdoContext->Xen->Ring.sring->rsp_event = index + 1;
-        moreWork = (RING_IDX) FALSE;
-    }
-    if (moreWork)
+    if ((index != fdoContext->Xen->Ring.req_prod_pvt) &&
+        fdoContext->PollMode)
     {
-        return TRUE;
+        fdoContext->Xen->Ring.rsp_cons = index;
+        if (PollForResponses(fdoContext->Xen))
+        {
+            fdoContext->totalPollHits++;
+            return TRUE;
+        }
     }
-    return FALSE;
+    return UsbifRingFinishResponses(&fdoContext->Xen->Ring,
+        index,
+        !fdoContext->DeviceUnplugged) ? TRUE : FALSE;
 }
 
 
@@ -2538,52 +3987,26 @@ XenPostProcessIsoResponse(
     IN PVOID isoPacketDescriptor,
     IN NTSTATUS Status)
 {    
-    iso_packet_info * isoInfoArray = (iso_packet_info *) isoPacketDescriptor;
+    const iso_packet_info * isoInfoArray = (const iso_packet_info *) isoPacketDescriptor;
 
     if (NT_SUCCESS(Status))
     {
         ULONG numberOfPackets = Urb->UrbIsochronousTransfer.NumberOfPackets; 
-        Urb->UrbIsochronousTransfer.ErrorCount = 0;
-        ULONG totalBytes = 0;
-
-        for (ULONG Index = 0;
-            Index < numberOfPackets;
-            Index++)
-        {
-            PCHAR usbifStatusString = "UnknownUsbIf";
-            PCHAR usbdStatusString = "";
-
-            MapUsbifToUsbdStatus(
-                FALSE,
-                isoInfoArray[Index].status,
-                &usbifStatusString,
-                &usbdStatusString);
-
-            Urb->UrbIsochronousTransfer.IsoPacket[Index].Offset = 
-                isoInfoArray[Index].offset;
-            Urb->UrbIsochronousTransfer.IsoPacket[Index].Length = 
-                isoInfoArray[Index].length;
-            Urb->UrbIsochronousTransfer.IsoPacket[Index].Status = 
-                isoInfoArray[Index].status;
-
-            if (isoInfoArray[Index].status == USBD_STATUS_SUCCESS)
-            {
-                totalBytes += isoInfoArray[Index].length;
-            }
-            else
-            {
-                Urb->UrbIsochronousTransfer.ErrorCount++;
-            }
+        USBD_ISO_PACKET_DESCRIPTOR * isoPacket = Urb->UrbIsochronousTransfer.IsoPacket;
+        ULONG bufferLength = Urb->UrbIsochronousTransfer.TransferBufferLength;
+        uint32_t errorCount = 0;
+        //
+        // the per-packet status is passed through and only a summary is
+        // traced. The packet descriptors come from the backend, see
+        // UsbifIsoCompletePackets().
+        //
+        ULONG totalBytes = UsbifIsoCompletePackets(isoInfoArray,
+            isoPacket,
+            numberOfPackets,
+            bufferLength,
+            &errorCount);
+        Urb->UrbIsochronousTransfer.ErrorCount = errorCount;
 
-            TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_DPC,
-                __FUNCTION__": packet %d offset %d length %d status %x %s %s\n",
-                Index,
-                Urb->UrbIsochronousTransfer.IsoPacket[Index].Offset,
-                Urb->UrbIsochronousTransfer.IsoPacket[Index].Length,
-                Urb->UrbIsochronousTransfer.IsoPacket[Index].Status, //@@@packetStatus,
-                usbifStatusString,
-                usbdStatusString);
-        }
         if (totalBytes == 0)
         {
             if (!gVistaOrLater)
@@ -2596,15 +4019,9 @@ XenPostProcessIsoResponse(
                 // are producing garbage as data. This code path is a consequence of an unplug
                 // operation, iso data is not reliable, and we can't fix usbaudio.
                 //
-                Urb->UrbIsochronousTransfer.IsoPacket[0].Status = USBD_STATUS_SUCCESS;
-                if (Urb->UrbIsochronousTransfer.IsoPacket[0].Length)
-                {
-                    totalBytes += Urb->UrbIsochronousTransfer.IsoPacket[0].Length;
-                }
-                else
-                {
-                    totalBytes += Urb->UrbIsochronousTransfer.IsoPacket[1].Offset;
-                }
+                totalBytes = UsbifIsoSucceedFirstPacket(isoPacket,
+                    numberOfPackets,
+                    bufferLength);
                 TraceEvents(TRACE_LEVEL_ERROR, TRACE_DPC,
                     __FUNCTION__": Urb %p succeed zero length ISO request xp usbaudio bug\n",
                     Urb);
@@ -2612,36 +4029,24 @@ XenPostProcessIsoResponse(
         }
 
         Urb->UrbIsochronousTransfer.TransferBufferLength = totalBytes;
-        if (Urb->UrbIsochronousTransfer.ErrorCount != bytesTransferred)
-        {
-            TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_DPC,
-                __FUNCTION__": packet completion: Urb ErrorCount %d != response ErrorCount %d\n",
-                Urb->UrbIsochronousTransfer.ErrorCount,
-                bytesTransferred);
-        }
-
-        if (Urb->UrbIsochronousTransfer.TransferFlags & USBD_START_ISO_TRANSFER_ASAP)
-        {
-            Urb->UrbIsochronousTransfer.StartFrame = startFrame;
-        }
-        else if (startFrame != Urb->UrbIsochronousTransfer.StartFrame)
-        {
-            TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_DPC,
-                __FUNCTION__": packet completion: Urb.startFrame %d != response startframe %d\n",
-                Urb->UrbIsochronousTransfer.StartFrame,
-                startFrame);
-        }
-                
-
-        // transfer the packet descriptors back?
+        //
+        // bytesTransferred is the backend's error count for isoch responses.
+        //
         TraceEvents(
             TRACE_LEVEL_VERBOSE, 
             TRACE_DPC,
-            __FUNCTION__": packet completion: StartFrame %d  errorCount %d numberOfPackets %d totalBytes %d\n",
+            __FUNCTION__": packet completion: StartFrame %d (urb %d) errorCount %d (response %d) numberOfPackets %d totalBytes %d\n",
             startFrame,
+            Urb->UrbIsochronousTransfer.StartFrame,
             Urb->UrbIsochronousTransfer.ErrorCount,
+            bytesTransferred,
             numberOfPackets,
             totalBytes);
+
+        if (Urb->UrbIsochronousTransfer.TransferFlags & USBD_START_ISO_TRANSFER_ASAP)
+        {
+            Urb->UrbIsochronousTransfer.StartFrame = startFrame;
+        }
     }
     else
     {
@@ -2684,9 +4089,9 @@ MaxSegments(
 
 ULONG
 MaxIsoPackets(
-    IN PXEN_INTERFACE)
+    IN PXEN_INTERFACE Xen)
 {
-    return MAX_ISO_PACKETS;
+    return Xen->MaxIsoPackets;
 }
 
 ULONG
@@ -2696,6 +4101,33 @@ OnRingBuffer(
     return Xen->RequestsOnRingbuffer;
 }
 
+ULONG
+MaxOnRingBuffer(
+    IN PXEN_INTERFACE Xen)
+{
+    return Xen->MaxRequestsOnRingbuffer;
+}
+
+//
+/// number of request slots on the shared ring, 0 if not connected.
+//
+ULONG
+RingBufferSize(
+    IN PXEN_INTERFACE Xen)
+{
+    return Xen->Sring ? RING_SIZE(&Xen->Ring) : 0;
+}
+
+//
+/// bytes of the shared ring page, 0 if not connected.
+//
+ULONG
+RingBufferBytes(
+    IN PXEN_INTERFACE Xen)
+{
+    return Xen->Sring ? PAGE_SIZE : 0;
+}
+
 static VOID
 DecrementRingBufferRequests(
     IN PXEN_INTERFACE Xen)
@@ -2723,129 +4155,69 @@ ULONG
 AvailableRequests(
     IN PXEN_INTERFACE Xen)
 {
-    return Xen->ShadowFree;
+    //
+    // shadows reserved for FdoSubmitIsoOutUrb() are not available.
+    //
+    return (Xen->FreeShadows.Free > Xen->ReservedShadows) ?
+        (Xen->FreeShadows.Free - Xen->ReservedShadows) : 0;
 }
 
 //
-// Error code translation (debug logging.)
+// Error code translation, see UsbifStatusLookup().
 //
 NTSTATUS 
 MapUsbifToUsbdStatus(
     IN BOOLEAN  ResetInProgress,
-    IN LONG UsbIfStatus,
-    IN PCHAR * OutUsbIfString,
-    IN PCHAR * OutUsbdString)
+    IN LONG UsbIfStatus)
 {
-    NTSTATUS UsbdStatus = USBD_STATUS_INTERNAL_HC_ERROR;
-    PCHAR UsbifString = "Unknown UsbIfCode";
-    PCHAR UsbdString = "USBD_STATUS_INTERNAL_HC_ERROR";
+    return UsbifMapStatus(ResetInProgress ? true : false, UsbIfStatus);
+}
 
-    switch(UsbIfStatus)
-    {
-    case 0:
-        UsbdStatus = USBD_STATUS_SUCCESS;
-        UsbifString = "USBIF_SUCCESS";
-        UsbdString = "USBD_STATUS_SUCCESS";
-        break;
-    case USBIF_RSP_USB_CANCELED:
-        UsbdStatus = USBD_STATUS_CANCELED;
-        UsbifString = "USBIF_RSP_USB_CANCELED";
-        UsbdString = "USBD_STATUS_CANCELED";
-        break;
-    case USBIF_RSP_USB_PENDING:
-        UsbdStatus = USBD_STATUS_INTERNAL_HC_ERROR;
-        UsbifString = "USBIF_RSP_USB_PENDING";
-        UsbdString = "USBD_STATUS_INTERNAL_HC_ERROR";
-        break;
-    case USBIF_RSP_USB_PROTO:
-        UsbdStatus = USBD_STATUS_INTERNAL_HC_ERROR;
-        UsbifString = "USBIF_RSP_USB_PROTO";
-        UsbdString = "USBD_STATUS_INTERNAL_HC_ERROR";
-        break;
-    case USBIF_RSP_USB_CRC:
-        UsbdStatus = USBD_STATUS_CANCELED; // was USBD_STATUS_CRC;
-        UsbifString = "USBIF_RSP_USB_CRC";
-        UsbdString = "USBD_STATUS_CANCELED";
-        break;
-    case USBIF_RSP_USB_TIMEOUT:
-        UsbdStatus = USBD_STATUS_STALL_PID; // USBD_STATUS_TIMEOUT;
-        UsbifString = "USBIF_RSP_USB_TIMEOUT";
-        UsbdString = "USBD_STATUS_STALL_PID";
-        break;
-    case USBIF_RSP_USB_STALLED:
-        UsbdStatus = USBD_STATUS_STALL_PID;
-        UsbifString = "USBIF_RSP_USB_STALLED";
-        UsbdString = "USBD_STATUS_STALL_PID";
-        break;
-    case USBIF_RSP_USB_INBUFF:
-        UsbdStatus = USBD_STATUS_BUFFER_OVERRUN;
-        UsbifString = "USBIF_RSP_USB_INBUFF";
-        UsbdString = "USBD_STATUS_BUFFER_OVERRUN";
-        break;
-    case USBIF_RSP_USB_OUTBUFF:
-        UsbdStatus = USBD_STATUS_BUFFER_UNDERRUN;
-        UsbifString = "USBIF_RSP_USB_OUTBUFF";
-        UsbdString = "USBD_STATUS_BUFFER_UNDERRUN";
-        break;
-    case USBIF_RSP_USB_OVERFLOW: // stall? babble - for bulk, perhaps not for isoch or interrupt?
-        UsbdStatus = USBD_STATUS_STALL_PID; // USBD_STATUS_BABBLE_DETECTED;
-        UsbifString = "USBIF_RSP_USB_OVERFLOW";
-        UsbdString = "USBD_STATUS_STALL_PID";
-        break;
-    case USBIF_RSP_USB_SHORTPKT:
-        UsbdStatus = USBD_STATUS_ERROR_SHORT_TRANSFER;
-        UsbifString = "USBIF_RSP_USB_SHORTPKT";
-        UsbdString = "USBD_STATUS_ERROR_SHORT_TRANSFER";
-        break;
-    case USBIF_RSP_USB_DEVRMVD:
-        UsbdStatus = USBD_STATUS_DEVICE_GONE;
-        UsbifString = "USBIF_RSP_USB_DEVRMVD";
-        UsbdString = "USBD_STATUS_DEVICE_GONE";
-        break;
-    case USBIF_RSP_USB_INVALID:
-        UsbdStatus = USBD_STATUS_INVALID_URB_FUNCTION; // ?
-        UsbifString = "USBIF_RSP_USB_INVALID";
-        UsbdString = "USBD_STATUS_INVALID_URB_FUNCTION";
-        break;
-    case USBIF_RSP_USB_PARTIAL:
-        UsbdStatus = USBD_STATUS_INTERNAL_HC_ERROR;
-        UsbifString = "USBIF_RSP_USB_PARTIAL";
-        UsbdString = "USBD_STATUS_INTERNAL_HC_ERROR";
-        break;
-    case USBIF_RSP_USB_RESET: // this is really a timeout
-        UsbdStatus = USBD_STATUS_TIMEOUT;
-        UsbifString = "USBIF_RSP_USB_RESET";
-        UsbdString = "USBD_STATUS_TIMEOUT";
-        break;
-    case USBIF_RSP_USB_SHUTDOWN:
-        UsbdStatus = USBD_STATUS_DEVICE_GONE; // was USBD_STATUS_ENDPOINT_HALTED
-        UsbifString = "USBIF_RSP_USB_SHUTDOWN";
-        UsbdString = "USBD_STATUS_DEVICE_GONE";
-        break;
-    case USBIF_RSP_USB_UNKNOWN: // backend unplug detected! (or not.)
-        UsbdStatus = USBD_STATUS_ERROR_BUSY; // was USBD_STATUS_DEVICE_GONE;
-        UsbifString = "USBIF_RSP_USB_UNKNOWN";
-        UsbdString = "USBD_STATUS_ERROR_BUSY";
-        break;
-    }
-    //
-    // treat device gone errors as transient if ResetInProgress.
-    //
-    if ((UsbdStatus == USBD_STATUS_DEVICE_GONE) &&
-        (ResetInProgress))
-    {
-        UsbdStatus = USBD_STATUS_CANCELED;
-        UsbdString = "USBD_STATUS_CANCELED";
-    }
-    if (OutUsbIfString)
+//
+// debug logging only, call these from the TraceEvents() arguments so the
+// lookup is skipped when the trace is filtered out.
+//
+PCHAR
+UsbifStatusToString(
+    IN LONG UsbIfStatus)
+{
+    if (UsbIfStatus == 0)
     {
-        *OutUsbIfString = UsbifString;
+        return "USBIF_SUCCESS";
     }
-    if (OutUsbdString)
+    return (PCHAR) UsbifStatusLookup(UsbIfStatus)->UsbifString;
+}
+
+PCHAR
+UsbdStatusToString(
+    IN NTSTATUS UsbdStatus)
+{
+    switch (UsbdStatus)
     {
-        *OutUsbdString = UsbdString;
+    case USBD_STATUS_SUCCESS:
+        return "USBD_STATUS_SUCCESS";
+    case USBD_STATUS_CANCELED:
+        return "USBD_STATUS_CANCELED";
+    case USBD_STATUS_INTERNAL_HC_ERROR:
+        return "USBD_STATUS_INTERNAL_HC_ERROR";
+    case USBD_STATUS_STALL_PID:
+        return "USBD_STATUS_STALL_PID";
+    case USBD_STATUS_BUFFER_OVERRUN:
+        return "USBD_STATUS_BUFFER_OVERRUN";
+    case USBD_STATUS_BUFFER_UNDERRUN:
+        return "USBD_STATUS_BUFFER_UNDERRUN";
+    case USBD_STATUS_ERROR_SHORT_TRANSFER:
+        return "USBD_STATUS_ERROR_SHORT_TRANSFER";
+    case USBD_STATUS_DEVICE_GONE:
+        return "USBD_STATUS_DEVICE_GONE";
+    case USBD_STATUS_INVALID_URB_FUNCTION:
+        return "USBD_STATUS_INVALID_URB_FUNCTION";
+    case USBD_STATUS_TIMEOUT:
+        return "USBD_STATUS_TIMEOUT";
+    case USBD_STATUS_ERROR_BUSY:
+        return "USBD_STATUS_ERROR_BUSY";
     }
-    return UsbdStatus;
+    return "USBD_STATUS_?";
 }
 
 BOOLEAN
@@ -25,6 +25,7 @@
 
 typedef struct XEN_INTERFACE * PXEN_INTERFACE;
 typedef struct USB_FDO_CONTEXT *PUSB_FDO_CONTEXT;
+typedef struct ISO_FAST_SLOT *PISO_FAST_SLOT;
 
 typedef VOID EVTCHN_HANDLER_CB(VOID *Context);
 typedef EVTCHN_HANDLER_CB *PEVTCHN_HANDLER_CB;
@@ -65,6 +66,17 @@ XenDeviceDisconnectBackend(
 
 _Requires_lock_held_(fdoContext->WdfDevice)
 VOID
+ReleaseThrottledRequests(
+    IN PUSB_FDO_CONTEXT fdoContext);
+
+_Requires_lock_held_(fdoContext->WdfDevice)
+VOID
+AbortThrottledRequests(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN UCHAR EndpointAddress);
+
+_Requires_lock_held_(fdoContext->WdfDevice)
+NTSTATUS
 PutUrbOnRing(
     IN PUSB_FDO_CONTEXT fdoContext,
     IN PWDF_USB_CONTROL_SETUP_PACKET packet,
@@ -82,11 +94,28 @@ PutResetOrCycleUrbOnRing(
     IN BOOLEAN IsReset);
 
 _Requires_lock_held_(fdoContext->WdfDevice)
-VOID
+BOOLEAN
+PutCancelRequestOnRing(
+    IN PUSB_FDO_CONTEXT fdoContext,
+    IN WDFREQUEST Request);
+
+_Requires_lock_held_(fdoContext->WdfDevice)
+WDFREQUEST
+GetTimedOutCancelRequest(
+    IN PUSB_FDO_CONTEXT fdoContext);
+
+_Requires_lock_held_(fdoContext->WdfDevice)
+NTSTATUS
+PutFrameSyncOnRing(
+    IN PUSB_FDO_CONTEXT fdoContext);
+
+_Requires_lock_held_(fdoContext->WdfDevice)
+NTSTATUS
 PutIsoUrbOnRing(
     IN PUSB_FDO_CONTEXT fdoContext,
     IN PWDF_USB_CONTROL_SETUP_PACKET packet,
     IN WDFREQUEST Request,
+    IN PISO_FAST_SLOT FastSlot,
     IN UCHAR EndpointAddress,
     IN BOOLEAN transferAsap,
     IN BOOLEAN ShortOK);
@@ -161,6 +190,30 @@ ULONG
 OnRingBuffer(
     IN PXEN_INTERFACE Xen);
 
+ULONG
+MaxOnRingBuffer(
+    IN PXEN_INTERFACE Xen);
+
+ULONG
+RingBufferSize(
+    IN PXEN_INTERFACE Xen);
+
+ULONG
+RingBufferBytes(
+    IN PXEN_INTERFACE Xen);
+
+NTSTATUS
+XenCaptureControl(
+    IN PXEN_INTERFACE Xen,
+    IN BOOLEAN Enable,
+    IN ULONG PayloadLimit);
+
+ULONG
+XenCaptureRead(
+    IN PXEN_INTERFACE Xen,
+    OUT PXENVUSB_CAPTURE_HEADER Header,
+    IN ULONG OutputLength);
+
 BOOLEAN
 IndirectGrefs(
     IN PXEN_INTERFACE Xen);
@@ -172,9 +225,15 @@ AvailableRequests(
 NTSTATUS 
 MapUsbifToUsbdStatus(
     IN BOOLEAN  ResetInProgress,
-    IN LONG UsbIfStatus,
-    IN PCHAR * OutUsbIfString,
-    IN PCHAR * OutUsbdString);
+    IN LONG UsbIfStatus);
+
+PCHAR
+UsbifStatusToString(
+    IN LONG UsbIfStatus);
+
+PCHAR
+UsbdStatusToString(
+    IN NTSTATUS UsbdStatus);
 
 BOOLEAN
 XenCheckOperationalState(
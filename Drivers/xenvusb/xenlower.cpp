@@ -332,6 +332,85 @@ XenLowerInterfaceVersion(
     return (ULONG)version;
 }
 
+ULONG
+XenLowerNegotiateMaxIsoPackets(
+    PXEN_LOWER XenLower,
+    ULONG FrontendMax)
+{
+    NTSTATUS status;
+    PCHAR mstr;
+    int backendMax = 0;
+
+    // Advertise what the frontend can send, backends that can accept more
+    // than one page of iso packet descriptors publish their own limit.
+    status = xenbus_printf(XBT_NIL, XenLower->FrontendPath,
+        "feature-max-iso-packets", "%d", FrontendMax);
+    if (!NT_SUCCESS(status))
+    {
+        TraceWarning((__FUNCTION__\
+            ": xenbus_printf(frontend/feature-max-iso-packets) failed.\n"));
+        return 0;
+    }
+
+    mstr = XenLowerReadXenstoreValue(XenLower->BackendPath, "feature-max-iso-packets");
+    if (mstr == NULL)
+    {
+        TraceInfo((__FUNCTION__
+            ": backend does not support multi-page iso packet descriptors.\n"));
+        return 0;
+    }
+
+    sscanf_s(mstr, "%d", &backendMax);
+    XmFreeMemory(mstr);
+
+    TraceInfo((__FUNCTION__
+        ": Read backend max iso packets: %d  -  Wrote frontend max iso packets: %d\n",
+        backendMax, FrontendMax));
+
+    if (backendMax <= 0)
+    {
+        return 0;
+    }
+    return ((ULONG)backendMax < FrontendMax) ? (ULONG)backendMax : FrontendMax;
+}
+
+BOOLEAN
+XenLowerNegotiateCancelRequest(
+    PXEN_LOWER XenLower)
+{
+    NTSTATUS status;
+    PCHAR cstr;
+    int backendCancel = 0;
+
+    // Single request cancel is optional, without it a cancelled request
+    // costs an abort of its whole pipe.
+    status = xenbus_printf(XBT_NIL, XenLower->FrontendPath,
+        "feature-cancel-request", "%d", 1);
+    if (!NT_SUCCESS(status))
+    {
+        TraceWarning((__FUNCTION__\
+            ": xenbus_printf(frontend/feature-cancel-request) failed.\n"));
+        return FALSE;
+    }
+
+    cstr = XenLowerReadXenstoreValue(XenLower->BackendPath, "feature-cancel-request");
+    if (cstr == NULL)
+    {
+        TraceInfo((__FUNCTION__
+            ": backend does not support single request cancel.\n"));
+        return FALSE;
+    }
+
+    sscanf_s(cstr, "%d", &backendCancel);
+    XmFreeMemory(cstr);
+
+    TraceInfo((__FUNCTION__
+        ": Read backend feature-cancel-request: %d\n",
+        backendCancel));
+
+    return (backendCancel > 0) ? TRUE : FALSE;
+}
+
 PCHAR
 XenLowerGetFrontendPath(
     PXEN_LOWER XenLower)
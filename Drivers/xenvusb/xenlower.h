@@ -65,6 +65,15 @@ ULONG
 XenLowerInterfaceVersion(
     PXEN_LOWER XenLower);
 
+ULONG
+XenLowerNegotiateMaxIsoPackets(
+    PXEN_LOWER XenLower,
+    ULONG FrontendMax);
+
+BOOLEAN
+XenLowerNegotiateCancelRequest(
+    PXEN_LOWER XenLower);
+
 PCHAR
 XenLowerGetFrontendPath(
     PXEN_LOWER XenLower);
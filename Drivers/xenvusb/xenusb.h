@@ -28,6 +28,7 @@
 #include <usbdlib.h>
 #undef _USBD_
 #include "usbbusif.h"
+#include "UsbDescriptorCore.h"
 
 // Cannot include this
 // #include <USBProtocolDefs.h>
@@ -125,30 +126,22 @@ formatOsFeaturePacket(
     return packet;
 }
 
-struct OS_FEATURE_HEADER
-{
-    ULONG  dwLength;
-    USHORT bcdVersion; // 0x0100
-    USHORT wIndex;     // 0x04
-    UCHAR  bCount;
-    UCHAR  reserved[7];
-};
-
-struct OS_COMPATID_FUNCTION
-{
-    UCHAR bFirstInterfaceNumber;
-    UCHAR reserved;
-    UCHAR compatibleID[8];
-    UCHAR subCompatibleID[8];
-    UCHAR reserved2[6];
-};
+//
+// OS_FEATURE_HEADER and OS_COMPAT_ID are in UsbDescriptorCore.h.
+//
 
-struct OS_COMPAT_ID
+//
+// The isoch schedule for one endpoint. Protected by the FDO lock.
+// nextFrame is the first frame after the last transfer scheduled
+// on the endpoint, ASAP transfers are started there.
+//
+struct ISO_STREAM
 {
-    OS_FEATURE_HEADER header;
-    OS_COMPATID_FUNCTION functions[1];
+    BOOLEAN active;      // nextFrame is valid.
+    ULONG nextFrame;
+    ULONG minLead;       // smallest lead in frames since the stream (re)started.
+    ULONG underruns;
 };
-typedef OS_COMPAT_ID *POS_COMPAT_ID;
 
 struct PIPE_DESCRIPTOR
 {
@@ -161,8 +154,18 @@ struct PIPE_DESCRIPTOR
     BOOLEAN abortInProgress;
     ULONG abortWaiters;
     KEVENT abortCompleteEvent;
+    ISO_STREAM isoStream;
 };
 
+//
+// The pipes for one interface/alternate setting are
+// m_pipeDescriptors[firstPipe] .. m_pipeDescriptors[firstPipe + numPipes - 1].
+//
+struct INTERFACE_PIPES
+{
+    ULONG firstPipe;
+    ULONG numPipes;
+};
 
 struct USB_CONFIG_INFO
 {
@@ -175,6 +178,10 @@ struct USB_CONFIG_INFO
     //
     PUSB_INTERFACE_DESCRIPTOR * m_interfaceDescriptors;
     //
+    // m_numInterfaces entries parallel to m_interfaceDescriptors.
+    //
+    INTERFACE_PIPES * m_interfacePipes;
+    //
     // A configuration supports up to 32 unique endpoints,
     // 16 in endpoints and 16 out endpoints. Alternate interfaces
     // cannot conflict with other concurrent interface endpoints.
@@ -182,6 +189,11 @@ struct USB_CONFIG_INFO
     // one for each possible endpoint in each interface and interface alternate.
     //
     PIPE_DESCRIPTOR * m_pipeDescriptors;
+    //
+    // single allocation backing m_pipeDescriptors, m_interfaceDescriptors
+    // and m_interfacePipes. Built by ParseConfig().
+    //
+    PVOID m_arena;
 };
 typedef USB_CONFIG_INFO * PUSB_CONFIG_INFO;
 